@@ -312,6 +312,20 @@ AC_DEFUN([SANE_CHECK_TIFF],
   AC_SUBST(TIFF_LIBS)
 ])
 
+# Checks for zlib, used for the compressed net/saned data stream.
+AC_DEFUN([SANE_CHECK_ZLIB],
+[
+  AC_CHECK_LIB(z,deflate,
+  [
+    AC_CHECK_HEADER(zlib.h,
+    [sane_cv_use_zlib="yes"; ZLIB_LIBS="-lz"],)
+  ],)
+  if test "$sane_cv_use_zlib" = "yes" ; then
+    AC_DEFINE(HAVE_LIBZ,1,[Define to 1 if you have the zlib library.])
+  fi
+  AC_SUBST(ZLIB_LIBS)
+])
+
 #
 # Checks for pthread support
 AC_DEFUN([SANE_CHECK_LOCKING],
@@ -136,6 +136,13 @@
 
 #include <math.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
 #define BACKEND_NAME avision
 #define BACKEND_BUILD 297 /* avision backend BUILD version */
 
@@ -1273,6 +1280,10 @@ static SANE_Bool force_calibration = SANE_FALSE;
 static SANE_Bool force_a4 = SANE_FALSE;
 static SANE_Bool force_a3 = SANE_FALSE;
 
+/* MB the rear side of a duplex sheet may take in memory before it is
+   spilled to a file */
+static int rear_memory_limit = 256;
+
 /* hardware resolutions to interpolate from */
 static const int  hw_res_list_c5[] =
   {
@@ -6681,6 +6692,129 @@ init_options (Avision_Scanner* s)
   return SANE_STATUS_GOOD;
 }
 
+/* The rear side of an interlaced or flipping duplex sheet is kept until
+   the next sane_start delivers it.  The reader storing it may be a forked
+   process, so the store is shared memory set up before the reader starts:
+   anonymous memory up to rear_memory_limit, the temporary file mapped
+   beyond that. */
+
+#define rear_store_data(rear) ((uint8_t*) ((rear) + 1))
+
+static void
+rear_store_close (Avision_Scanner* s)
+{
+  Avision_Rear_Store* rear = s->duplex_rear;
+  
+  if (!rear)
+    return;
+  
+#ifdef HAVE_MMAP
+  munmap ((void*) rear, rear->size);
+#else
+  free (rear);
+#endif
+  s->duplex_rear = 0;
+}
+
+static SANE_Status
+rear_store_open (Avision_Scanner* s, size_t lines)
+{
+  Avision_Rear_Store* rear = s->duplex_rear;
+  size_t bytes_per_line = s->avdimen.hw_bytes_per_line;
+  size_t size = sizeof (*rear) + lines * bytes_per_line;
+  void* mem = 0;
+  
+  /* keep the store of the last sheet if it is big enough */
+  if (rear && rear->size < size)
+    rear_store_close (s);
+  
+  if (!s->duplex_rear) {
+#ifdef HAVE_MMAP
+#ifdef MAP_ANONYMOUS
+    if (size <= (size_t) rear_memory_limit * 1024 * 1024) {
+      mem = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		  -1, 0);
+      if (mem == MAP_FAILED)
+	mem = 0;
+    }
+#endif
+    if (!mem) {
+      int fd;
+      
+      DBG (3, "rear_store_open: spilling %lu bytes to %s\n",
+	   (u_long) size, s->duplex_rear_fname);
+      fd = open (s->duplex_rear_fname, O_RDWR | O_CREAT | O_EXCL, 0600);
+      if (fd >= 0) {
+	if (ftruncate (fd, size) == 0) {
+	  mem = mmap (0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	  if (mem == MAP_FAILED)
+	    mem = 0;
+	}
+	/* the mapping keeps the data */
+	close (fd);
+	unlink (s->duplex_rear_fname);
+      }
+    }
+#else
+    /* the reader is a thread without fork, plain memory will do */
+    mem = malloc (size);
+#endif
+    if (!mem) {
+      DBG (1, "rear_store_open: cannot allocate %lu bytes for the rear side: %s\n",
+	   (u_long) size, strerror (errno));
+      return SANE_STATUS_NO_MEM;
+    }
+    rear = s->duplex_rear = mem;
+    rear->size = size;
+  }
+  
+  rear->bytes_per_line = bytes_per_line;
+  rear->lines = (rear->size - sizeof (*rear)) / bytes_per_line;
+  rear->first = rear->lines;
+  rear->end = 0;
+  
+  DBG (3, "rear_store_open: room for %lu lines of %lu bytes\n",
+       (u_long) rear->lines, (u_long) bytes_per_line);
+  return SANE_STATUS_GOOD;
+}
+
+/* store one line at the given line index */
+static void
+rear_store_put (Avision_Rear_Store* rear, size_t line, const uint8_t* data)
+{
+  if (line >= rear->lines) {
+    DBG (1, "rear_store_put: line %lu out of range, dropped\n", (u_long) line);
+    return;
+  }
+  
+  memcpy (rear_store_data (rear) + line * rear->bytes_per_line, data,
+	  rear->bytes_per_line);
+  if (line < rear->first)
+    rear->first = line;
+  if (line >= rear->end)
+    rear->end = line + 1;
+}
+
+/* copy up to len bytes from offset into the stored lines, returns the
+   number of bytes copied */
+static size_t
+rear_store_get (Avision_Rear_Store* rear, size_t offset, uint8_t* data,
+		size_t len)
+{
+  size_t avail = 0;
+  
+  if (rear->end > rear->first)
+    avail = (rear->end - rear->first) * rear->bytes_per_line;
+  if (offset >= avail)
+    return 0;
+  if (len > avail - offset)
+    len = avail - offset;
+  
+  memcpy (data, rear_store_data (rear) + rear->first * rear->bytes_per_line +
+	  offset, len);
+  return len;
+}
+
 /* This function is executed as a child process. The reason this is
    executed as a subprocess is because some (most?) generic SCSI
    interfaces block a SCSI request until it has completed. With a
@@ -6707,7 +6841,7 @@ reader_process (void *data)
   struct SIGACTION act;
   
   FILE* fp;
-  FILE* rear_fp = 0; /* used to store the deinterlaced rear data */
+  Avision_Rear_Store* rear = 0; /* used to store the deinterlaced rear data */
   FILE* raw_fp = 0; /* used to write the RAW image data for debugging */
   
   /* the complex params */
@@ -6818,26 +6952,21 @@ reader_process (void *data)
       }
     }
   
-  /* setup file i/o for deinterlacing scans or if we are the back page with a flipping duplexer */
+  /* the rear store for deinterlacing scans or if we are the back page
+     with a flipping duplexer, set up by sane_start */
   if (deinterlace != NONE ||
      (dev->hw->feature_type2 & AV_ADF_FLIPPING_DUPLEX && s->source_mode == AV_ADF_DUPLEX && !(s->page % 2)))
     {
-      if (!s->duplex_rear_valid) { /* create new file for writing */
-	DBG (3, "reader_process: opening duplex rear file for writing.\n");
-	rear_fp = fopen (s->duplex_rear_fname, "w");
-	if (! rear_fp) {
-	  fclose (fp);
-	  return SANE_STATUS_NO_MEM;
-	}
-      }
-      else { /* open saved rear data */
-	DBG (3, "reader_process: opening duplex rear file for reading.\n");
-	rear_fp = fopen (s->duplex_rear_fname, "r");
-	if (! rear_fp) {
-	  fclose (fp);
-	  return SANE_STATUS_IO_ERROR;
-	}
+      rear = s->duplex_rear;
+      if (!rear) {
+	DBG (1, "reader_process: no duplex rear store.\n");
+	fclose (fp);
+	return s->duplex_rear_valid ? SANE_STATUS_IO_ERROR : SANE_STATUS_NO_MEM;
       }
+      if (!s->duplex_rear_valid)
+	DBG (3, "reader_process: storing the duplex rear side.\n");
+      else
+	DBG (3, "reader_process: delivering the stored duplex rear side.\n");
     }
   
   /* it takes quite a few lines to saturate the (USB) bus */
@@ -6998,7 +7127,8 @@ reader_process (void *data)
 	       (u_long) processed_bytes, (u_long) total_size);
 	  DBG (5, "reader_process: virtual this_read: %lu\n", (u_long) this_read);
 	  
-	  got = fread (stripe_data + stripe_fill, 1, this_read, rear_fp);
+	  got = rear_store_get (rear, processed_bytes,
+				stripe_data + stripe_fill, this_read);
 	  stripe_fill += got;
 	  processed_bytes += got;
 	  if (got != this_read)
@@ -7031,8 +7161,8 @@ reader_process (void *data)
 		   (deinterlace == HALF   && absline >= total_size / s->avdimen.hw_bytes_per_line / 2) ||
 		   (deinterlace == LINE   && absline & 0x1) ) /* last bit equals % 2 */
 		{
-		  DBG (9, "reader_process: saving rear line %d to temporary file.\n", absline);
-		  fwrite (ptr, s->avdimen.hw_bytes_per_line, 1, rear_fp);
+		  DBG (9, "reader_process: saving rear line %d to the rear store.\n", absline);
+		  rear_store_put (rear, rear->end, ptr);
 		  if (deinterlace == LINE)
 		    memmove (ptr, ptr+s->avdimen.hw_bytes_per_line,
 			     stripe_data + stripe_fill - ptr - s->avdimen.hw_bytes_per_line);
@@ -7048,13 +7178,12 @@ reader_process (void *data)
 	       useful_bytes, stripe_fill);
 	}
       if (dev->hw->feature_type2 & AV_ADF_FLIPPING_DUPLEX && s->source_mode == AV_ADF_DUPLEX && !(s->page % 2) && !s->duplex_rear_valid) {
-        /* Here we flip the image by writing the lines from the end of the file to the beginning. */
+        /* Here we flip the image by storing the lines from the bottom up. */
 	unsigned int absline = (processed_bytes - stripe_fill) / s->avdimen.hw_bytes_per_line;
 	unsigned int abslines = absline + useful_bytes / s->avdimen.hw_bytes_per_line;
 	uint8_t* ptr = stripe_data;
 	for ( ; absline < abslines; ++absline) {
-          fseek (rear_fp, ((0 - s->params.lines) - absline - 2) * s->avdimen.hw_bytes_per_line, SEEK_SET);
-          fwrite (ptr, s->avdimen.hw_bytes_per_line, 1, rear_fp);
+          rear_store_put (rear, rear->lines - 1 - absline, ptr);
           useful_bytes -= s->avdimen.hw_bytes_per_line;
           stripe_fill -= s->avdimen.hw_bytes_per_line;
           ptr += s->avdimen.hw_bytes_per_line;
@@ -7504,9 +7633,7 @@ reader_process (void *data)
   } else {
     fclose (fp);
   }
-  if (rear_fp)
-    fclose (rear_fp);
- 
+
   if (ip_data) free (ip_data);
   if (ip_history)
     free (ip_history);
@@ -7617,6 +7744,11 @@ sane_reload_devices (void)
 		     linenumber);
 		force_a4 = SANE_TRUE;
 	      }
+	      else if (strcmp (word, "rear-memory-limit") == 0) {
+		rear_memory_limit = atoi (sanei_config_skip_whitespace (cp));
+		DBG (3, "sane_reload_devices: config file line %d: rear-memory-limit %d MB\n",
+		     linenumber, rear_memory_limit);
+	      }
 	      else if (strcmp (word, "force-a3") == 0) {
 		DBG (3, "sane_reload_devices: config file line %d: enabling force-a3\n",
 		     linenumber);
@@ -7996,6 +8128,7 @@ sane_close (SANE_Handle handle)
   if (s->background_raster)
     free (s->background_raster);
   
+  rear_store_close (s);
   if (*(s->duplex_rear_fname)) {
     unlink (s->duplex_rear_fname);
     *(s->duplex_rear_fname) = 0;
@@ -8515,6 +8648,17 @@ sane_start (SANE_Handle handle)
     goto stop_scanner_and_return;
   }
   
+  /* the reader of this sheet stores its rear side */
+  if (s->avdimen.interlaced_duplex ||
+      (dev->hw->feature_type2 & AV_ADF_FLIPPING_DUPLEX &&
+       s->source_mode == AV_ADF_DUPLEX && !((s->page + 1) % 2))) {
+    status = rear_store_open (s, s->avdimen.hw_lines +
+			      2 * s->avdimen.line_difference +
+			      s->avdimen.rear_offset);
+    if (status != SANE_STATUS_GOOD)
+      goto stop_scanner_and_return;
+  }
+  
  start_scan_end:
   
   s->scanning = SANE_TRUE;
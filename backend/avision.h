@@ -425,6 +425,16 @@ typedef struct Avision_Device
   Avision_HWEntry* hw;
 } Avision_Device;
 
+/* the rear side of a duplex sheet, in memory shared with the reader */
+typedef struct Avision_Rear_Store
+{
+  size_t size;           /* bytes allocated, including this header */
+  size_t bytes_per_line;
+  size_t lines;          /* lines the store can hold */
+  size_t first;          /* first line stored */
+  size_t end;            /* one past the last line stored */
+} Avision_Rear_Store;
+
 /* all the state relevant for the SANE interface */
 typedef struct Avision_Scanner
 {
@@ -455,6 +465,7 @@ typedef struct Avision_Scanner
   /* Internal data for duplex scans */
   char duplex_rear_fname [PATH_MAX];
   SANE_Bool duplex_rear_valid;
+  Avision_Rear_Store* duplex_rear;
   
   color_mode c_mode;
   source_mode source_mode;
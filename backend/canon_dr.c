@@ -349,10 +349,12 @@
 #include <sys/time.h> /*gettimeofday*/
 
 #include "../include/sane/sanei_backend.h"
+#include "../include/sane/sanei.h"
 #include "../include/sane/sanei_scsi.h"
 #include "../include/sane/sanei_usb.h"
 #include "../include/sane/saneopts.h"
 #include "../include/sane/sanei_config.h"
+#include "../include/sane/sanei_magic.h"
 
 #include "canon_dr-cmd.h"
 #include "canon_dr.h"
@@ -371,13 +373,6 @@
  - useless noise   35
 */
 
-/* ------------------------------------------------------------------------- */
-/* if JPEG support is not enabled in sane.h, we setup our own defines */
-#ifndef SANE_FRAME_JPEG
-#define SANE_FRAME_JPEG 0x0B
-#define SANE_JPEG_DISABLED 1
-#endif
-/* ------------------------------------------------------------------------- */
 #define STRING_FLATBED SANE_I18N("Flatbed")
 #define STRING_ADFFRONT SANE_I18N("ADF Front")
 #define STRING_ADFBACK SANE_I18N("ADF Back")
@@ -453,6 +448,8 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
   DBG (5, "sane_init: canon_dr backend %d.%d.%d, from %s\n",
     SANE_CURRENT_MAJOR, V_MINOR, BUILD, PACKAGE_STRING);
 
+  sanei_magic_init();
+
   DBG (10, "sane_init: finish\n");
 
   return SANE_STATUS_GOOD;
@@ -2154,10 +2151,9 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
     i=0;
     s->compress_list[i++]=STRING_NONE;
 
-    if(s->has_comp_JPEG){
-#ifndef SANE_JPEG_DISABLED
+    /* only for frontends that asked for compressed frames */
+    if(s->has_comp_JPEG && SANEI_COMPRESSED_FRAMES()){
       s->compress_list[i++]=STRING_JPEG;
-#endif
     }
 
     s->compress_list[i]=NULL;
@@ -8406,102 +8402,44 @@ getEdgeSlope (int width, int height, int * top, int * bot,
 
 /* function to do a simple rotation by a given slope, around
  * a given point. The point can be outside of image to get
- * proper edge alignment. Unused areas filled with bg color
- * FIXME: Do in-place rotation to save memory */
+ * proper edge alignment. Unused areas filled with bg color.
+ * The rotation itself is done in place by sanei_magic */
 SANE_Status
 rotateOnCenter (struct scanner *s, int side,
   int centerX, int centerY, double slope)
 {
-  double slopeRad = -atan(slope);
-  double slopeSin = sin(slopeRad);
-  double slopeCos = cos(slopeRad);
-
-  int bwidth = s->i.Bpl;
-  int pwidth = s->i.width;
-  int height = s->i.height;
-  int depth = 1;
+  SANE_Parameters params;
   int bg_color = s->lut[s->bg_color];
-
-  unsigned char * outbuf;
-  int i, j, k;
+  SANE_Status ret;
 
   DBG(10,"rotateOnCenter: start: %d %d\n",centerX,centerY);
 
-  outbuf = malloc(s->i.bytes_tot[side]);
-  if(!outbuf){
-    DBG(15,"rotateOnCenter: no outbuf\n");
-    return SANE_STATUS_NO_MEM;
-  }
+  params.format = s->i.format;
+  params.last_frame = 1;
+  params.bytes_per_line = s->i.Bpl;
+  params.pixels_per_line = s->i.width;
+  params.lines = s->i.height;
 
   switch (s->i.mode){
 
     case MODE_COLOR:
-      depth = 3;
-
     case MODE_GRAYSCALE:
-      memset(outbuf,bg_color,s->i.bytes_tot[side]);
-
-      for (i=0; i<height; i++) {
-        int shiftY = centerY - i;
-    
-        for (j=0; j<pwidth; j++) {
-          int shiftX = centerX - j;
-          int sourceX, sourceY;
-    
-          sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-          if (sourceX < 0 || sourceX >= pwidth)
-            continue;
-    
-          sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-          if (sourceY < 0 || sourceY >= height)
-            continue;
-    
-          for (k=0; k<depth; k++) {
-            outbuf[i*bwidth+j*depth+k]
-              = s->buffers[side][sourceY*bwidth+sourceX*depth+k];
-          }
-        }
-      }
+      params.depth = 8;
       break;
 
     case MODE_LINEART:
     case MODE_HALFTONE:
-      memset(outbuf,(bg_color<s->threshold)?0xff:0x00,s->i.bytes_tot[side]);
-
-      for (i=0; i<height; i++) {
-        int shiftY = centerY - i;
-    
-        for (j=0; j<pwidth; j++) {
-          int shiftX = centerX - j;
-          int sourceX, sourceY;
-    
-          sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-          if (sourceX < 0 || sourceX >= pwidth)
-            continue;
-    
-          sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-          if (sourceY < 0 || sourceY >= height)
-            continue;
-
-          /* wipe out old bit */
-          outbuf[i*bwidth + j/8] &= ~(1 << (7-(j%8)));
-
-          /* fill in new bit */
-          outbuf[i*bwidth + j/8] |= 
-            ((s->buffers[side][sourceY*bwidth + sourceX/8]
-            >> (7-(sourceX%8))) & 1) << (7-(j%8));
-        }
-      }
+      params.depth = 1;
+      bg_color = (bg_color<s->threshold);
       break;
   }
 
-  memcpy(s->buffers[side],outbuf,s->i.bytes_tot[side]);
-
-  free(outbuf);
+  ret = sanei_magic_rotate(&params, s->buffers[side],
+    centerX, centerY, slope, bg_color);
 
   DBG(10,"rotateOnCenter: finish\n");
 
-  return 0;
+  return ret;
 }
 
 /* Function to build a lookup table (LUT), often
@@ -44,7 +44,7 @@
 
 /* Please increase version number with every change 
    (don't forget to update dll.desc) */
-#define DLL_VERSION "1.0.13"
+#define DLL_VERSION "1.0.15"
 
 #ifdef _AIX
 # include "lalloca.h"		/* MUST come first for AIX! */
@@ -96,7 +96,15 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(USE_PTHREAD) && defined(HAVE_PTHREAD_H)
+# include <pthread.h>
+# define DLL_USE_THREADS
+#endif
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
@@ -163,6 +171,24 @@ struct backend
   u_int inited:1;		/* has the backend been initialized? */
   void *handle;			/* handle returned by dlopen() */
   void *(*op[NUM_OPS]) (void);
+  /* PRELOAD_DEFN leaves all of this zero: */
+  struct
+  {
+    u_int absent:1;		/* none of its USB devices attached (usb_match) */
+#ifdef DLL_USE_THREADS
+    /* get_devices() running in a thread of its own (see probe_timeout): */
+    int probing;		/* probe_thread started, not yet joined */
+    int probe_done;		/* probe_thread finished (under probe_lock) */
+    pthread_t probe_thread;
+    SANE_Bool probe_local_only;
+    SANE_Status probe_status;
+    const SANE_Device **probe_list;
+#endif
+    /* ids from the USB index (usb_match); none if the backend isn't listed */
+    SANE_Word *usb_ids;		/* vendor << 16 | product */
+    int num_usb_ids;
+  }
+  state;
 };
 
 #define BE_ENTRY(be,func)       sane_##be##_##func
@@ -203,7 +229,8 @@ struct backend
     BE_ENTRY(name,cancel),                      \
     BE_ENTRY(name,set_io_mode),                 \
     BE_ENTRY(name,get_select_fd)                \
-  }                                             \
+  },                                            \
+  { 0 } /* state */                             \
 }
 
 #ifndef __BEOS__
@@ -211,7 +238,7 @@ struct backend
 #include "dll-preload.h"
 #else
 static struct backend preloaded_backends[] = {
- { 0, 0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }}
+ { 0, 0, 0, 0, 0, 0, {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 }, { 0 }}
 };
 #endif
 #endif
@@ -240,6 +267,29 @@ static struct alias *first_alias;
 static SANE_Auth_Callback auth_callback;
 static struct backend *first_backend;
 
+/* dll.conf options */
+static int probe_timeout;	/* seconds; 0 = probe backends in turn */
+static int device_cache_ttl;	/* seconds; 0 = no device cache */
+
+#define DLL_CACHE_FILE "/.sane/dll-devices"
+#define DLL_CACHE_MAGIC "# SANE dll device cache 2"
+/* changes whenever dll.conf or dll.d is edited (see stamp_config) */
+static unsigned long config_stamp;
+
+static SANE_Bool usb_match;	/* load USB-only backends on demand */
+static SANE_Word *usb_present;	/* ids of the attached USB devices */
+static int num_usb_present;
+
+#define DLL_USB_INDEX "/sane/dll-usb.index"
+#define DLL_USB_SYSFS "/sys/bus/usb/devices"
+
+#ifdef DLL_USE_THREADS
+static pthread_mutex_t probe_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t probe_cond = PTHREAD_COND_INITIALIZER;
+/* held while a backend is loaded and initialized, see init() */
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 #ifndef __BEOS__
 static const char *op_name[] = {
   "init", "exit", "get_devices", "open", "close", "get_option_descriptor",
@@ -598,7 +648,7 @@ load (struct backend *be)
 #endif /* __BEOS__ */
 
 static SANE_Status
-init (struct backend *be)
+init_backend (struct backend *be)
 {
   SANE_Status status;
   SANE_Int version;
@@ -632,6 +682,256 @@ init (struct backend *be)
   return SANE_STATUS_GOOD;
 }
 
+/* Backends were never written to be initialized concurrently, and
+   many of them set up shared sanei state in sane_init().  So while
+   the probe threads run get_devices() in parallel, loading and
+   initializing happens one backend at a time. */
+static SANE_Status
+init (struct backend *be)
+{
+#ifdef DLL_USE_THREADS
+  SANE_Status status;
+
+  pthread_mutex_lock (&init_lock);
+  status = init_backend (be);
+  pthread_mutex_unlock (&init_lock);
+  return status;
+#else
+  return init_backend (be);
+#endif
+}
+
+/* The USB index is generated by sane-desc from the .desc files.  It
+   lists the backends that drive nothing but USB devices, one line per
+   "backend vendor-id product-id".  Attach the ids to the configured
+   backends; backends without ids are always loaded. */
+static void
+read_usb_index (void)
+{
+  char line[PATH_MAX], name[PATH_MAX];
+  const char *path = STRINGIFY (PATH_SANE_DATA_DIR) DLL_USB_INDEX;
+  struct backend *be = NULL;
+  unsigned int vendor, product;
+  SANE_Word *ids;
+  FILE *fp;
+  int count = 0;
+
+  fp = fopen (path, "r");
+  if (!fp)
+    {
+      DBG (1, "sane_init/read_usb_index: can't open %s (%s), loading all "
+	   "backends\n", path, strerror (errno));
+      return;
+    }
+
+  while (fgets (line, sizeof (line), fp))
+    {
+      if (line[0] == '#'
+	  || sscanf (line, "%s %x %x", name, &vendor, &product) != 3)
+	continue;
+
+      if (!be || strcmp (be->name, name) != 0)
+	for (be = first_backend; be; be = be->next)
+	  if (strcmp (be->name, name) == 0)
+	    break;
+      if (!be)
+	continue;
+
+      ids = realloc (be->state.usb_ids,
+		     (be->state.num_usb_ids + 1) * sizeof (ids[0]));
+      if (!ids)
+	{
+	  /* better load it in vain than miss a device */
+	  free (be->state.usb_ids);
+	  be->state.usb_ids = NULL;
+	  be->state.num_usb_ids = 0;
+	  continue;
+	}
+      ids[be->state.num_usb_ids++] =
+	(vendor & 0xffff) << 16 | (product & 0xffff);
+      be->state.usb_ids = ids;
+      ++count;
+    }
+  fclose (fp);
+
+  DBG (3, "sane_init/read_usb_index: %d ids from %s\n", count, path);
+}
+
+static int
+read_sysfs_id (const char *dev, const char *attr, unsigned int *id)
+{
+  char path[PATH_MAX];
+  FILE *fp;
+  int ok;
+
+  snprintf (path, sizeof (path), "%s/%s/%s", DLL_USB_SYSFS, dev, attr);
+  fp = fopen (path, "r");
+  if (!fp)
+    return 0;
+  ok = (fscanf (fp, "%x", id) == 1);
+  fclose (fp);
+  return ok;
+}
+
+/* Collect the ids of the attached USB devices.  Returns SANE_FALSE if
+   the bus can't be enumerated (no sysfs), so nothing may be skipped. */
+static SANE_Bool
+scan_usb_bus (void)
+{
+  unsigned int vendor, product;
+  struct dirent *de;
+  SANE_Word *ids;
+  int size = 0;
+  DIR *dir;
+
+  free (usb_present);
+  usb_present = NULL;
+  num_usb_present = 0;
+
+  dir = opendir (DLL_USB_SYSFS);
+  if (!dir)
+    {
+      DBG (3, "scan_usb_bus: can't open %s (%s)\n", DLL_USB_SYSFS,
+	   strerror (errno));
+      return SANE_FALSE;
+    }
+
+  while ((de = readdir (dir)) != NULL)
+    {
+      /* skip "." and interfaces like "1-2:1.0" */
+      if (de->d_name[0] == '.' || strchr (de->d_name, ':'))
+	continue;
+      if (!read_sysfs_id (de->d_name, "idVendor", &vendor)
+	  || !read_sysfs_id (de->d_name, "idProduct", &product))
+	continue;
+
+      if (num_usb_present == size)
+	{
+	  size += 32;
+	  ids = realloc (usb_present, size * sizeof (ids[0]));
+	  if (!ids)
+	    {
+	      closedir (dir);
+	      return SANE_FALSE;
+	    }
+	  usb_present = ids;
+	}
+      usb_present[num_usb_present++] =
+	(vendor & 0xffff) << 16 | (product & 0xffff);
+    }
+  closedir (dir);
+
+  DBG (3, "scan_usb_bus: %d USB devices attached\n", num_usb_present);
+  return SANE_TRUE;
+}
+
+/* Can BE be skipped because none of its USB devices is attached?
+   Only valid after scan_usb_bus() succeeded. */
+static int
+usb_absent (struct backend *be)
+{
+  int i, j;
+
+  for (i = 0; i < be->state.num_usb_ids; ++i)
+    for (j = 0; j < num_usb_present; ++j)
+      if (be->state.usb_ids[i] == usb_present[j])
+	return 0;
+
+  if (be->state.num_usb_ids > 0)
+    {
+      DBG (3, "usb_absent: no device for backend `%s' attached\n", be->name);
+      return 1;
+    }
+  return 0;
+}
+
+#ifdef DLL_USE_THREADS
+static void *
+probe_thread (void *arg)
+{
+  struct backend *be = arg;
+  const SANE_Device **be_list = NULL;
+  SANE_Status status = SANE_STATUS_GOOD;
+
+  if (!be->inited)
+    status = init (be);
+  if (status == SANE_STATUS_GOOD)
+    status = (*(op_get_devs_t)be->op[OP_GET_DEVS]) (&be_list,
+						    be->state.probe_local_only);
+
+  pthread_mutex_lock (&probe_lock);
+  be->state.probe_status = status;
+  be->state.probe_list = be_list;
+  be->state.probe_done = 1;
+  pthread_cond_broadcast (&probe_cond);
+  pthread_mutex_unlock (&probe_lock);
+  return NULL;
+}
+
+/* Wait until the probe thread of BE is done, but not past DEADLINE
+   (if given), and join it.  Returns 0 if the thread is still busy. */
+static int
+finish_probe (struct backend *be, struct timespec *deadline)
+{
+  int done;
+
+  if (!be->state.probing)
+    return 1;
+
+  pthread_mutex_lock (&probe_lock);
+  while (!be->state.probe_done)
+    {
+      if (!deadline)
+	pthread_cond_wait (&probe_cond, &probe_lock);
+      else if (pthread_cond_timedwait (&probe_cond, &probe_lock, deadline)
+	       != 0)
+	break;
+    }
+  done = be->state.probe_done;
+  pthread_mutex_unlock (&probe_lock);
+
+  if (!done)
+    return 0;
+
+  pthread_join (be->state.probe_thread, NULL);
+  be->state.probing = 0;
+  return 1;
+}
+
+/* Start get_devices() of all dynamically loaded backends at once.
+   Preloaded backends share the sanei code with each other and are
+   probed in turn by the caller. */
+static void
+start_probes (SANE_Bool local_only)
+{
+  struct backend *be;
+  struct timespec expired = { 0, 0 };
+
+  for (be = first_backend; be; be = be->next)
+    {
+      if (be->permanent || be->state.absent)
+	continue;
+
+      /* a backend that timed out last time may still be at it */
+      if (!finish_probe (be, &expired))
+	{
+	  DBG (1, "start_probes: backend `%s' is still busy\n", be->name);
+	  continue;
+	}
+
+      be->state.probe_done = 0;
+      be->state.probe_local_only = local_only;
+      if (pthread_create (&be->state.probe_thread, NULL, probe_thread, be) != 0)
+	{
+	  DBG (1, "start_probes: pthread_create failed (%s)\n",
+	       strerror (errno));
+	  continue;
+	}
+      be->state.probing = 1;
+    }
+}
+#endif /* DLL_USE_THREADS */
+
 
 static void
 add_alias (const char *line_param)
@@ -724,12 +1024,70 @@ add_alias (const char *line_param)
 }
 
 
+/* Options are the only dll.conf lines with an equal sign, as in
+   "probe_timeout = 10" or "usb_match = yes". */
+static int
+read_option (const char *line)
+{
+  const char *eq, *comment, *val;
+  char *end;
+  long n;
+
+  eq = strchr (line, '=');
+  comment = strchr (line, '#');
+  if (!eq || (comment && comment < eq))
+    return 0;
+
+  val = sanei_config_skip_whitespace (eq + 1);
+  if (strncmp (line, "usb_match", 9) == 0)
+    {
+      usb_match = (strncmp (val, "yes", 3) == 0 || val[0] == '1');
+      DBG (3, "sane_init/read_option: usb_match %s\n",
+	   usb_match ? "yes" : "no");
+      return 1;
+    }
+
+  n = strtol (val, &end, 10);
+  if (end == val || n < 0)
+    {
+      DBG (1, "sane_init/read_option: invalid value in `%s'\n", line);
+      return 1;
+    }
+
+  if (strncmp (line, "probe_timeout", 13) == 0)
+    {
+      probe_timeout = n;
+      DBG (3, "sane_init/read_option: probe timeout %d s\n", probe_timeout);
+    }
+  else if (strncmp (line, "device_cache", 12) == 0)
+    {
+      device_cache_ttl = n;
+      DBG (3, "sane_init/read_option: device cache ttl %d s\n",
+	   device_cache_ttl);
+    }
+  else
+    DBG (1, "sane_init/read_option: unknown option `%s'\n", line);
+
+  return 1;
+}
+
+/* Fold the identity and modification time of a configuration file or
+   directory into config_stamp, which keys the device cache. */
+static void
+stamp_config (const struct stat *st)
+{
+  config_stamp = config_stamp * 31 + (unsigned long) st->st_ino;
+  config_stamp = config_stamp * 31 + (unsigned long) st->st_mtime;
+  config_stamp = config_stamp * 31 + (unsigned long) st->st_size;
+}
+
 static void
 read_config (const char *conffile)
 {
   FILE *fp;
   char config_line[PATH_MAX];
   char *backend_name;
+  struct stat st;
 
   fp = sanei_config_open (conffile);
   if (!fp)
@@ -738,6 +1096,8 @@ read_config (const char *conffile)
            conffile, strerror (errno));
       return; /* don't insist on config file */
     }
+  if (fstat (fileno (fp), &st) == 0)
+    stamp_config (&st);
 
   DBG (5, "sane_init/read_config: reading %s\n", conffile);
   while (sanei_config_read (config_line, sizeof (config_line), fp))
@@ -745,6 +1105,9 @@ read_config (const char *conffile)
       char *comment;
       SANE_String_Const cp;
 
+      if (read_option (config_line))
+        continue;
+
       cp = sanei_config_get_string (config_line, &backend_name);
       /* ignore empty lines */
       if (!backend_name || cp == config_line)
@@ -801,6 +1164,10 @@ read_dlld (void)
 	  /* length of path to parent dir of dll.d/ */
 	  plen = strlen (dir) + 1;
 
+	  /* files added to or removed from dll.d change its mtime */
+	  if (stat (dlldir, &st) == 0)
+	    stamp_config (&st);
+
 	  DBG(3, "sane_init/read_dlld: using config directory `%s'\n", dlldir);
 	  break;
 	}
@@ -865,6 +1232,10 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
   DBG_INIT ();
 
   auth_callback = authorize;
+  probe_timeout = 0;
+  device_cache_ttl = 0;
+  config_stamp = 0;
+  usb_match = SANE_FALSE;
 
   DBG (1, "sane_init: SANE dll backend version %s from %s\n", DLL_VERSION,
        PACKAGE_STRING);
@@ -893,6 +1264,8 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
    */
   read_dlld ();
   read_config (DLL_CONFIG_FILE);
+  if (usb_match)
+    read_usb_index ();
 
   fp = sanei_config_open (DLL_ALIASES_FILE);
   if (!fp)
@@ -941,12 +1314,26 @@ sane_exit (void)
 {
   struct backend *be, *next;
   struct alias *alias;
+#ifdef DLL_USE_THREADS
+  struct timespec expired = { 0, 0 };
+#endif
 
   DBG (2, "sane_exit: exiting\n");
 
   for (be = first_backend; be; be = next)
     {
       next = be->next;
+#ifdef DLL_USE_THREADS
+      if (!finish_probe (be, &expired))
+	{
+	  /* a backend stuck in get_devices() can't be unloaded; leave it
+	     to the end of the process */
+	  DBG (1, "sane_exit: backend `%s' is still busy, not unloading it\n",
+	       be->name);
+	  pthread_detach (be->state.probe_thread);
+	  continue;
+	}
+#endif
       if (be->loaded)
 	{
 	  if (be->inited)
@@ -981,6 +1368,9 @@ sane_exit (void)
 #endif /* HAVE_DLL */
 #endif /* __BEOS__ */
 	}
+      free (be->state.usb_ids);
+      be->state.usb_ids = NULL;
+      be->state.num_usb_ids = 0;
       if (!be->permanent)
 	{
 	  if (be->name)
@@ -994,6 +1384,10 @@ sane_exit (void)
     }
   first_backend = 0;
 
+  free (usb_present);
+  usb_present = NULL;
+  num_usb_present = 0;
+
   while ((alias = first_alias) != NULL)
     {
       first_alias = first_alias->next;
@@ -1015,20 +1409,6 @@ sane_exit (void)
   DBG (3, "sane_exit: finished\n");
 }
 
-/* Note that a call to get_devices() implies that we'll have to load
-   all backends.  To avoid this, you can call sane_open() directly
-   (assuming you know the name of the backend/device).  This is
-   appropriate for the command-line interface of SANE, for example.
- */
-SANE_Status
-sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
-{
-  const SANE_Device **be_list;
-  struct backend *be;
-  SANE_Status status;
-  char *full_name;
-  int i, num_devs;
-  size_t len;
 #define ASSERT_SPACE(n)                                                    \
   {                                                                        \
     if (devlist_len + (n) > devlist_size)                                  \
@@ -1043,84 +1423,368 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
       }                                                                    \
   }
 
-  DBG (3, "sane_get_devices\n");
+/* Append the devices of backend BE to devlist, applying aliases. */
+static SANE_Status
+add_devices (struct backend *be, const SANE_Device ** be_list)
+{
+  char *full_name;
+  int i, num_devs;
+  size_t len;
 
-  if (devlist)
-    for (i = 0; i < devlist_len; ++i)
-      free ((void *) devlist[i]);
-  devlist_len = 0;
+  /* count the number of devices for this backend: */
+  for (num_devs = 0; be_list[num_devs]; ++num_devs);
 
-  for (be = first_backend; be; be = be->next)
+  ASSERT_SPACE (num_devs);
+
+  for (i = 0; i < num_devs; ++i)
     {
-      if (!be->inited)
-	if (init (be) != SANE_STATUS_GOOD)
-	  continue;
+      SANE_Device *dev;
+      char *mem;
+      struct alias *alias;
 
-      status = (*(op_get_devs_t)be->op[OP_GET_DEVS]) (&be_list, local_only);
-      if (status != SANE_STATUS_GOOD || !be_list)
-	continue;
+      for (alias = first_alias; alias != NULL; alias = alias->next)
+	{
+	  len = strlen (be->name);
+	  if (strlen (alias->oldname) <= len)
+	    continue;
+	  if (strncmp (alias->oldname, be->name, len) == 0
+	      && alias->oldname[len] == ':'
+	      && strcmp (&alias->oldname[len + 1], be_list[i]->name) == 0)
+	    break;
+	}
+
+      if (alias)
+	{
+	  if (!alias->newname)	/* hidden device */
+	    continue;
+
+	  len = strlen (alias->newname);
+	  mem = malloc (sizeof (*dev) + len + 1);
+	  if (!mem)
+	    return SANE_STATUS_NO_MEM;
+
+	  full_name = mem + sizeof (*dev);
+	  strcpy (full_name, alias->newname);
+	}
+      else
+	{
+	  /* create a new device entry with a device name that is the
+	     sum of the backend name a colon and the backend's device
+	     name: */
+	  len = strlen (be->name) + 1 + strlen (be_list[i]->name);
+	  mem = malloc (sizeof (*dev) + len + 1);
+	  if (!mem)
+	    return SANE_STATUS_NO_MEM;
+
+	  full_name = mem + sizeof (*dev);
+	  strcpy (full_name, be->name);
+	  strcat (full_name, ":");
+	  strcat (full_name, be_list[i]->name);
+	}
+
+      dev = (SANE_Device *) mem;
+      dev->name = full_name;
+      dev->vendor = be_list[i]->vendor;
+      dev->model = be_list[i]->model;
+      dev->type = be_list[i]->type;
+
+      devlist[devlist_len++] = dev;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+/* The device cache lives in $HOME/.sane/dll-devices.  It is a text
+   file starting with DLL_CACHE_MAGIC, the configuration path, the
+   config_stamp of dll.conf and dll.d and the local_only flag it was
+   made for, followed by one line per device
+   with name, vendor, model and type separated by tabs.  Its age is
+   taken from the modification time. */
+static char *
+device_cache_path (void)
+{
+  const char *home;
+  char *path;
+
+  home = getenv ("HOME");
+  if (!home || !home[0])
+    return NULL;
+
+  path = malloc (strlen (home) + sizeof (DLL_CACHE_FILE));
+  if (path)
+    {
+      strcpy (path, home);
+      strcat (path, DLL_CACHE_FILE);
+    }
+  return path;
+}
 
-      /* count the number of devices for this backend: */
-      for (num_devs = 0; be_list[num_devs]; ++num_devs);
+/* Fill devlist from the device cache if it is fresh and matches the
+   current configuration. */
+static SANE_Status
+read_device_cache (SANE_Bool local_only)
+{
+  char line[PATH_MAX], *field[4], *mem, *p;
+  const char *paths;
+  struct stat st;
+  SANE_Device *dev;
+  time_t now;
+  size_t len;
+  char *path;
+  FILE *fp;
+  int i, ok;
 
-      ASSERT_SPACE (num_devs);
+  path = device_cache_path ();
+  if (!path)
+    return SANE_STATUS_INVAL;
+
+  now = time (NULL);
+  if (stat (path, &st) < 0 || st.st_mtime > now
+      || now - st.st_mtime >= device_cache_ttl)
+    {
+      DBG (3, "read_device_cache: no fresh cache in %s\n", path);
+      free (path);
+      return SANE_STATUS_INVAL;
+    }
+
+  fp = fopen (path, "r");
+  free (path);
+  if (!fp)
+    return SANE_STATUS_INVAL;
+
+  paths = sanei_config_get_paths ();
+  if (!paths)
+    paths = "";
+  ok = (fgets (line, sizeof (line), fp)
+	&& strcmp (line, DLL_CACHE_MAGIC "\n") == 0
+	&& fgets (line, sizeof (line), fp)
+	&& strncmp (line, "config ", 7) == 0
+	&& strncmp (line + 7, paths, strlen (paths)) == 0
+	&& strcmp (line + 7 + strlen (paths), "\n") == 0
+	&& fgets (line, sizeof (line), fp)
+	&& strtoul (line, NULL, 10) == config_stamp
+	&& fgets (line, sizeof (line), fp)
+	&& line[0] == (local_only ? '1' : '0'));
+
+  while (ok && fgets (line, sizeof (line), fp))
+    {
+      len = strlen (line);
+      if (len == 0 || line[len - 1] != '\n')
+	{
+	  ok = 0;
+	  break;
+	}
+      line[--len] = '\0';
 
-      for (i = 0; i < num_devs; ++i)
+      p = line;
+      for (i = 0; i < 4; ++i)
+	{
+	  field[i] = p;
+	  p = strchr (p, '\t');
+	  if (p)
+	    *p++ = '\0';
+	  else if (i < 3)
+	    break;
+	}
+      if (i < 4)
 	{
-	  SANE_Device *dev;
-	  char *mem;
-	  struct alias *alias;
+	  ok = 0;
+	  break;
+	}
 
-	  for (alias = first_alias; alias != NULL; alias = alias->next)
+      if (devlist_len + 1 > devlist_size)
+	{
+	  devlist_size += 16;
+	  devlist = realloc (devlist, devlist_size * sizeof (devlist[0]));
+	  if (!devlist)
 	    {
-	      len = strlen (be->name);
-	      if (strlen (alias->oldname) <= len)
-		continue;
-	      if (strncmp (alias->oldname, be->name, len) == 0
-		  && alias->oldname[len] == ':'
-		  && strcmp (&alias->oldname[len + 1], be_list[i]->name) == 0)
-		break;
+	      devlist_size = devlist_len = 0;
+	      fclose (fp);
+	      return SANE_STATUS_NO_MEM;
 	    }
+	}
 
-	  if (alias)
-	    {
-	      if (!alias->newname)	/* hidden device */
-		continue;
+      /* device struct and the four strings in one block, like
+         add_devices() does it */
+      mem = malloc (sizeof (*dev) + len + 1);
+      if (!mem)
+	{
+	  ok = 0;
+	  break;
+	}
+      p = mem + sizeof (*dev);
+      memcpy (p, line, len + 1);
+      dev = (SANE_Device *) mem;
+      dev->name = p + (field[0] - line);
+      dev->vendor = p + (field[1] - line);
+      dev->model = p + (field[2] - line);
+      dev->type = p + (field[3] - line);
+      devlist[devlist_len++] = dev;
+    }
+  fclose (fp);
 
-	      len = strlen (alias->newname);
-	      mem = malloc (sizeof (*dev) + len + 1);
-	      if (!mem)
-		return SANE_STATUS_NO_MEM;
+  if (!ok)
+    {
+      DBG (1, "read_device_cache: ignoring invalid device cache\n");
+      for (i = 0; i < devlist_len; ++i)
+	free ((void *) devlist[i]);
+      devlist_len = 0;
+      return SANE_STATUS_INVAL;
+    }
 
-	      full_name = mem + sizeof (*dev);
-	      strcpy (full_name, alias->newname);
-	    }
-	  else
+  DBG (3, "read_device_cache: using %d cached devices\n", devlist_len);
+  return SANE_STATUS_GOOD;
+}
+
+/* Store the current devlist in the device cache. */
+static void
+write_device_cache (SANE_Bool local_only)
+{
+  const char *paths;
+  char *path, *tmp;
+  FILE *fp;
+  int i;
+
+  path = device_cache_path ();
+  if (!path)
+    return;
+
+  tmp = malloc (strlen (path) + 32);
+  if (!tmp)
+    {
+      free (path);
+      return;
+    }
+
+  /* make sure $HOME/.sane exists */
+  strcpy (tmp, path);
+  *strrchr (tmp, '/') = '\0';
+  mkdir (tmp, 0700);
+
+  sprintf (tmp, "%s.%ld", path, (long) getpid ());
+
+  fp = fopen (tmp, "w");
+  if (!fp)
+    {
+      DBG (1, "write_device_cache: can't create %s (%s)\n", tmp,
+	   strerror (errno));
+      free (tmp);
+      free (path);
+      return;
+    }
+
+  paths = sanei_config_get_paths ();
+  fprintf (fp, "%s\nconfig %s\n%lu\n%d\n", DLL_CACHE_MAGIC,
+	   paths ? paths : "", config_stamp, local_only ? 1 : 0);
+  for (i = 0; i < devlist_len; ++i)
+    {
+      const SANE_Device *dev = devlist[i];
+
+      /* a tab or newline would break the format */
+      if (strpbrk (dev->name, "\t\n") || strpbrk (dev->vendor, "\t\n")
+	  || strpbrk (dev->model, "\t\n") || strpbrk (dev->type, "\t\n"))
+	break;
+      fprintf (fp, "%s\t%s\t%s\t%s\n", dev->name, dev->vendor, dev->model,
+	       dev->type);
+    }
+
+  if (fclose (fp) != 0 || i < devlist_len || rename (tmp, path) < 0)
+    {
+      DBG (1, "write_device_cache: not caching the device list\n");
+      unlink (tmp);
+    }
+  else
+    DBG (3, "write_device_cache: cached %d devices in %s\n", devlist_len,
+	 path);
+
+  free (tmp);
+  free (path);
+}
+
+/* Note that a call to get_devices() implies that we'll have to load
+   all backends.  To avoid this, you can call sane_open() directly
+   (assuming you know the name of the backend/device).  This is
+   appropriate for the command-line interface of SANE, for example.
+   With probe_timeout set, the backends are asked at the same time and
+   slow ones are left behind; with device_cache set, the result is
+   reused for a while without loading any backend at all.
+ */
+SANE_Status
+sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
+{
+  const SANE_Device **be_list;
+  struct backend *be;
+  SANE_Status status;
+  int i, complete = 1;
+  SANE_Bool usb_known = SANE_FALSE;
+#ifdef DLL_USE_THREADS
+  struct timespec deadline;
+  struct timeval now;
+#endif
+
+  DBG (3, "sane_get_devices\n");
+
+  if (devlist)
+    for (i = 0; i < devlist_len; ++i)
+      free ((void *) devlist[i]);
+  devlist_len = 0;
+
+  if (device_cache_ttl > 0
+      && read_device_cache (local_only) == SANE_STATUS_GOOD)
+    goto done;
+
+  usb_known = usb_match && scan_usb_bus ();
+  for (be = first_backend; be; be = be->next)
+    be->state.absent = usb_known && usb_absent (be);
+
+#ifdef DLL_USE_THREADS
+  if (probe_timeout > 0)
+    {
+      gettimeofday (&now, NULL);
+      deadline.tv_sec = now.tv_sec + probe_timeout;
+      deadline.tv_nsec = now.tv_usec * 1000;
+      start_probes (local_only);
+    }
+#endif
+
+  for (be = first_backend; be; be = be->next)
+    {
+#ifdef DLL_USE_THREADS
+      if (be->state.probing)
+	{
+	  if (!finish_probe (be, &deadline))
 	    {
-	      /* create a new device entry with a device name that is the
-	         sum of the backend name a colon and the backend's device
-	         name: */
-	      len = strlen (be->name) + 1 + strlen (be_list[i]->name);
-	      mem = malloc (sizeof (*dev) + len + 1);
-	      if (!mem)
-		return SANE_STATUS_NO_MEM;
-
-	      full_name = mem + sizeof (*dev);
-	      strcpy (full_name, be->name);
-	      strcat (full_name, ":");
-	      strcat (full_name, be_list[i]->name);
+	      DBG (1, "sane_get_devices: backend `%s' timed out\n", be->name);
+	      complete = 0;
+	      continue;
 	    }
+	  status = be->state.probe_status;
+	  be_list = be->state.probe_list;
+	}
+      else
+#endif
+	{
+	  if (be->state.absent)
+	    continue;
 
-	  dev = (SANE_Device *) mem;
-	  dev->name = full_name;
-	  dev->vendor = be_list[i]->vendor;
-	  dev->model = be_list[i]->model;
-	  dev->type = be_list[i]->type;
+	  if (!be->inited)
+	    if (init (be) != SANE_STATUS_GOOD)
+	      continue;
 
-	  devlist[devlist_len++] = dev;
+	  status = (*(op_get_devs_t)be->op[OP_GET_DEVS]) (&be_list,
+							  local_only);
 	}
+      if (status != SANE_STATUS_GOOD || !be_list)
+	continue;
+
+      status = add_devices (be, be_list);
+      if (status != SANE_STATUS_GOOD)
+	return status;
     }
 
+  if (device_cache_ttl > 0 && complete)
+    write_device_cache (local_only);
+
+done:
   /* terminate device list with NULL entry: */
   ASSERT_SPACE (1);
   devlist[devlist_len++] = 0;
@@ -1191,6 +1855,11 @@ sane_open (SANE_String_Const full_name, SANE_Handle * meta_handle)
 	return status;
     }
 
+#ifdef DLL_USE_THREADS
+  /* don't open while a timed out get_devices() is still running */
+  finish_probe (be, NULL);
+#endif
+
   if (!be->inited)
     {
       status = init (be);
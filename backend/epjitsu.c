@@ -184,11 +184,16 @@
 #include <math.h> /*tan*/
 #include <unistd.h> /*usleep*/
 #include <time.h> /*time*/
+#include <sys/time.h> /*gettimeofday*/
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h> /*reader thread*/
+#endif
 
 #include "../include/sane/sanei_backend.h"
 #include "../include/sane/sanei_usb.h"
 #include "../include/sane/saneopts.h"
 #include "../include/sane/sanei_config.h"
+#include "../include/sane/sanei_buf_pool.h"
 
 #include "epjitsu.h"
 #include "epjitsu-cmd.h"
@@ -202,6 +207,12 @@
 
 unsigned char global_firmware_filename[PATH_MAX];
 
+/* blocks read ahead of sane_read by a thread, 0 reads in sane_read */
+static int global_readahead = 0;
+
+/* usb reads of a block kept in flight at once, 0 reads one at a time */
+static int global_usbqueue = 0;
+
 /* values for SANE_DEBUG_EPJITSU env var:
  - errors           5
  - function trace  10
@@ -343,6 +354,18 @@ sane_get_devices (const SANE_Device *** device_list, SANE_Bool local_only)
                 DBG (15, "sane_get_devices: firmware '%s'\n", lp);
                 strncpy((char *)global_firmware_filename,lp,PATH_MAX);
             }
+            else if ((strncmp ("readahead", lp, 9) == 0) && isspace (lp[9])) {
+                lp += 9;
+                lp = sanei_config_skip_whitespace (lp);
+                global_readahead = atoi (lp);
+                DBG (15, "sane_get_devices: readahead %d\n", global_readahead);
+            }
+            else if ((strncmp ("usbqueue", lp, 8) == 0) && isspace (lp[8])) {
+                lp += 8;
+                lp = sanei_config_skip_whitespace (lp);
+                global_usbqueue = atoi (lp);
+                DBG (15, "sane_get_devices: usbqueue %d\n", global_usbqueue);
+            }
             else if ((strncmp ("usb", lp, 3) == 0) && isspace (lp[3])) {
                 DBG (15, "sane_get_devices: looking for '%s'\n", lp);
                 sanei_usb_attach_matching_devices(lp, attach_one);
@@ -2468,6 +2491,9 @@ sane_start (SANE_Handle handle)
         /* reset block */
         update_transfer_totals(&s->block_xfr);
 
+        s->time_descramble = 0;
+        s->time_copy = 0;
+
         /* reset front and back page counters */
         for (i = 0; i < 2; i++)
         {
@@ -2487,6 +2513,13 @@ sane_start (SANE_Handle handle)
             sane_cancel((SANE_Handle)s);
             return ret;
         }
+
+        ret = start_reader(s);
+        if (ret != SANE_STATUS_GOOD) {
+            DBG (5, "sane_start: ERROR: failed to start reader\n");
+            sane_cancel((SANE_Handle)s);
+            return ret;
+        }
     }
     else{
         DBG(15,"sane_start: back side\n");
@@ -2554,6 +2587,20 @@ setup_buffers(struct scanner *s)
         return SANE_STATUS_NO_MEM;
     }
 
+#ifdef HAVE_PTHREAD_H
+    /* raw blocks for the reader thread, the one being converted */
+    /* and up to readahead more, read while it is converted */
+    if(global_readahead > 0){
+        ret = sanei_buf_pool_new(s->block_xfr.line_stride * s->block_img.height + 8,
+          global_readahead + 1, &s->pool);
+        if(ret){
+            DBG (5, "setup_buffers: ERROR: failed to setup block pool\n");
+            return ret;
+        }
+        sanei_buf_pool_set_limit(s->pool, global_readahead + 1);
+    }
+#endif
+
     /* one grayscale line for dynamic threshold */
     s->dt.buffer = calloc (1,s->dt.width_bytes * s->dt.height * s->dt.pages);
     if(!s->dt.buffer){
@@ -2696,7 +2743,11 @@ coarsecal_get_line(struct scanner *s, struct image *img)
         }
     }
     /* convert the raw data into normal packed pixel data */
-    descramble_raw(s, &s->cal_image);
+    ret = descramble_raw(s, &s->cal_image);
+    if(ret){
+        DBG (5, "coarsecal_get_line: cant descramble\n");
+        return ret;
+    }
 
     DBG (5, "coarsecal_get_line: finish\n");
     return ret;
@@ -3173,7 +3224,11 @@ finecal_get_line(struct scanner *s, struct image *img)
         }
     }
     /* convert the raw data into normal packed pixel data */
-    descramble_raw(s, &s->cal_image);
+    ret = descramble_raw(s, &s->cal_image);
+    if(ret){
+        DBG (5, "finecal_get_line: cant descramble\n");
+        return ret;
+    }
 
     /* average the columns of pixels together and put the results in the top line(s) */
     for (i = 0; i < img->pages; i++)
@@ -3903,130 +3958,70 @@ sane_read (SANE_Handle handle, SANE_Byte * buf, SANE_Int max_len, SANE_Int * len
     /* scan not finished, get more into block buffer */
     if(!s->fullscan.done)
     {
-        /* block buffer currently empty, clean up */ 
-        if(!s->block_xfr.rx_bytes)
+        /* reader thread gets the blocks, just convert the next one */
+        if(s->reader_running)
         {
-            /* block buffer bigger than remainder of scan, shrink block */
-            int remainTotal = s->fullscan.total_bytes - s->fullscan.rx_bytes;
-            if(remainTotal < s->block_xfr.total_bytes)
-            {
-                DBG (15, "sane_read: shrinking block to %lu\n", (unsigned long)remainTotal);
-                s->block_xfr.total_bytes = remainTotal;
-            }
-            /* send d3 cmd for S300, S1100, S1300 */
-            if(s->model == MODEL_S300 || s->model == MODEL_S1100 || s->model == MODEL_S1300i)
-            {
-                unsigned char cmd[] = {0x1b, 0xd3};
-                size_t cmdLen = 2;
-                unsigned char stat[1];
-                size_t statLen = 1;
-                
-                DBG (15, "sane_read: d3\n");
-              
-                ret = do_cmd(
-                  s, 0,
-                  cmd, cmdLen,
-                  NULL, 0,
-                  stat, &statLen
-                );
-                if(ret){
-                    DBG (5, "sane_read: error sending d3 cmd\n");
-                    return ret;
-                }
-                if(stat[0] != 6){
-                    DBG (5, "sane_read: cmd bad status?\n");
-                    return SANE_STATUS_IO_ERROR;
-                }
+            ret = read_from_queue(s);
+            if(ret){
+                DBG (5, "sane_read: cant get block from reader thread\n");
+                return ret;
             }
         }
 
-        ret = read_from_scanner(s, &s->block_xfr);
-        if(ret){
-            DBG (5, "sane_read: cant read from scanner\n");
-            return ret;
-        }
-
-        /* block filled, copy to front/back */
-        if(s->block_xfr.done)
+        else
         {
-            DBG (15, "sane_read: block buffer full\n");
-
-            /* convert the raw data into normal packed pixel data */
-            descramble_raw(s, &s->block_xfr);
-
-            s->block_xfr.done = 0;
-
-            /* get the 0x43 cmd for the S300, S1100, S1300  */
-            if(s->model == MODEL_S300 || s->model == MODEL_S1100 || s->model == MODEL_S1300i){
+            /* block buffer currently empty, clean up */ 
+            if(!s->block_xfr.rx_bytes)
+            {
+                /* block buffer bigger than remainder of scan, shrink block */
+                int remainTotal = s->fullscan.total_bytes - s->fullscan.rx_bytes;
+                if(remainTotal < s->block_xfr.total_bytes)
+                {
+                    DBG (15, "sane_read: shrinking block to %lu\n", (unsigned long)remainTotal);
+                    s->block_xfr.total_bytes = remainTotal;
+                }
 
-                unsigned char cmd[] = {0x1b, 0x43};
-                size_t cmdLen = 2;
-                unsigned char in[10];
-                size_t inLen = 10;
-      
-                ret = do_cmd(
-                  s, 0,
-                  cmd, cmdLen,
-                  NULL, 0,
-                  in, &inLen
-                );
-                hexdump(15, "cmd 43: ", in, inLen);
-    
+                ret = start_block(s);
                 if(ret){
-                    DBG (5, "sane_read: error sending 43 cmd\n");
+                    DBG (5, "sane_read: cant start block\n");
                     return ret;
                 }
+            }
 
-                /*copy backside data into buffer*/
-                if( s->source == SOURCE_ADF_DUPLEX || s->source == SOURCE_ADF_BACK )
-                    ret = copy_block_to_page(s, SIDE_BACK);
+            ret = read_from_scanner(s, &s->block_xfr);
+            if(ret){
+                DBG (5, "sane_read: cant read from scanner\n");
+                return ret;
+            }
 
-                /*copy frontside data into buffer*/
-                if( s->source != SOURCE_ADF_BACK )
-                    ret = copy_block_to_page(s, SIDE_FRONT);
+            /* block filled, copy to front/back */
+            if(s->block_xfr.done)
+            {
+                DBG (15, "sane_read: block buffer full\n");
 
+                ret = finish_block(s, &s->fullscan.total_bytes);
                 if(ret){
-                    DBG (5, "sane_read: cant copy to front/back\n");
+                    DBG (5, "sane_read: cant finish block\n");
                     return ret;
                 }
 
-                s->fullscan.rx_bytes += s->block_xfr.rx_bytes;
-
-                /* autodetect mode, check for change length */
-                if( s->source != SOURCE_FLATBED && !s->page_height ){
-                    int get = (in[6] << 8) | in[7];
-
-                    /*always have to get full blocks*/
-                    if(get % s->block_img.height){
-                      get += s->block_img.height - (get % s->block_img.height);
-                    }
-
-                    if(get < s->fullscan.height){
-                      DBG (15, "sane_read: paper out? %d\n",get);
-                      s->fullscan.total_bytes = s->fullscan.width_bytes * get;
-                    }
-                }
-            }
-
-            else { /*fi-60f*/
-                ret = copy_block_to_page(s, SIDE_FRONT);
+                ret = convert_block(s);
                 if(ret){
-                    DBG (5, "sane_read: cant copy to front/back\n");
+                    DBG (5, "sane_read: cant convert block\n");
                     return ret;
                 }
+            }
+        }
 
-                s->fullscan.rx_bytes += s->block_xfr.rx_bytes;
-	    }
-
-            /* reset for next pass */
-            update_transfer_totals(&s->block_xfr);
+        /* scan now finished */
+        if(s->fullscan.rx_bytes == s->fullscan.total_bytes){
+            DBG (15, "sane_read: last block\n");
+            s->fullscan.done = 1;
+            stop_reader(s);
 
-            /* scan now finished */
-            if(s->fullscan.rx_bytes == s->fullscan.total_bytes){
-                DBG (15, "sane_read: last block\n");
-                s->fullscan.done = 1;
-            }
-	}
+            DBG (10, "sane_read: page took %.3f s descramble, %.3f s copy\n",
+              s->time_descramble, s->time_copy);
+        }
     }
 
     *len = page->bytes_scanned - page->bytes_read;
@@ -4089,6 +4084,380 @@ six5 (struct scanner *s)
   return ret;
 }
 
+/* finds the input columns of one read head that are averaged into each */
+/* output pixel. they are the same for every line, so this is done once */
+/* per block. curr_col carries over from the previous head */
+static int
+descramble_runs(struct transfer * tp, int head_offset, int * curr_col,
+  int * start, int * count)
+{
+    int k, runs = 0, ppc = 0;
+
+    for (k = 0; k <= tp->plane_width; k++){  /* column (x) within the read head */
+      int this_col = (k+head_offset)*tp->image->x_res/tp->x_res;
+
+      /* going to change output pixel, close the run */
+      if(ppc && *curr_col != this_col){
+        start[runs] = k - ppc;
+        count[runs] = ppc;
+        runs++;
+        ppc = 0;
+        *curr_col = this_col;
+      }
+
+      if(k == tp->plane_width || this_col >= tp->image->width_pix){
+        break;
+      }
+
+      ppc++;
+    }
+
+    return runs;
+}
+
+/* averages the runs of one line into rgb pixels */
+/* the components of a color are step bytes apart in the raw data */
+static unsigned char *
+descramble_line(unsigned char * p_out, unsigned char * r_in,
+  unsigned char * g_in, unsigned char * b_in, int step,
+  int * start, int * count, int runs, int direct)
+{
+    int n, k;
+
+    /* same resolution, each column is a pixel. kept as simple loops */
+    /* with a fixed step, so the compiler can vectorize them */
+    if(direct && step == 3){
+      for (n = 0; n < runs; n++){
+        p_out[n*3] = r_in[n*3];
+        p_out[n*3+1] = g_in[n*3];
+        p_out[n*3+2] = b_in[n*3];
+      }
+      return p_out + runs*3;
+    }
+
+    if(direct && step == 1){
+      for (n = 0; n < runs; n++){
+        p_out[n*3] = r_in[n];
+        p_out[n*3+1] = g_in[n];
+        p_out[n*3+2] = b_in[n];
+      }
+      return p_out + runs*3;
+    }
+
+    for (n = 0; n < runs; n++){
+      int r=0, g=0, b=0;
+      int first = start[n]*step;
+
+      for (k = 0; k < count[n]; k++){
+        r += r_in[first + k*step];
+        g += g_in[first + k*step];
+        b += b_in[first + k*step];
+      }
+
+      *p_out++ = r/count[n];
+      *p_out++ = g/count[n];
+      *p_out++ = b/count[n];
+    }
+
+    return p_out;
+}
+
+/* the S300, S1100 and S1300i want a d3 cmd before each block */
+static SANE_Status
+start_block(struct scanner *s)
+{
+    SANE_Status ret=SANE_STATUS_GOOD;
+    unsigned char cmd[] = {0x1b, 0xd3};
+    size_t cmdLen = 2;
+    unsigned char stat[1];
+    size_t statLen = 1;
+
+    if(s->model != MODEL_S300 && s->model != MODEL_S1100 && s->model != MODEL_S1300i){
+        return ret;
+    }
+
+    DBG (15, "start_block: d3\n");
+
+    ret = do_cmd(
+      s, 0,
+      cmd, cmdLen,
+      NULL, 0,
+      stat, &statLen
+    );
+    if(ret){
+        DBG (5, "start_block: error sending d3 cmd\n");
+        return ret;
+    }
+    if(stat[0] != 6){
+        DBG (5, "start_block: cmd bad status?\n");
+        return SANE_STATUS_IO_ERROR;
+    }
+
+    return ret;
+}
+
+/* get the 0x43 cmd for the S300, S1100, S1300 after each block */
+/* it tells where the paper ended, which shortens the scan total */
+static SANE_Status
+finish_block(struct scanner *s, int * total_bytes)
+{
+    SANE_Status ret=SANE_STATUS_GOOD;
+    unsigned char cmd[] = {0x1b, 0x43};
+    size_t cmdLen = 2;
+    unsigned char in[10];
+    size_t inLen = 10;
+
+    if(s->model != MODEL_S300 && s->model != MODEL_S1100 && s->model != MODEL_S1300i){
+        return ret;
+    }
+
+    ret = do_cmd(
+      s, 0,
+      cmd, cmdLen,
+      NULL, 0,
+      in, &inLen
+    );
+    hexdump(15, "cmd 43: ", in, inLen);
+
+    if(ret){
+        DBG (5, "finish_block: error sending 43 cmd\n");
+        return ret;
+    }
+
+    /* autodetect mode, check for change length */
+    if( s->source != SOURCE_FLATBED && !s->page_height ){
+        int get = (in[6] << 8) | in[7];
+
+        /*always have to get full blocks*/
+        if(get % s->block_img.height){
+          get += s->block_img.height - (get % s->block_img.height);
+        }
+
+        if(get < s->fullscan.height){
+          DBG (15, "finish_block: paper out? %d\n",get);
+          *total_bytes = s->fullscan.width_bytes * get;
+        }
+    }
+
+    return ret;
+}
+
+/* descrambles the block in the block buffer, copies it to front/back */
+/* and moves on to the next block */
+static SANE_Status
+convert_block(struct scanner *s)
+{
+    SANE_Status ret=SANE_STATUS_GOOD;
+    double start = get_time();
+
+    /* convert the raw data into normal packed pixel data */
+    ret = descramble_raw(s, &s->block_xfr);
+    if(ret){
+        DBG (5, "convert_block: cant descramble\n");
+        return ret;
+    }
+    s->time_descramble += get_time() - start;
+
+    start = get_time();
+
+    /*copy backside data into buffer*/
+    if( s->source == SOURCE_ADF_DUPLEX || s->source == SOURCE_ADF_BACK ){
+        ret = copy_block_to_page(s, SIDE_BACK);
+        if(ret){
+            DBG (5, "convert_block: cant copy to back\n");
+            return ret;
+        }
+    }
+
+    /*copy frontside data into buffer*/
+    if( s->source != SOURCE_ADF_BACK ){
+        ret = copy_block_to_page(s, SIDE_FRONT);
+        if(ret){
+            DBG (5, "convert_block: cant copy to front\n");
+            return ret;
+        }
+    }
+
+    s->time_copy += get_time() - start;
+
+    s->fullscan.rx_bytes += s->block_xfr.rx_bytes;
+
+    /* reset for next pass */
+    update_transfer_totals(&s->block_xfr);
+
+    return ret;
+}
+
+/* starts a thread reading all blocks of the scan into the pool, */
+/* if configured. sane_read then only converts the blocks, while the */
+/* scanner keeps sending the next ones */
+static SANE_Status
+start_reader(struct scanner *s)
+{
+#ifdef HAVE_PTHREAD_H
+    SANE_Status ret=SANE_STATUS_GOOD;
+
+    /* previous page not read to the end? */
+    stop_reader(s);
+
+    if(!s->pool){
+        return ret;
+    }
+
+    DBG (10, "start_reader: start\n");
+
+    /* the pool keeps its buffers from the first page */
+    ret = sanei_buf_pool_reset(s->pool, 0);
+    if(ret){
+        DBG (5, "start_reader: cant reset pool\n");
+        return ret;
+    }
+
+    s->thread_xfr = s->block_xfr;
+    if(pthread_create(&s->thread, NULL, read_thread, s)){
+        DBG (5, "start_reader: cant create thread, reading in sane_read\n");
+        return ret;
+    }
+    s->reader_running = 1;
+
+    DBG (10, "start_reader: finish\n");
+#else
+    (void) s;
+#endif
+
+    return SANE_STATUS_GOOD;
+}
+
+/* waits for the reader thread, stopping it after the current block */
+/* if it has not read the whole scan yet */
+static void
+stop_reader(struct scanner *s)
+{
+#ifdef HAVE_PTHREAD_H
+    SANEI_Buf_Pool_Stats stats;
+
+    if(!s->reader_running){
+        return;
+    }
+
+    DBG (10, "stop_reader: start\n");
+
+    sanei_buf_pool_reader_close(s->pool);
+    pthread_join(s->thread, NULL);
+    s->reader_running = 0;
+
+    sanei_buf_pool_get_stats(s->pool, &stats);
+    DBG (10, "stop_reader: %d blocks, thread waited %d times for sane_read, "
+      "sane_read %d times for the scanner\n",
+      stats.buffers, stats.writer_waits, stats.reader_waits);
+
+    DBG (10, "stop_reader: finish\n");
+#else
+    (void) s;
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/* the reader thread, does all usb i/o of the scan while it runs */
+static void *
+read_thread(void * arg)
+{
+    struct scanner *s = arg;
+    struct transfer * tp = &s->thread_xfr;
+    SANE_Status ret=SANE_STATUS_GOOD;
+    int rx_bytes = 0;
+    int total_bytes = s->fullscan.total_bytes;
+
+    DBG (10, "read_thread: start\n");
+
+    while(rx_bytes < total_bytes){
+
+        /* waits while readahead blocks are queued */
+        tp->raw_data = sanei_buf_pool_writer_get_buffer(s->pool);
+        if(!tp->raw_data){
+            DBG (10, "read_thread: stopped\n");
+            ret = SANE_STATUS_CANCELLED;
+            break;
+        }
+
+        /* block buffer bigger than remainder of scan, shrink block */
+        update_transfer_totals(tp);
+        if(total_bytes - rx_bytes < tp->total_bytes){
+            DBG (15, "read_thread: shrinking block to %lu\n",
+              (unsigned long)(total_bytes - rx_bytes));
+            tp->total_bytes = total_bytes - rx_bytes;
+        }
+
+        ret = start_block(s);
+
+        while(!ret && !tp->done){
+            ret = read_from_scanner(s, tp);
+        }
+
+        if(!ret){
+            ret = finish_block(s, &total_bytes);
+        }
+
+        if(ret){
+            DBG (5, "read_thread: cant read block\n");
+            break;
+        }
+
+        rx_bytes += tp->rx_bytes;
+        sanei_buf_pool_writer_put_buffer(s->pool, tp->rx_bytes);
+    }
+
+    sanei_buf_pool_writer_close(s->pool, ret ? ret : SANE_STATUS_EOF);
+
+    DBG (10, "read_thread: finish\n");
+
+    return NULL;
+}
+#endif
+
+/* gets the next block read by the reader thread and converts it */
+static SANE_Status
+read_from_queue(struct scanner *s)
+{
+#ifdef HAVE_PTHREAD_H
+    SANE_Status ret=SANE_STATUS_GOOD;
+    unsigned char * raw_data = s->block_xfr.raw_data;
+    SANE_Byte * buf;
+    SANE_Int bytes;
+
+    ret = sanei_buf_pool_reader_get_buffer(s->pool, &buf, &bytes);
+
+    /* thread read the whole scan, maybe shortened by paper length */
+    if(ret == SANE_STATUS_EOF){
+        DBG (15, "read_from_queue: end of scan\n");
+        s->fullscan.total_bytes = s->fullscan.rx_bytes;
+        return SANE_STATUS_GOOD;
+    }
+    if(ret){
+        DBG (5, "read_from_queue: reader thread failed\n");
+        stop_reader(s);
+        return ret;
+    }
+
+    /* convert straight from the pool buffer */
+    s->block_xfr.raw_data = buf;
+    s->block_xfr.total_bytes = bytes;
+    s->block_xfr.rx_bytes = bytes;
+    s->block_xfr.done = 1;
+
+    ret = convert_block(s);
+
+    s->block_xfr.raw_data = raw_data;
+    sanei_buf_pool_reader_put_buffer(s->pool);
+
+    return ret;
+#else
+    DBG (5, "read_from_queue: no reader thread\n");
+    (void) s;
+    return SANE_STATUS_INVAL;
+#endif
+}
+
 /* de-scrambles the raw data from the scanner into the image buffer */
 /* the output image might be lower dpi than input image, so we scale horizontally */
 static SANE_Status
@@ -4097,138 +4466,73 @@ descramble_raw(struct scanner *s, struct transfer * tp)
     SANE_Status ret = SANE_STATUS_GOOD;
     unsigned char *p_out = tp->image->buffer;
     int height = tp->total_bytes / tp->line_stride;
-    int i, j, k;
+    int heads = 1, curr_col = 0, direct = 1;
+    int runs[3];
+    int *start, *count;
+    int i, j, n;
+
+    /* FI-60F has three read heads side by side */
+    if (s->model == MODEL_FI60F || s->model == MODEL_FI65F){
+      heads = 3;
+    }
+
+    start = malloc(heads * (tp->plane_width+1) * 2 * sizeof(int));
+    if(!start){
+        DBG (5, "descramble_raw: failed to alloc mem\n");
+        return SANE_STATUS_NO_MEM;
+    }
+    count = start + heads * (tp->plane_width+1);
+
+    for (i = 0; i < heads; i++){
+      int * h_start = start + i * (tp->plane_width+1);
+      int * h_count = count + i * (tp->plane_width+1);
+
+      runs[i] = descramble_runs(tp, i*tp->plane_width, &curr_col,
+        h_start, h_count);
+
+      for (n = 0; n < runs[i]; n++){
+        if(h_start[n] != n || h_count[n] != 1){
+          direct = 0;
+        }
+      }
+    }
 
     if (s->model == MODEL_S300 || s->model == MODEL_S1300i) {
       for (i = 0; i < 2; i++){                   /* page, front/back */
         for (j = 0; j < height; j++){             /* row (y)*/
-          int curr_col = 0;
-          int r=0, g=0, b=0, ppc=0;
-      
-          for (k = 0; k <= tp->plane_width; k++){  /* column (x) */
-            int this_col = k*tp->image->x_res/tp->x_res;
-      
-            /* going to change output pixel, dump rgb and reset */
-            if(ppc && curr_col != this_col){
-              *p_out = r/ppc;
-              p_out++;
-      
-              *p_out = g/ppc;
-              p_out++;
-      
-              *p_out = b/ppc;
-              p_out++;
-      
-              r = g = b = ppc = 0;
-      
-              curr_col = this_col;
-            }
-      
-            if(k == tp->plane_width || this_col >= tp->image->width_pix){
-              break;
-            }
-  
-            /*red is first*/
-            r += tp->raw_data[j*tp->line_stride + k*3 + i];
-      
-            /*green is second*/
-            g += tp->raw_data[j*tp->line_stride + tp->plane_stride + k*3 + i];
-      
-            /*blue is third*/
-            b += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k*3 + i];
-      
-            ppc++;
-          }
+          unsigned char *line = tp->raw_data + j*tp->line_stride + i;
+
+          /*red is first, green is second, blue is third*/
+          p_out = descramble_line(p_out, line, line + tp->plane_stride,
+            line + 2*tp->plane_stride, 3, start, count, runs[0], direct);
         }
       }
     }
     else if (s->model == MODEL_S1100){
       for (j = 0; j < height; j++){             /* row (y)*/
-        int curr_col = 0;
-        int r=0, g=0, b=0, ppc=0;
-    
-        for (k = 0; k <= tp->plane_width; k++){  /* column (x) */
-          int this_col = k*tp->image->x_res/tp->x_res;
-    
-          /* going to change output pixel, dump rgb and reset */
-          if(ppc && curr_col != this_col){
-            *p_out = r/ppc;
-            p_out++;
-    
-            *p_out = g/ppc;
-            p_out++;
-    
-            *p_out = b/ppc;
-            p_out++;
-    
-            r = g = b = ppc = 0;
-    
-            curr_col = this_col;
-          }
-    
-          if(k == tp->plane_width || this_col >= tp->image->width_pix){
-            break;
-          }
+        unsigned char *line = tp->raw_data + j*tp->line_stride;
 
-          /*red is second*/
-          r += tp->raw_data[j*tp->line_stride + tp->plane_stride + k];
-    
-          /*green is third*/
-          g += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k];
-    
-          /*blue is first*/
-          b += tp->raw_data[j*tp->line_stride + k];
-    
-          ppc++;
-        }
+        /*red is second, green is third, blue is first*/
+        p_out = descramble_line(p_out, line + tp->plane_stride,
+          line + 2*tp->plane_stride, line, 1, start, count, runs[0], direct);
       }
     }
     else { /* MODEL_FI60F or MODEL_FI65F */
 
       for (j = 0; j < height; j++){             /* row (y)*/
-        int curr_col = 0;
-
         for (i = 0; i < 3; i++){                /* read head */
-          int r=0, g=0, b=0, ppc=0;
-      
-          for (k = 0; k <= tp->plane_width; k++){  /* column (x) within the read head */
-            int this_col = (k+i*tp->plane_width)*tp->image->x_res/tp->x_res;
-      
-            /* going to change output pixel, dump rgb and reset */
-            if(ppc && curr_col != this_col){
-              *p_out = r/ppc;
-              p_out++;
-      
-              *p_out = g/ppc;
-              p_out++;
-      
-              *p_out = b/ppc;
-              p_out++;
-      
-              r = g = b = ppc = 0;
-      
-              curr_col = this_col;
-            }
-      
-            if(k == tp->plane_width || this_col >= tp->image->width_pix){
-              break;
-            }
-  
-            /*red is first*/
-            r += tp->raw_data[j*tp->line_stride + k*3 + i];
-      
-            /*green is second*/
-            g += tp->raw_data[j*tp->line_stride + tp->plane_stride + k*3 + i];
-      
-            /*blue is third*/
-            b += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k*3 + i];
-      
-            ppc++;
-          }
+          unsigned char *line = tp->raw_data + j*tp->line_stride + i;
+
+          /*red is first, green is second, blue is third*/
+          p_out = descramble_line(p_out, line, line + tp->plane_stride,
+            line + 2*tp->plane_stride, 3, start + i*(tp->plane_width+1),
+            count + i*(tp->plane_width+1), runs[i], direct);
         }
       }
     }
 
+    free(start);
+
     return ret;
 }
 
@@ -4253,6 +4557,11 @@ read_from_scanner(struct scanner *s, struct transfer * tp)
         return SANE_STATUS_INVAL;
     }
 
+    /* S1300i wants big requests, so it always reads one at a time */
+    if(global_usbqueue > 0 && s->model != MODEL_S1300i){
+        return read_from_stream(s, tp);
+    }
+
     DBG (10, "read_from_scanner: start rB:%lu len:%lu\n",
       (unsigned long)remainBlock, (unsigned long)bytes);
 
@@ -4308,6 +4617,72 @@ read_from_scanner(struct scanner *s, struct transfer * tp)
     return ret;
 }
 
+/* reads the next piece of a block like read_from_scanner, but the */
+/* whole block is requested on the first call, so the reads of the */
+/* rest stay queued on the bus while this piece is copied */
+static SANE_Status
+read_from_stream(struct scanner *s, struct transfer * tp)
+{
+    SANE_Status ret=SANE_STATUS_GOOD;
+    size_t remainBlock = tp->total_bytes - tp->rx_bytes + 8;
+    SANE_Byte * buf;
+    size_t bytes;
+
+    if(!s->usb_stream){
+        DBG (10, "read_from_stream: queueing %d reads of %lu bytes\n",
+          global_usbqueue, (unsigned long)remainBlock);
+
+        sanei_usb_set_timeout(USB_DATA_TIME);
+        ret = sanei_usb_read_bulk_async_start(s->fd, MAX_IMG_PASS,
+          global_usbqueue, remainBlock);
+        if(ret){
+            DBG (5, "read_from_stream: cant start reads\n");
+            return ret;
+        }
+        s->usb_stream = 1;
+    }
+
+    ret = sanei_usb_read_bulk_async_next(s->fd, &buf, &bytes);
+    if(ret){
+        DBG (5, "read_from_stream: error reading status = %d\n", ret);
+        stop_stream(s);
+        return ret;
+    }
+
+    /* same pieces as read_from_scanner gets, trailer comes last */
+    if(bytes > remainBlock){
+        DBG(15,"read_from_stream: block too big?\n");
+        bytes = remainBlock;
+    }
+
+    if(bytes == remainBlock){
+        DBG(15,"read_from_stream: block done, ignoring trailer\n");
+        bytes -= 8;
+        tp->done = 1;
+    }
+
+    memcpy(tp->raw_data + tp->rx_bytes, buf, bytes);
+    tp->rx_bytes += bytes;
+
+    /* the next command must not find reads still queued */
+    if(tp->done){
+        stop_stream(s);
+    }
+
+    return ret;
+}
+
+/* cancels the reads still queued by read_from_stream */
+static void
+stop_stream(struct scanner *s)
+{
+    if(!s->usb_stream){
+        return;
+    }
+    sanei_usb_read_bulk_async_stop(s->fd);
+    s->usb_stream = 0;
+}
+
 /* copies block buffer into front or back image buffer */
 /* converts pixel data from RGB Color to the output format */
 /* the output image might be lower dpi than input image, so we scale vertically */
@@ -4323,12 +4698,18 @@ copy_block_to_page(struct scanner *s,int side)
     int block_page_stride = block->image->width_bytes * block->image->height;
     int line_reverse = (side == SIDE_BACK) || (s->model == MODEL_FI60F) || (s->model == MODEL_FI65F);
     int i,j,k=0,l=0;
+    int r_off=0, g_off=1, b_off=2;
 
     int curr_in_row = s->fullscan.rx_bytes/s->fullscan.width_bytes;
     int last_out_row = (page->bytes_scanned / page->image->width_bytes) - 1;
 
     DBG (10, "copy_block_to_page: start\n");
 
+    /* S300 block image pixels are stored bgr */
+    if (s->model == MODEL_S300 || s->model == MODEL_S1300i){
+        r_off = 1; g_off = 2; b_off = 0;
+    }
+
     /* skip padding and tl_y */
     if (s->fullscan.rx_bytes + s->block_xfr.rx_bytes < block->line_stride * page->image->y_skip_offset)
     {
@@ -4390,39 +4771,48 @@ copy_block_to_page(struct scanner *s,int side)
             p_in += (page_width - 1) * 3;
 
         /* convert all of the pixels in this row */
-        for (j = 0; j < page_width; j++)
+        /* one loop per mode and direction, so the inner loops have no */
+        /* branches and a fixed step, and the compiler can vectorize them */
+        if (s->mode == MODE_COLOR)
         {
-            unsigned char r, g, b;
-            if (s->model == MODEL_S300 || s->model == MODEL_S1300i)
-                { r = p_in[1]; g = p_in[2]; b = p_in[0]; }
-            else /* MODEL_FI60F or MODEL_FI65F or MODEL_S1100 */
-                { r = p_in[0]; g = p_in[1]; b = p_in[2]; }
-            if (s->mode == MODE_COLOR)
+            if (line_reverse)
             {
-                *p_out++ = r;
-                *p_out++ = g;
-                *p_out++ = b;
+                for (j = 0; j < page_width; j++)
+                {
+                    p_out[j*3] = p_in[r_off - j*3];
+                    p_out[j*3+1] = p_in[g_off - j*3];
+                    p_out[j*3+2] = p_in[b_off - j*3];
+                }
             }
-            else if (s->mode == MODE_GRAYSCALE)
+            else
             {
-                *p_out++ = (r + g + b) / 3;
+                for (j = 0; j < page_width; j++)
+                {
+                    p_out[j*3] = p_in[r_off + j*3];
+                    p_out[j*3+1] = p_in[g_off + j*3];
+                    p_out[j*3+2] = p_in[b_off + j*3];
+                }
             }
-            else if (s->mode == MODE_LINEART)
+        }
+        else if (s->mode == MODE_GRAYSCALE || s->mode == MODE_LINEART)
+        {
+            /* lineart stores gray in the dt temp image buffer and binarizes afterword */
+            unsigned char * gray = p_out;
+            if (s->mode == MODE_LINEART)
+                gray = s->dt.buffer;
+
+            if (line_reverse)
             {
-                s->dt.buffer[j] = (r + g + b) / 3; /* stores dt temp image buffer and binarize afterword */
+                for (j = 0; j < page_width; j++)
+                    gray[j] = (p_in[-j*3] + p_in[1 - j*3] + p_in[2 - j*3]) / 3;
             }
-            if (line_reverse)
-                p_in -= 3;
             else
-                p_in += 3;
+            {
+                for (j = 0; j < page_width; j++)
+                    gray[j] = (p_in[j*3] + p_in[j*3+1] + p_in[j*3+2]) / 3;
+            }
         }
 
-	/* skip non-transfer pixels in block image buffer */
-        if (line_reverse)
-            p_in -= page->image->x_offset_bytes;
-        else
-            p_in += page->image->x_offset_bytes;
-
         /* for MODE_LINEART, binarize the gray line stored in the temp image buffer(dt) */
         /* bacause dt.width = page_width, we pass page_width */
         if (s->mode == MODE_LINEART)
@@ -4442,48 +4832,66 @@ static SANE_Status
 binarize_line(struct scanner *s, unsigned char *lineOut, int width)
 {
     SANE_Status ret = SANE_STATUS_GOOD;
-    int j, windowX, sum = 0;
+    unsigned char *gray = s->dt.buffer;
+    int j, b, windowX, sum = 0;
+    unsigned int recip;
 
     /* ~1mm works best, but the window needs to have odd # of pixels */
     windowX = 6 * s->resolution / 150;
     if (!(windowX % 2)) windowX++;
 
+    /* sum/windowX is sum*recip>>18, which is exact as long as */
+    /* 255*windowX*windowX < 1<<18, up to 32 pixels (~1200 dpi) */
+    recip = (1 << 18) / windowX + 1;
+
     /*second, prefill the sliding sum*/
     for (j = 0; j < windowX; j++)
-        sum += s->dt.buffer[j];
+        sum += gray[j];
 
     /* third, walk the dt buffer, update the sliding sum, */
-    /* determine threshold, output bits */
-    for (j = 0; j < width; j++)
+    /* determine threshold, output bits a byte at a time */
+    for (j = 0; j < width; j += 8)
     {
-        /*output image location*/
-        int offset = j % 8;
-        unsigned char mask = 0x80 >> offset;
-        int thresh = s->threshold;
+        int bits = 0;
+        int last = width - j < 8 ? width - j : 8;
 
-        /* move sum/update threshold only if there is a curve*/
-        if (s->threshold_curve)
+        /* no curve, the threshold is fixed */
+        if (!s->threshold_curve)
         {
-            int addCol  = j + windowX/2;
-            int dropCol = addCol - windowX;
-  
-            if (dropCol >= 0 && addCol < width)
+            for (b = 0; b < last; b++)
+                bits |= (gray[j+b] <= s->threshold) << (7-b);
+        }
+        else
+        {
+            for (b = 0; b < last; b++)
             {
-                sum -= s->dt.buffer[dropCol];
-                sum += s->dt.buffer[addCol];
+                int addCol  = j + b + windowX/2;
+                int dropCol = addCol - windowX;
+                int avg;
+
+                if (dropCol >= 0 && addCol < width)
+                {
+                    sum -= gray[dropCol];
+                    sum += gray[addCol];
+                }
+
+                if (255 * windowX * windowX < (1 << 18))
+                    avg = (sum * recip) >> 18;
+                else
+                    avg = sum / windowX;
+
+                /*use average to lookup threshold*/
+                bits |= (gray[j+b] <= s->dt_lut[avg]) << (7-b);
             }
-            thresh = s->dt_lut[sum/windowX];
         }
 
-        /*use average to lookup threshold*/
-        if (s->dt.buffer[j] > thresh)
-          *lineOut &= ~mask;     /* white */
+        /* black is 1, white is 0, keep the unused bits of a short byte */
+        if (last < 8)
+            *lineOut = (*lineOut & (0xff >> last)) | bits;
         else
-          *lineOut |= mask;      /* black */
-                  
-        if (offset == 7)
-            lineOut++;
-      }
+            *lineOut = bits;
+        lineOut++;
+    }
 
     return ret;
 }
@@ -4516,6 +4924,8 @@ sane_cancel (SANE_Handle handle)
   /*FIXME: actually ask the scanner to stop?*/
   struct scanner * s = (struct scanner *) handle;
   DBG (10, "sane_cancel: start\n");
+  stop_reader(s);
+  stop_stream(s);
   s->started = 0;
   DBG (10, "sane_cancel: finish\n");
 }
@@ -4555,6 +4965,7 @@ disconnect_fd (struct scanner *s)
     DBG (15, "disconnecting usb device\n");
     sanei_usb_close (s->fd);
     s->fd = -1;
+    s->usb_stream = 0;
   }
 
   DBG (10, "disconnect_fd: finish\n");
@@ -4629,6 +5040,12 @@ teardown_buffers(struct scanner *s)
         free(s->block_xfr.raw_data);
 	s->block_xfr.raw_data = NULL;
     }
+#ifdef HAVE_PTHREAD_H
+    if(s->pool){
+        sanei_buf_pool_free(s->pool);
+	s->pool = NULL;
+    }
+#endif
 
     /* dynamic thresh slice */
     if(s->dt.buffer){
@@ -4811,6 +5228,16 @@ do_cmd(struct scanner *s, int shortTime,
 /**
  * Convenience method to determine longest string size in a list.
  */
+/* wall clock time in seconds */
+static double
+get_time (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
 static size_t
 maxStringSize (const SANE_String_Const strings[])
 {
@@ -238,6 +238,21 @@ struct scanner
   struct image  dt;
   unsigned char dt_lut[256];
 
+  /* reads of the current block queued by read_from_stream */
+  int usb_stream;
+
+  /* reader thread, reads the blocks ahead while sane_read converts */
+  int reader_running;
+#ifdef HAVE_PTHREAD_H
+  pthread_t thread;
+  SANEI_Buf_Pool * pool;
+  struct transfer thread_xfr;
+#endif
+
+  /* seconds the host spent on the current page, for debug output */
+  double time_descramble;
+  double time_copy;
+
   /* final-sized front image, always used */
   struct image front;
 
@@ -378,6 +393,17 @@ static SANE_Status set_window(struct scanner *s, int window);
 static SANE_Status scan(struct scanner *s);
 
 static SANE_Status read_from_scanner(struct scanner *s, struct transfer *tp);
+static SANE_Status read_from_stream(struct scanner *s, struct transfer *tp);
+static void stop_stream(struct scanner *s);
+static SANE_Status start_block(struct scanner *s);
+static SANE_Status finish_block(struct scanner *s, int * total_bytes);
+static SANE_Status convert_block(struct scanner *s);
+static SANE_Status start_reader(struct scanner *s);
+static void stop_reader(struct scanner *s);
+#ifdef HAVE_PTHREAD_H
+static void * read_thread(void * arg);
+#endif
+static SANE_Status read_from_queue(struct scanner *s);
 static SANE_Status descramble_raw(struct scanner *s, struct transfer * tp);
 static SANE_Status copy_block_to_page(struct scanner *s, int side);
 static SANE_Status binarize_line(struct scanner *s, unsigned char *lineOut, int width);
@@ -393,6 +419,7 @@ static unsigned char get_stat(struct scanner *s);
 
 /* utils */
 static void update_transfer_totals(struct transfer * t);
+static double get_time (void);
 static void hexdump (int level, char *comment, unsigned char *p, int l);
 static size_t maxStringSize (const SANE_String_Const strings[]);
 
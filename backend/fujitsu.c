@@ -605,6 +605,7 @@
 #include <unistd.h> /*usleep*/
 
 #include "../include/sane/sanei_backend.h"
+#include "../include/sane/sanei.h"
 #include "../include/sane/sanei_scsi.h"
 #include "../include/sane/sanei_usb.h"
 #include "../include/sane/saneopts.h"
@@ -628,13 +629,6 @@
  - useless noise   35
 */
 
-/* ------------------------------------------------------------------------- */
-/* if JPEG support is not enabled in sane.h, we setup our own defines */
-#ifndef SANE_FRAME_JPEG
-#define SANE_FRAME_JPEG 0x0B
-#define SANE_JPEG_DISABLED 1
-#endif
-/* ------------------------------------------------------------------------- */
 #define STRING_FLATBED SANE_I18N("Flatbed")
 #define STRING_ADFFRONT SANE_I18N("ADF Front")
 #define STRING_ADFBACK SANE_I18N("ADF Back")
@@ -1614,9 +1608,8 @@ init_vpd (struct fujitsu *s)
 
           s->has_comp_JPG1 = get_IN_compression_JPG_BASE (in);
           DBG (15, "  compression JPG1: %d\n", s->has_comp_JPG1);
-#ifdef SANE_JPEG_DISABLED
-          DBG (15, "  (Disabled)\n");
-#endif
+          if (!SANEI_COMPRESSED_FRAMES())
+            DBG (15, "  (Disabled, frontend does not accept JPEG)\n");
 
           s->has_comp_JPG2 = get_IN_compression_JPG_EXT (in);
           DBG (15, "  compression JPG2: %d\n", s->has_comp_JPG2);
@@ -3453,10 +3446,9 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
     i=0;
     s->compress_list[i++]=STRING_NONE;
 
-    if(s->has_comp_JPG1){
-#ifndef SANE_JPEG_DISABLED
+    /* only for frontends that asked for compressed frames */
+    if(s->has_comp_JPG1 && SANEI_COMPRESSED_FRAMES()){
       s->compress_list[i++]=STRING_JPEG;
-#endif
     }
 
     s->compress_list[i]=NULL;
@@ -7012,7 +7004,25 @@ sane_start (SANE_Handle handle)
    * tell the user the size of the image. the sane 
    * API has no way to inform the frontend of this,
    * so we block and buffer. yuck */
-  if( must_fully_buffer(s) ){
+  if( must_fully_buffer(s) && can_stream_skip(s) ){
+
+    /* only blank page skipping is enabled, so just wait until
+     * the image turns out not to be blank, or ends */
+    int blank = 0;
+
+    ret = buffer_isblank_stream(s, s->side, &blank);
+    if (ret != SANE_STATUS_GOOD) {
+      DBG (5, "sane_start: ERROR: cannot buffer image\n");
+      goto errors;
+    }
+
+    if(blank){
+      s->bytes_tx[s->side] = s->bytes_rx[s->side];
+      s->eof_tx[s->side] = 1;
+      return sane_start(handle);
+    }
+  }
+  else if( must_fully_buffer(s) ){
 
     /* get image */
     while(!s->eof_rx[s->side] && !ret){
@@ -9723,6 +9733,29 @@ must_fully_buffer(struct fujitsu *s)
   return 0;
 }
 
+/* blank page skipping alone does not need the entire image,
+ * only enough of it to find something on the page. the rest
+ * can be passed to the frontend as it arrives. */
+static int
+can_stream_skip(struct fujitsu *s)
+{
+  if(!s->swskip || s->swdeskew || s->swdespeck || s->swcrop){
+    return 0;
+  }
+
+  /* scanner may change image size after transfer */
+  if(s->hwdeskewcrop || s->ald){
+    return 0;
+  }
+
+  /* lines are not complete as they arrive */
+  if(s->s_mode == MODE_COLOR && s->color_interlace == COLOR_INTERLACE_3091){
+    return 0;
+  }
+
+  return s->s_params.format != SANE_FRAME_JPEG;
+}
+
 /* certain scanners require the mode of the 
  * image to be changed in software. */
 static int
@@ -10045,3 +10078,67 @@ buffer_isblank(struct fujitsu *s, int side)
   return status;
 }
 
+/* Read image into buffer only until it is known whether it has too
+ * few dark pixels. Pages with something on them are usually known
+ * long before their end, the rest is read by sane_read as usual. */
+static SANE_Status
+buffer_isblank_stream(struct fujitsu *s, int side, int * blank)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+  SANEI_Magic_Stream * stream = NULL;
+  int bwidth = s->s_params.bytes_per_line;
+  int lines = 0;
+
+  DBG (10, "buffer_isblank_stream: start\n");
+
+  *blank = 0;
+
+  ret = sanei_magic_stream_new(&s->s_params,
+    s->resolution_x, s->resolution_y, s->swskip, &stream);
+  if(ret){
+    DBG (5, "buffer_isblank_stream: no stream %d\n",ret);
+    return ret;
+  }
+
+  while(sanei_magic_stream_isBlank2(stream) == SANE_STATUS_DEVICE_BUSY){
+
+    SANE_Int len = 0;
+
+    /* pass on all complete lines */
+    if(s->bytes_rx[side] / bwidth > lines){
+      int count = s->bytes_rx[side] / bwidth - lines;
+
+      ret = sanei_magic_stream_write(stream,
+        s->buffers[side] + lines*bwidth, count);
+      if(ret){
+        DBG (5, "buffer_isblank_stream: write error %d\n",ret);
+        break;
+      }
+      lines += count;
+      continue;
+    }
+
+    if(s->eof_rx[side]){
+      sanei_magic_stream_finish(stream);
+      continue;
+    }
+
+    ret = sane_read((SANE_Handle)s, NULL, 0, &len);
+    if(ret){
+      break;
+    }
+  }
+
+  if(!ret && sanei_magic_stream_isBlank2(stream) == SANE_STATUS_NO_DOCS){
+    DBG (5, "buffer_isblank_stream: blank!\n");
+    *blank = 1;
+  }
+
+  DBG (15, "buffer_isblank_stream: decided after %d lines\n",lines);
+
+  sanei_magic_stream_free(stream);
+
+  DBG (10, "buffer_isblank_stream: finished\n");
+  return ret;
+}
+
@@ -810,6 +810,7 @@ static SANE_Status set_off_mode(struct fujitsu *s);
 
 static int must_downsample (struct fujitsu *s);
 static int must_fully_buffer (struct fujitsu *s);
+static int can_stream_skip (struct fujitsu *s);
 static int get_page_width (struct fujitsu *s);
 static int get_page_height (struct fujitsu *s);
 
@@ -845,6 +846,8 @@ static SANE_Status buffer_deskew(struct fujitsu *s, int side);
 static SANE_Status buffer_crop(struct fujitsu *s, int side);
 static SANE_Status buffer_despeck(struct fujitsu *s, int side);
 static int buffer_isblank(struct fujitsu *s, int side);
+static SANE_Status buffer_isblank_stream(struct fujitsu *s, int side,
+  int * blank);
 
 static void hexdump (int level, char *comment, unsigned char *p, int l);
 
@@ -58,7 +58,6 @@
 #ifdef USE_FORK
 #include <sys/wait.h>
 #include <unistd.h>
-#include "gt68xx_shm_channel.c"
 #endif
 
 /** Check that the device pointer is not NULL.
@@ -776,11 +775,11 @@ gt68xx_reader_process (GT68xx_Device * dev)
   size_t size;
   SANE_Int line = 0;
   size_t read_bytes_left = dev->read_bytes_left;
-  shm_channel_writer_init (dev->shm_channel);
+  sanei_shm_channel_writer_init (dev->shm_channel);
   while (read_bytes_left > 0)
     {
-      status = shm_channel_writer_get_buffer (dev->shm_channel,
-					      &buffer_id, &buffer_addr);
+      status = sanei_shm_channel_writer_get_buffer (dev->shm_channel,
+						    &buffer_id, &buffer_addr);
       if (status != SANE_STATUS_GOOD)
 	break;
       DBG (9, "gt68xx_reader_process: buffer %d: get\n", buffer_id);
@@ -795,7 +794,8 @@ gt68xx_reader_process (GT68xx_Device * dev)
 	   "gt68xx_reader_process: buffer %d: read %lu bytes (line %d)\n",
 	   buffer_id, (unsigned long) size, line);
       status =
-	shm_channel_writer_put_buffer (dev->shm_channel, buffer_id, size);
+	sanei_shm_channel_writer_put_buffer (dev->shm_channel, buffer_id,
+					     size);
       if (status != SANE_STATUS_GOOD)
 	break;
       DBG (9, "gt68xx_reader_process: buffer %d: put\n", buffer_id);
@@ -806,7 +806,7 @@ gt68xx_reader_process (GT68xx_Device * dev)
   if (status != SANE_STATUS_GOOD)
     return status;
   sleep (5 * 60);		/* wait until we are killed (or timeout) */
-  shm_channel_writer_close (dev->shm_channel);
+  sanei_shm_channel_writer_close (dev->shm_channel);
   return status;
 }
 
@@ -823,7 +823,8 @@ gt68xx_device_read_start_fork (GT68xx_Device * dev)
     }
 
   status =
-    shm_channel_new (dev->read_buffer_size, SHM_BUFFERS, &dev->shm_channel);
+    sanei_shm_channel_new (dev->read_buffer_size, SHM_BUFFERS, SANE_TRUE,
+			   &dev->shm_channel);
   if (status != SANE_STATUS_GOOD)
     {
       DBG (3,
@@ -838,7 +839,7 @@ gt68xx_device_read_start_fork (GT68xx_Device * dev)
     {
       DBG (3, "gt68xx_device_read_start_fork: cannot fork: %s\n",
 	   strerror (errno));
-      shm_channel_free (dev->shm_channel);
+      sanei_shm_channel_free (dev->shm_channel);
       dev->shm_channel = NULL;
       return SANE_STATUS_NO_MEM;
     }
@@ -853,8 +854,8 @@ gt68xx_device_read_start_fork (GT68xx_Device * dev)
     {
       /* Parent process */
       dev->reader_pid = pid;
-      shm_channel_reader_init (dev->shm_channel);
-      shm_channel_reader_start (dev->shm_channel);
+      sanei_shm_channel_reader_init (dev->shm_channel);
+      sanei_shm_channel_reader_start (dev->shm_channel);
       return SANE_STATUS_GOOD;
     }
 }
@@ -908,15 +909,16 @@ gt68xx_device_read (GT68xx_Device * dev, SANE_Byte * buffer, size_t * size)
 #ifdef USE_FORK
 	  if (dev->shm_channel)
 	    {
-	      status = shm_channel_reader_get_buffer (dev->shm_channel,
-						      &buffer_id,
-						      &buffer_addr,
-						      &buffer_bytes);
+	      status = sanei_shm_channel_reader_get_buffer (dev->shm_channel,
+							    &buffer_id,
+							    &buffer_addr,
+							    &buffer_bytes);
 	      if (status == SANE_STATUS_GOOD && buffer_addr != NULL)
 		{
 		  DBG (9, "gt68xx_device_read: buffer %d: get\n", buffer_id);
 		  memcpy (dev->read_buffer, buffer_addr, buffer_bytes);
-		  shm_channel_reader_put_buffer (dev->shm_channel, buffer_id);
+		  sanei_shm_channel_reader_put_buffer (dev->shm_channel,
+						       buffer_id);
 		  DBG (9, "gt68xx_device_read: buffer %d: put\n", buffer_id);
 		}
 	    }
@@ -983,7 +985,7 @@ gt68xx_device_read_finish (GT68xx_Device * dev)
     }
   if (dev->shm_channel)
     {
-      shm_channel_free (dev->shm_channel);
+      sanei_shm_channel_free (dev->shm_channel);
       dev->shm_channel = NULL;
     }
 
@@ -55,7 +55,7 @@
 
 #ifdef USE_FORK
 #include <sys/types.h>
-#include "gt68xx_shm_channel.h"
+#include "../include/sane/sanei_shm_channel.h"
 #endif
 
 #ifdef NDEBUG
@@ -528,7 +528,7 @@ struct GT68xx_Device
   SANE_Byte gray_mode_color;
   SANE_Bool manual_selection;
 #ifdef USE_FORK
-  Shm_Channel *shm_channel;
+  SANEI_Shm_Channel *shm_channel;
   pid_t reader_pid;
 #endif				/* USE_FORK */
 
@@ -111,6 +111,7 @@
 #endif
 
 #include "../include/sane/sanei_backend.h"
+#include "../include/sane/sanei.h"
 #include "../include/sane/sanei_scsi.h"
 #include "../include/sane/saneopts.h"
 #include "../include/sane/sanei_config.h"
@@ -141,6 +142,9 @@
 #define STRING_GRAYSCALE SANE_VALUE_SCAN_MODE_GRAY
 #define STRING_COLOR SANE_VALUE_SCAN_MODE_COLOR
 
+#define STRING_NONE SANE_I18N("None")
+#define STRING_JPEG SANE_I18N("JPEG")
+
 /* Also set via config file. */
 static int global_buffer_size = DEFAULT_BUFFER_SIZE;
 
@@ -1226,6 +1230,31 @@ sane_get_option_descriptor (SANE_Handle handle, SANE_Int option)
       opt->cap = SANE_CAP_INACTIVE;
   }
 
+  /*compression, only the color window can do jpeg*/
+  if(option==OPT_COMPRESS){
+    i=0;
+    s->o_compress_list[i++]=STRING_NONE;
+
+    /* only for frontends that asked for compressed frames */
+    if(SANEI_COMPRESSED_FRAMES()){
+      s->o_compress_list[i++]=STRING_JPEG;
+    }
+    s->o_compress_list[i]=NULL;
+
+    opt->name = "compression";
+    opt->title = "Compression";
+    opt->desc = "Enable compressed data. May crash your front-end program";
+    opt->type = SANE_TYPE_STRING;
+    opt->constraint_type = SANE_CONSTRAINT_STRING_LIST;
+    opt->constraint.string_list = s->o_compress_list;
+    opt->size = maxStringSize (opt->constraint.string_list);
+
+    if (i > 1 && s->u_mode == MODE_COLOR)
+      opt->cap = SANE_CAP_SOFT_SELECT | SANE_CAP_SOFT_DETECT;
+    else
+      opt->cap = SANE_CAP_INACTIVE;
+  }
+
   return opt;
 }
 
@@ -1361,6 +1390,15 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
         case OPT_RIF:
           *val_p = s->u_rif;
           return SANE_STATUS_GOOD;
+
+        case OPT_COMPRESS:
+          if(s->u_compr){
+            strcpy (val, STRING_JPEG);
+          }
+          else{
+            strcpy (val, STRING_NONE);
+          }
+          return SANE_STATUS_GOOD;
       }
   }
   else if (action == SANE_ACTION_SET_VALUE) {
@@ -1512,6 +1550,14 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
           }
           return SANE_STATUS_GOOD;
 
+        case OPT_COMPRESS:
+          tmp = !strcmp (val, STRING_JPEG);
+          if (tmp != s->u_compr){
+            s->u_compr = tmp;
+            *info |= SANE_INFO_RELOAD_PARAMS;
+          }
+          return SANE_STATUS_GOOD;
+
       }                       /* switch */
   }                           /* else */
 
@@ -1631,6 +1677,9 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
         if (s->u_mode == MODE_COLOR) {
             params->format = SANE_FRAME_RGB;
             params->depth = 8;
+            if (s->u_compr) {
+                params->format = SANE_FRAME_JPEG;
+            }
         }
         else if (s->u_mode == MODE_GRAYSCALE) {
             params->format = SANE_FRAME_GRAY;
@@ -1885,9 +1934,11 @@ set_window (struct scanner *s)
 
   set_WD_bitorder (desc, 1);
 
-  /* compression options */
+  /* compression options, no frame type for fax data yet */
+#ifdef SANE_FRAME_G42D
   if(s->u_compr)
     set_WD_compress_type (desc, WD_compr_FAXG4);
+#endif
 
   /*FIXME: noise filter */
 
@@ -1983,7 +2034,7 @@ set_window (struct scanner *s)
     set_WD_bitsperpixel (desc, 24);
 
     /* compression options */
-    if(s->u_compr)
+    if(s->u_compr && s->u_mode == MODE_COLOR)
       set_WD_compress_type (desc, WD_compr_JPEG);
   }
 
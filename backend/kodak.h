@@ -33,6 +33,7 @@ enum kodak_Option
   OPT_CONTRAST,
   OPT_THRESHOLD,
   OPT_RIF,
+  OPT_COMPRESS,
 
   /* must come last: */
   NUM_OPTIONS
@@ -106,6 +107,7 @@ struct scanner
   SANE_Range o_brightness_range;
   SANE_Range o_contrast_range;
   SANE_Range o_threshold_range;
+  SANE_String_Const o_compress_list[3];
 
   /* --------------------------------------------------------------------- */
   /* changeable vars to hold user input. modified by SANE_Options above    */
@@ -66,98 +66,6 @@ static const struct known_device known_devices[] = {
   },
 };
 
-static inline SANE_Status buf_init(struct buf *b, SANE_Int sz)
-{
-	const int num = sz / BUF_SIZE + 1;
-	b->buf = (u8 **) realloc(b->buf, num * sizeof(u8 *));
-	if (!b->buf)
-		return SANE_STATUS_NO_MEM;
-	memset(b->buf, 0, num * sizeof(void *));
-	b->size = b->head = b->tail = 0;
-	b->sem = 0;
-	b->st = SANE_STATUS_GOOD;
-	pthread_cond_init(&b->cond, NULL);
-	pthread_mutex_init(&b->mu, NULL);
-	return SANE_STATUS_GOOD;
-}
-
-static inline void buf_deinit(struct buf *b)
-{
-	int i;
-	if (!b->buf)
-		return;
-	for (i = b->head; i < b->tail; i++)
-		if (b->buf[i])
-			free(b->buf[i]);
-	free(b->buf);
-	b->buf = NULL;
-	b->head = b->tail = 0;
-}
-
-static inline SANE_Status new_buf(struct buf *b, u8 ** p)
-{
-	b->buf[b->tail] = (u8 *) malloc(BUF_SIZE);
-	if (!b->buf[b->tail])
-		return SANE_STATUS_NO_MEM;
-	*p = b->buf[b->tail];
-	++b->tail;
-	return SANE_STATUS_GOOD;
-}
-
-static inline SANE_Status buf_get_err(struct buf *b)
-{
-	return b->size ? SANE_STATUS_GOOD : b->st;
-}
-
-static inline void buf_set_st(struct buf *b, SANE_Status st)
-{
-	pthread_mutex_lock(&b->mu);
-	b->st = st;
-	if (buf_get_err(b))
-		pthread_cond_signal(&b->cond);
-	pthread_mutex_unlock(&b->mu);
-}
-
-static inline void buf_cancel(struct buf *b)
-{
-	buf_set_st(b, SANE_STATUS_CANCELLED);
-}
-
-static inline void push_buf(struct buf *b, SANE_Int sz)
-{
-	pthread_mutex_lock(&b->mu);
-	b->sem++;
-	b->size += sz;
-	pthread_cond_signal(&b->cond);
-	pthread_mutex_unlock(&b->mu);
-}
-
-static inline u8 *get_buf(struct buf *b, SANE_Int * sz)
-{
-	SANE_Status err = buf_get_err(b);
-	if (err)
-		return NULL;
-
-	pthread_mutex_lock(&b->mu);
-	while (!b->sem && !buf_get_err(b))
-		pthread_cond_wait(&b->cond, &b->mu);
-	b->sem--;
-	err = buf_get_err(b);
-	if (!err) {
-		*sz = b->size < BUF_SIZE ? b->size : BUF_SIZE;
-		b->size -= *sz;
-	}
-	pthread_mutex_unlock(&b->mu);
-	return err ? NULL : b->buf[b->head];
-}
-
-static inline void pop_buf(struct buf *b)
-{
-	free(b->buf[b->head]);
-	b->buf[b->head] = NULL;
-	++b->head;
-}
-
 SANE_Status
 sane_init (SANE_Int __sane_unused__ * version_code,
 	   SANE_Auth_Callback __sane_unused__ authorize)
@@ -409,8 +317,8 @@ sane_close (SANE_Handle handle)
 	free (s->val[i].s);
     }
 
-  for (i = 0; i < sizeof (s->buf) / sizeof (s->buf[0]); i++)
-    buf_deinit (&s->buf[i]);
+  for (i = 0; i < sizeof (s->pool) / sizeof (s->pool[0]); i++)
+    sanei_buf_pool_free (s->pool[i]);
 
   free (s->buffer);
   free (s);
@@ -457,24 +365,28 @@ static SANE_Status read_image_duplex(SANE_Handle handle)
 	struct side {
 		unsigned mx, eof;
 		u8 *p;
-		struct buf *buf;
+		SANEI_Buf_Pool *pool;
 	} a[2], *b;
 
 	for (i = 0; i < 2; i++) {
 		a[i].mx = BUF_SIZE;
 		a[i].eof = 0;
-		a[i].buf = &s->buf[i];
-		st = new_buf(&s->buf[i], &a[i].p);
-		if (st)
+		a[i].pool = s->pool[i];
+		a[i].p = sanei_buf_pool_writer_get_buffer(s->pool[i]);
+		if (!a[i].p) {
+			st = SANE_STATUS_NO_MEM;
 			goto err;
+		}
 	}
 	for (b = &a[0], side = SIDE_FRONT; (!a[0].eof || !a[1].eof);) {
 		pthread_testcancel();
 		if (b->mx == 0) {
-			push_buf(b->buf, BUF_SIZE);
-			st = new_buf(b->buf, &b->p);
-			if (st)
+			sanei_buf_pool_writer_put_buffer(b->pool, BUF_SIZE);
+			b->p = sanei_buf_pool_writer_get_buffer(b->pool);
+			if (!b->p) {
+				st = SANE_STATUS_NO_MEM;
 				goto err;
+			}
 			b->mx = BUF_SIZE;
 		}
 
@@ -489,7 +401,8 @@ static SANE_Status read_image_duplex(SANE_Handle handle)
 
 			if (st == SANE_STATUS_EOF) {
 				b->eof = 1;
-				push_buf(b->buf, BUF_SIZE - b->mx);
+				sanei_buf_pool_writer_put_buffer(b->pool,
+							 BUF_SIZE - b->mx);
 			}
 			side ^= SIDE_BACK;
 			b = &a[side == SIDE_FRONT ? 0 : 1];
@@ -498,7 +411,7 @@ static SANE_Status read_image_duplex(SANE_Handle handle)
 
       err:
 	for (i = 0; i < 2; i++)
-		buf_set_st(&s->buf[i], st);
+		sanei_buf_pool_writer_close(s->pool[i], st);
 	return st;
 }
 
@@ -509,8 +422,12 @@ static SANE_Status read_image_simplex(SANE_Handle handle)
 
 	for (; (!st || st == INCORRECT_LENGTH);) {
 		unsigned read, mx;
-		unsigned char *p = NULL;
-		st = new_buf(&s->buf[0], &p);
+		unsigned char *p;
+		p = sanei_buf_pool_writer_get_buffer(s->pool[0]);
+		if (!p) {
+			st = SANE_STATUS_NO_MEM;
+			break;
+		}
 		for (read = 0, mx = BUF_SIZE; mx &&
 		     (!st || st == INCORRECT_LENGTH); mx -= read) {
 			pthread_testcancel();
@@ -518,9 +435,9 @@ static SANE_Status read_image_simplex(SANE_Handle handle)
 						     p + BUF_SIZE - mx, mx,
 						     &read);
 		}
-		push_buf(&s->buf[0], BUF_SIZE - mx);
+		sanei_buf_pool_writer_put_buffer(s->pool[0], BUF_SIZE - mx);
 	}
-	buf_set_st(&s->buf[0], st);
+	sanei_buf_pool_writer_close(s->pool[0], st);
 	return st;
 }
 
@@ -633,9 +550,17 @@ sane_start (SANE_Handle handle)
 
 	} while (!data_avalible);
 
+  /* the whole side is read before sane_read() gets to it when the
+     page length is unknown, and for the back side in duplex */
   for (i = 0; i < (duplex ? 2 : 1); i++)
     {
-      st = buf_init (&s->buf[i], s->side_size);
+      int num = POOL_BUFS;
+      if (i || s->val[CROP].b || s->val[LENGTHCTL].b || s->val[LONG_PAPER].b)
+	num = s->side_size / BUF_SIZE + 1;
+      if (!s->pool[i])
+	st = sanei_buf_pool_new (BUF_SIZE, num, &s->pool[i]);
+      else
+	st = sanei_buf_pool_reset (s->pool[i], num);
       if (st)
 	goto err;
     }
@@ -658,58 +583,56 @@ err:
   return st;
 }
 
+static void print_pool_stats(struct scanner *s, SANEI_Buf_Pool *pool)
+{
+	SANEI_Buf_Pool_Stats stats;
+	sanei_buf_pool_get_stats(pool, &stats);
+	DBG(DBG_INFO, "side %d: %d buffers of %d bytes, %d allocated while "
+	    "scanning, at most %d queued, sane_read waited %d times\n",
+	    s->side, stats.buffers, BUF_SIZE, stats.exhausted,
+	    stats.max_queued, stats.reader_waits);
+}
+
 SANE_Status
 sane_read(SANE_Handle handle, SANE_Byte * buf,
 	  SANE_Int max_len, SANE_Int * len)
 {
 	struct scanner *s = (struct scanner *) handle;
 	int duplex = s->val[DUPLEX].w;
-	struct buf *b = s->side == SIDE_FRONT ? &s->buf[0] : &s->buf[1];
-	SANE_Status err = buf_get_err(b);
+	SANEI_Buf_Pool *pool =
+	    s->side == SIDE_FRONT ? s->pool[0] : s->pool[1];
+	SANE_Status err = SANE_STATUS_GOOD;
 	SANE_Int inbuf = 0;
 	*len = 0;
 
 	if (!s->scanning)
 		return SANE_STATUS_EOF;
-	if (err)
-		goto out;
-
-	if (s->read) {
-		*len =
-		    max_len <
-		    (SANE_Int) s->read ? max_len : (SANE_Int) s->read;
-		memcpy(buf, s->data + BUF_SIZE - s->read, *len);
-		s->read -= *len;
-
-		if (!s->read)
-			pop_buf(b);
-		goto out;
-	}
 
-	s->data = get_buf(b, &inbuf);
-	if (!s->data)
-		goto out;
+	while (!s->read) {
+		err = sanei_buf_pool_reader_get_buffer(pool, &s->data, &inbuf);
+		if (err)
+			goto out;
+		if (inbuf)
+			s->read = inbuf;
+		else
+			sanei_buf_pool_reader_put_buffer(pool);
+	}
 
-	*len = max_len < inbuf ? max_len : inbuf;
-	if (*len > BUF_SIZE)
-		*len = BUF_SIZE;
+	*len = max_len < (SANE_Int) s->read ? max_len : (SANE_Int) s->read;
 	memcpy(buf, s->data, *len);
-	s->read = inbuf > BUF_SIZE ? BUF_SIZE - *len : inbuf - *len;
+	s->data += *len;
+	s->read -= *len;
 
 	if (!s->read)
-		pop_buf(b);
+		sanei_buf_pool_reader_put_buffer(pool);
       out:
-	err = *len ? SANE_STATUS_GOOD : buf_get_err(b);
+	err = *len ? SANE_STATUS_GOOD : err;
 	if (err == SANE_STATUS_EOF) {
 		if (strcmp(s->val[FEEDER_MODE].s, SANE_I18N("continuous"))) {
 			if (!duplex || s->side == SIDE_BACK)
 				s->scanning = 0;
 		}
-		buf_deinit(b);
-	} else if (err) {
-		unsigned i;
-		for (i = 0; i < sizeof(s->buf) / sizeof(s->buf[0]); i++)
-			buf_deinit(&s->buf[i]);
+		print_pool_stats(s, pool);
 	}
 	return err;
 }
@@ -729,8 +652,11 @@ sane_cancel (SANE_Handle handle)
       pthread_join (s->thread, NULL);
       s->thread = 0;
     }
-  for (i = 0; i < sizeof (s->buf) / sizeof (s->buf[0]); i++)
-    buf_deinit (&s->buf[i]);
+  /* the buffers are kept for the next scan, just wake up sane_read */
+  for (i = 0; i < sizeof (s->pool) / sizeof (s->pool[0]); i++)
+    if (s->pool[i])
+      sanei_buf_pool_writer_close (s->pool[i], SANE_STATUS_CANCELLED);
+  s->read = 0;
   s->scanning = 0;
 }
 
@@ -10,6 +10,7 @@
 
 #include "../include/sane/config.h"
 #include <semaphore.h>
+#include "../include/sane/sanei_buf_pool.h"
 
 #undef  BACKEND_NAME
 #define BACKEND_NAME kvs40xx
@@ -35,6 +36,7 @@
 #define BULK_HEADER_SIZE	12
 #define MAX_READ_DATA_SIZE	(0x10000-0x100)
 #define BUF_SIZE MAX_READ_DATA_SIZE
+#define POOL_BUFS	16	/* buffers kept when sane_read keeps up */
 
 #define INCORRECT_LENGTH 0xfafafafa
 
@@ -108,18 +110,6 @@ typedef enum
 } KV_OPTION;
 
 
-struct buf
-{
-  u8 **buf;
-  volatile int head;
-  volatile int tail;
-  volatile unsigned size;
-  volatile int sem;
-  volatile SANE_Status st;
-  pthread_mutex_t mu;
-  pthread_cond_t cond;
-};
-
 struct scanner
 {
   char name[128];
@@ -133,7 +123,7 @@ struct scanner
   Option_Value val[NUM_OPTIONS];
   SANE_Parameters params;
   u8 *buffer;
-  struct buf buf[2];
+  SANEI_Buf_Pool *pool[2];
   u8 *data;
   unsigned side_size;
   unsigned read;
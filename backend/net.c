@@ -105,13 +105,13 @@ static AvahiServiceBrowser *avahi_browser = NULL;
 #if defined (HAVE_GETADDRINFO) && defined (HAVE_GETNAMEINFO)
 # define NET_USES_AF_INDEP
 # ifdef ENABLE_IPV6
-#  define NET_VERSION "1.0.14 (AF-indep+IPv6)"
+#  define NET_VERSION "1.0.17 (AF-indep+IPv6)"
 # else
-#  define NET_VERSION "1.0.14 (AF-indep)"
+#  define NET_VERSION "1.0.17 (AF-indep)"
 # endif /* ENABLE_IPV6 */
 #else
 # undef ENABLE_IPV6
-# define NET_VERSION "1.0.14"
+# define NET_VERSION "1.0.17"
 #endif /* HAVE_GETADDRINFO && HAVE_GETNAMEINFO */
 
 static SANE_Auth_Callback auth_callback;
@@ -119,31 +119,19 @@ static Net_Device *first_device;
 static Net_Scanner *first_handle;
 static const SANE_Device **devlist;
 static int client_big_endian; /* 1 == big endian; 0 == little endian */
-static int server_big_endian; /* 1 == big endian; 0 == little endian */
-static int depth; /* bits per pixel */
 static int connect_timeout = -1; /* timeout for connection to saned */
+static SANE_Bool batch_options = SANE_FALSE; /* defer SET_VALUE requests */
+static SANE_Word compression = SANE_NET_COMPRESSION_NONE; /* data stream */
+
+/* size of the buffer for compressed data records */
+#define NET_ZBUF_SIZE (64 * 1024)
+/* size of the staging buffer for byte-swapped 16 bit data */
+#define NET_SWAP_BUF_SIZE (64 * 1024)
 
 #ifndef NET_USES_AF_INDEP
 static int saned_port;
 #endif /* !NET_USES_AF_INDEP */
 
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no hang over; otherwise the value has to be casted to SANE_Byte.  hang_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which could not be byte-swapped, e.g. because the frontend requested an odd
-   number of bytes.
-*/
-static int hang_over;
-
-/* This variable is only needed, if the depth is 16bit/channel and
-   client/server have different endianness.  A value of -1 means, that there's
-   no left over; otherwise the value has to be casted to SANE_Byte.  left_over
-   means, that there is a remaining byte from a previous call to sane_read,
-   which already is in the the correct byte order, but could not be returned,
-   e.g.  because the frontend requested only one byte per call.
-*/
-static int left_over;
 
 
 #ifdef NET_USES_AF_INDEP
@@ -486,6 +474,8 @@ connect_dev (Net_Device * dev)
   /* exchange version codes with the server: */
   req.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
 					SANEI_NET_PROTOCOL_VERSION);
+  if (SANEI_COMPRESSED_FRAMES ())
+    req.version_code |= SANE_NET_INIT_COMPRESSED_FRAMES;
   req.username = getlogin ();
   DBG (2, "connect_dev: net_init (user=%s, local version=%d.%d.%d)\n",
        req.username, V_MAJOR, V_MINOR, SANEI_NET_PROTOCOL_VERSION);
@@ -521,8 +511,8 @@ connect_dev (Net_Device * dev)
       status = SANE_STATUS_IO_ERROR;
       goto fail;
     }
-  if (SANE_VERSION_BUILD (version_code) != SANEI_NET_PROTOCOL_VERSION
-      && SANE_VERSION_BUILD (version_code) != 2)
+  if (SANE_VERSION_BUILD (version_code) > SANEI_NET_PROTOCOL_VERSION
+      || SANE_VERSION_BUILD (version_code) < 2)
     {
       DBG (1, "connect_dev: network protocol version mismatch: "
 	   "got %d, expected %d\n",
@@ -619,6 +609,264 @@ fetch_options (Net_Scanner * s)
   return SANE_STATUS_GOOD;
 }
 
+static void
+free_pending_options (Net_Scanner * s)
+{
+  int i;
+
+  for (i = 0; i < s->num_pending; i++)
+    if (s->pending[i].value)
+      free (s->pending[i].value);
+  s->num_pending = 0;
+}
+
+/* Remember a SET_VALUE request for the next flush_options().  The value
+   is copied, as the frontend may reuse its buffer right away.  */
+static SANE_Status
+queue_option (Net_Scanner * s, SANE_Control_Option_Req * req)
+{
+  SANE_Control_Option_Req *r;
+
+  if (s->num_pending == s->max_pending)
+    {
+      r = realloc (s->pending, (s->max_pending + 16) * sizeof (*r));
+      if (!r)
+	return SANE_STATUS_NO_MEM;
+      s->pending = r;
+      s->max_pending += 16;
+    }
+
+  r = &s->pending[s->num_pending];
+  *r = *req;
+  r->value = 0;
+  if (req->value_size > 0)
+    {
+      r->value = malloc (req->value_size);
+      if (!r->value)
+	return SANE_STATUS_NO_MEM;
+      memcpy (r->value, req->value, req->value_size);
+    }
+  s->num_pending++;
+
+  DBG (3, "queue_option: option %d queued (%d pending)\n", req->option,
+       s->num_pending);
+  return SANE_STATUS_GOOD;
+}
+
+/* Send all queued SET_VALUE requests to saned in a single round trip.
+   If params is not NULL, the scan parameters are fetched in the same
+   message.  Errors of the queued requests are reported here, since the
+   frontend was already told they succeeded.  */
+static SANE_Status
+flush_options (Net_Scanner * s, SANE_Parameters * params)
+{
+  SANE_Control_Option_Batch_Req req;
+  SANE_Control_Option_Batch_Reply reply;
+  SANE_Status status = SANE_STATUS_GOOD;
+  int i;
+
+  if (s->num_pending == 0)
+    return SANE_STATUS_GOOD;
+
+  DBG (3, "flush_options: sending %d options%s\n", s->num_pending,
+       params ? " and get_parameters" : "");
+
+  req.handle = s->handle;
+  req.num_reqs = s->num_pending;
+  req.req = s->pending;
+  req.get_parameters = (params != NULL);
+
+  sanei_w_call (&s->hw->wire, SANE_NET_CONTROL_OPTION_BATCH,
+		(WireCodecFunc) sanei_w_control_option_batch_req, &req,
+		(WireCodecFunc) sanei_w_control_option_batch_reply, &reply);
+  free_pending_options (s);
+
+  if (s->hw->wire.status)
+    {
+      DBG (1, "flush_options: batch request failed (%s)\n",
+	   strerror (s->hw->wire.status));
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  for (i = 0; i < reply.num_replies; i++)
+    {
+      if (reply.reply[i].status != SANE_STATUS_GOOD
+	  && status == SANE_STATUS_GOOD)
+	{
+	  DBG (1, "flush_options: request %d failed (%s)\n", i,
+	       sane_strstatus (reply.reply[i].status));
+	  status = reply.reply[i].status;
+	}
+      if (reply.reply[i].info & SANE_INFO_RELOAD_OPTIONS)
+	s->options_valid = 0;
+    }
+
+  if (params)
+    {
+      *params = reply.params.params;
+      s->depth = reply.params.params.depth;
+      if (status == SANE_STATUS_GOOD)
+	status = reply.params.status;
+    }
+
+  sanei_w_free (&s->hw->wire,
+		(WireCodecFunc) sanei_w_control_option_batch_reply, &reply);
+
+  /* the frontend never saw SANE_INFO_RELOAD_OPTIONS, so reload here */
+  if (!s->options_valid)
+    {
+      SANE_Status reload = fetch_options (s);
+
+      if (status == SANE_STATUS_GOOD)
+	status = reload;
+    }
+
+  DBG (3, "flush_options: done (%s)\n", sane_strstatus (status));
+  return status;
+}
+
+/* Swap the two bytes of each 16 bit sample in BUF, which must be
+   aligned for 32 bit access.  Written as plain word arithmetic, so the
+   compiler is free to turn the loop into vector byte shuffles. */
+static void
+swap_bytes16 (SANE_Byte * buf, size_t len)
+{
+  uint32_t *word = (uint32_t *) buf;
+  size_t i, nwords = len / 4;
+  SANE_Byte tmp;
+
+  for (i = 0; i < nwords; i++)
+    word[i] = ((word[i] & 0x00ff00ffU) << 8) | ((word[i] >> 8) & 0x00ff00ffU);
+
+  for (i = nwords * 4; i + 1 < len; i += 2)
+    {
+      tmp = buf[i];
+      buf[i] = buf[i + 1];
+      buf[i + 1] = tmp;
+    }
+}
+
+/* Hand out data from the swap buffer; returns the number of bytes. */
+static SANE_Int
+copy_swapped (Net_Scanner * s, SANE_Byte * data, SANE_Int max_length)
+{
+  size_t n = s->swap_end - s->swap_pos;
+
+  if (n > (size_t) max_length)
+    n = max_length;
+  memcpy (data, s->swap_buf + s->swap_pos, n);
+  s->swap_pos += n;
+  return n;
+}
+
+/* Prepare for the data stream announced in the START reply. */
+static SANE_Status
+start_inflate (Net_Scanner * s)
+{
+  s->raw_bytes = 0;
+  s->wire_bytes = 0;
+  if (s->compression == SANE_NET_COMPRESSION_NONE)
+    return SANE_STATUS_GOOD;
+
+#ifdef HAVE_LIBZ
+  if (!s->zbuf)
+    {
+      s->zbuf = malloc (NET_ZBUF_SIZE);
+      if (!s->zbuf)
+	{
+	  s->compression = SANE_NET_COMPRESSION_NONE;
+	  return SANE_STATUS_NO_MEM;
+	}
+    }
+  memset (&s->zs, 0, sizeof (s->zs));
+  if (inflateInit (&s->zs) != Z_OK)
+    {
+      DBG (1, "start_inflate: inflateInit failed\n");
+      s->compression = SANE_NET_COMPRESSION_NONE;
+      return SANE_STATUS_NO_MEM;
+    }
+  s->zs_more = 0;
+  DBG (2, "start_inflate: data stream is compressed\n");
+  return SANE_STATUS_GOOD;
+#else
+  DBG (1, "start_inflate: server sent compressed data, but zlib support "
+       "is missing\n");
+  s->compression = SANE_NET_COMPRESSION_NONE;
+  return SANE_STATUS_IO_ERROR;
+#endif
+}
+
+static void
+end_inflate (Net_Scanner * s)
+{
+  if (s->compression == SANE_NET_COMPRESSION_NONE)
+    return;
+
+  DBG (2, "end_inflate: received %lu bytes for %lu bytes of image data "
+       "(ratio %.2f)\n", s->wire_bytes, s->raw_bytes,
+       s->wire_bytes > 0 ? (double) s->raw_bytes / s->wire_bytes : 0.0);
+#ifdef HAVE_LIBZ
+  inflateEnd (&s->zs);
+#endif
+  s->compression = SANE_NET_COMPRESSION_NONE;
+}
+
+/* Is decompressed data of the current record still waiting? */
+static int
+inflate_pending (Net_Scanner * s)
+{
+#ifdef HAVE_LIBZ
+  if (s->compression != SANE_NET_COMPRESSION_NONE)
+    return s->zs.avail_in > 0 || s->zs_more;
+#endif
+  return 0;
+}
+
+#ifdef HAVE_LIBZ
+/* Decompress up to MAX_LENGTH bytes into DATA, reading more of the
+   current record if inflate() has run dry.  Returns the number of bytes
+   produced, or -1 with errno set like read(). */
+static ssize_t
+read_inflate (Net_Scanner * s, SANE_Byte * data, SANE_Int max_length)
+{
+  ssize_t nread;
+  size_t want;
+  int ret;
+
+  if (s->zs.avail_in == 0 && !s->zs_more && s->bytes_remaining > 0)
+    {
+      want = s->bytes_remaining;
+      if (want > NET_ZBUF_SIZE)
+	want = NET_ZBUF_SIZE;
+
+      nread = read (s->data, s->zbuf, want);
+      if (nread <= 0)
+	return nread;
+
+      s->bytes_remaining -= nread;
+      s->wire_bytes += nread;
+      s->zs.next_in = s->zbuf;
+      s->zs.avail_in = nread;
+    }
+
+  s->zs.next_out = data;
+  s->zs.avail_out = max_length;
+  ret = inflate (&s->zs, Z_SYNC_FLUSH);
+  if (ret != Z_OK && ret != Z_BUF_ERROR)
+    {
+      DBG (1, "read_inflate: inflate failed (%s)\n",
+	   s->zs.msg ? s->zs.msg : "unknown error");
+      errno = EIO;
+      return -1;
+    }
+
+  nread = max_length - s->zs.avail_out;
+  s->zs_more = (s->zs.avail_out == 0);
+  s->raw_bytes += nread;
+  return nread;
+}
+#endif /* HAVE_LIBZ */
+
 static SANE_Status
 do_cancel (Net_Scanner * s)
 {
@@ -630,6 +878,7 @@ do_cancel (Net_Scanner * s)
       close (s->data);
       s->data = -1;
     }
+  end_inflate (s);
   return SANE_STATUS_CANCELLED;
 }
 
@@ -1026,6 +1275,55 @@ sane_init (SANE_Int * version_code, SANE_Auth_Callback authorize)
 	   * Check for net backend options.
 	   * Anything that isn't an option is a saned host.
 	   */
+	  if (strstr(device_name, "batch_options") != NULL)
+	    {
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      if ((optval != NULL) && (*optval != '\0'))
+		{
+		  batch_options = (strncmp (optval, "yes", 3) == 0);
+
+		  DBG (2, "sane_init: option batching %s\n",
+		       batch_options ? "enabled" : "disabled");
+		}
+
+	      continue;
+	    }
+
+	  if (strstr(device_name, "compression") != NULL)
+	    {
+	      optval = strchr(device_name, '=');
+
+	      if (!optval)
+		continue;
+
+	      optval = sanei_config_skip_whitespace (++optval);
+	      if ((optval != NULL) && (*optval != '\0'))
+		{
+		  if (strncmp (optval, "fast", 4) == 0)
+		    compression = SANE_NET_COMPRESSION_FAST;
+		  else if (strncmp (optval, "best", 4) == 0)
+		    compression = SANE_NET_COMPRESSION_BEST;
+		  else
+		    compression = SANE_NET_COMPRESSION_NONE;
+#ifndef HAVE_LIBZ
+		  if (compression != SANE_NET_COMPRESSION_NONE)
+		    {
+		      DBG (1, "sane_init: compression requires zlib, "
+			   "disabled\n");
+		      compression = SANE_NET_COMPRESSION_NONE;
+		    }
+#endif
+		  DBG (2, "sane_init: compression level %d\n", compression);
+		}
+
+	      continue;
+	    }
+
 	  if (strstr(device_name, "connect_timeout") != NULL)
 	    {
 	      /* Look for the = sign; if it's not there, error out */
@@ -1651,6 +1949,10 @@ sane_close (SANE_Handle handle)
 	     "(%s)\n", sane_strstatus (s->hw->wire.status));
     }
 
+  free_pending_options (s);
+  if (s->pending)
+    free (s->pending);
+
   DBG (2, "sane_close: removing local option descriptors\n");
   for (option_number = 0; option_number < s->local_opt.num_options;
        option_number++)
@@ -1667,6 +1969,13 @@ sane_close (SANE_Handle handle)
       DBG (2, "sane_close: closing data pipe\n");
       close (s->data);
     }
+  end_inflate (s);
+#ifdef HAVE_LIBZ
+  if (s->zbuf)
+    free (s->zbuf);
+#endif
+  if (s->swap_buf)
+    free (s->swap_buf);
   free (s);
   DBG (2, "sane_close: done\n");
 }
@@ -1760,6 +2069,20 @@ sane_control_option (SANE_Handle handle, SANE_Int option,
   req.value_size = value_size;
   req.value = value;
 
+  /* With protocol version 4, SET_VALUE requests can wait for the next
+     request that needs an answer and travel to saned together. */
+  if (batch_options && s->hw->wire.version >= 4
+      && action == SANE_ACTION_SET_VALUE && s->data < 0)
+    {
+      if (info)
+	*info = 0;
+      return queue_option (s, &req);
+    }
+
+  status = flush_options (s, 0);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   local_info = 0;
 
   DBG (3, "sane_control_option: remote control option\n");
@@ -1840,6 +2163,9 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
       return SANE_STATUS_INVAL;
     }
 
+  if (s->num_pending > 0)
+    return flush_options (s, params);
+
   DBG (3, "sane_get_parameters: remote get parameters\n");
   sanei_w_call (&s->hw->wire, SANE_NET_GET_PARAMETERS,
 		(WireCodecFunc) sanei_w_word, &s->handle,
@@ -1847,10 +2173,20 @@ sane_get_parameters (SANE_Handle handle, SANE_Parameters * params)
 
   status = reply.status;
   *params = reply.params;
-  depth = reply.params.depth;
+  s->depth = reply.params.depth;
   sanei_w_free (&s->hw->wire,
 		(WireCodecFunc) sanei_w_get_parameters_reply, &reply);
 
+  /* saned only sends compressed frames if we asked for them in
+     SANE_NET_INIT, but older servers don't know about that */
+  if (status == SANE_STATUS_GOOD && params->format > SANE_FRAME_BLUE
+      && !SANEI_COMPRESSED_FRAMES ())
+    {
+      DBG (1, "sane_get_parameters: frame format %d not accepted by the "
+	   "frontend\n", params->format);
+      return SANE_STATUS_INVAL;
+    }
+
   DBG (3, "sane_get_parameters: returned status %s\n",
        sane_strstatus (status));
   return status;
@@ -1861,6 +2197,7 @@ SANE_Status
 sane_start (SANE_Handle handle)
 {
   Net_Scanner *s = handle;
+  SANE_Start_Req req;
   SANE_Start_Reply reply;
   struct sockaddr_in sin;
   struct sockaddr *sa;
@@ -1875,15 +2212,16 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
-
   if (s->data >= 0)
     {
       DBG (2, "sane_start: data pipe already exists\n");
       return SANE_STATUS_INVAL;
     }
 
+  status = flush_options (s, 0);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   /* Do this ahead of time so in case anything fails, we can
      recover gracefully (without hanging our server).  */
 
@@ -1919,8 +2257,10 @@ sane_start (SANE_Handle handle)
     }
 
   DBG (3, "sane_start: remote start\n");
+  req.handle = s->handle;
+  req.compression = compression;
   sanei_w_call (&s->hw->wire, SANE_NET_START,
-		(WireCodecFunc) sanei_w_word, &s->handle,
+		(WireCodecFunc) sanei_w_start_req, &req,
 		(WireCodecFunc) sanei_w_start_reply, &reply);
   do
     {
@@ -1928,12 +2268,12 @@ sane_start (SANE_Handle handle)
       port = reply.port;
       if (reply.byte_order == 0x1234)
 	{
-	  server_big_endian = 0;
+	  s->server_big_endian = 0;
 	  DBG (1, "sane_start: server has little endian byte order\n");
 	}
       else
 	{
-	  server_big_endian = 1;
+	  s->server_big_endian = 1;
 	  DBG (1, "sane_start: server has big endian byte order\n");
 	}
 
@@ -1986,10 +2326,19 @@ sane_start (SANE_Handle handle)
       close (fd);
       return SANE_STATUS_IO_ERROR;
     }
+  s->compression = reply.compression;
+  status = start_inflate (s);
+  if (status != SANE_STATUS_GOOD)
+    {
+      close (fd);
+      return status;
+    }
   shutdown (fd, 1);
   s->data = fd;
   s->reclen_buf_offset = 0;
   s->bytes_remaining = 0;
+  s->swap_pos = s->swap_end = 0;
+  s->swap_carry = -1;
   DBG (3, "sane_start: done (%s)\n", sane_strstatus (status));
   return status;
 }
@@ -2000,6 +2349,7 @@ SANE_Status
 sane_start (SANE_Handle handle)
 {
   Net_Scanner *s = handle;
+  SANE_Start_Req req;
   SANE_Start_Reply reply;
   struct sockaddr_in sin;
   SANE_Status status;
@@ -2010,15 +2360,16 @@ sane_start (SANE_Handle handle)
 
   DBG (3, "sane_start\n");
 
-  hang_over = -1;
-  left_over = -1;
-
   if (s->data >= 0)
     {
       DBG (2, "sane_start: data pipe already exists\n");
       return SANE_STATUS_INVAL;
     }
 
+  status = flush_options (s, 0);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+
   /* Do this ahead of time so in case anything fails, we can
      recover gracefully (without hanging our server).  */
   len = sizeof (sin);
@@ -2036,8 +2387,10 @@ sane_start (SANE_Handle handle)
     }
 
   DBG (3, "sane_start: remote start\n");
+  req.handle = s->handle;
+  req.compression = compression;
   sanei_w_call (&s->hw->wire, SANE_NET_START,
-		(WireCodecFunc) sanei_w_word, &s->handle,
+		(WireCodecFunc) sanei_w_start_req, &req,
 		(WireCodecFunc) sanei_w_start_reply, &reply);
   do
     {
@@ -2046,12 +2399,12 @@ sane_start (SANE_Handle handle)
       port = reply.port;
       if (reply.byte_order == 0x1234)
 	{
-	  server_big_endian = 0;
+	  s->server_big_endian = 0;
 	  DBG (1, "sane_start: server has little endian byte order\n");
 	}
       else
 	{
-	  server_big_endian = 1;
+	  s->server_big_endian = 1;
 	  DBG (1, "sane_start: server has big endian byte order\n");
 	}
 
@@ -2093,10 +2446,19 @@ sane_start (SANE_Handle handle)
       close (fd);
       return SANE_STATUS_IO_ERROR;
     }
+  s->compression = reply.compression;
+  status = start_inflate (s);
+  if (status != SANE_STATUS_GOOD)
+    {
+      close (fd);
+      return status;
+    }
   shutdown (fd, 1);
   s->data = fd;
   s->reclen_buf_offset = 0;
   s->bytes_remaining = 0;
+  s->swap_pos = s->swap_end = 0;
+  s->swap_carry = -1;
   DBG (3, "sane_start: done (%s)\n", sane_strstatus (status));
   return status;
 }
@@ -2109,12 +2471,10 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 {
   Net_Scanner *s = handle;
   ssize_t nread;
-  SANE_Int cnt;
-  SANE_Int start_cnt;
-  SANE_Int end_cnt;
-  SANE_Byte swap_buf;
-  SANE_Byte temp_hang_over;
-  int is_even;
+  SANE_Byte *buf;
+  SANE_Int buf_len;
+  size_t n = 0;
+  int swap;
 
   DBG (3, "sane_read: handle=%p, data=%p, max_length=%d, length=%p\n",
        handle, data, max_length, (void *) length);
@@ -2124,25 +2484,20 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
       return SANE_STATUS_INVAL;
     }
 
-  is_even = 1;
   *length = 0;
 
-  /* If there's a left over, i.e. a byte already in the correct byte order,
-     return it immediately; otherwise read may fail with a SANE_STATUS_EOF and
-     the caller never can read the last byte */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
+  /* 16 bit samples from a server with the other byte order are read
+     into a per-handle buffer and swapped there in one go. */
+  swap = (s->depth == 16 && s->server_big_endian != client_big_endian);
+
+  /* If there's swapped data from a previous call, return it immediately;
+     otherwise read may fail with a SANE_STATUS_EOF and the caller never
+     can read the last bytes */
+  if (swap && s->swap_pos < s->swap_end)
     {
-      if (left_over > -1)
-	{
-	  DBG (3, "sane_read: left_over from previous call, return "
-	       "immediately\n");
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  *data = (SANE_Byte) left_over;
-	  left_over = -1;
-	  *length = 1;
-	  return SANE_STATUS_GOOD;
-	}
+      *length = copy_swapped (s, data, max_length);
+      DBG (3, "sane_read: %d swapped bytes from previous call\n", *length);
+      return SANE_STATUS_GOOD;
     }
 
   if (s->data < 0)
@@ -2151,7 +2506,7 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
       return SANE_STATUS_CANCELLED;
     }
 
-  if (s->bytes_remaining == 0)
+  if (s->bytes_remaining == 0 && !inflate_pending (s))
     {
       /* boy, is this painful or what? */
       
@@ -2211,11 +2566,40 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 	}
     }
 
-  if (max_length > (SANE_Int) s->bytes_remaining)
-    max_length = s->bytes_remaining;
+  buf = data;
+  buf_len = max_length;
+  if (swap)
+    {
+      if (!s->swap_buf)
+	{
+	  s->swap_buf = malloc (NET_SWAP_BUF_SIZE);
+	  if (!s->swap_buf)
+	    {
+	      DBG (1, "sane_read: not enough memory for swap buffer\n");
+	      return SANE_STATUS_NO_MEM;
+	    }
+	}
+      /* a byte still waiting for its partner goes first */
+      if (s->swap_carry >= 0)
+	s->swap_buf[n++] = (SANE_Byte) s->swap_carry;
+      buf = s->swap_buf + n;
+      buf_len = NET_SWAP_BUF_SIZE - n;
+    }
+
+#ifdef HAVE_LIBZ
+  if (s->compression != SANE_NET_COMPRESSION_NONE)
+    nread = read_inflate (s, buf, buf_len);
+  else
+#endif
+    {
+      if (buf_len > (SANE_Int) s->bytes_remaining)
+	buf_len = s->bytes_remaining;
+
+      nread = read (s->data, buf, buf_len);
+      if (nread > 0)
+	s->bytes_remaining -= nread;
+    }
 
-  nread = read (s->data, data, max_length);
-  
   if (nread < 0)
     {
       DBG (2, "sane_read: error code %s\n", strerror (errno));
@@ -2229,94 +2613,18 @@ sane_read (SANE_Handle handle, SANE_Byte * data, SANE_Int max_length,
 	}
     }
 
-  s->bytes_remaining -= nread;
-
-  *length = nread;
-  /* Check whether we are scanning with a depth of 16 bits/pixel and whether
-     server and client have different byte order. If this is true, then it's
-     neccessary to check whether read returned an odd number. If an odd number
-     has been returned, we must save the last byte.
-  */
-  if ((depth == 16) && (server_big_endian != client_big_endian))
+  if (swap)
     {
-      DBG (1,"sane_read: client/server have different byte order; "
-	   "must swap\n");
-      /* special case: 1 byte scanned and hang_over */
-      if ((nread == 1) && (hang_over > -1))
-	{
-	  /* return the byte, we've currently scanned; hang_over becomes 
-	     left_over */
-	  left_over = hang_over;
-	  hang_over = -1;
-	  return SANE_STATUS_GOOD;
-	}
-      /* check whether an even or an odd number of bytes has been scanned */
-      if ((nread % 2) == 0)
-        is_even = 1;
-      else
-        is_even = 0;
-      /* check, whether there's a hang over from a previous call;
-	 in this case we memcopy the data up one byte */
-      if ((nread > 1) && (hang_over > -1))
-	{
-	  /* store last byte */
-	  temp_hang_over = *(data + nread - 1);
-	  memmove (data + 1, data, nread - 1);
-	  *data = (SANE_Byte) hang_over;
-	  /* what happens with the last byte depends on whether the number
-	     of bytes is even or odd */
-	  if (is_even == 1)
-	    {
-	      /* number of bytes is even; no new hang_over, exchange last
-		 byte with hang over; last byte becomes left_over */
-	      left_over = *(data + nread - 1);
-	      *(data + nread - 1) = temp_hang_over;
-	      hang_over = -1;
-	      start_cnt = 0;
-	      /* last byte already swapped */
-	      end_cnt = nread - 2;
-	    }
-	  else
-	    {
-	      /* number of bytes is odd; last byte becomes new hang_over */
-	      hang_over = temp_hang_over;
-	      left_over = -1;
-	      start_cnt = 0;
-	      end_cnt = nread - 1;
-	    }
-	}
-      else if (nread == 1)
-	{
-	  /* if only one byte has been read, save it as hang_over and return
-	     length=0 */
-	  hang_over = (int) *data;
-	  *length = 0;
-	  return SANE_STATUS_GOOD;
-	}
-      else
-	{
-	  /* no hang_over; test for even or odd byte number */
-	  if(is_even == 1)
-	    {
-	      start_cnt = 0;
-	      end_cnt = *length;
-	    }
-	  else
-	    {
-	      start_cnt = 0;
-	      hang_over = *(data + *length - 1);
-	      *length -= 1;
-	      end_cnt = *length;
-	    }
-	}
-      /* swap the bytes */
-      for (cnt = start_cnt; cnt < end_cnt - 1; cnt += 2)
-	{
-	  swap_buf = *(data + cnt);
-	  *(data + cnt) = *(data + cnt + 1);
-	  *(data + cnt + 1) = swap_buf;
-	}
+      n += nread;
+      s->swap_carry = (n & 1) ? s->swap_buf[n - 1] : -1;
+      s->swap_pos = 0;
+      s->swap_end = n & ~((size_t) 1);
+      swap_bytes16 (s->swap_buf, s->swap_end);
+      *length = copy_swapped (s, data, max_length);
     }
+  else
+    *length = nread;
+
   DBG (3, "sane_read: %lu bytes read, %lu remaining\n", (u_long) nread,
        (u_long) s->bytes_remaining);
 
@@ -47,8 +47,13 @@
 #include <sys/socket.h>
 
 #include "../include/sane/sanei_wire.h"
+#include "../include/sane/sanei_net.h"
 #include "../include/sane/config.h"
 
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
 typedef struct Net_Device
   {
     struct Net_Device *next;
@@ -80,6 +85,29 @@ typedef struct Net_Scanner
     u_char reclen_buf[4];
     size_t bytes_remaining;	/* how many bytes left in this record? */
 
+    /* SET_VALUE requests waiting for SANE_NET_CONTROL_OPTION_BATCH: */
+    SANE_Control_Option_Req *pending;
+    int num_pending;
+    int max_pending;
+
+    /* compressed data stream (protocol version 5): */
+    SANE_Word compression;	/* as announced in the START reply */
+#ifdef HAVE_LIBZ
+    z_stream zs;
+    SANE_Byte *zbuf;		/* compressed input */
+    int zs_more;		/* inflate() may have more output */
+#endif
+    u_long raw_bytes;		/* image data returned to the frontend */
+    u_long wire_bytes;		/* compressed data received */
+
+    /* 16 bit data from a server with the other byte order: */
+    int depth;			/* from the last GET_PARAMETERS */
+    int server_big_endian;	/* 1 == big endian; 0 == little endian */
+    SANE_Byte *swap_buf;	/* swapped data not yet returned */
+    size_t swap_pos;
+    size_t swap_end;
+    int swap_carry;		/* byte waiting for its partner, or -1 */
+
     /* device (host) info: */
     Net_Device *hw;
   }
@@ -77,6 +77,10 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
 #include <sys/wait.h>
 
 #include <pwd.h>
@@ -87,7 +91,8 @@
 #else
 /* 
  * This replacement poll() using select() is only designed to cover
- * our needs in run_standalone(). It should probably be extended...
+ * our needs in run_standalone() and do_scan(). It should probably be
+ * extended...
  */
 struct pollfd
 {
@@ -98,6 +103,9 @@ struct pollfd
 
 #define POLLIN 0x0001
 #define POLLERR 0x0002
+#define POLLOUT 0x0004
+#define POLLHUP 0x0008
+#define POLLNVAL 0x0010
 
 int
 poll (struct pollfd *ufds, unsigned int nfds, int timeout);
@@ -108,6 +116,7 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
   struct pollfd *fdp;
 
   fd_set rfds;
+  fd_set wfds;
   fd_set efds;
   struct timeval tv;
   int maxfd = 0;
@@ -118,15 +127,22 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
   tv.tv_usec = (timeout - tv.tv_sec * 1000) * 1000;
 
   FD_ZERO (&rfds);
+  FD_ZERO (&wfds);
   FD_ZERO (&efds);
 
   for (i = 0, fdp = ufds; i < nfds; i++, fdp++)
     {
       fdp->revents = 0;
 
+      if (fdp->fd < 0)
+	continue;
+
       if (fdp->events & POLLIN)
 	FD_SET (fdp->fd, &rfds);
 
+      if (fdp->events & POLLOUT)
+	FD_SET (fdp->fd, &wfds);
+
       FD_SET (fdp->fd, &efds);
 
       maxfd = (fdp->fd > maxfd) ? fdp->fd : maxfd;
@@ -134,17 +150,24 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
 
   maxfd++;
 
-  ret = select (maxfd, &rfds, NULL, &efds, &tv);
+  ret = select (maxfd, &rfds, &wfds, &efds, (timeout < 0) ? NULL : &tv);
 
   if (ret < 0)
     return ret;
 
   for (i = 0, fdp = ufds; i < nfds; i++, fdp++)
     {
+      if (fdp->fd < 0)
+	continue;
+
       if (fdp->events & POLLIN)
 	if (FD_ISSET (fdp->fd, &rfds))
 	  fdp->revents |= POLLIN;
 
+      if (fdp->events & POLLOUT)
+	if (FD_ISSET (fdp->fd, &wfds))
+	  fdp->revents |= POLLOUT;
+
       if (FD_ISSET (fdp->fd, &efds))
 	fdp->revents |= POLLERR;
     }
@@ -153,6 +176,28 @@ poll (struct pollfd *ufds, unsigned int nfds, int timeout)
 }
 #endif /* HAVE_SYS_POLL_H && HAVE_POLL */
 
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+
+/*
+ * Threaded mode keeps the per-connection state in thread-local storage,
+ * so the request handlers work unchanged whether a connection is served
+ * by a forked child or by a worker thread.  Between requests the state
+ * is kept with the connection, which any worker may serve next.
+ */
+#if defined(USE_PTHREAD) && defined(HAVE_PTHREAD_H) && defined(__GNUC__)
+# include <pthread.h>
+# define SANED_WITH_THREADS
+# define SANED_TLS __thread
+#else
+# define SANED_TLS
+#endif
+
 #ifdef WITH_AVAHI
 # include <avahi-client/client.h>
 # include <avahi-client/publish.h>
@@ -236,17 +281,23 @@ typedef struct
   u_int scanning:1;		/* are we scanning? */
   u_int docancel:1;		/* cancel the current scan */
   SANE_Handle handle;		/* backends handle */
+  SANE_String device;		/* device name locked by this handle */
+  struct saned_backend_lock *backend;	/* lock of its backend */
+  SANE_Word compression;	/* compression of the current scan */
 }
 Handle;
 
-static SANE_Net_Procedure_Number current_request;
+static SANED_TLS SANE_Net_Procedure_Number current_request;
 static const char *prog_name;
-static int can_authorize;
-static Wire wire;
-static int num_handles;
+static SANED_TLS int can_authorize;
+static SANED_TLS Wire wire;
+static SANED_TLS int num_handles;
 static int debug;
 static int run_mode;
-static Handle *handle;
+static char compressed_frames_env[] = SANEI_COMPRESSED_FRAMES_ENV "=1";
+static SANED_TLS SANE_Bool compressed_frames;	/* client takes JPEG frames */
+static SANED_TLS Handle *handle;
+static SANED_TLS int last_handle_checked = -1;
 static union
 {
   int w;
@@ -257,15 +308,41 @@ byte_order;
 /* The default-user name.  This is not used to imply any rights.  All
    it does is save a remote user some work by reducing the amount of
    text s/he has to type when authentication is requested.  */
-static const char *default_username = "saned-user";
-static char *remote_ip;
+static const char saned_default_username[] = "saned-user";
+static SANED_TLS const char *default_username = saned_default_username;
+static SANED_TLS char *remote_ip;
 
 /* data port range */
 static in_port_t data_port_lo;
 static in_port_t data_port_hi;
 
+/* size of the ring buffer between sane_read() and the data socket */
+#define SANED_DATA_BUFFER_MIN      8192
+#define SANED_DATA_BUFFER_DEFAULT  (1024 * 1024)
+#define SANED_DATA_BUFFER_MAX      (64 * 1024 * 1024)
+/* don't bother the backend unless a record of this size fits */
+#define SANED_MIN_RECORD           1024
+static size_t data_buffer_size = SANED_DATA_BUFFER_DEFAULT;
+
+/* worker threads serving connections in standalone mode (0 = fork) */
+#define SANED_THREADS_MAX          64
+/* clients connected at a time per worker thread */
+#define SANED_CLIENTS_PER_THREAD   16
+/* seconds a cached device list stays valid in threaded mode */
+#define SANED_DEVICE_CACHE_TTL     30
+/* seconds a connection may sit idle before it is dropped */
+#define SANED_IDLE_TIMEOUT         3600
+/* seconds to wait for the client to connect to the data port */
+#define SANED_DATA_CONNECT_TIMEOUT 30
+static int num_threads;
+
+/* highest data stream compression a client may ask for */
+static SANE_Word max_compression = SANE_NET_COMPRESSION_BEST;
+/* largest sane_read() request while compressing */
+#define SANED_ZCHUNK               (128 * 1024)
+
 #ifdef SANED_USES_AF_INDEP
-static union {
+static SANED_TLS union saned_address {
   struct sockaddr_storage ss;
   struct sockaddr sa;
   struct sockaddr_in sin;
@@ -273,9 +350,9 @@ static union {
   struct sockaddr_in6 sin6;
 #endif
 } remote_address;
-static int remote_address_len;
+static SANED_TLS int remote_address_len;
 #else
-static struct in_addr remote_address;
+static SANED_TLS struct in_addr remote_address;
 #endif /* SANED_USES_AF_INDEP */
 
 #ifndef _PATH_HEQUIV
@@ -332,8 +409,9 @@ saned_debug_call (int level, const char *fmt, ...)
 static void
 reset_watchdog (void)
 {
-  if (!debug)
-    alarm (3600);
+  /* alarm() is per process, so worker threads can't use it */
+  if (!debug && num_threads == 0)
+    alarm (SANED_IDLE_TIMEOUT);
 }
 
 static void
@@ -480,11 +558,312 @@ quit (int signum)
   exit (EXIT_SUCCESS);		/* This is a nowait-daemon. */
 }
 
+#ifdef SANED_WITH_THREADS
+/* The backends were never written with concurrent callers in mind, so
+   worker threads serialize their calls per backend: one lock for each
+   backend named by the part of a device name up to the first `:' (the
+   sub-backend of dll, or the whole name without one).  Calls into
+   different backends run in parallel, sane_read() included; calls that
+   go through all of them, like sane_get_devices(), take every lock.
+   Only the calls themselves are locked, never the socket I/O around
+   them, so a slow client can't hold up the others. */
+struct saned_backend_lock
+{
+  char *name;
+  pthread_mutex_t lock;
+  struct saned_backend_lock *next;
+};
+
+/* The list only grows.  lock_backends() holds backend_list_lock while
+   it owns all backends, so that none is added behind its back. */
+static struct saned_backend_lock *backend_locks;
+static pthread_mutex_t backend_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Devices currently opened by some connection. */
+struct saned_device_lock
+{
+  char *name;
+  struct saned_device_lock *next;
+};
+static struct saned_device_lock *locked_devices;
+static pthread_mutex_t device_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* check_host() relies on non-reentrant resolver calls */
+static pthread_mutex_t resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* SANED_WITH_THREADS */
+
+/* Return the lock of the backend serving device NAME, creating it on
+   first use.  Returns NULL when no locking is needed (forking mode) and
+   when out of memory in threaded mode. */
+static struct saned_backend_lock *
+find_backend (SANE_String_Const name)
+{
+#ifdef SANED_WITH_THREADS
+  struct saned_backend_lock *b;
+  size_t len;
+
+  if (num_threads == 0)
+    return NULL;
+
+  len = strcspn (name, ":");
+
+  pthread_mutex_lock (&backend_list_lock);
+  for (b = backend_locks; b; b = b->next)
+    if (strncmp (b->name, name, len) == 0 && b->name[len] == '\0')
+      break;
+
+  if (!b && (b = malloc (sizeof (*b))) != NULL)
+    {
+      b->name = strndup (name, len);
+      if (!b->name)
+	{
+	  free (b);
+	  b = NULL;
+	}
+      else
+	{
+	  pthread_mutex_init (&b->lock, NULL);
+	  b->next = backend_locks;
+	  backend_locks = b;
+	  DBG (DBG_DBG, "find_backend: new lock for backend `%s'\n", b->name);
+	}
+    }
+  pthread_mutex_unlock (&backend_list_lock);
+
+  return b;
+#else
+  (void) name;
+  return NULL;
+#endif
+}
+
+static void
+lock_backend (struct saned_backend_lock *b)
+{
+#ifdef SANED_WITH_THREADS
+  if (b)
+    pthread_mutex_lock (&b->lock);
+#else
+  (void) b;
+#endif
+}
+
+static void
+unlock_backend (struct saned_backend_lock *b)
+{
+#ifdef SANED_WITH_THREADS
+  if (b)
+    pthread_mutex_unlock (&b->lock);
+#else
+  (void) b;
+#endif
+}
+
+/* Take every backend, for the calls that go through all of them.
+   Never called with a backend lock held, and the only place that holds
+   more than one, always in list order. */
+static void
+lock_backends (void)
+{
+#ifdef SANED_WITH_THREADS
+  struct saned_backend_lock *b;
+
+  if (num_threads == 0)
+    return;
+
+  pthread_mutex_lock (&backend_list_lock);
+  for (b = backend_locks; b; b = b->next)
+    pthread_mutex_lock (&b->lock);
+#endif
+}
+
+static void
+unlock_backends (void)
+{
+#ifdef SANED_WITH_THREADS
+  struct saned_backend_lock *b;
+
+  if (num_threads == 0)
+    return;
+
+  for (b = backend_locks; b; b = b->next)
+    pthread_mutex_unlock (&b->lock);
+  pthread_mutex_unlock (&backend_list_lock);
+#endif
+}
+
+/* Reserve a device for exclusive use by the calling connection.  Only
+   needed in threaded mode, where all connections share one set of
+   backends. */
+static SANE_Bool
+lock_device (SANE_String_Const name)
+{
+#ifdef SANED_WITH_THREADS
+  struct saned_device_lock *l;
+  SANE_Bool ok = SANE_FALSE;
+
+  if (num_threads == 0)
+    return SANE_TRUE;
+
+  pthread_mutex_lock (&device_list_lock);
+  for (l = locked_devices; l; l = l->next)
+    if (strcmp (l->name, name) == 0)
+      {
+	DBG (DBG_MSG, "lock_device: `%s' is in use by another client\n", name);
+	goto out;
+      }
+
+  l = malloc (sizeof (*l));
+  if (!l)
+    goto out;
+  l->name = strdup (name);
+  if (!l->name)
+    {
+      free (l);
+      goto out;
+    }
+  l->next = locked_devices;
+  locked_devices = l;
+  ok = SANE_TRUE;
+
+out:
+  pthread_mutex_unlock (&device_list_lock);
+  return ok;
+#else
+  (void) name;
+  return SANE_TRUE;
+#endif
+}
+
+static void
+unlock_device (SANE_String_Const name)
+{
+#ifdef SANED_WITH_THREADS
+  struct saned_device_lock *l, **prev;
+
+  if (num_threads == 0)
+    return;
+
+  pthread_mutex_lock (&device_list_lock);
+  for (prev = &locked_devices; (l = *prev) != NULL; prev = &l->next)
+    if (strcmp (l->name, name) == 0)
+      {
+	*prev = l->next;
+	free (l->name);
+	free (l);
+	break;
+      }
+  pthread_mutex_unlock (&device_list_lock);
+#else
+  (void) name;
+#endif
+}
+
+/* Copy a device list into a single block, so the copy can be encoded
+   after the backends are unlocked and released with one free(). */
+static const SANE_Device **
+copy_devices (const SANE_Device ** list)
+{
+  const SANE_Device **copy;
+  SANE_Device *dev;
+  size_t size;
+  char *str;
+  int i, n;
+
+  for (n = 0; list && list[n]; n++)
+    ;
+
+  size = (n + 1) * sizeof (copy[0]) + n * sizeof (SANE_Device);
+  for (i = 0; i < n; i++)
+    size += strlen (list[i]->name ? list[i]->name : "") + 1
+      + strlen (list[i]->vendor ? list[i]->vendor : "") + 1
+      + strlen (list[i]->model ? list[i]->model : "") + 1
+      + strlen (list[i]->type ? list[i]->type : "") + 1;
+
+  copy = malloc (size);
+  if (!copy)
+    return NULL;
+
+  dev = (SANE_Device *) (copy + n + 1);
+  str = (char *) (dev + n);
+  for (i = 0; i < n; i++, dev++)
+    {
+#define COPY_FIELD(f)					\
+      strcpy (str, list[i]->f ? list[i]->f : "");	\
+      dev->f = str;					\
+      str += strlen (str) + 1;
+      COPY_FIELD (name);
+      COPY_FIELD (vendor);
+      COPY_FIELD (model);
+      COPY_FIELD (type);
+#undef COPY_FIELD
+      copy[i] = dev;
+    }
+  copy[n] = NULL;
+
+  return copy;
+}
+
+/* Return a private copy of the device list, which the caller has to
+   free().  In threaded mode the backends stay initialized, so they are
+   only probed again once the cached list is SANED_DEVICE_CACHE_TTL
+   seconds old. */
+static SANE_Status
+get_devices (const SANE_Device *** device_list)
+{
+#ifdef SANED_WITH_THREADS
+  static const SANE_Device **cached_list;
+  static time_t cached_time;
+  time_t now = time (NULL);
+#endif
+  const SANE_Device **list = NULL;
+  SANE_Status status;
+
+  *device_list = NULL;
+
+  lock_backends ();
+#ifdef SANED_WITH_THREADS
+  if (num_threads > 0 && cached_list
+      && now - cached_time < SANED_DEVICE_CACHE_TTL)
+    {
+      list = cached_list;
+      status = SANE_STATUS_GOOD;
+    }
+  else
+#endif
+    {
+      status = sane_get_devices (&list, SANE_TRUE);
+#ifdef SANED_WITH_THREADS
+      if (num_threads > 0)
+	{
+	  /* the backend's list is only valid until its next call */
+	  free (cached_list);
+	  cached_list = NULL;
+	  if (status == SANE_STATUS_GOOD)
+	    {
+	      cached_list = copy_devices (list);
+	      cached_time = now;
+	    }
+	}
+#endif
+    }
+
+  if (status == SANE_STATUS_GOOD)
+    {
+      *device_list = copy_devices (list);
+      if (!*device_list)
+	status = SANE_STATUS_NO_MEM;
+    }
+  unlock_backends ();
+
+  return status;
+}
+
 static SANE_Word
 get_free_handle (void)
 {
 # define ALLOC_INCREMENT        16
-  static int h, last_handle_checked = -1;
+  int h;
 
   if (num_handles > 0)
     {
@@ -525,8 +904,17 @@ close_handle (int h)
 {
   if (h >= 0 && handle[h].inuse)
     {
+      lock_backend (handle[h].backend);
       sane_close (handle[h].handle);
+      unlock_backend (handle[h].backend);
+      if (handle[h].device)
+	unlock_device (handle[h].device);
       handle[h].inuse = 0;
+      if (handle[h].device)
+	{
+	  free (handle[h].device);
+	  handle[h].device = NULL;
+	}
     }
 }
 
@@ -1335,7 +1723,13 @@ init (Wire * w)
 
   reset_watchdog ();
 
+#ifdef SANED_WITH_THREADS
+  pthread_mutex_lock (&resolver_lock);
+#endif
   status = check_host (w->io.fd);
+#ifdef SANED_WITH_THREADS
+  pthread_mutex_unlock (&resolver_lock);
+#endif
   if (status != SANE_STATUS_GOOD)
     {
       DBG (DBG_WARN, "init: access by host %s denied\n", remote_ip);
@@ -1366,7 +1760,18 @@ init (Wire * w)
       return -1;
     }
 
-  w->version = SANEI_NET_PROTOCOL_VERSION;
+  /* Speak the client's protocol version if it is older than ours.
+     Clients before version 3 have always been answered with 3.  */
+  w->version = SANE_VERSION_BUILD (req.version_code)
+    & ~SANE_NET_INIT_COMPRESSED_FRAMES;
+  compressed_frames = (SANE_VERSION_BUILD (req.version_code)
+		       & SANE_NET_INIT_COMPRESSED_FRAMES) != 0;
+  if (w->version > SANEI_NET_PROTOCOL_VERSION)
+    w->version = SANEI_NET_PROTOCOL_VERSION;
+  if (w->version < 3)
+    w->version = 3;
+  DBG (DBG_MSG, "init: using network protocol version %d%s\n", w->version,
+       compressed_frames ? ", compressed frames" : "");
   if (req.username)
     default_username = strdup (req.username);
 
@@ -1377,13 +1782,17 @@ init (Wire * w)
       return -1;
     }
 
-  reply.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR,
-					  SANEI_NET_PROTOCOL_VERSION);
+  reply.version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR, w->version);
 
   DBG (DBG_WARN, "init: access granted to %s@%s\n",
        default_username, remote_ip);
 
-  if (status == SANE_STATUS_GOOD)
+  if (status == SANE_STATUS_GOOD && num_threads > 0)
+    {
+      /* the backends were initialized once by start_workers() */
+      be_version_code = SANE_VERSION_CODE (V_MAJOR, V_MINOR, 0);
+    }
+  else if (status == SANE_STATUS_GOOD)
     {
       status = sane_init (&be_version_code, auth_callback);
       if (status != SANE_STATUS_GOOD)
@@ -1409,6 +1818,109 @@ init (Wire * w)
   return 0;
 }
 
+/* The backends offer compressed frames to every client, see main().
+   Clients that didn't ask for them in SANE_NET_INIT don't see the
+   option values that select them and never get such a frame. */
+
+/* Is VALUE one of the option values that make the backends send
+   compressed frames? */
+static int
+is_compressed_value (SANE_String_Const value)
+{
+  return value && strcmp (value, "JPEG") == 0;
+}
+
+/* Returns a copy of DESC without the compressed frame values in its
+   string list, or NULL if there are none to hide.  The list is part of
+   the copy, so it is freed with it. */
+static SANE_Option_Descriptor *
+hide_compressed_values (const SANE_Option_Descriptor * desc)
+{
+  SANE_Option_Descriptor *copy;
+  SANE_String_Const *list;
+  int i, n, found = 0;
+
+  if (compressed_frames || !desc || desc->type != SANE_TYPE_STRING
+      || desc->constraint_type != SANE_CONSTRAINT_STRING_LIST)
+    return NULL;
+
+  for (n = 0; desc->constraint.string_list[n]; n++)
+    if (is_compressed_value (desc->constraint.string_list[n]))
+      found = 1;
+  if (!found)
+    return NULL;
+
+  copy = malloc (sizeof (*copy) + (n + 1) * sizeof (*list));
+  if (!copy)
+    return NULL;
+  *copy = *desc;
+  list = (SANE_String_Const *) (copy + 1);
+  copy->constraint.string_list = list;
+  for (i = 0; i < n; i++)
+    if (!is_compressed_value (desc->constraint.string_list[i]))
+      *list++ = desc->constraint.string_list[i];
+  *list = NULL;
+  return copy;
+}
+
+/* Refuses to set an option to a value hidden by hide_compressed_values.
+   Call with the backends locked. */
+static SANE_Status
+check_option_value (SANE_Handle be_handle, SANE_Int option,
+		    SANE_Action action, void *value)
+{
+  const SANE_Option_Descriptor *desc;
+
+  if (compressed_frames || action != SANE_ACTION_SET_VALUE)
+    return SANE_STATUS_GOOD;
+
+  desc = sane_get_option_descriptor (be_handle, option);
+  if (desc && desc->type == SANE_TYPE_STRING
+      && is_compressed_value ((SANE_String_Const) value))
+    {
+      DBG (DBG_MSG, "check_option_value: option %d: client doesn't take "
+	   "compressed frames\n", option);
+      return SANE_STATUS_INVAL;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+/* Refuses frame types the client didn't ask for, in case a backend
+   sends them anyway. */
+static SANE_Status
+check_frame (SANE_Status status, const SANE_Parameters * params)
+{
+  if (status == SANE_STATUS_GOOD && !compressed_frames
+      && params->format > SANE_FRAME_BLUE)
+    {
+      DBG (DBG_ERR, "check_frame: client doesn't take frame format %d\n",
+	   params->format);
+      return SANE_STATUS_INVAL;
+    }
+  return status;
+}
+
+/* sane_start() for handle H, which gives up at once on frames the
+   client can't take */
+static SANE_Status
+start_backend (int h)
+{
+  SANE_Parameters params;
+  SANE_Status status;
+
+  lock_backend (handle[h].backend);
+  status = sane_start (handle[h].handle);
+  if (status == SANE_STATUS_GOOD && !compressed_frames)
+    {
+      status = check_frame (sane_get_parameters (handle[h].handle, &params),
+			    &params);
+      if (status != SANE_STATUS_GOOD)
+	sane_cancel (handle[h].handle);
+    }
+  unlock_backend (handle[h].backend);
+  return status;
+}
+
 #ifdef SANED_USES_AF_INDEP
 static int
 start_scan (Wire * w, int h, SANE_Start_Reply * reply)
@@ -1425,13 +1937,10 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 #ifdef ENABLE_IPV6
   struct sockaddr_in6 *sin6;
 #endif /* ENABLE_IPV6 */
-  SANE_Handle be_handle;
   int fd, len;
   in_port_t data_port;
   int ret;
 
-  be_handle = handle[h].handle;
-
   len = sizeof (data_addr.ss);
   if (getsockname (w->io.fd, &data_addr.sa, (socklen_t *) &len) < 0)
     {
@@ -1530,7 +2039,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 
   DBG (DBG_MSG, "start_scan: using port %d for data\n", reply->port);
 
-  reply->status = sane_start (be_handle);
+  reply->status = start_backend (h);
   if (reply->status == SANE_STATUS_GOOD)
     {
       handle[h].scanning = 1;
@@ -1546,13 +2055,10 @@ static int
 start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 {
   struct sockaddr_in sin;
-  SANE_Handle be_handle;
   int fd, len;
   in_port_t data_port;
   int ret;
 
-  be_handle = handle[h].handle;
-
   len = sizeof (sin);
   if (getsockname (w->io.fd, (struct sockaddr *) &sin, (socklen_t *) &len) < 0)
     {
@@ -1611,7 +2117,7 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 
   DBG (DBG_MSG, "start_scan: using port %d for data\n", reply->port);
 
-  reply->status = sane_start (be_handle);
+  reply->status = start_backend (h);
   if (reply->status == SANE_STATUS_GOOD)
     {
       handle[h].scanning = 1;
@@ -1622,6 +2128,21 @@ start_scan (Wire * w, int h, SANE_Start_Reply * reply)
 }
 #endif /* SANED_USES_AF_INDEP */
 
+static const char *
+compression_name (SANE_Word compression)
+{
+  switch (compression)
+    {
+    case SANE_NET_COMPRESSION_NONE:
+      return "none";
+    case SANE_NET_COMPRESSION_FAST:
+      return "fast";
+    case SANE_NET_COMPRESSION_BEST:
+      return "best";
+    }
+  return "unknown";
+}
+
 static int
 store_reclen (SANE_Byte * buf, size_t buf_size, int i, size_t reclen)
 {
@@ -1640,191 +2161,573 @@ store_reclen (SANE_Byte * buf, size_t buf_size, int i, size_t reclen)
   return i;
 }
 
-static void
-do_scan (Wire * w, int h, int data_fd)
+/* Queue as much of the ring buffer as possible for the client.  When
+   the pending data wraps around the end of the buffer, both pieces go
+   out in a single writev() call.  Returns the number of bytes written,
+   0 if the socket is full and -1 on error. */
+static long int
+send_ring (int data_fd, SANE_Byte * buf, size_t buf_size, int writer,
+	   size_t bytes_in_buf)
 {
-  int num_fds, be_fd = -1, reader, writer, bytes_in_buf, status_dirty = 0;
-  SANE_Handle be_handle = handle[h].handle;
-  struct timeval tv, *timeout = 0;
-  fd_set rd_set, rd_mask, wr_set, wr_mask;
-  SANE_Byte buf[8192];
-  SANE_Status status;
   long int nwritten;
-  SANE_Int length;
   size_t nbytes;
-  
-  DBG (3, "do_scan: start\n");
 
-  FD_ZERO (&rd_mask);
-  FD_SET (w->io.fd, &rd_mask);
-  num_fds = w->io.fd + 1;
+  nbytes = bytes_in_buf;
+  if (writer + nbytes > buf_size)
+    nbytes = buf_size - writer;
 
-  FD_ZERO (&wr_mask);
-  FD_SET (data_fd, &wr_mask);
-  if (data_fd >= num_fds)
-    num_fds = data_fd + 1;
-
-  sane_set_io_mode (be_handle, SANE_TRUE);
-  if (sane_get_select_fd (be_handle, &be_fd) == SANE_STATUS_GOOD)
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_WRITEV)
+  if (nbytes < bytes_in_buf)
     {
-      FD_SET (be_fd, &rd_mask);
-      if (be_fd >= num_fds)
-	num_fds = be_fd + 1;
+      struct iovec iov[2];
+
+      iov[0].iov_base = buf + writer;
+      iov[0].iov_len = nbytes;
+      iov[1].iov_base = buf;
+      iov[1].iov_len = bytes_in_buf - nbytes;
+      DBG (DBG_INFO, "send_ring: trying to write %lu bytes to client\n",
+	   (u_long) bytes_in_buf);
+      nwritten = writev (data_fd, iov, 2);
     }
   else
+#endif
     {
-      memset (&tv, 0, sizeof (tv));
-      timeout = &tv;
+      DBG (DBG_INFO, "send_ring: trying to write %lu bytes to client\n",
+	   (u_long) nbytes);
+      nwritten = write (data_fd, buf + writer, nbytes);
     }
 
-  status = SANE_STATUS_GOOD;
-  reader = writer = bytes_in_buf = 0;
-  do
+  if (nwritten < 0)
     {
-      rd_set = rd_mask;
-      wr_set = wr_mask;
-      if (select (num_fds, &rd_set, &wr_set, 0, timeout) < 0)
-	{
-	  if (be_fd >= 0 && errno == EBADF)
-	    {
-	      /* This normally happens when a backend closes a select
-		 filedescriptor when reaching the end of file.  So
-		 pass back this status to the client: */
-	      FD_CLR (be_fd, &rd_mask);
-	      be_fd = -1;
-	      /* only set status_dirty if EOF hasn't been already detected */
-	      if (status == SANE_STATUS_GOOD) 
-		status_dirty = 1; 
-	      status = SANE_STATUS_EOF;
-	      DBG (DBG_INFO, "do_scan: select_fd was closed --> EOF\n");
-	      continue;
-	    }
-	  else
-	    {
-	      status = SANE_STATUS_IO_ERROR;
-	      DBG (DBG_ERR, "do_scan: select failed (%s)\n", strerror (errno));
-	      break;
-	    }
-	}
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	return 0;
+      DBG (DBG_ERR, "send_ring: write failed (%s)\n", strerror (errno));
+      return -1;
+    }
+  DBG (DBG_INFO, "send_ring: wrote %ld bytes to client\n", nwritten);
+  return nwritten;
+}
 
-      if (bytes_in_buf)
-	{
-	  if (FD_ISSET (data_fd, &wr_set))
-	    {
-	      if (bytes_in_buf > 0)
-		{
-		  /* write more input data */
-		  nbytes = bytes_in_buf;
-		  if (writer + nbytes > sizeof (buf))
-		    nbytes = sizeof (buf) - writer;
-		  DBG (DBG_INFO, 
-		       "do_scan: trying to write %d bytes to client\n",
-		       nbytes);
-		  nwritten = write (data_fd, buf + writer, nbytes);
-		  DBG (DBG_INFO, 
-		       "do_scan: wrote %ld bytes to client\n", nwritten);
-		  if (nwritten < 0)
-		    {
-		      DBG (DBG_ERR, "do_scan: write failed (%s)\n",
-			   strerror (errno));
-		      status = SANE_STATUS_CANCELLED;
-		      break;
-		    }
-		  bytes_in_buf -= nwritten;
-		  writer += nwritten;
-		  if (writer == sizeof (buf))
-		    writer = 0;
-		}
-	    }
-	}
-      else if (status == SANE_STATUS_GOOD
-	       && (timeout || FD_ISSET (be_fd, &rd_set)))
-	{
-	  int i;
+#ifdef HAVE_LIBZ
+/* Compress LEN bytes from IN into the ring buffer, starting at index I
+   where at least ROOM bytes are free (possibly wrapping around).  The
+   output ends with a sync flush, so the client can inflate each record
+   as soon as it arrives.  Returns the compressed length or -1 if the
+   output didn't fit. */
+static long int
+deflate_record (z_stream * zs, SANE_Byte * in, SANE_Int len,
+		SANE_Byte * buf, size_t buf_size, int i, size_t room)
+{
+  size_t first;
+  int ret;
+
+  first = buf_size - i;
+  if (first > room)
+    first = room;
+
+  zs->next_in = in;
+  zs->avail_in = len;
+  zs->next_out = buf + i;
+  zs->avail_out = first;
+  ret = deflate (zs, Z_SYNC_FLUSH);
+  if (ret == Z_OK && zs->avail_out == 0 && room > first)
+    {
+      /* continue at the start of the ring */
+      zs->next_out = buf;
+      zs->avail_out = room - first;
+      ret = deflate (zs, Z_SYNC_FLUSH);
+      if (ret == Z_BUF_ERROR)
+	ret = Z_OK;		/* the first part was exactly big enough */
+      first = room;
+    }
 
-	  /* get more input data */
+  if (ret != Z_OK || zs->avail_in != 0 || zs->avail_out == 0)
+    {
+      DBG (DBG_ERR, "deflate_record: deflate failed (%d)\n", ret);
+      return -1;
+    }
+  return first - zs->avail_out;
+}
+#endif /* HAVE_LIBZ */
 
-	  /* reserve 4 bytes to store the length of the data record: */
-	  i = reader;
-	  reader += 4;
-	  if (reader >= (int) sizeof (buf))
-	    reader -= sizeof(buf);
+/* An image transfer in progress: the ring buffer between sane_read()
+   and the data socket, and how far the scan has got.  do_scan() runs a
+   transfer to its end; the event loop of the threaded daemon advances
+   it a step whenever one of its sockets is ready. */
+typedef struct
+{
+  int h;			/* handle being scanned */
+  int data_fd;			/* data connection to the client */
+  int be_fd;			/* select fd of the backend, or -1 */
+  int nonblocking;		/* backend is in non-blocking mode */
+  int want_read;		/* room for another record */
+  SANE_Byte *buf;
+  size_t buf_size;
+  size_t bytes_in_buf;
+  size_t min_room;
+  int reader, writer;
+  SANE_Status status;
+  int status_dirty;
+  u_long total_bytes;
+  u_long wire_bytes;
+  struct timeval start_time;
+#ifdef HAVE_LIBZ
+  z_stream zs;
+  SANE_Byte *zraw;
+  size_t zchunk;
+#endif
+}
+Scan;
 
-	  assert (bytes_in_buf == 0);
-	  nbytes = sizeof (buf) - 4;
-	  if (reader + nbytes > sizeof (buf))
-	    nbytes = sizeof (buf) - reader;
+static int
+scan_begin (Scan * s, int h, int data_fd)
+{
+  SANE_Handle be_handle = handle[h].handle;
 
-	  DBG (DBG_INFO,
-	       "do_scan: trying to read %d bytes from scanner\n", nbytes);
-	  status = sane_read (be_handle, buf + reader, nbytes, &length);
-	  DBG (DBG_INFO,
-	       "do_scan: read %d bytes from scanner\n", length);
+  DBG (3, "scan_begin: start\n");
 
-	  reset_watchdog ();
+  memset (s, 0, sizeof (*s));
+  s->h = h;
+  s->data_fd = data_fd;
+  s->be_fd = -1;
+  s->buf_size = data_buffer_size;
+  s->min_room = SANED_MIN_RECORD + 4;
 
-	  reader += length;
-	  if (reader >= (int) sizeof (buf))
-	    reader = 0;
-	  bytes_in_buf += length + 4;
+  s->buf = malloc (s->buf_size);
+  if (!s->buf)
+    {
+      DBG (DBG_ERR, "scan_begin: failed to allocate %lu byte buffer\n",
+	   (u_long) s->buf_size);
+      handle[h].docancel = 0;
+      handle[h].scanning = 0;
+      return -1;
+    }
+  DBG (DBG_MSG, "scan_begin: using %lu byte data buffer\n",
+       (u_long) s->buf_size);
 
-	  if (status != SANE_STATUS_GOOD)
-	    {
-	      reader = i;	/* restore reader index */
-	      status_dirty = 1;
-	      DBG (DBG_MSG,
-		   "do_scan: status = `%s'\n", sane_strstatus(status));
-	    }
-	  else
-	    store_reclen (buf, sizeof (buf), i, length);
-	}
+  s->status = SANE_STATUS_GOOD;
 
-      if (status_dirty && sizeof (buf) - bytes_in_buf >= 5)
+#ifdef HAVE_LIBZ
+  if (handle[h].compression != SANE_NET_COMPRESSION_NONE)
+    {
+      int level = Z_BEST_SPEED;
+
+      if (handle[h].compression == SANE_NET_COMPRESSION_BEST)
+	level = Z_BEST_COMPRESSION;
+
+      /* the client has been promised a compressed stream, so any
+	 failure from here on has to be reported in-band */
+      s->zchunk = SANED_ZCHUNK;
+      if (s->zchunk > s->buf_size / 2)
+	s->zchunk = s->buf_size / 2;
+      s->zraw = malloc (s->zchunk);
+      if (!s->zraw || deflateInit (&s->zs, level) != Z_OK)
 	{
-	  status_dirty = 0;
-	  reader = store_reclen (buf, sizeof (buf), reader, 0xffffffff);
-	  buf[reader] = status;
-	  bytes_in_buf += 5;
-	  DBG (DBG_MSG, "do_scan: statuscode `%s' was added to buffer\n", 
-	       sane_strstatus(status));
+	  DBG (DBG_ERR, "scan_begin: failed to set up compression\n");
+	  free (s->zraw);
+	  s->zraw = NULL;
+	  s->status = SANE_STATUS_NO_MEM;
+	  s->status_dirty = 1;
 	}
-
-      if (FD_ISSET (w->io.fd, &rd_set))
+      else
 	{
-	  DBG (DBG_MSG,
-	       "do_scan: processing RPC request on fd %d\n", w->io.fd);
-	  process_request (w);
-	  if (handle[h].docancel)
-	    break;
+	  /* worst case output of one record, including the sync flush */
+	  s->min_room = deflateBound (&s->zs, s->zchunk) + 16 + 4;
+	  DBG (DBG_MSG, "scan_begin: compressing with level %d, %lu byte "
+	       "records\n", level, (u_long) s->zchunk);
 	}
     }
-  while (status == SANE_STATUS_GOOD || bytes_in_buf > 0 || status_dirty);
-  DBG (DBG_MSG, "do_scan: done, status=%s\n", sane_strstatus (status));
-  handle[h].docancel = 0;
-  handle[h].scanning = 0;
+#endif
+
+  lock_backend (handle[h].backend);
+  s->nonblocking =
+    (sane_set_io_mode (be_handle, SANE_TRUE) == SANE_STATUS_GOOD);
+  if (sane_get_select_fd (be_handle, &s->be_fd) != SANE_STATUS_GOOD)
+    s->be_fd = -1;
+  unlock_backend (handle[h].backend);
+
+  gettimeofday (&s->start_time, NULL);
+  return 0;
 }
 
 static int
-process_request (Wire * w)
+scan_pending (Scan * s)
 {
-  SANE_Handle be_handle;
-  SANE_Word h, word;
-  int i;
+  return s->status == SANE_STATUS_GOOD || s->bytes_in_buf > 0
+    || s->status_dirty;
+}
 
-  DBG (DBG_DBG, "process_request: waiting for request\n");
-  sanei_w_set_dir (w, WIRE_DECODE);
-  sanei_w_word (w, &word);	/* decode procedure number */
+/* Queue a pending status for the client and fill in what the transfer
+   waits for next. */
+static void
+scan_wait_for (Scan * s, struct pollfd *data_pfd, struct pollfd *be_pfd)
+{
+  /* only wait for the scanner while there is room for a record */
+  s->want_read = (s->status == SANE_STATUS_GOOD
+		  && s->buf_size - s->bytes_in_buf >= s->min_room);
 
-  if (w->status)
+  if (s->status_dirty && s->buf_size - s->bytes_in_buf >= 5)
     {
-      DBG (DBG_ERR,
-	   "process_request: bad status %d\n", w->status);
-      return -1;
+      s->status_dirty = 0;
+      s->reader = store_reclen (s->buf, s->buf_size, s->reader, 0xffffffff);
+      s->buf[s->reader] = s->status;
+      if (++s->reader >= (int) s->buf_size)
+	s->reader = 0;
+      s->bytes_in_buf += 5;
+      DBG (DBG_MSG, "scan_wait_for: statuscode `%s' was added to buffer\n",
+	   sane_strstatus (s->status));
     }
 
-  current_request = word;
+  /* poll() ignores entries with a negative fd; POLLHUP and POLLERR
+     are reported even with no events requested, so an idle data
+     socket has to be left out entirely */
+  data_pfd->fd = s->bytes_in_buf ? s->data_fd : -1;
+  data_pfd->events = POLLOUT;
+  data_pfd->revents = 0;
+  be_pfd->fd = (s->want_read && s->be_fd >= 0) ? s->be_fd : -1;
+  be_pfd->events = POLLIN;
+  be_pfd->revents = 0;
+}
 
-  DBG (DBG_MSG, "process_request: got request %d\n", current_request);
+/* Backends without a select fd have to be polled. */
+static int
+scan_must_poll (Scan * s)
+{
+  return s->want_read && s->be_fd < 0;
+}
+
+/* Move data as far as the poll() results allow.  Returns -1 when the
+   data connection failed. */
+static int
+scan_step (Scan * s, struct pollfd *data_pfd, struct pollfd *be_pfd)
+{
+  SANE_Handle be_handle = handle[s->h].handle;
+  long int nwritten;
+  SANE_Int length;
+  size_t nbytes;
+#ifdef HAVE_LIBZ
+  long int zlen;
+#endif
+
+  if (be_pfd->fd >= 0 && (be_pfd->revents & POLLNVAL))
+    {
+      /* This normally happens when a backend closes a select
+	 filedescriptor when reaching the end of file.  So
+	 pass back this status to the client: */
+      s->be_fd = -1;
+      /* only set status_dirty if EOF hasn't been already detected */
+      if (s->status == SANE_STATUS_GOOD)
+	s->status_dirty = 1;
+      s->status = SANE_STATUS_EOF;
+      DBG (DBG_INFO, "scan_step: select_fd was closed --> EOF\n");
+      return 0;
+    }
+
+  if (s->bytes_in_buf && (data_pfd->revents & (POLLOUT | POLLERR | POLLHUP)))
+    {
+      nwritten = send_ring (s->data_fd, s->buf, s->buf_size, s->writer,
+			    s->bytes_in_buf);
+      if (nwritten < 0)
+	{
+	  s->status = SANE_STATUS_CANCELLED;
+	  return -1;
+	}
+      s->bytes_in_buf -= nwritten;
+      s->writer += nwritten;
+      if (s->writer >= (int) s->buf_size)
+	s->writer -= s->buf_size;
+      if (s->bytes_in_buf == 0)
+	s->reader = s->writer = 0;	/* maximize contiguous space */
+    }
+
+  /* Drain the backend into the free part of the ring.  Each sane_read()
+     result becomes one record; keep going until the backend has nothing
+     more for us or the ring is full. */
+  if (!s->want_read
+      || (s->be_fd >= 0 && !(be_pfd->revents & (POLLIN | POLLERR | POLLHUP))))
+    return 0;
+
+  while (s->status == SANE_STATUS_GOOD
+	 && s->buf_size - s->bytes_in_buf >= s->min_room)
+    {
+      int i;
+
+      /* reserve 4 bytes to store the length of the data record: */
+      i = s->reader;
+      s->reader += 4;
+      if (s->reader >= (int) s->buf_size)
+	s->reader -= s->buf_size;
+
+      nbytes = s->buf_size - s->bytes_in_buf - 4;
+#ifdef HAVE_LIBZ
+      if (s->zraw)
+	{
+	  DBG (DBG_INFO, "scan_step: trying to read %lu bytes from scanner\n",
+	       (u_long) s->zchunk);
+	  lock_backend (handle[s->h].backend);
+	  s->status = sane_read (be_handle, s->zraw, s->zchunk, &length);
+	  unlock_backend (handle[s->h].backend);
+	}
+      else
+#endif
+	{
+	  if (s->reader + nbytes > s->buf_size)
+	    nbytes = s->buf_size - s->reader;
+
+	  DBG (DBG_INFO, "scan_step: trying to read %lu bytes from scanner\n",
+	       (u_long) nbytes);
+	  lock_backend (handle[s->h].backend);
+	  s->status = sane_read (be_handle, s->buf + s->reader, nbytes,
+				 &length);
+	  unlock_backend (handle[s->h].backend);
+	}
+      DBG (DBG_INFO, "scan_step: read %d bytes from scanner\n", length);
+
+      reset_watchdog ();
+
+      if (s->status != SANE_STATUS_GOOD)
+	{
+	  s->reader = i;	/* restore reader index */
+	  s->status_dirty = 1;
+	  DBG (DBG_MSG, "scan_step: status = `%s'\n",
+	       sane_strstatus (s->status));
+	  break;
+	}
+      if (length == 0)
+	{
+	  /* non-blocking backend has no data right now */
+	  s->reader = i;
+	  break;
+	}
+
+      s->total_bytes += length;
+#ifdef HAVE_LIBZ
+      if (s->zraw)
+	{
+	  zlen = deflate_record (&s->zs, s->zraw, length, s->buf,
+				 s->buf_size, s->reader, nbytes);
+	  if (zlen < 0)
+	    {
+	      s->reader = i;
+	      s->status = SANE_STATUS_IO_ERROR;
+	      s->status_dirty = 1;
+	      break;
+	    }
+	  length = zlen;
+	}
+#endif
+
+      store_reclen (s->buf, s->buf_size, i, length);
+      s->reader += length;
+      if (s->reader >= (int) s->buf_size)
+	s->reader -= s->buf_size;
+      s->bytes_in_buf += length + 4;
+      s->wire_bytes += length;
+
+      /* a blocking backend would stall the sender */
+      if (!s->nonblocking)
+	break;
+    }
+  return 0;
+}
+
+/* Run one round of a transfer: wait up to TIMEOUT ms for the client or
+   the backend, move data and serve a request that arrives meanwhile.
+   Returns 1 while the transfer goes on, 0 once it is over and -1 when
+   the control connection is gone. */
+static int
+scan_iterate (Wire * w, Scan * s, int timeout)
+{
+  struct pollfd fds[3];
+  int ret;
+
+  fds[0].fd = w->io.fd;
+  fds[0].events = POLLIN;
+  scan_wait_for (s, &fds[1], &fds[2]);
+  if (scan_must_poll (s))
+    timeout = 0;
+
+  ret = poll (fds, 3, timeout);
+  if (ret < 0)
+    {
+      if (errno == EINTR)
+	return scan_pending (s);
+      s->status = SANE_STATUS_IO_ERROR;
+      DBG (DBG_ERR, "scan_iterate: poll failed (%s)\n", strerror (errno));
+      return 0;
+    }
+  if (ret == 0 && timeout > 0)
+    {
+      s->status = SANE_STATUS_CANCELLED;
+      DBG (DBG_ERR, "scan_iterate: no progress for %d seconds, giving up\n",
+	   timeout / 1000);
+      return 0;
+    }
+
+  if (scan_step (s, &fds[1], &fds[2]) < 0)
+    return 0;
+
+  if (fds[0].revents & (POLLIN | POLLERR | POLLHUP))
+    {
+      DBG (DBG_MSG,
+	   "scan_iterate: processing RPC request on fd %d\n", w->io.fd);
+      if (process_request (w) < 0)
+	return -1;
+      if (handle[s->h].docancel)
+	return 0;
+    }
+
+  return scan_pending (s);
+}
+
+static void
+scan_end (Scan * s)
+{
+  struct timeval end_time;
+  double elapsed;
+
+  gettimeofday (&end_time, NULL);
+  elapsed = (end_time.tv_sec - s->start_time.tv_sec)
+    + (end_time.tv_usec - s->start_time.tv_usec) / 1000000.0;
+  DBG (DBG_MSG, "scan_end: sent %lu bytes in %.3f s (%.0f bytes/s)\n",
+       s->total_bytes, elapsed,
+       elapsed > 0 ? s->total_bytes / elapsed : 0.0);
+  if (handle[s->h].compression != SANE_NET_COMPRESSION_NONE)
+    DBG (DBG_MSG, "scan_end: compressed to %lu bytes (ratio %.2f)\n",
+	 s->wire_bytes,
+	 s->wire_bytes > 0 ? (double) s->total_bytes / s->wire_bytes : 0.0);
+
+#ifdef HAVE_LIBZ
+  if (s->zraw)
+    {
+      deflateEnd (&s->zs);
+      free (s->zraw);
+    }
+#endif
+  free (s->buf);
+  DBG (DBG_MSG, "scan_end: done, status=%s\n", sane_strstatus (s->status));
+  handle[s->h].docancel = 0;
+  handle[s->h].scanning = 0;
+}
+
+static void
+do_scan (Wire * w, int h, int data_fd)
+{
+  Scan s;
+  /* worker threads have no alarm() watchdog to stop a stuck client */
+  int timeout = (num_threads > 0) ? SANED_IDLE_TIMEOUT * 1000 : -1;
+
+  if (scan_begin (&s, h, data_fd) < 0)
+    return;
+
+  while (scan_iterate (w, &s, timeout) > 0)
+    ;
+
+  scan_end (&s);
+}
+
+#ifdef SANED_WITH_THREADS
+/* The threaded daemon serves all its clients from one event loop, run
+   by the main thread in run_standalone().  Between two requests a
+   connection belongs to the event loop, which waits for its control
+   socket and, while it scans, for its data socket and the select fd of
+   its backend.  Once one of them is ready, a worker thread takes the
+   connection, serves one request or moves the transfer along, and hands
+   it back.  So only connections with work to do occupy a thread, and a
+   few threads serve many clients. */
+
+/* the sockets a connection waits for */
+#define CONN_CTL	0
+#define CONN_DATA	1
+#define CONN_BACKEND	2
+#define CONN_NFDS	3
+
+struct saned_conn
+{
+  int fd;			/* control socket, -1 for a free slot */
+  int started;			/* SANE_NET_INIT has been handled */
+  int armed;			/* waited for by the event loop */
+  int again;			/* to be served again without waiting */
+  int expired;			/* idle for too long, to be dropped */
+  int closed;			/* dropped, slot to be freed */
+  time_t last_active;
+  struct pollfd watch[CONN_NFDS];	/* what the event loop waits for */
+  Scan *scan;			/* transfer in progress, or NULL */
+  struct saned_conn *next;	/* in the ready or the done queue */
+
+  /* thread-local state of the connection while no worker has it */
+  Wire wire;
+  Handle *handle;
+  int num_handles;
+  int last_handle_checked;
+  SANE_Bool compressed_frames;
+  const char *default_username;
+  char *remote_ip;
+#ifdef SANED_USES_AF_INDEP
+  union saned_address remote_address;
+  int remote_address_len;
+#else
+  struct in_addr remote_address;
+#endif
+};
+
+/* the connection served by the calling worker thread */
+static SANED_TLS struct saned_conn *current_conn;
+
+/* Let the event loop run a transfer that has just been started, rather
+   than running it to its end here.  Returns 0 if the caller has to run
+   it, i.e. outside the event loop and for a second transfer on the same
+   connection. */
+static int
+conn_start_scan (int h, int data_fd)
+{
+  struct saned_conn *c = current_conn;
+
+  if (!c || c->scan)
+    return 0;
+
+  c->scan = malloc (sizeof (*c->scan));
+  if (!c->scan)
+    return 0;
+
+  if (scan_begin (c->scan, h, data_fd) < 0)
+    {
+      free (c->scan);
+      c->scan = NULL;
+      close (data_fd);
+    }
+  return 1;
+}
+#endif /* SANED_WITH_THREADS */
+
+/* Wait for the client to connect to the data port, but not forever:
+   nothing else stops a client that never does. */
+static int
+accept_data_connection (int fd)
+{
+  struct pollfd pfd;
+  int ret;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  do
+    ret = poll (&pfd, 1, SANED_DATA_CONNECT_TIMEOUT * 1000);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret == 0)
+    errno = ETIMEDOUT;
+  if (ret <= 0)
+    return -1;
+
+  return accept (fd, 0, 0);
+}
+
+static int
+dispatch_request (Wire * w)
+{
+  SANE_Handle be_handle;
+  SANE_Word h;
+  int i;
 
   switch (current_request)
     {
@@ -1833,9 +2736,9 @@ process_request (Wire * w)
 	SANE_Get_Devices_Reply reply;
 
 	reply.status =
-	  sane_get_devices ((const SANE_Device ***) &reply.device_list,
-			    SANE_TRUE);
+	  get_devices ((const SANE_Device ***) &reply.device_list);
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_get_devices_reply, &reply);
+	free (reply.device_list);
       }
       break;
 
@@ -1843,7 +2746,8 @@ process_request (Wire * w)
       {
 	SANE_Open_Reply reply;
 	SANE_Handle be_handle;
-	SANE_String name, resource;
+	SANE_String name, resource, device = NULL;
+	struct saned_backend_lock *backend = NULL;
 
 	sanei_w_string (w, &name);
 	if (w->status)
@@ -1873,8 +2777,7 @@ process_request (Wire * w)
 	  DBG(DBG_DBG, "process_request: (open) strlen(resource) == 0\n");
 	  free (resource);
 
-	  if ((i = sane_get_devices (&device_list, SANE_TRUE)) != 
-	      SANE_STATUS_GOOD) 
+	  if ((i = get_devices (&device_list)) != SANE_STATUS_GOOD)
 	    {
 	      DBG(DBG_ERR, "process_request: (open) sane_get_devices failed\n");
 	      memset (&reply, 0, sizeof (reply));
@@ -1886,6 +2789,7 @@ process_request (Wire * w)
 	  if ((device_list == NULL) || (device_list[0] == NULL)) 
 	    {
 	      DBG(DBG_ERR, "process_request: (open) device_list[0] == 0\n");
+	      free (device_list);
 	      memset (&reply, 0, sizeof (reply));
 	      reply.status = SANE_STATUS_INVAL;
 	      sanei_w_reply (w, (WireCodecFunc) sanei_w_open_reply, &reply);
@@ -1893,8 +2797,11 @@ process_request (Wire * w)
 	    }
 
 	  resource = strdup (device_list[0]->name);
+	  free (device_list);
 	}
 
+	device = strdup (resource);
+
 	if (strchr (resource, ':'))
 	  *(strchr (resource, ':')) = 0;
 
@@ -1913,22 +2820,48 @@ process_request (Wire * w)
 		 resource);
 	    free (resource);
 	    memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
-	    reply.status = sane_open (name, &be_handle);
-	    DBG (DBG_MSG, "process_request: sane_open returned: %s\n", 
-		 sane_strstatus (reply.status));
+	    if (device)
+	      backend = find_backend (device);
+	    if (!device || (num_threads > 0 && !backend))
+	      reply.status = SANE_STATUS_NO_MEM;
+	    else if (!lock_device (device))
+	      reply.status = SANE_STATUS_DEVICE_BUSY;
+	    else
+	      {
+		/* open the device that was locked, so an empty name can't
+		   end up in another backend than the lock was taken for */
+		lock_backend (backend);
+		reply.status = sane_open (device, &be_handle);
+		unlock_backend (backend);
+		DBG (DBG_MSG, "process_request: sane_open returned: %s\n",
+		     sane_strstatus (reply.status));
+		if (reply.status != SANE_STATUS_GOOD)
+		  unlock_device (device);
+	      }
 	  }
 
 	if (reply.status == SANE_STATUS_GOOD)
 	  {
 	    h = get_free_handle ();
 	    if (h < 0)
-	      reply.status = SANE_STATUS_NO_MEM;
+	      {
+		lock_backend (backend);
+		sane_close (be_handle);
+		unlock_backend (backend);
+		unlock_device (device);
+		reply.status = SANE_STATUS_NO_MEM;
+	      }
 	    else
 	      {
 		handle[h].handle = be_handle;
+		handle[h].device = device;
+		handle[h].backend = backend;
+		device = NULL;
 		reply.handle = h;
 	      }
 	  }
+	if (device)
+	  free (device);
 
 	can_authorize = 0;
 
@@ -1950,22 +2883,38 @@ process_request (Wire * w)
     case SANE_NET_GET_OPTION_DESCRIPTORS:
       {
 	SANE_Option_Descriptor_Array opt;
+	SANE_Option_Descriptor **hidden;
 
 	h = decode_handle (w, "get_option_descriptors");
 	if (h < 0)
 	  return 1;
 	be_handle = handle[h].handle;
+	lock_backend (handle[h].backend);
 	sane_control_option (be_handle, 0, SANE_ACTION_GET_VALUE,
 			     &opt.num_options, 0);
 
 	opt.desc = malloc (opt.num_options * sizeof (opt.desc[0]));
+	hidden = calloc (opt.num_options, sizeof (hidden[0]));
 	for (i = 0; i < opt.num_options; ++i)
-	  opt.desc[i] = (SANE_Option_Descriptor *)
-	    sane_get_option_descriptor (be_handle, i);
+	  {
+	    opt.desc[i] = (SANE_Option_Descriptor *)
+	      sane_get_option_descriptor (be_handle, i);
+	    if (hidden)
+	      hidden[i] = hide_compressed_values (opt.desc[i]);
+	    if (hidden && hidden[i])
+	      opt.desc[i] = hidden[i];
+	  }
+	unlock_backend (handle[h].backend);
 
 	sanei_w_reply (w,(WireCodecFunc) sanei_w_option_descriptor_array,
 		       &opt);
 
+	if (hidden)
+	  {
+	    for (i = 0; i < opt.num_options; ++i)
+	      free (hidden[i]);
+	    free (hidden);
+	  }
 	free (opt.desc);
       }
       break;
@@ -1990,9 +2939,14 @@ process_request (Wire * w)
 
 	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
 	be_handle = handle[req.handle].handle;
-	reply.status = sane_control_option (be_handle, req.option,
-					    req.action, req.value,
-					    &reply.info);
+	lock_backend (handle[req.handle].backend);
+	reply.status = check_option_value (be_handle, req.option,
+					   req.action, req.value);
+	if (reply.status == SANE_STATUS_GOOD)
+	  reply.status = sane_control_option (be_handle, req.option,
+					      req.action, req.value,
+					      &reply.info);
+	unlock_backend (handle[req.handle].backend);
 	reply.value_type = req.value_type;
 	reply.value_size = req.value_size;
 	reply.value = req.value;
@@ -2005,6 +2959,88 @@ process_request (Wire * w)
       }
       break;
 
+    case SANE_NET_CONTROL_OPTION_BATCH:
+      {
+	SANE_Control_Option_Batch_Req req;
+	SANE_Control_Option_Batch_Reply reply;
+
+	sanei_w_control_option_batch_req (w, &req);
+	if (w->status || w->version < 4
+	    || (unsigned) req.handle >= (unsigned) num_handles
+	    || !handle[req.handle].inuse)
+	  {
+	    DBG (DBG_ERR,
+		 "process_request: (control_option_batch) "
+		 "error while decoding args h=%d (%s)\n"
+		 , req.handle, strerror (w->status));
+	    return 1;
+	  }
+
+	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
+	if (req.num_reqs > 0)
+	  {
+	    reply.reply = calloc (req.num_reqs, sizeof (reply.reply[0]));
+	    if (!reply.reply)
+	      {
+		DBG (DBG_ERR, "process_request: (control_option_batch) "
+		     "out of memory\n");
+		sanei_w_free (w,
+			      (WireCodecFunc) sanei_w_control_option_batch_req,
+			      &req);
+		return -1;
+	      }
+	  }
+	reply.num_replies = req.num_reqs;
+
+	/* There is no way to ask for credentials in the middle of a
+	   batch, so options that need authorization fail here. */
+	be_handle = handle[req.handle].handle;
+	lock_backend (handle[req.handle].backend);
+	for (i = 0; i < req.num_reqs; i++)
+	  {
+	    reply.reply[i].status =
+	      check_option_value (be_handle, req.req[i].option,
+				  req.req[i].action, req.req[i].value);
+	    if (reply.reply[i].status == SANE_STATUS_GOOD)
+	      reply.reply[i].status =
+		sane_control_option (be_handle, req.req[i].option,
+				     req.req[i].action, req.req[i].value,
+				     &reply.reply[i].info);
+	    reply.reply[i].value_type = req.req[i].value_type;
+	    reply.reply[i].value_size = req.req[i].value_size;
+	    reply.reply[i].value = req.req[i].value;
+
+	    /* do what a frontend has to do before touching options again */
+	    if (reply.reply[i].info & SANE_INFO_RELOAD_OPTIONS)
+	      {
+		SANE_Int opt = 0;
+
+		while (sane_get_option_descriptor (be_handle, opt))
+		  opt++;
+	      }
+	  }
+	DBG (DBG_MSG, "process_request: (control_option_batch) "
+	     "%d options set\n", req.num_reqs);
+
+	if (req.get_parameters)
+	  reply.params.status =
+	    check_frame (sane_get_parameters (be_handle,
+					      &reply.params.params),
+			 &reply.params.params);
+	else
+	  reply.params.status = SANE_STATUS_UNSUPPORTED;
+	unlock_backend (handle[req.handle].backend);
+
+	sanei_w_reply (w, (WireCodecFunc) sanei_w_control_option_batch_reply,
+		       &reply);
+	/* the option values belong to req */
+	if (reply.reply)
+	  free (reply.reply);
+	sanei_w_free (w, (WireCodecFunc) sanei_w_control_option_batch_req,
+		      &req);
+      }
+      break;
+
     case SANE_NET_GET_PARAMETERS:
       {
 	SANE_Get_Parameters_Reply reply;
@@ -2014,7 +3050,11 @@ process_request (Wire * w)
 	  return 1;
 	be_handle = handle[h].handle;
 
-	reply.status = sane_get_parameters (be_handle, &reply.params);
+	lock_backend (handle[h].backend);
+	reply.status = check_frame (sane_get_parameters (be_handle,
+							 &reply.params),
+				    &reply.params);
+	unlock_backend (handle[h].backend);
 
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_get_parameters_reply,
 		       &reply);
@@ -2024,17 +3064,34 @@ process_request (Wire * w)
     case SANE_NET_START:
       {
 	SANE_Start_Reply reply;
+	SANE_Word compression = SANE_NET_COMPRESSION_NONE;
 	int fd = -1, data_fd;
 
 	h = decode_handle (w, "start");
 	if (h < 0)
 	  return 1;
+	/* version 5 appends the wanted compression, see sanei_w_start_req */
+	if (w->version >= 5)
+	  sanei_w_word (w, &compression);
 
 	memset (&reply, 0, sizeof (reply));	/* avoid leaking bits */
 	reply.byte_order = SANE_NET_LITTLE_ENDIAN;
 	if (byte_order.w != 1)
 	  reply.byte_order = SANE_NET_BIG_ENDIAN;
 
+#ifdef HAVE_LIBZ
+	if (compression > max_compression)
+	  compression = max_compression;
+	if (compression < SANE_NET_COMPRESSION_NONE)
+	  compression = SANE_NET_COMPRESSION_NONE;
+#else
+	compression = SANE_NET_COMPRESSION_NONE;
+#endif
+	reply.compression = compression;
+	handle[h].compression = compression;
+	DBG (DBG_MSG, "process_request: (start) compression %s\n",
+	     compression_name (compression));
+
 	if (handle[h].scanning)
 	  reply.status = SANE_STATUS_DEVICE_BUSY;
 	else
@@ -2042,101 +3099,105 @@ process_request (Wire * w)
 
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_start_reply, &reply);
 
-#ifdef SANED_USES_AF_INDEP
 	if (reply.status == SANE_STATUS_GOOD)
 	  {
-	    struct sockaddr_storage ss;
-	    char text_addr[64];
-	    int len;
-	    int error;
-
 	    DBG (DBG_MSG, "process_request: waiting for data connection\n");
-	    data_fd = accept (fd, 0, 0);
+	    data_fd = accept_data_connection (fd);
 	    close (fd);
 
-	    /* Get address of remote host */
-	    len = sizeof (ss);
-	    if (getpeername (data_fd, (struct sockaddr *) &ss, (socklen_t *) &len) < 0)
+	    if (data_fd < 0)
 	      {
-		DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
+		DBG (DBG_ERR, "process_request: accept failed! (%s)\n",
 		     strerror (errno));
+		lock_backend (handle[h].backend);
+		sane_cancel (handle[h].handle);
+		unlock_backend (handle[h].backend);
+		handle[h].scanning = 0;
+		handle[h].docancel = 0;
 		return 1;
 	      }
 
-	    error = getnameinfo ((struct sockaddr *) &ss, len, text_addr,
-				 sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
-	    if (error)
-	      {
-		DBG (DBG_ERR, "process_request: getnameinfo failed: %s\n",
-		     gai_strerror (error));
-		return 1;
-	      }
-
-	    DBG (DBG_MSG, "process_request: access to data port from %s\n",
-		 text_addr);
-	    
-	    if (strcmp (text_addr, remote_ip) != 0)
-	      {
-		DBG (DBG_ERR, "process_request: however, only %s is authorized\n",
-		     text_addr);
-		DBG (DBG_ERR, "process_request: configuration problem or attack?\n");
-		close (data_fd);
-		data_fd = -1;
-		return -1;
-	      }
+#ifdef SANED_USES_AF_INDEP
+	    {
+	      struct sockaddr_storage ss;
+	      char text_addr[64];
+	      int len;
+	      int error;
+
+	      /* Get address of remote host */
+	      len = sizeof (ss);
+	      if (getpeername (data_fd, (struct sockaddr *) &ss, (socklen_t *) &len) < 0)
+		{
+		  DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
+		       strerror (errno));
+		  close (data_fd);
+		  return 1;
+		}
 
-#else /* !SANED_USES_AF_INDEP */
+	      error = getnameinfo ((struct sockaddr *) &ss, len, text_addr,
+				   sizeof (text_addr), NULL, 0, NI_NUMERICHOST);
+	      if (error)
+		{
+		  DBG (DBG_ERR, "process_request: getnameinfo failed: %s\n",
+		       gai_strerror (error));
+		  close (data_fd);
+		  return 1;
+		}
 
-	if (reply.status == SANE_STATUS_GOOD)
-	  {
-	    struct sockaddr_in sin;
-	    int len;
+	      DBG (DBG_MSG, "process_request: access to data port from %s\n",
+		   text_addr);
 
-	    DBG (DBG_MSG, "process_request: waiting for data connection\n");
-	    data_fd = accept (fd, 0, 0);
-	    close (fd);
+	      if (strcmp (text_addr, remote_ip) != 0)
+		{
+		  DBG (DBG_ERR, "process_request: however, only %s is authorized\n",
+		       text_addr);
+		  DBG (DBG_ERR, "process_request: configuration problem or attack?\n");
+		  close (data_fd);
+		  return -1;
+		}
+	    }
+#else /* !SANED_USES_AF_INDEP */
+	    {
+	      struct sockaddr_in sin;
+	      int len;
 
-	    /* Get address of remote host */
-	    len = sizeof (sin);
-	    if (getpeername (data_fd, (struct sockaddr *) &sin, 
-			     (socklen_t *) &len) < 0)
-	      {
-		DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
-		     strerror (errno));
-		return 1;
-	      }
+	      /* Get address of remote host */
+	      len = sizeof (sin);
+	      if (getpeername (data_fd, (struct sockaddr *) &sin, 
+			       (socklen_t *) &len) < 0)
+		{
+		  DBG (DBG_ERR, "process_request: getpeername failed: %s\n",
+		       strerror (errno));
+		  close (data_fd);
+		  return 1;
+		}
 
-	    if (memcmp (&remote_address, &sin.sin_addr,
-			sizeof (remote_address)) != 0)
-	      {
-		DBG (DBG_ERR, 
-		     "process_request: access to data port from %s\n",
+	      if (memcmp (&remote_address, &sin.sin_addr,
+			  sizeof (remote_address)) != 0)
+		{
+		  DBG (DBG_ERR, 
+		       "process_request: access to data port from %s\n",
+		       inet_ntoa (sin.sin_addr));
+		  DBG (DBG_ERR, 
+		       "process_request: however, only %s is authorized\n",
+		       inet_ntoa (remote_address));
+		  DBG (DBG_ERR, 
+		       "process_request: configuration problem or attack?\n");
+		  close (data_fd);
+		  return -1;
+		}
+	      else
+		DBG (DBG_MSG, "process_request: access to data port from %s\n",
 		     inet_ntoa (sin.sin_addr));
-		DBG (DBG_ERR, 
-		     "process_request: however, only %s is authorized\n",
-		     inet_ntoa (remote_address));
-		DBG (DBG_ERR, 
-		     "process_request: configuration problem or attack?\n");
-		close (data_fd);
-		data_fd = -1;
-		return -1;
-	      }
-	    else
-	      DBG (DBG_MSG, "process_request: access to data port from %s\n",
-		   inet_ntoa (sin.sin_addr));
+	    }
 #endif /* SANED_USES_AF_INDEP */
 
-	    if (data_fd < 0)
-	      {
-		sane_cancel (handle[h].handle);
-		handle[h].scanning = 0;
-		handle[h].docancel = 0;
-		DBG (DBG_ERR, "process_request: accept failed! (%s)\n",
-		     strerror (errno));
-		return 1;
-	      }
-	    fcntl (data_fd, F_SETFL, 1);      /* set non-blocking */
+	    fcntl (data_fd, F_SETFL, O_NONBLOCK);      /* set non-blocking */
 	    shutdown (data_fd, 0);
+#ifdef SANED_WITH_THREADS
+	    if (conn_start_scan (h, data_fd))
+	      break;
+#endif
 	    do_scan (w, h, data_fd);
 	    close (data_fd);
 	  }
@@ -2150,7 +3211,9 @@ process_request (Wire * w)
 	h = decode_handle (w, "cancel");
 	if (h >= 0)
 	  {
+	    lock_backend (handle[h].backend);
 	    sane_cancel (handle[h].handle);
+	    unlock_backend (handle[h].backend);
 	    handle[h].docancel = 1;
 	  }
 	sanei_w_reply (w, (WireCodecFunc) sanei_w_word, &ack);
@@ -2173,6 +3236,29 @@ process_request (Wire * w)
   return 0;
 }
 
+static int
+process_request (Wire * w)
+{
+  SANE_Word word;
+
+  DBG (DBG_DBG, "process_request: waiting for request\n");
+  sanei_w_set_dir (w, WIRE_DECODE);
+  sanei_w_word (w, &word);	/* decode procedure number */
+
+  if (w->status)
+    {
+      DBG (DBG_ERR,
+	   "process_request: bad status %d\n", w->status);
+      return -1;
+    }
+
+  current_request = word;
+
+  DBG (DBG_MSG, "process_request: got request %d\n", current_request);
+
+  return dispatch_request (w);
+}
+
 
 static int
 wait_child (pid_t pid, int *status, int options)
@@ -2212,116 +3298,665 @@ wait_child (pid_t pid, int *status, int options)
 	}
     }
 
-  return ret;
+  return ret;
+}
+
+static int
+add_child (pid_t pid)
+{
+  struct saned_child *c;
+
+  c = (struct saned_child *) malloc (sizeof(struct saned_child));
+
+  if (c == NULL)
+    {
+      DBG (DBG_ERR, "add_child: out of memory\n");
+      return -1;
+    }
+
+  c->pid = pid;
+  c->next = children;
+
+  children = c;
+
+  return 0;
+}
+
+
+/* Set up a new control connection and handle SANE_NET_INIT.  Returns
+   -1 if the connection is to be closed. */
+static int
+start_connection (int fd)
+{
+#ifdef TCP_NODELAY
+  int on = 1;
+  int level = -1;
+#endif
+
+  DBG (DBG_DBG, "start_connection: processing client connection\n");
+
+  wire.io.fd = fd;
+
+  if (num_threads == 0)
+    {
+      signal (SIGALRM, quit);
+      signal (SIGPIPE, quit);
+    }
+  else
+    {
+      /* alarm() is per process; the event loop drops idle clients,
+	 and timeouts on the control socket stop a client that stalls
+	 in the middle of a request */
+      struct timeval tv;
+
+      tv.tv_sec = SANED_IDLE_TIMEOUT;
+      tv.tv_usec = 0;
+      if (setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv)) < 0
+	  || setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv)) < 0)
+	DBG (DBG_WARN, "start_connection: failed to set idle timeout (%s)\n",
+	     strerror (errno));
+    }
+
+#ifdef TCP_NODELAY
+# ifdef SOL_TCP
+  level = SOL_TCP;
+# else /* !SOL_TCP */
+  /* Look up the protocol level in the protocols database. */
+  {
+    struct protoent *p;
+    p = getprotobyname ("tcp");
+    if (p == 0)
+      {
+	DBG (DBG_WARN, "start_connection: cannot look up `tcp' protocol number");
+      }
+    else
+      level = p->p_proto;
+  }
+# endif	/* SOL_TCP */
+  if (level == -1
+      || setsockopt (wire.io.fd, level, TCP_NODELAY, &on, sizeof (on)))
+    DBG (DBG_WARN, "start_connection: failed to put socket in TCP_NODELAY mode (%s)",
+	 strerror (errno));
+#endif /* !TCP_NODELAY */
+
+  return init (&wire);
+}
+
+static void
+handle_connection (int fd)
+{
+  if (start_connection (fd) < 0)
+    return;
+
+  while (1)
+    {
+      reset_watchdog ();
+      if (process_request (&wire) < 0)
+	break;
+    }  
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static int listen_epfd = -1;
+#endif
+
+static void
+listen_events_exit (void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  if (listen_epfd >= 0)
+    close (listen_epfd);
+  listen_epfd = -1;
+#endif
+}
+
+static void
+handle_client (int fd)
+{
+  pid_t pid;
+  int i;
+
+  DBG (DBG_DBG, "handle_client: spawning child process\n");
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      /* child */
+      if (log_to_syslog)
+	closelog();
+
+      for (i = 3; i < fd; i++)
+	close(i);
+      listen_events_exit ();
+
+      if (log_to_syslog)
+	openlog ("saned", LOG_PID | LOG_CONS, LOG_DAEMON);
+
+      handle_connection (fd);
+      quit (0);
+    }
+  else if (pid > 0)
+    {
+      /* parent */
+      add_child (pid);
+      close(fd);
+    }
+  else
+    {
+      /* FAILED */
+      DBG (DBG_ERR, "handle_client: fork() failed: %s\n", strerror (errno));
+      close(fd);
+    }
+}
+
+#ifdef SANED_WITH_THREADS
+/* Connection slots, allocated by start_workers(); the event loop turns
+   away clients once they are all taken. */
+static struct saned_conn *conns;
+static int max_conns, num_conns;
+
+/* Connections ready for a worker thread, and connections the workers
+   are done with.  The workers wake up the event loop through conn_wake
+   to collect the latter. */
+static struct saned_conn *ready_queue, *ready_queue_tail, *done_queue;
+static pthread_mutex_t conn_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_queue_cond = PTHREAD_COND_INITIALIZER;
+static int conn_wake[2] = { -1, -1 };
+
+/* epoll tags of the wakeup pipe and of connection slots; the listening
+   sockets are tagged with their index */
+#define SANED_EVENT_WAKE	0xffffffffU
+#define SANED_EVENT_CONN	0x80000000U
+
+/* Release everything a connection left behind in the worker thread. */
+static void
+close_connection (void)
+{
+  int i;
+
+  for (i = 0; i < num_handles; ++i)
+    close_handle (i);
+
+  if (handle)
+    free (handle);
+  handle = NULL;
+  num_handles = 0;
+
+  sanei_w_exit (&wire);
+  close (wire.io.fd);
+
+  if (remote_ip)
+    free (remote_ip);
+  remote_ip = NULL;
+  if (default_username != saned_default_username)
+    free ((char *) default_username);
+  default_username = saned_default_username;
+}
+
+/* Move the state of a connection into the thread-local variables of
+   the worker serving it, and back. */
+static void
+conn_load (struct saned_conn *c)
+{
+  current_conn = c;
+  wire = c->wire;
+  handle = c->handle;
+  num_handles = c->num_handles;
+  last_handle_checked = c->last_handle_checked;
+  compressed_frames = c->compressed_frames;
+  default_username = c->default_username;
+  remote_ip = c->remote_ip;
+  remote_address = c->remote_address;
+#ifdef SANED_USES_AF_INDEP
+  remote_address_len = c->remote_address_len;
+#endif
+}
+
+static void
+conn_save (struct saned_conn *c)
+{
+  c->wire = wire;
+  c->handle = handle;
+  c->num_handles = num_handles;
+  c->last_handle_checked = last_handle_checked;
+  c->compressed_frames = compressed_frames;
+  c->default_username = default_username;
+  c->remote_ip = remote_ip;
+  c->remote_address = remote_address;
+#ifdef SANED_USES_AF_INDEP
+  c->remote_address_len = remote_address_len;
+#endif
+  current_conn = NULL;
+}
+
+static void
+conn_end_scan (struct saned_conn *c)
+{
+  scan_end (c->scan);
+  close (c->scan->data_fd);
+  free (c->scan);
+  c->scan = NULL;
+}
+
+/* Serve a connection the event loop found ready, and note what it
+   waits for next. */
+static void
+serve_connection (struct saned_conn *c)
+{
+  int ret;
+
+  if (c->expired)
+    {
+      DBG (DBG_WARN, "serve_connection: no activity for %d seconds, "
+	   "dropping client\n", SANED_IDLE_TIMEOUT);
+      ret = -1;
+    }
+  else if (!c->started)
+    {
+      c->started = 1;
+      sanei_w_init (&wire, sanei_codec_bin_init);
+      wire.io.read = read;
+      wire.io.write = write;
+      ret = start_connection (c->fd);
+    }
+  else if (c->scan)
+    {
+      ret = scan_iterate (&wire, c->scan, 0);
+      if (ret <= 0)
+	conn_end_scan (c);
+    }
+  else
+    ret = process_request (&wire);
+
+  if (ret < 0)
+    {
+      if (c->scan)
+	conn_end_scan (c);
+      if (c->started)
+	close_connection ();
+      else
+	close (c->fd);
+      c->closed = 1;
+      return;
+    }
+
+  c->last_active = time (NULL);
+  c->watch[CONN_CTL].fd = c->fd;
+  c->watch[CONN_CTL].events = POLLIN;
+  c->watch[CONN_DATA].fd = -1;
+  c->watch[CONN_BACKEND].fd = -1;
+  c->again = 0;
+  if (c->scan)
+    {
+      scan_wait_for (c->scan, &c->watch[CONN_DATA], &c->watch[CONN_BACKEND]);
+      c->again = scan_must_poll (c->scan);
+    }
+}
+
+static void *
+worker_thread (void *arg)
+{
+  struct saned_conn *c;
+
+  (void) arg;
+
+  while (1)
+    {
+      pthread_mutex_lock (&conn_queue_lock);
+      while (!ready_queue)
+	pthread_cond_wait (&ready_queue_cond, &conn_queue_lock);
+      c = ready_queue;
+      ready_queue = c->next;
+      if (!ready_queue)
+	ready_queue_tail = NULL;
+      pthread_mutex_unlock (&conn_queue_lock);
+
+      DBG (DBG_DBG, "worker_thread: serving connection on fd %d\n", c->fd);
+
+      conn_load (c);
+      serve_connection (c);
+      conn_save (c);
+
+      pthread_mutex_lock (&conn_queue_lock);
+      c->next = done_queue;
+      done_queue = c;
+      pthread_mutex_unlock (&conn_queue_lock);
+
+      /* a full pipe already has the event loop coming */
+      if (write (conn_wake[1], "", 1) < 0 && errno != EAGAIN)
+	DBG (DBG_ERR, "worker_thread: failed to wake up event loop (%s)\n",
+	     strerror (errno));
+    }
+
+  return NULL;
 }
 
+/* Initialize the backends once and start the worker pool.  Returns 0
+   on success; on failure saned falls back to forking per connection. */
 static int
-add_child (pid_t pid)
+start_workers (void)
 {
-  struct saned_child *c;
+  const SANE_Device **device_list;
+  SANE_Int version_code;
+  SANE_Status status;
+  pthread_t thread;
+  int i;
 
-  c = (struct saned_child *) malloc (sizeof(struct saned_child));
+  max_conns = num_threads * SANED_CLIENTS_PER_THREAD;
+  conns = malloc (max_conns * sizeof (conns[0]));
+  if (!conns)
+    {
+      DBG (DBG_ERR, "start_workers: out of memory\n");
+      return -1;
+    }
+  for (i = 0; i < max_conns; i++)
+    {
+      conns[i].fd = -1;
+      conns[i].armed = 0;
+    }
 
-  if (c == NULL)
+  if (pipe (conn_wake) < 0)
     {
-      DBG (DBG_ERR, "add_child: out of memory\n");
+      DBG (DBG_ERR, "start_workers: pipe failed (%s)\n", strerror (errno));
+      free (conns);
       return -1;
     }
+  for (i = 0; i < 2; i++)
+    {
+      fcntl (conn_wake[i], F_SETFL, O_NONBLOCK);
+      fcntl (conn_wake[i], F_SETFD, FD_CLOEXEC);
+    }
 
-  c->pid = pid;
-  c->next = children;
+  status = sane_init (&version_code, auth_callback);
+  if (status != SANE_STATUS_GOOD)
+    {
+      DBG (DBG_ERR, "start_workers: failed to initialize backends (%s)\n",
+	   sane_strstatus (status));
+      goto fail;
+    }
 
-  children = c;
+  /* connections must not kill the daemon by writing to a dead peer */
+  signal (SIGPIPE, SIG_IGN);
+
+  for (i = 0; i < num_threads; i++)
+    {
+      if (pthread_create (&thread, NULL, worker_thread, NULL) != 0)
+	{
+	  DBG (DBG_ERR, "start_workers: pthread_create failed (%s)\n",
+	       strerror (errno));
+	  if (i == 0)
+	    {
+	      sane_exit ();
+	      goto fail;
+	    }
+	  break;
+	}
+      pthread_detach (thread);
+    }
+  num_threads = i;
 
+  /* probe once now so the first client gets the device list at once */
+  if (get_devices (&device_list) == SANE_STATUS_GOOD)
+    free (device_list);
+
+  DBG (DBG_WARN, "start_workers: serving up to %d clients from %d threads\n",
+       max_conns, num_threads);
   return 0;
+
+fail:
+  close (conn_wake[0]);
+  close (conn_wake[1]);
+  conn_wake[0] = conn_wake[1] = -1;
+  free (conns);
+  conns = NULL;
+  return -1;
 }
 
+/* The rest is the event loop's side, run by the main thread only. */
 
 static void
-handle_connection (int fd)
+conn_queue (struct saned_conn *c)
 {
-#ifdef TCP_NODELAY
-  int on = 1;
-  int level = -1;
-#endif
+  c->next = NULL;
+  pthread_mutex_lock (&conn_queue_lock);
+  if (ready_queue_tail)
+    ready_queue_tail->next = c;
+  else
+    ready_queue = c;
+  ready_queue_tail = c;
+  pthread_cond_signal (&ready_queue_cond);
+  pthread_mutex_unlock (&conn_queue_lock);
+}
 
-  DBG (DBG_DBG, "handle_connection: processing client connection\n");
+static void
+conn_disarm (struct saned_conn *c)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int i;
 
-  wire.io.fd = fd;
+  if (listen_epfd >= 0)
+    for (i = 0; i < CONN_NFDS; i++)
+      if (c->watch[i].fd >= 0)
+	epoll_ctl (listen_epfd, EPOLL_CTL_DEL, c->watch[i].fd, &ev);
+#endif
+  c->armed = 0;
+}
 
-  signal (SIGALRM, quit);
-  signal (SIGPIPE, quit);
+/* Wait for the sockets of a connection, or hand it to the workers
+   again right away. */
+static void
+conn_arm (struct saned_conn *c)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int i;
+#endif
 
-#ifdef TCP_NODELAY
-# ifdef SOL_TCP
-  level = SOL_TCP;
-# else /* !SOL_TCP */
-  /* Look up the protocol level in the protocols database. */
-  {
-    struct protoent *p;
-    p = getprotobyname ("tcp");
-    if (p == 0)
-      {
-	DBG (DBG_WARN, "handle_connection: cannot look up `tcp' protocol number");
-      }
-    else
-      level = p->p_proto;
-  }
-# endif	/* SOL_TCP */
-  if (level == -1
-      || setsockopt (wire.io.fd, level, TCP_NODELAY, &on, sizeof (on)))
-    DBG (DBG_WARN, "handle_connection: failed to put socket in TCP_NODELAY mode (%s)",
-	 strerror (errno));
-#endif /* !TCP_NODELAY */
+  if (c->again)
+    {
+      conn_queue (c);
+      return;
+    }
 
-  if (init (&wire) < 0)
+  c->armed = 1;
+#ifdef HAVE_SYS_EPOLL_H
+  if (listen_epfd < 0)
     return;
 
-  while (1)
+  for (i = 0; i < CONN_NFDS; i++)
     {
-      reset_watchdog ();
-      if (process_request (&wire) < 0)
-	break;
-    }  
+      if (c->watch[i].fd < 0)
+	continue;
+      memset (&ev, 0, sizeof (ev));
+      ev.events = (c->watch[i].events & POLLOUT) ? EPOLLOUT : EPOLLIN;
+      ev.data.u32 = SANED_EVENT_CONN | (c - conns);
+      if (epoll_ctl (listen_epfd, EPOLL_CTL_ADD, c->watch[i].fd, &ev) < 0)
+	{
+	  /* a select fd epoll can't watch; the worker's poll() copes */
+	  DBG (DBG_DBG, "conn_arm: epoll_ctl failed for fd %d (%s)\n",
+	       c->watch[i].fd, strerror (errno));
+	  conn_disarm (c);
+	  conn_queue (c);
+	  return;
+	}
+    }
+#endif
 }
 
+/* One of the sockets of connection slot SLOT is ready. */
 static void
-handle_client (int fd)
+conn_ready (unsigned int slot)
 {
-  pid_t pid;
-  int i;
+  struct saned_conn *c = &conns[slot];
 
-  DBG (DBG_DBG, "handle_client: spawning child process\n");
+  /* an earlier event may have handed it to a worker already */
+  if (!c->armed)
+    return;
+  conn_disarm (c);
+  conn_queue (c);
+}
 
-  pid = fork ();
-  if (pid == 0)
-    {
-      /* child */
-      if (log_to_syslog)
-	closelog();
+/* Take back the connections the workers are done with. */
+static void
+conn_collect (void)
+{
+  struct saned_conn *c, *next;
+  char buf[64];
 
-      for (i = 3; i < fd; i++)
-	close(i);
+  while (read (conn_wake[0], buf, sizeof (buf)) > 0)
+    ;
 
-      if (log_to_syslog)
-	openlog ("saned", LOG_PID | LOG_CONS, LOG_DAEMON);
+  pthread_mutex_lock (&conn_queue_lock);
+  c = done_queue;
+  done_queue = NULL;
+  pthread_mutex_unlock (&conn_queue_lock);
 
-      handle_connection (fd);
-      quit (0);
+  for (; c; c = next)
+    {
+      next = c->next;
+      if (c->closed)
+	{
+	  c->fd = -1;
+	  num_conns--;
+	}
+      else
+	conn_arm (c);
     }
-  else if (pid > 0)
+}
+
+/* Drop the connections that have been idle for too long.  Checked once
+   a second at most. */
+static void
+conn_expire (void)
+{
+  static time_t last_check;
+  time_t now = time (NULL);
+  int i;
+
+  if (now == last_check)
+    return;
+  last_check = now;
+
+  for (i = 0; i < max_conns; i++)
+    if (conns[i].fd >= 0 && conns[i].armed
+	&& now - conns[i].last_active >= SANED_IDLE_TIMEOUT)
+      {
+	conns[i].expired = 1;
+	conn_ready (i);
+      }
+}
+
+static void
+add_client (int fd)
+{
+  struct saned_conn *c;
+
+  if (num_conns >= max_conns)
     {
-      /* parent */
-      add_child (pid);
-      close(fd);
+      DBG (DBG_WARN, "add_client: %d clients connected already; closing "
+	   "connection\n", num_conns);
+      close (fd);
+      return;
     }
-  else
+
+  for (c = conns; c->fd >= 0; c++)
+    ;
+  memset (c, 0, sizeof (*c));
+  c->fd = fd;
+  c->last_active = time (NULL);
+  c->last_handle_checked = -1;
+  c->default_username = saned_default_username;
+  c->watch[CONN_CTL].fd = fd;
+  c->watch[CONN_CTL].events = POLLIN;
+  c->watch[CONN_DATA].fd = -1;
+  c->watch[CONN_BACKEND].fd = -1;
+  num_conns++;
+
+  DBG (DBG_DBG, "add_client: %d clients connected\n", num_conns);
+  conn_arm (c);
+}
+
+/* Wait for the listening sockets and the connections when epoll isn't
+   available; the poll() set is rebuilt every time. */
+static int
+conn_poll (struct pollfd *fds, int nfds, int timeout)
+{
+  static struct pollfd *pfds;
+  static int *slots, size;
+  int i, j, n, ret;
+
+  n = nfds + 1 + num_conns * CONN_NFDS;
+  if (n > size)
     {
-      /* FAILED */
-      DBG (DBG_ERR, "handle_client: fork() failed: %s\n", strerror (errno));
-      close(fd);
+      struct pollfd *p = realloc (pfds, n * sizeof (pfds[0]));
+      int *s;
+
+      if (p)
+	pfds = p;
+      s = realloc (slots, n * sizeof (slots[0]));
+      if (s)
+	slots = s;
+      if (!p || !s)
+	{
+	  DBG (DBG_ERR, "conn_poll: out of memory\n");
+	  return poll (fds, nfds, timeout);
+	}
+      size = n;
     }
+
+  memcpy (pfds, fds, nfds * sizeof (pfds[0]));
+  n = nfds;
+  pfds[n].fd = conn_wake[0];
+  pfds[n].events = POLLIN;
+  n++;
+  for (i = 0; i < max_conns; i++)
+    if (conns[i].fd >= 0 && conns[i].armed)
+      for (j = 0; j < CONN_NFDS; j++)
+	if (conns[i].watch[j].fd >= 0)
+	  {
+	    pfds[n] = conns[i].watch[j];
+	    slots[n] = i;
+	    n++;
+	  }
+
+  ret = poll (pfds, n, timeout);
+  if (ret <= 0)
+    return ret;
+
+  for (i = 0; i < nfds; i++)
+    fds[i].revents = pfds[i].revents;
+  for (i = nfds + 1; i < n; i++)
+    if (pfds[i].revents)
+      conn_ready (slots[i]);
+  if (pfds[nfds].revents)
+    conn_collect ();
+
+  return ret;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* (Re)register the wakeup pipe and the waiting connections with a new
+   epoll set. */
+static int
+conn_events_init (void)
+{
+  struct epoll_event ev;
+  int i;
+
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = SANED_EVENT_WAKE;
+  if (epoll_ctl (listen_epfd, EPOLL_CTL_ADD, conn_wake[0], &ev) < 0)
+    return -1;
+
+  for (i = 0; i < max_conns; i++)
+    if (conns[i].fd >= 0 && conns[i].armed)
+      conn_arm (&conns[i]);
+  return 0;
 }
+#endif /* HAVE_SYS_EPOLL_H */
+#endif /* SANED_WITH_THREADS */
 
 static void
 bail_out (int error)
@@ -2697,6 +4332,79 @@ read_config (void)
                   DBG (DBG_INFO, "read_config: data port range: %d - %d\n", data_port_lo, data_port_hi);
                 }
             }
+          else if (strstr(config_line, "threads") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              if ((optval != NULL) && (*optval != '\0'))
+                {
+		  val = strtol (optval, &endval, 10);
+		  if ((optval == endval) || (val < 0) || (val > SANED_THREADS_MAX))
+		    {
+		      DBG (DBG_ERR, "read_config: threads must be between 0 and %d\n",
+			   SANED_THREADS_MAX);
+		      continue;
+		    }
+#ifdef SANED_WITH_THREADS
+		  num_threads = val;
+                  DBG (DBG_INFO, "read_config: worker threads: %d\n", num_threads);
+#else
+		  if (val > 0)
+		    DBG (DBG_WARN, "read_config: threads option ignored, saned was built without thread support\n");
+#endif
+                }
+            }
+          else if (strstr(config_line, "compression") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              if ((optval != NULL) && (*optval != '\0'))
+                {
+		  if (strncmp (optval, "none", 4) == 0)
+		    max_compression = SANE_NET_COMPRESSION_NONE;
+		  else if (strncmp (optval, "fast", 4) == 0)
+		    max_compression = SANE_NET_COMPRESSION_FAST;
+		  else if (strncmp (optval, "best", 4) == 0)
+		    max_compression = SANE_NET_COMPRESSION_BEST;
+		  else
+		    {
+		      DBG (DBG_ERR, "read_config: compression must be none, fast or best\n");
+		      continue;
+		    }
+#ifndef HAVE_LIBZ
+		  if (max_compression != SANE_NET_COMPRESSION_NONE)
+		    DBG (DBG_WARN, "read_config: compression ignored, saned was built without zlib\n");
+#endif
+                  DBG (DBG_INFO, "read_config: maximum compression: %s\n",
+		       compression_name (max_compression));
+                }
+            }
+          else if (strstr(config_line, "data_buffer_size") != NULL)
+            {
+              optval = sanei_config_skip_whitespace (++optval);
+              if ((optval != NULL) && (*optval != '\0'))
+                {
+		  val = strtol (optval, &endval, 10);
+		  if (optval == endval)
+		    {
+		      DBG (DBG_ERR, "read_config: invalid value for data_buffer_size\n");
+		      continue;
+		    }
+		  if (*endval == 'k' || *endval == 'K')
+		    val *= 1024;
+		  else if (*endval == 'm' || *endval == 'M')
+		    val *= 1024 * 1024;
+
+		  if ((val < SANED_DATA_BUFFER_MIN) || (val > SANED_DATA_BUFFER_MAX))
+		    {
+		      DBG (DBG_ERR, "read_config: data_buffer_size must be between %d and %d bytes\n",
+			   SANED_DATA_BUFFER_MIN, SANED_DATA_BUFFER_MAX);
+		      continue;
+		    }
+
+		  data_buffer_size = val;
+
+                  DBG (DBG_INFO, "read_config: data buffer size: %lu\n", (u_long) data_buffer_size);
+                }
+            }
         }
       fclose (fp);
       DBG (DBG_INFO, "read_config: done reading config\n");
@@ -2922,6 +4630,114 @@ do_bindings (int *nfds, struct pollfd **fds)
 #endif /* SANED_USES_AF_INDEP */
 
 
+/*
+ * Readiness notification for the listening sockets.  With epoll the
+ * kernel keeps the interest set, so each wakeup only reports the
+ * sockets that are actually ready; otherwise fall back to poll().
+ * Either way, ready sockets are flagged in fds[].revents.
+ */
+static void
+listen_events_init (struct pollfd *fds, int nfds)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+  int i;
+
+  listen_epfd = epoll_create (nfds > 0 ? nfds : 1);
+  if (listen_epfd < 0)
+    {
+      DBG (DBG_WARN, "listen_events_init: epoll_create failed (%s), using poll\n",
+	   strerror (errno));
+      return;
+    }
+  fcntl (listen_epfd, F_SETFD, FD_CLOEXEC);
+
+  for (i = 0; i < nfds; i++)
+    {
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.u32 = i;
+      if (epoll_ctl (listen_epfd, EPOLL_CTL_ADD, fds[i].fd, &ev) < 0)
+	{
+	  DBG (DBG_WARN, "listen_events_init: epoll_ctl failed (%s), using poll\n",
+	       strerror (errno));
+	  close (listen_epfd);
+	  listen_epfd = -1;
+	  return;
+	}
+    }
+#ifdef SANED_WITH_THREADS
+  if (num_threads > 0 && conn_events_init () < 0)
+    {
+      DBG (DBG_WARN, "listen_events_init: epoll_ctl failed (%s), using poll\n",
+	   strerror (errno));
+      close (listen_epfd);
+      listen_epfd = -1;
+      return;
+    }
+#endif
+  DBG (DBG_DBG, "listen_events_init: using epoll for %d sockets\n", nfds);
+#else
+  (void) fds;
+  (void) nfds;
+#endif
+}
+
+static int
+listen_events_wait (struct pollfd *fds, int nfds, int timeout)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event events[64];
+  int i, ret;
+#ifdef SANED_WITH_THREADS
+  int woken = 0;
+#endif
+
+  if (listen_epfd >= 0)
+    {
+      for (i = 0; i < nfds; i++)
+	fds[i].revents = 0;
+
+      ret = epoll_wait (listen_epfd, events, 64, timeout);
+      for (i = 0; i < ret; i++)
+	{
+	  struct pollfd *fdp;
+
+#ifdef SANED_WITH_THREADS
+	  if (events[i].data.u32 == SANED_EVENT_WAKE)
+	    {
+	      woken = 1;
+	      continue;
+	    }
+	  if (events[i].data.u32 & SANED_EVENT_CONN)
+	    {
+	      conn_ready (events[i].data.u32 & ~SANED_EVENT_CONN);
+	      continue;
+	    }
+#endif
+	  fdp = &fds[events[i].data.u32];
+	  if (events[i].events & EPOLLIN)
+	    fdp->revents |= POLLIN;
+	  if (events[i].events & EPOLLERR)
+	    fdp->revents |= POLLERR;
+	  if (events[i].events & EPOLLHUP)
+	    fdp->revents |= POLLHUP;
+	}
+#ifdef SANED_WITH_THREADS
+      if (woken)
+	conn_collect ();
+#endif
+      return ret;
+    }
+#endif
+#ifdef SANED_WITH_THREADS
+  if (num_threads > 0)
+    return conn_poll (fds, nfds, timeout);
+#endif
+  return poll (fds, nfds, timeout);
+}
+
+
 static void
 run_standalone (int argc, char **argv)
 {
@@ -3095,11 +4911,23 @@ run_standalone (int argc, char **argv)
   /* NOT REACHED (Avahi process) */
 #endif /* WITH_AVAHI */
 
+#ifdef SANED_WITH_THREADS
+  if (run_mode != SANED_RUN_ALONE)
+    num_threads = 0;
+  else if (num_threads > 0 && start_workers () < 0)
+    {
+      DBG (DBG_WARN, "run_standalone: falling back to one process per client\n");
+      num_threads = 0;
+    }
+#endif
+
   DBG (DBG_MSG, "run_standalone: waiting for control connection\n");
 
+  listen_events_init (fds, nfds);
+
   while (1)
     {
-      ret = poll (fds, nfds, 500);
+      ret = listen_events_wait (fds, nfds, 500);
       if (ret < 0)
 	{
 	  if (errno == EINTR)
@@ -3107,6 +4935,7 @@ run_standalone (int argc, char **argv)
 	  else
 	    {
 	      DBG (DBG_ERR, "run_standalone: poll failed: %s\n", strerror (errno));
+	      listen_events_exit ();
 	      free (fds);
 	      bail_out (1);
 	    }
@@ -3115,6 +4944,10 @@ run_standalone (int argc, char **argv)
       /* Wait for children */
       while (wait_child (-1, NULL, WNOHANG) > 0)
 	;
+#ifdef SANED_WITH_THREADS
+      if (num_threads > 0)
+	conn_expire ();
+#endif
 
       if (ret == 0)
 	continue;
@@ -3124,6 +4957,8 @@ run_standalone (int argc, char **argv)
 	  /* Error on an fd */
 	  if (fdp->revents & (POLLERR | POLLHUP | POLLNVAL))
 	    {
+	      listen_events_exit ();
+
 	      for (i = 0, fdp = fds; i < nfds; i++, fdp++)
 		close (fdp->fd);
 
@@ -3133,6 +4968,7 @@ run_standalone (int argc, char **argv)
 
 	      /* Reopen sockets */
 	      do_bindings (&nfds, &fds);
+	      listen_events_init (fds, nfds);
 
 	      break;
 	    }
@@ -3148,6 +4984,10 @@ run_standalone (int argc, char **argv)
 
 	  if (run_mode == SANED_RUN_DEBUG)
 	    break; /* We have the only connection we're going to handle */
+#ifdef SANED_WITH_THREADS
+	  else if (num_threads > 0)
+	    add_client (fd);
+#endif
 	  else
 	    handle_client (fd);
 	}
@@ -3156,6 +4996,8 @@ run_standalone (int argc, char **argv)
 	break;
     }
 
+  listen_events_exit ();
+
   for (i = 0, fdp = fds; i < nfds; i++, fdp++)
     close (fdp->fd);
 
@@ -3309,6 +5151,12 @@ main (int argc, char *argv[])
 
   read_config ();
 
+  /* let the backends offer compressed frames; they go unchanged to the
+   * clients that ask for them in SANE_NET_INIT and are hidden from the
+   * others, see hide_compressed_values() */
+  if (!getenv (SANEI_COMPRESSED_FRAMES_ENV))
+    putenv (compressed_frames_env);
+
   byte_order.w = 0;
   byte_order.ch = 1;
 
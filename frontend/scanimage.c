@@ -37,20 +37,39 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <errno.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#ifdef HAVE_MMAP
+# include <sys/mman.h>
+#endif
 
 #include "../include/_stdint.h"
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei.h"
 #include "../include/sane/saneopts.h"
+#include "../include/sane/sanei_thread.h"
+#include "../include/sane/sanei_shm_channel.h"
 
 #include "stiff.h"
 
 #include "../include/md5.h"
 
+#ifdef HAVE_LIBZ
+# include <zlib.h>
+#endif
+#ifdef HAVE_LIBJPEG
+# include <jpeglib.h>
+#endif
+
+#if defined(USE_PTHREAD) && defined(HAVE_PTHREAD_H)
+# include <pthread.h>
+# define SCANIMAGE_WITH_THREADS
+#endif
+
 #ifndef PATH_MAX
 #define PATH_MAX 1024
 #endif
@@ -63,12 +82,25 @@ typedef struct
 {
   uint8_t *data;
   int width;    /*WARNING: this is in bytes, get pixel width from param*/
-  int height;
-  int x;
-  int y;
+  int height;			/* lines that fit in data */
+  int y;			/* lines received so far */
+  size_t size;			/* bytes allocated or mapped at data */
+  FILE *spill;			/* file mapped at data, NULL if malloc'ed */
 }
 Image;
 
+/* a scanned page waiting to be written in pipelined batch mode */
+typedef struct Page
+{
+  Image image;
+  SANE_Parameters parm;
+  char path[PATH_MAX];
+  char part_path[PATH_MAX];
+  int print;			/* --batch-print */
+  struct Page *next;
+}
+Page;
+
 #define OPTION_FORMAT   1001
 #define OPTION_MD5	1002
 #define OPTION_BATCH_COUNT	1003
@@ -77,6 +109,10 @@ Image;
 #define OPTION_BATCH_INCREMENT	1006
 #define OPTION_BATCH_PROMPT    1007
 #define OPTION_BATCH_PRINT     1008
+#define OPTION_ASYNC_WRITE     1009
+#define OPTION_BATCH_QUEUE     1010
+#define OPTION_COMPRESSION     1011
+#define OPTION_BENCHMARK       1012
 
 #define BATCH_COUNT_UNLIMITED -1
 
@@ -88,9 +124,11 @@ static struct option basic_options[] = {
   {"verbose", no_argument, NULL, 'v'},
   {"progress", no_argument, NULL, 'p'},
   {"test", no_argument, NULL, 'T'},
+  {"benchmark", optional_argument, NULL, OPTION_BENCHMARK},
   {"all-options", no_argument, NULL, 'A'},
   {"version", no_argument, NULL, 'V'},
   {"buffer-size", optional_argument, NULL, 'B'},
+  {"async-write", optional_argument, NULL, OPTION_ASYNC_WRITE},
   {"batch", optional_argument, NULL, 'b'},
   {"batch-count", required_argument, NULL, OPTION_BATCH_COUNT},
   {"batch-start", required_argument, NULL, OPTION_BATCH_START_AT},
@@ -98,7 +136,9 @@ static struct option basic_options[] = {
   {"batch-increment", required_argument, NULL, OPTION_BATCH_INCREMENT},
   {"batch-print", no_argument, NULL, OPTION_BATCH_PRINT},
   {"batch-prompt", no_argument, NULL, OPTION_BATCH_PROMPT},
+  {"batch-queue", optional_argument, NULL, OPTION_BATCH_QUEUE},
   {"format", required_argument, NULL, OPTION_FORMAT},
+  {"compression-level", required_argument, NULL, OPTION_COMPRESSION},
   {"accept-md5-only", no_argument, NULL, OPTION_MD5},
   {"icc-profile", required_argument, NULL, 'i'},
   {"dont-scan", no_argument, NULL, 'n'},
@@ -107,9 +147,12 @@ static struct option basic_options[] = {
 
 #define OUTPUT_PNM      0
 #define OUTPUT_TIFF     1
+#define OUTPUT_PNG      2
+#define OUTPUT_JPEG     3
+#define OUTPUT_TIFF_DEFLATE 4
 
 #define BASE_OPTSTRING	"d:hi:Lf:B::nvVTAbp"
-#define STRIP_HEIGHT	256	/* # lines we increment image height */
+#define SPILL_CHUNK	(2 * 1024 * 1024)	/* image buffer granularity */
 
 static struct option *all_options;
 static int option_number_len;
@@ -118,8 +161,11 @@ static SANE_Handle device;
 static int verbose;
 static int progress = 0;
 static int test;
+static int benchmark;		/* number of scans for --benchmark */
 static int all;
 static int output_format = OUTPUT_PNM;
+/* with jpeg output, backends may send their JPEG data as it is */
+static char compressed_frames_env[] = SANEI_COMPRESSED_FRAMES_ENV "=jpeg";
 static int help;
 static int dont_scan = 0;
 static const char *prog_name;
@@ -144,6 +190,31 @@ static SANE_Word br_y = 0;
 static SANE_Byte *buffer;
 static size_t buffer_size;
 
+/* --async-write: a writer task drains filled buffers to the output file
+   while scan_it() keeps calling sane_read() */
+static int async_buffers = 0;	/* number of buffers, 0 writes directly */
+static SANEI_Shm_Channel *async_channel;
+static SANE_Pid async_pid;
+static FILE *async_ofp;
+static SANE_Int async_id = -1;	/* buffer being filled, if any */
+static SANE_Byte *async_data;
+static size_t async_fill;
+static double async_stall;	/* time sane_read() waited for the writer */
+
+/* --batch-queue: pages are kept in memory and written by a page writer
+   thread while the next one is scanned */
+static int batch_queue = 0;	/* pages that may wait, 0 writes in turn */
+#ifdef SCANIMAGE_WITH_THREADS
+static Page *page_queue, *page_queue_tail;
+static int page_queue_len;	/* pages queued or being written */
+static int page_queue_done;	/* no more pages will be queued */
+static SANE_Status page_queue_status = SANE_STATUS_GOOD;
+static pthread_t page_writer_thread;
+static int page_writer_running;
+static pthread_mutex_t page_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t page_queue_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
 
 static void
 auth_callback (SANE_String_Const resource,
@@ -1156,176 +1227,956 @@ write_pnm_header (SANE_Frame format, int width, int height, int depth, FILE *ofp
 #endif
 }
 
-static void *
-advance (Image * image)
+/* PNG, JPEG and deflate compressed TIFF output, compressed line by line
+   as the data comes in */
+
+/* png filter types */
+#define PNG_FILTER_NONE	0
+#define PNG_FILTER_SUB	1
+
+#define ZBUF_SIZE	(64 * 1024)
+
+typedef struct
+{
+  int format;			/* OUTPUT_*, 0 when not in use */
+  SANE_Parameters parm;
+  int height;			/* as announced, -1 if not known */
+  int lines;			/* lines compressed so far */
+  int bpl;			/* bytes per line from the backend */
+  FILE *ofp;			/* where the file has to end up */
+  FILE *out;			/* where it is written, a temporary file if
+				   ofp can't seek back to the header */
+  long start;			/* offset of the file in out */
+  SANE_Byte *line;		/* one line as it comes from the backend */
+  int fill;			/* bytes in line */
+  SANE_Byte *conv;		/* the line as the format wants it */
+  long compressed;		/* bytes of compressed image data */
+#ifdef HAVE_LIBZ
+  z_stream zs;
+  Bytef *zbuf;
+#endif
+#ifdef HAVE_LIBJPEG
+  struct jpeg_compress_struct cinfo;
+  struct jpeg_error_mgr jerr;
+#endif
+}
+Encoder;
+
+static Encoder stream_encoder;	/* used while scan_it() streams a page */
+static int compression_level = -1;	/* -1 for the default of the format */
+
+static int
+encoder_channels (const SANE_Parameters * parm)
+{
+  return parm->format == SANE_FRAME_GRAY ? 1 : 3;
+}
+
+#ifdef HAVE_LIBZ
+static void
+put_be32 (Bytef * p, uLong val)
+{
+  p[0] = (val >> 24) & 0xff;
+  p[1] = (val >> 16) & 0xff;
+  p[2] = (val >> 8) & 0xff;
+  p[3] = val & 0xff;
+}
+
+static void
+write_png_chunk (FILE *out, const char *type, const Bytef * data, uInt len)
+{
+  Bytef head[8];
+  uLong crc;
+
+  put_be32 (head, len);
+  memcpy (head + 4, type, 4);
+  crc = crc32 (0, head + 4, 4);
+  if (len)
+    crc = crc32 (crc, data, len);
+  fwrite (head, 1, 8, out);
+  if (len)
+    fwrite (data, 1, len, out);
+  put_be32 (head, crc);
+  fwrite (head, 1, 4, out);
+}
+
+static void
+write_png_ihdr (Encoder * enc, int height)
+{
+  Bytef ihdr[13];
+
+  put_be32 (ihdr, enc->parm.pixels_per_line);
+  put_be32 (ihdr + 4, height);
+  ihdr[8] = enc->parm.depth;
+  ihdr[9] = encoder_channels (&enc->parm) == 1 ? 0 : 2;	/* gray, RGB */
+  ihdr[10] = 0;			/* deflate */
+  ihdr[11] = 0;			/* adaptive filtering */
+  ihdr[12] = 0;			/* no interlace */
+  write_png_chunk (enc->out, "IHDR", ihdr, sizeof (ihdr));
+}
+
+static void
+write_png_header (Encoder * enc)
 {
-  if (++image->x >= image->width)
+  static const Bytef signature[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+  Bytef phys[9];
+
+  fwrite (signature, 1, sizeof (signature), enc->out);
+  write_png_ihdr (enc, enc->height < 0 ? 0 : enc->height);
+
+  if (resolution_value > 0)
     {
-      image->x = 0;
-      if (++image->y >= image->height || !image->data)
-	{
-	  size_t old_size = 0, new_size;
+      /* pixels per meter */
+      uLong ppm = (resolution_value * 10000L + 127) / 254;
 
-	  if (image->data)
-	    old_size = image->height * image->width;
+      put_be32 (phys, ppm);
+      put_be32 (phys + 4, ppm);
+      phys[8] = 1;
+      write_png_chunk (enc->out, "pHYs", phys, sizeof (phys));
+    }
+}
 
-	  image->height += STRIP_HEIGHT;
-	  new_size = image->height * image->width;
+/* compress, and write out whatever the output buffer has gathered */
+static void
+deflate_data (Encoder * enc, Bytef * data, uInt len, int flush)
+{
+  uInt n;
+  int ret;
 
-	  if (image->data)
-	    image->data = realloc (image->data, new_size);
+  enc->zs.next_in = data;
+  enc->zs.avail_in = len;
+  do
+    {
+      ret = deflate (&enc->zs, flush);
+      n = ZBUF_SIZE - enc->zs.avail_out;
+      if (n && (enc->zs.avail_out == 0 || flush == Z_FINISH))
+	{
+	  if (enc->format == OUTPUT_PNG)
+	    write_png_chunk (enc->out, "IDAT", enc->zbuf, n);
 	  else
-	    image->data = malloc (new_size);
-	  if (image->data)
-	    memset (image->data + old_size, 0, new_size - old_size);
+	    fwrite (enc->zbuf, 1, n, enc->out);
+	  enc->compressed += n;
+	  enc->zs.next_out = enc->zbuf;
+	  enc->zs.avail_out = ZBUF_SIZE;
 	}
     }
-  if (!image->data)
-    fprintf (stderr, "%s: can't allocate image buffer (%dx%d)\n",
-	     prog_name, image->width, image->height);
-  return image->data;
+  while (ret == Z_OK && (enc->zs.avail_in > 0 || flush == Z_FINISH));
 }
 
-static SANE_Status
-scan_it (FILE *ofp)
+/* one line in png order: black is 0, 16 bit samples are big endian, and
+   every line starts with its filter type */
+static void
+png_line (Encoder * enc)
 {
-  int i, len, first_frame = 1, offset = 0, must_buffer = 0, hundred_percent;
-  SANE_Byte min = 0xff, max = 0;
-  SANE_Parameters parm;
-  SANE_Status status;
-  Image image = { 0, 0, 0, 0, 0 };
-  static const char *format_name[] = {
-    "gray", "RGB", "red", "green", "blue"
-  };
-  SANE_Word total_bytes = 0, expected_bytes;
-  SANE_Int hang_over = -1;
+  SANE_Byte *dst = enc->conv + 1;
+  int i, bpp;
 
-  do
+  if (enc->parm.depth == 1)
     {
-      if (!first_frame)
-	{
-#ifdef SANE_STATUS_WARMING_UP
-          do
-	    {
-	      status = sane_start (device);
-	    }
-	  while(status == SANE_STATUS_WARMING_UP);
-#else
-	  status = sane_start (device);
+      for (i = 0; i < enc->bpl; i++)
+	dst[i] = ~enc->line[i];
+      enc->conv[0] = PNG_FILTER_NONE;
+      return;
+    }
+
+#if !defined(WORDS_BIGENDIAN)
+  if (enc->parm.depth == 16)
+    for (i = 0; i < enc->bpl - 1; i += 2)
+      {
+	dst[i] = enc->line[i + 1];
+	dst[i + 1] = enc->line[i];
+      }
+  else
 #endif
-	  if (status != SANE_STATUS_GOOD)
+    memcpy (dst, enc->line, enc->bpl);
+
+  /* the sub filter is cheap and helps deflate a lot on scanned images */
+  bpp = encoder_channels (&enc->parm) * enc->parm.depth / 8;
+  for (i = enc->bpl - 1; i >= bpp; i--)
+    dst[i] -= dst[i - bpp];
+  enc->conv[0] = PNG_FILTER_SUB;
+}
+#endif /* HAVE_LIBZ */
+
+#ifdef HAVE_LIBJPEG
+/* one line as 8 bit samples */
+static void
+jpeg_line (Encoder * enc)
+{
+  int i, n = enc->parm.pixels_per_line * encoder_channels (&enc->parm);
+
+  if (enc->parm.depth == 1)
+    for (i = 0; i < n; i++)
+      enc->conv[i] = (enc->line[i >> 3] & (0x80 >> (i & 7))) ? 0 : 255;
+  else if (enc->parm.depth == 16)
+    for (i = 0; i < n; i++)
+      enc->conv[i] = ((uint16_t *) enc->line)[i] >> 8;
+}
+#endif
+
+static void
+encode_line (Encoder * enc)
+{
+  if (enc->height >= 0 && enc->lines >= enc->height)
+    return;			/* more than announced */
+
+  switch (enc->format)
+    {
+#ifdef HAVE_LIBZ
+    case OUTPUT_PNG:
+      png_line (enc);
+      deflate_data (enc, enc->conv, enc->bpl + 1, Z_NO_FLUSH);
+      break;
+
+    case OUTPUT_TIFF_DEFLATE:
+      deflate_data (enc, enc->line, enc->bpl, Z_NO_FLUSH);
+      break;
+#endif
+#ifdef HAVE_LIBJPEG
+    case OUTPUT_JPEG:
+      {
+	JSAMPROW row = enc->line;
+
+	if (enc->parm.depth != 8)
+	  {
+	    jpeg_line (enc);
+	    row = enc->conv;
+	  }
+	jpeg_write_scanlines (&enc->cinfo, &row, 1);
+      }
+      break;
+#endif
+    default:
+      break;
+    }
+  enc->lines++;
+}
+
+static void
+encoder_free (Encoder * enc)
+{
+  if (enc->line)
+    free (enc->line);
+  if (enc->conv)
+    free (enc->conv);
+#ifdef HAVE_LIBZ
+  if (enc->zbuf)
+    {
+      deflateEnd (&enc->zs);
+      free (enc->zbuf);
+    }
+#endif
+#ifdef HAVE_LIBJPEG
+  if (enc->format == OUTPUT_JPEG)
+    jpeg_destroy_compress (&enc->cinfo);
+#endif
+  if (enc->out && enc->out != enc->ofp)
+    fclose (enc->out);
+  memset (enc, 0, sizeof (*enc));
+}
+
+/* Start a compressed file; height is -1 if not known yet.  JPEG needs to
+   know the height. */
+static SANE_Status
+encoder_start (Encoder * enc, FILE *ofp, const SANE_Parameters * parm,
+	       int height)
+{
+  memset (enc, 0, sizeof (*enc));
+  enc->format = output_format;
+  enc->parm = *parm;
+  enc->height = height;
+  enc->ofp = enc->out = ofp;
+
+  /* separate color frames are put together into one RGB image */
+  enc->bpl = parm->bytes_per_line;
+  if (parm->format >= SANE_FRAME_RED && parm->format <= SANE_FRAME_BLUE)
+    enc->bpl = 3 * parm->pixels_per_line;
+
+  /* the header is finished at the end, which needs a file to seek in */
+  if (enc->format == OUTPUT_TIFF_DEFLATE
+      || (enc->format == OUTPUT_PNG && height < 0))
+    {
+      fflush (ofp);
+      enc->start = ftell (ofp);
+      if (enc->start < 0 || fseek (ofp, enc->start, SEEK_SET) != 0)
+	{
+	  enc->out = tmpfile ();
+	  enc->start = 0;
+	  if (!enc->out)
 	    {
-	      fprintf (stderr, "%s: sane_start: %s\n",
-		       prog_name, sane_strstatus (status));
-	      goto cleanup;
+	      fprintf (stderr, "%s: can't create temporary file: %s\n",
+		       prog_name, strerror (errno));
+	      encoder_free (enc);
+	      return SANE_STATUS_IO_ERROR;
 	    }
 	}
+    }
 
-      status = sane_get_parameters (device, &parm);
-      if (status != SANE_STATUS_GOOD)
+  enc->line = malloc (enc->bpl);
+  enc->conv = malloc (8 * enc->bpl + 1);
+  if (!enc->line || !enc->conv)
+    {
+      encoder_free (enc);
+      return SANE_STATUS_NO_MEM;
+    }
+
+  switch (enc->format)
+    {
+#ifdef HAVE_LIBZ
+    case OUTPUT_PNG:
+    case OUTPUT_TIFF_DEFLATE:
+      enc->zbuf = malloc (ZBUF_SIZE);
+      if (!enc->zbuf
+	  || deflateInit (&enc->zs, compression_level > 9 ? 9
+			  : compression_level) != Z_OK)
 	{
-	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
-		   prog_name, sane_strstatus (status));
-	  goto cleanup;
+	  if (enc->zbuf)
+	    free (enc->zbuf);
+	  enc->zbuf = NULL;
+	  encoder_free (enc);
+	  return SANE_STATUS_NO_MEM;
 	}
+      enc->zs.next_out = enc->zbuf;
+      enc->zs.avail_out = ZBUF_SIZE;
 
-      if (verbose)
+      if (enc->format == OUTPUT_PNG)
+	write_png_header (enc);
+      else
+	sanei_write_tiff_header_compressed (parm->format,
+					    parm->pixels_per_line,
+					    height < 0 ? 0 : height,
+					    parm->depth, resolution_value,
+					    icc_profile,
+					    TIFF_COMPRESSION_DEFLATE, 0,
+					    enc->out);
+      break;
+#endif
+#ifdef HAVE_LIBJPEG
+    case OUTPUT_JPEG:
+      assert (height > 0);
+      enc->cinfo.err = jpeg_std_error (&enc->jerr);
+      jpeg_create_compress (&enc->cinfo);
+      jpeg_stdio_dest (&enc->cinfo, enc->out);
+      enc->cinfo.image_width = parm->pixels_per_line;
+      enc->cinfo.image_height = height;
+      enc->cinfo.input_components = encoder_channels (parm);
+      enc->cinfo.in_color_space =
+	enc->cinfo.input_components == 1 ? JCS_GRAYSCALE : JCS_RGB;
+      jpeg_set_defaults (&enc->cinfo);
+      if (compression_level >= 0)
+	jpeg_set_quality (&enc->cinfo, compression_level, TRUE);
+      if (resolution_value > 0)
 	{
-	  if (first_frame)
-	    {
-	      if (parm.lines >= 0)
-		fprintf (stderr, "%s: scanning image of size %dx%d pixels at "
-			 "%d bits/pixel\n",
-			 prog_name, parm.pixels_per_line, parm.lines,
-			 8 * parm.bytes_per_line / parm.pixels_per_line);
-	      else
-		fprintf (stderr, "%s: scanning image %d pixels wide and "
-			 "variable height at %d bits/pixel\n",
-			 prog_name, parm.pixels_per_line,
-			 8 * parm.bytes_per_line / parm.pixels_per_line);
-	    }
+	  enc->cinfo.density_unit = 1;	/* dots per inch */
+	  enc->cinfo.X_density = resolution_value;
+	  enc->cinfo.Y_density = resolution_value;
+	}
+      jpeg_start_compress (&enc->cinfo, TRUE);
+      break;
+#endif
+    default:
+      encoder_free (enc);
+      return SANE_STATUS_UNSUPPORTED;
+    }
 
-	  fprintf (stderr, "%s: acquiring %s frame\n", prog_name,
-	   parm.format <= SANE_FRAME_BLUE ? format_name[parm.format]:"Unknown");
+  return SANE_STATUS_GOOD;
+}
+
+static SANE_Status
+encoder_write (Encoder * enc, const SANE_Byte * data, size_t len)
+{
+  size_t n;
+
+  while (len > 0)
+    {
+      n = enc->bpl - enc->fill;
+      if (n > len)
+	n = len;
+      memcpy (enc->line + enc->fill, data, n);
+      enc->fill += n;
+      data += n;
+      len -= n;
+
+      if (enc->fill == enc->bpl)
+	{
+	  encode_line (enc);
+	  enc->fill = 0;
 	}
+    }
 
-      if (first_frame)
+  return ferror (enc->out) ? SANE_STATUS_IO_ERROR : SANE_STATUS_GOOD;
+}
+
+/* Complete the file.  Missing lines of an image with known height are
+   filled with zeros, the header of one without is finished now. */
+static SANE_Status
+encoder_finish (Encoder * enc)
+{
+  SANE_Status status = SANE_STATUS_GOOD;
+  char copy[8192];
+  size_t n;
+
+  if (enc->height >= 0)
+    {
+      memset (enc->line, 0, enc->bpl);
+      while (enc->lines < enc->height)
+	encode_line (enc);
+    }
+
+  switch (enc->format)
+    {
+#ifdef HAVE_LIBZ
+    case OUTPUT_PNG:
+      deflate_data (enc, NULL, 0, Z_FINISH);
+      write_png_chunk (enc->out, "IEND", NULL, 0);
+      if (enc->height < 0)
 	{
-	  switch (parm.format)
-	    {
-	    case SANE_FRAME_RED:
-	    case SANE_FRAME_GREEN:
-	    case SANE_FRAME_BLUE:
-	      assert (parm.depth == 8);
-	      must_buffer = 1;
-	      offset = parm.format - SANE_FRAME_RED;
-	      break;
+	  /* the IHDR chunk follows the signature */
+	  fseek (enc->out, enc->start + 8, SEEK_SET);
+	  write_png_ihdr (enc, enc->lines);
+	}
+      break;
 
-	    case SANE_FRAME_RGB:
-	      assert ((parm.depth == 8) || (parm.depth == 16));
-	    case SANE_FRAME_GRAY:
-	      assert ((parm.depth == 1) || (parm.depth == 8)
-		      || (parm.depth == 16));
-	      if (parm.lines < 0)
-		{
-		  must_buffer = 1;
-		  offset = 0;
-		}
-	      else
-		{
-		  if (output_format == OUTPUT_TIFF)
-		    sanei_write_tiff_header (parm.format,
-					     parm.pixels_per_line, parm.lines,
-					     parm.depth, resolution_value,
-					     icc_profile, ofp);
-		  else
-		    write_pnm_header (parm.format, parm.pixels_per_line,
-				      parm.lines, parm.depth, ofp);
-		}
-	      break;
+    case OUTPUT_TIFF_DEFLATE:
+      deflate_data (enc, NULL, 0, Z_FINISH);
+      fseek (enc->out, enc->start, SEEK_SET);
+      sanei_write_tiff_header_compressed (enc->parm.format,
+					  enc->parm.pixels_per_line,
+					  enc->lines, enc->parm.depth,
+					  resolution_value, icc_profile,
+					  TIFF_COMPRESSION_DEFLATE,
+					  enc->compressed, enc->out);
+      break;
+#endif
+#ifdef HAVE_LIBJPEG
+    case OUTPUT_JPEG:
+      jpeg_finish_compress (&enc->cinfo);
+      break;
+#endif
+    default:
+      break;
+    }
 
-            default:
-	      break;
-	    }
+  if (fflush (enc->out) != 0 || ferror (enc->out))
+    status = SANE_STATUS_IO_ERROR;
 
-	  if (must_buffer)
-	    {
-	      /* We're either scanning a multi-frame image or the
-		 scanner doesn't know what the eventual image height
-		 will be (common for hand-held scanners).  In either
-		 case, we need to buffer all data before we can write
-		 the image.  */
-	      image.width = parm.bytes_per_line;
+  if (enc->out != enc->ofp && status == SANE_STATUS_GOOD)
+    {
+      rewind (enc->out);
+      while ((n = fread (copy, 1, sizeof (copy), enc->out)) > 0)
+	if (fwrite (copy, 1, n, enc->ofp) != n)
+	  {
+	    status = SANE_STATUS_IO_ERROR;
+	    break;
+	  }
+    }
 
-	      if (parm.lines >= 0)
-		/* See advance(); we allocate one extra line so we
-		   don't end up realloc'ing in when the image has been
-		   filled in.  */
-		image.height = parm.lines - STRIP_HEIGHT + 1;
-	      else
-		image.height = 0;
+  encoder_free (enc);
+  return status;
+}
 
-	      image.x = image.width - 1;
-	      image.y = -1;
-	      if (!advance (&image))
-		{
-		  status = SANE_STATUS_NO_MEM;
-		  goto cleanup;
-		}
+/* Make room for at least lines lines in image.  The buffer at least
+   doubles each time it grows, so a page of any length costs a constant
+   amount per line.  Where possible it is a sparse temporary file mapped
+   into memory: growing it then does not copy anything, and the kernel
+   can page out a long scan instead of keeping all of it in RAM. */
+static SANE_Status
+image_reserve (Image * image, int lines)
+{
+  size_t need = (size_t) lines * image->width, size = 2 * image->size;
+  void *data;
+
+  if (need <= image->size)
+    return SANE_STATUS_GOOD;
+  if (size < need)
+    size = (need + SPILL_CHUNK - 1) / SPILL_CHUNK * SPILL_CHUNK;
+
+#ifdef HAVE_MMAP
+  if (!image->data || image->spill)
+    {
+      if (!image->spill)
+	image->spill = tmpfile ();
+      if (image->spill && ftruncate (fileno (image->spill), size) == 0)
+	{
+	  if (image->data)
+	    munmap (image->data, image->size);
+	  data = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		       fileno (image->spill), 0);
+	  image->data = NULL;
+	  if (data != MAP_FAILED)
+	    {
+	      image->data = data;
+	      image->size = size;
+	      image->height = size / image->width;
+	      return SANE_STATUS_GOOD;
 	    }
 	}
-      else
+      /* without a file to keep what is already there, give up */
+      if (image->size)
 	{
-	  assert (parm.format >= SANE_FRAME_RED
-		  && parm.format <= SANE_FRAME_BLUE);
-	  offset = parm.format - SANE_FRAME_RED;
-	  image.x = image.y = 0;
+	  fprintf (stderr, "%s: can't map image buffer (%dx%d): %s\n",
+		   prog_name, image->width, lines, strerror (errno));
+	  return SANE_STATUS_NO_MEM;
 	}
-      hundred_percent = parm.bytes_per_line * parm.lines 
-	* ((parm.format == SANE_FRAME_RGB || parm.format == SANE_FRAME_GRAY) ? 1:3);
+      if (image->spill)
+	fclose (image->spill);
+      image->spill = NULL;
+    }
+#endif
 
-      while (1)
-	{
+  data = realloc (image->data, size);
+  if (!data)
+    {
+      fprintf (stderr, "%s: can't allocate image buffer (%dx%d)\n",
+	       prog_name, image->width, lines);
+      return SANE_STATUS_NO_MEM;
+    }
+  memset ((uint8_t *) data + image->size, 0, size - image->size);
+  image->data = data;
+  image->size = size;
+  image->height = size / image->width;
+  return SANE_STATUS_GOOD;
+}
+
+static void
+image_free (Image * image)
+{
+#ifdef HAVE_MMAP
+  if (image->spill)
+    {
+      if (image->data)
+	munmap (image->data, image->size);
+      image->data = NULL;
+      fclose (image->spill);
+      image->spill = NULL;
+    }
+#endif
+  if (image->data)
+    free (image->data);
+  image->data = NULL;
+  image->size = 0;
+}
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* write image data to the file, or to the encoder if compressing */
+static SANE_Status
+output_data (const SANE_Byte * data, size_t len, FILE *ofp)
+{
+  if (stream_encoder.format)
+    return encoder_write (&stream_encoder, data, len);
+
+  if (fwrite (data, 1, len, ofp) != len)
+    return SANE_STATUS_IO_ERROR;
+  return SANE_STATUS_GOOD;
+}
+
+/* the writer task: write out every buffer scan_it() fills until the
+   channel is closed */
+static int
+async_writer (void *arg)
+{
+  SANE_Status status;
+  SANE_Int id, bytes;
+  SANE_Byte *data;
+  double start, waited = 0, writing = 0;
+
+  (void) arg;
+
+  sanei_shm_channel_reader_init (async_channel);
+  status = sanei_shm_channel_reader_start (async_channel);
+
+  while (status == SANE_STATUS_GOOD)
+    {
+      start = now ();
+      status = sanei_shm_channel_reader_get_buffer (async_channel, &id,
+						    &data, &bytes);
+      waited += now () - start;
+      if (status != SANE_STATUS_GOOD)
+	break;
+
+      start = now ();
+      status = output_data (data, bytes, async_ofp);
+      writing += now () - start;
+
+      if (status == SANE_STATUS_GOOD)
+	status = sanei_shm_channel_reader_put_buffer (async_channel, id);
+    }
+  if (status == SANE_STATUS_EOF)
+    status = SANE_STATUS_GOOD;
+
+  start = now ();
+  if (stream_encoder.format && status == SANE_STATUS_GOOD)
+    status = encoder_finish (&stream_encoder);
+  if (fflush (async_ofp) != 0)
+    status = SANE_STATUS_IO_ERROR;
+  writing += now () - start;
+
+  /* tells scan_it() to stop if we stopped early */
+  sanei_shm_channel_reader_close (async_channel);
+
+  /* a forked writer can't hand its figures back, so report them here */
+  fprintf (stderr, "%s: writer waited %.3f s for data, %.3f s writing\n",
+	   prog_name, waited, writing);
+
+  return status;
+}
+
+static void
+async_write_start (FILE *ofp)
+{
+  SANE_Status status;
+
+  /* whatever is buffered must not be written again by a forked writer */
+  fflush (ofp);
+
+  status = sanei_shm_channel_new (buffer_size, async_buffers,
+				  sanei_thread_is_forked (), &async_channel);
+  if (status != SANE_STATUS_GOOD)
+    {
+      fprintf (stderr, "%s: can't set up write buffers (%s), writing "
+	       "directly\n", prog_name, sane_strstatus (status));
+      async_channel = NULL;
+      return;
+    }
+
+  async_ofp = ofp;
+  async_id = -1;
+  async_stall = 0;
+
+  sanei_thread_init ();
+  async_pid = sanei_thread_begin (async_writer, NULL);
+  if (sanei_thread_is_invalid (async_pid))
+    {
+      fprintf (stderr, "%s: can't start writer, writing directly\n",
+	       prog_name);
+      sanei_shm_channel_free (async_channel);
+      async_channel = NULL;
+      return;
+    }
+
+  sanei_shm_channel_writer_init (async_channel);
+}
+
+/* write image data, either directly or by handing it to the writer */
+static SANE_Status
+write_data (const SANE_Byte * data, size_t len, FILE *ofp)
+{
+  SANE_Status status;
+  size_t n;
+  double start;
+
+  if (!async_channel)
+    {
+      if (stream_encoder.format)
+	return encoder_write (&stream_encoder, data, len);
+      fwrite (data, 1, len, ofp);
+      return SANE_STATUS_GOOD;
+    }
+
+  while (len > 0)
+    {
+      if (async_id < 0)
+	{
+	  start = now ();
+	  status = sanei_shm_channel_writer_get_buffer (async_channel,
+							&async_id,
+							&async_data);
+	  async_stall += now () - start;
+	  if (status != SANE_STATUS_GOOD)
+	    return SANE_STATUS_IO_ERROR;
+	  async_fill = 0;
+	}
+
+      n = buffer_size - async_fill;
+      if (n > len)
+	n = len;
+      memcpy (async_data + async_fill, data, n);
+      async_fill += n;
+      data += n;
+      len -= n;
+
+      if (async_fill == buffer_size)
+	{
+	  status = sanei_shm_channel_writer_put_buffer (async_channel,
+							async_id,
+							async_fill);
+	  async_id = -1;
+	  if (status != SANE_STATUS_GOOD)
+	    return SANE_STATUS_IO_ERROR;
+	}
+    }
+
+  return SANE_STATUS_GOOD;
+}
+
+/* hand over the last buffer, wait for the writer and report the stalls;
+   returns status unless the writer failed on an otherwise good scan */
+static SANE_Status
+async_write_finish (SANE_Status status)
+{
+  SANE_Status write_status = SANE_STATUS_GOOD;
+  int writer_status;
+
+  if (!async_channel)
+    return status;
+
+  if (async_id >= 0)
+    write_status = sanei_shm_channel_writer_put_buffer (async_channel,
+							async_id,
+							async_fill);
+  async_id = -1;
+
+  sanei_shm_channel_writer_close (async_channel);
+  sanei_thread_waitpid (async_pid, &writer_status);
+  sanei_shm_channel_free (async_channel);
+  async_channel = NULL;
+
+  if (writer_status != SANE_STATUS_GOOD)
+    write_status = writer_status;
+
+  fprintf (stderr, "%s: scan side waited %.3f s for free buffers\n",
+	   prog_name, async_stall);
+
+  if (write_status != SANE_STATUS_GOOD
+      && (status == SANE_STATUS_GOOD || status == SANE_STATUS_EOF))
+    {
+      fprintf (stderr, "%s: writing output failed: %s\n",
+	       prog_name, sane_strstatus (write_status));
+      return write_status;
+    }
+  return status;
+}
+
+/* write a page that was buffered in memory */
+static void
+write_image (Image * image, SANE_Parameters * parm, FILE *ofp)
+{
+  /* already a JPEG file, kept one byte per line */
+  if (parm->format == SANE_FRAME_JPEG)
+    {
+      fwrite (image->data, 1, image->height, ofp);
+      return;
+    }
+
+  if (output_format >= OUTPUT_PNG)
+    {
+      Encoder enc;
+
+      if (encoder_start (&enc, ofp, parm, image->height) == SANE_STATUS_GOOD)
+	{
+	  encoder_write (&enc, image->data,
+			 (size_t) image->height * image->width);
+	  encoder_finish (&enc);
+	}
+      return;
+    }
+
+  if (output_format == OUTPUT_TIFF)
+    sanei_write_tiff_header (parm->format, parm->pixels_per_line,
+			     image->height, parm->depth, resolution_value,
+			     icc_profile, ofp);
+  else
+    write_pnm_header (parm->format, parm->pixels_per_line,
+		      image->height, parm->depth, ofp);
+
+#if !defined(WORDS_BIGENDIAN)
+  /* multibyte pnm file may need byte swap to LE */
+  /* FIXME: other bit depths? */
+  if (output_format != OUTPUT_TIFF && parm->depth == 16)
+    {
+      size_t i;
+      for (i = 0; i < (size_t) image->height * image->width; i += 2)
+	{
+	  unsigned char LSB;
+	  LSB = image->data[i];
+	  image->data[i] = image->data[i + 1];
+	  image->data[i + 1] = LSB;
+	}
+    }
+#endif
+
+  fwrite (image->data, 1, (size_t) image->height * image->width, ofp);
+}
+
+/* Scan one page.  If page is not NULL, the whole image is kept in memory
+   and handed back in page instead of being written to ofp. */
+static SANE_Status
+scan_it (FILE *ofp, Page * page)
+{
+  int i, len, first_frame = 1, offset = 0, must_buffer = 0, hundred_percent;
+  int line_bytes = 0;
+  SANE_Byte min = 0xff, max = 0;
+  SANE_Parameters parm;
+  SANE_Status status;
+  Image image = { 0, 0, 0, 0, 0, NULL };
+  size_t frame_bytes = 0;
+  static const char *format_name[] = {
+    "gray", "RGB", "red", "green", "blue"
+  };
+  SANE_Word total_bytes = 0, expected_bytes;
+  SANE_Int hang_over = -1;
+
+  do
+    {
+      if (!first_frame)
+	{
+#ifdef SANE_STATUS_WARMING_UP
+          do
+	    {
+	      status = sane_start (device);
+	    }
+	  while(status == SANE_STATUS_WARMING_UP);
+#else
+	  status = sane_start (device);
+#endif
+	  if (status != SANE_STATUS_GOOD)
+	    {
+	      fprintf (stderr, "%s: sane_start: %s\n",
+		       prog_name, sane_strstatus (status));
+	      goto cleanup;
+	    }
+	}
+
+      status = sane_get_parameters (device, &parm);
+      if (status != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: sane_get_parameters: %s\n",
+		   prog_name, sane_strstatus (status));
+	  goto cleanup;
+	}
+
+      if (verbose)
+	{
+	  if (first_frame)
+	    {
+	      if (parm.lines >= 0)
+		fprintf (stderr, "%s: scanning image of size %dx%d pixels at "
+			 "%d bits/pixel\n",
+			 prog_name, parm.pixels_per_line, parm.lines,
+			 8 * parm.bytes_per_line / parm.pixels_per_line);
+	      else
+		fprintf (stderr, "%s: scanning image %d pixels wide and "
+			 "variable height at %d bits/pixel\n",
+			 prog_name, parm.pixels_per_line,
+			 8 * parm.bytes_per_line / parm.pixels_per_line);
+	    }
+
+	  fprintf (stderr, "%s: acquiring %s frame\n", prog_name,
+	   parm.format <= SANE_FRAME_BLUE ? format_name[parm.format]
+		   : parm.format == SANE_FRAME_JPEG ? "JPEG" : "Unknown");
+	}
+
+      if (first_frame)
+	{
+	  switch (parm.format)
+	    {
+	    case SANE_FRAME_RED:
+	    case SANE_FRAME_GREEN:
+	    case SANE_FRAME_BLUE:
+	      assert (parm.depth == 8);
+	      must_buffer = 1;
+	      offset = parm.format - SANE_FRAME_RED;
+	      break;
+
+	    case SANE_FRAME_RGB:
+	      assert ((parm.depth == 8) || (parm.depth == 16));
+	    case SANE_FRAME_GRAY:
+	      assert ((parm.depth == 1) || (parm.depth == 8)
+		      || (parm.depth == 16));
+	      /* png and deflated tiff can finish the header at the end */
+	      if (page || (parm.lines < 0 && output_format != OUTPUT_PNG
+			   && output_format != OUTPUT_TIFF_DEFLATE))
+		{
+		  must_buffer = 1;
+		  offset = 0;
+		}
+	      else
+		{
+		  if (output_format >= OUTPUT_PNG)
+		    {
+		      status = encoder_start (&stream_encoder, ofp, &parm,
+					      parm.lines);
+		      if (status != SANE_STATUS_GOOD)
+			goto cleanup;
+		    }
+		  else if (output_format == OUTPUT_TIFF)
+		    sanei_write_tiff_header (parm.format,
+					     parm.pixels_per_line, parm.lines,
+					     parm.depth, resolution_value,
+					     icc_profile, ofp);
+		  else
+		    write_pnm_header (parm.format, parm.pixels_per_line,
+				      parm.lines, parm.depth, ofp);
+
+		  if (async_buffers)
+		    async_write_start (ofp);
+		}
+	      break;
+
+            default:
+	      /* the backend compressed the image already, it can only go
+		 to a jpeg file unchanged */
+	      if (parm.format != SANE_FRAME_JPEG)
+		break;
+	      if (output_format != OUTPUT_JPEG)
+		{
+		  fprintf (stderr, "%s: backend sends JPEG data, use "
+			   "--format=jpeg\n", prog_name);
+		  status = SANE_STATUS_INVAL;
+		  goto cleanup;
+		}
+	      if (page)
+		{
+		  must_buffer = 1;
+		  offset = 0;
+		}
+	      else if (async_buffers)
+		async_write_start (ofp);
+	      break;
+	    }
+
+	  if (must_buffer)
+	    {
+	      /* We're either scanning a multi-frame image or the
+		 scanner doesn't know what the eventual image height
+		 will be (common for hand-held scanners).  In either
+		 case, we need to buffer all data before we can write
+		 the image.  */
+	      line_bytes = parm.bytes_per_line;
+	      if (parm.format == SANE_FRAME_JPEG)
+		line_bytes = 1;
+	      image.width = line_bytes;
+	      if (parm.format >= SANE_FRAME_RED
+		  && parm.format <= SANE_FRAME_BLUE)
+		image.width *= 3;
+
+	      if (parm.lines > 0 && parm.format != SANE_FRAME_JPEG)
+		{
+		  status = image_reserve (&image, parm.lines);
+		  if (status != SANE_STATUS_GOOD)
+		    goto cleanup;
+		}
+	    }
+	}
+      else
+	{
+	  assert (parm.format >= SANE_FRAME_RED
+		  && parm.format <= SANE_FRAME_BLUE);
+	  offset = parm.format - SANE_FRAME_RED;
+	}
+      frame_bytes = 0;
+      hundred_percent = parm.bytes_per_line * parm.lines 
+	* ((parm.format == SANE_FRAME_RGB || parm.format == SANE_FRAME_GRAY) ? 1:3);
+
+      while (1)
+	{
 	  double progr;
 	  status = sane_read (device, buffer, buffer_size, &len);
 	  total_bytes += (SANE_Word) len;
@@ -1337,71 +2188,45 @@ scan_it (FILE *ofp)
 
 	  if (status != SANE_STATUS_GOOD)
 	    {
-	      if (verbose && parm.depth == 8)
+	      if (verbose && parm.depth == 8
+		  && parm.format != SANE_FRAME_JPEG)
 		fprintf (stderr, "%s: min/max graylevel value = %d/%d\n",
 			 prog_name, min, max);
 	      if (status != SANE_STATUS_EOF)
 		{
 		  fprintf (stderr, "%s: sane_read: %s\n",
 			   prog_name, sane_strstatus (status));
-		  return status;
+		  goto cleanup;
 		}
 	      break;
 	    }
 
 	  if (must_buffer)
 	    {
-	      switch (parm.format)
+	      status = image_reserve (&image, (frame_bytes + len
+					       + line_bytes - 1) / line_bytes);
+	      if (status != SANE_STATUS_GOOD)
+		goto cleanup;
+
+	      /* single color frames are merged into the RGB image as
+		 they come in */
+	      if (parm.format >= SANE_FRAME_RED
+		  && parm.format <= SANE_FRAME_BLUE)
 		{
-		case SANE_FRAME_RED:
-		case SANE_FRAME_GREEN:
-		case SANE_FRAME_BLUE:
-		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + 3 * i] = buffer[i];
-		      if (!advance (&image))
-			{
-			  status = SANE_STATUS_NO_MEM;
-			  goto cleanup;
-			}
-		    }
-		  offset += 3 * len;
-		  break;
-
-		case SANE_FRAME_RGB:
-		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + i] = buffer[i];
-		      if (!advance (&image))
-			  {
-			    status = SANE_STATUS_NO_MEM;
-			    goto cleanup;
-			  }
-		    }
-		  offset += len;
-		  break;
+		  uint8_t *dst = image.data + 3 * frame_bytes + offset;
 
-		case SANE_FRAME_GRAY:
 		  for (i = 0; i < len; ++i)
-		    {
-		      image.data[offset + i] = buffer[i];
-		      if (!advance (&image))
-			  {
-			    status = SANE_STATUS_NO_MEM;
-			    goto cleanup;
-			  }
-		    }
-		  offset += len;
-		  break;
-
-                default:
-		  break;
+		    dst[3 * i] = buffer[i];
 		}
+	      else
+		memcpy (image.data + frame_bytes, buffer, len);
+	      frame_bytes += len;
+	      image.y = frame_bytes / line_bytes;
 	    }
 	  else			/* ! must_buffer */
 	    {
-	      if ((output_format == OUTPUT_TIFF) || (parm.depth != 16))
-		fwrite (buffer, 1, len, ofp);
+	      if ((output_format != OUTPUT_PNM) || (parm.depth != 16))
+		status = write_data (buffer, len, ofp);
 	      else
 		{
 #if !defined(WORDS_BIGENDIAN)
@@ -1412,7 +2237,7 @@ scan_it (FILE *ofp)
 		    {
 		      if (len > 0)
 			{
-			  fwrite (buffer, 1, 1, ofp);
+			  status = write_data (buffer, 1, ofp);
 			  buffer[0] = (SANE_Byte) hang_over;
 			  hang_over = -1;
 			  start = 1;
@@ -1433,8 +2258,11 @@ scan_it (FILE *ofp)
 		      len--;
 		    }
 #endif
-		  fwrite (buffer, 1, len, ofp);
+		  if (status == SANE_STATUS_GOOD)
+		    status = write_data (buffer, len, ofp);
 		}
+	      if (status != SANE_STATUS_GOOD)
+		goto cleanup;
 	    }
 
 	  if (verbose && parm.depth == 8)
@@ -1450,49 +2278,47 @@ scan_it (FILE *ofp)
     }
   while (!parm.last_frame);
 
+  if (stream_encoder.format && !async_channel)
+    {
+      if (encoder_finish (&stream_encoder) != SANE_STATUS_GOOD)
+	{
+	  fprintf (stderr, "%s: writing output failed\n", prog_name);
+	  status = SANE_STATUS_IO_ERROR;
+	  goto cleanup;
+	}
+    }
+
   if (must_buffer)
     {
       image.height = image.y;
 
-      if (output_format == OUTPUT_TIFF)
-	sanei_write_tiff_header (parm.format, parm.pixels_per_line,
-				 image.height, parm.depth, resolution_value,
-				 icc_profile, ofp);
-      else
-	write_pnm_header (parm.format, parm.pixels_per_line,
-                          image.height, parm.depth, ofp);
-
-#if !defined(WORDS_BIGENDIAN)
-      /* multibyte pnm file may need byte swap to LE */
-      /* FIXME: other bit depths? */
-      if (output_format != OUTPUT_TIFF && parm.depth == 16)
+      if (page)
 	{
-	  int i;
-	  for (i = 0; i < image.height * image.width; i += 2)
-	    {
-	      unsigned char LSB;
-	      LSB = image.data[i];
-	      image.data[i] = image.data[i + 1];
-	      image.data[i + 1] = LSB;
-	    }
+	  page->image = image;
+	  page->parm = parm;
+	  image.data = NULL;
+	  image.spill = NULL;
 	}
-#endif
-
-	fwrite (image.data, 1, image.height * image.width, ofp);
+      else
+	write_image (&image, &parm, ofp);
     }
 
   /* flush the output buffer */
-  fflush( ofp );
+  if (ofp)
+    fflush( ofp );
 
 cleanup:
-  if (image.data)
-    free (image.data);
+  status = async_write_finish (status);
+  if (stream_encoder.format)
+    encoder_free (&stream_encoder);
+
+  image_free (&image);
 
 
   expected_bytes = parm.bytes_per_line * parm.lines *
     ((parm.format == SANE_FRAME_RGB
       || parm.format == SANE_FRAME_GRAY) ? 1 : 3);
-  if (parm.lines < 0)
+  if (parm.lines < 0 || parm.format == SANE_FRAME_JPEG)
     expected_bytes = 0;
   if (total_bytes > expected_bytes && expected_bytes != 0)
     {
@@ -1506,6 +2332,161 @@ cleanup:
   return status;
 }
 
+static void
+free_page (Page * page)
+{
+  image_free (&page->image);
+  free (page);
+}
+
+/* write a page scanned in pipelined batch mode to its .part file and let
+   it show up under its real name */
+static SANE_Status
+write_page (Page * page)
+{
+  FILE *ofp;
+  int failed;
+
+  if (NULL == (ofp = fopen (page->part_path, "w")))
+    {
+      fprintf (stderr, "cannot open %s\n", page->part_path);
+      return SANE_STATUS_ACCESS_DENIED;
+    }
+
+  write_image (&page->image, &page->parm, ofp);
+
+  failed = ferror (ofp);
+  if (fclose (ofp) != 0 || failed)
+    {
+      fprintf (stderr, "cannot close image file\n");
+      unlink (page->part_path);
+      return SANE_STATUS_ACCESS_DENIED;
+    }
+  if (rename (page->part_path, page->path))
+    {
+      fprintf (stderr, "cannot rename %s to %s\n",
+	       page->part_path, page->path);
+      return SANE_STATUS_ACCESS_DENIED;
+    }
+  if (page->print)
+    {
+      fprintf (stdout, "%s\n", page->path);
+      fflush (stdout);
+    }
+  return SANE_STATUS_GOOD;
+}
+
+#ifdef SCANIMAGE_WITH_THREADS
+static void *
+page_writer (void *arg)
+{
+  SANE_Status status;
+  Page *page;
+
+  (void) arg;
+
+  while (1)
+    {
+      pthread_mutex_lock (&page_queue_lock);
+      while (!page_queue && !page_queue_done)
+	pthread_cond_wait (&page_queue_cond, &page_queue_lock);
+      page = page_queue;
+      if (page)
+	{
+	  page_queue = page->next;
+	  if (!page_queue)
+	    page_queue_tail = NULL;
+	}
+      pthread_mutex_unlock (&page_queue_lock);
+
+      if (!page)
+	break;
+
+      status = write_page (page);
+      free_page (page);
+
+      pthread_mutex_lock (&page_queue_lock);
+      --page_queue_len;
+      if (status != SANE_STATUS_GOOD && page_queue_status == SANE_STATUS_GOOD)
+	page_queue_status = status;
+      pthread_cond_broadcast (&page_queue_cond);
+      pthread_mutex_unlock (&page_queue_lock);
+    }
+
+  return NULL;
+}
+#endif
+
+/* Hand a scanned page to the page writer, waiting while --batch-queue
+   pages are already waiting.  Takes over the page; returns an error if
+   writing this or an earlier page failed. */
+static SANE_Status
+queue_page (Page * page)
+{
+  SANE_Status status;
+
+#ifdef SCANIMAGE_WITH_THREADS
+  if (!page_writer_running)
+    {
+      if (pthread_create (&page_writer_thread, NULL, page_writer, NULL) == 0)
+	page_writer_running = 1;
+      else
+	fprintf (stderr, "%s: can't start page writer, writing pages in "
+		 "turn\n", prog_name);
+    }
+
+  if (page_writer_running)
+    {
+      pthread_mutex_lock (&page_queue_lock);
+      while (page_queue_len >= batch_queue
+	     && page_queue_status == SANE_STATUS_GOOD)
+	pthread_cond_wait (&page_queue_cond, &page_queue_lock);
+      status = page_queue_status;
+      if (status == SANE_STATUS_GOOD)
+	{
+	  page->next = NULL;
+	  if (page_queue_tail)
+	    page_queue_tail->next = page;
+	  else
+	    page_queue = page;
+	  page_queue_tail = page;
+	  ++page_queue_len;
+	  pthread_cond_broadcast (&page_queue_cond);
+	}
+      pthread_mutex_unlock (&page_queue_lock);
+
+      if (status != SANE_STATUS_GOOD)
+	free_page (page);
+      return status;
+    }
+#endif
+
+  status = write_page (page);
+  free_page (page);
+  return status;
+}
+
+/* wait until all queued pages are written */
+static SANE_Status
+page_queue_finish (void)
+{
+#ifdef SCANIMAGE_WITH_THREADS
+  if (page_writer_running)
+    {
+      pthread_mutex_lock (&page_queue_lock);
+      page_queue_done = 1;
+      pthread_cond_broadcast (&page_queue_cond);
+      pthread_mutex_unlock (&page_queue_lock);
+
+      pthread_join (page_writer_thread, NULL);
+      page_writer_running = 0;
+      page_queue_done = 0;
+      return page_queue_status;
+    }
+#endif
+  return SANE_STATUS_GOOD;
+}
+
 #define clean_buffer(buf,size)	memset ((buf), 0x23, size)
 
 static void
@@ -1533,7 +2514,7 @@ test_it (void)
   int i, len;
   SANE_Parameters parm;
   SANE_Status status;
-  Image image = { 0, 0, 0, 0, 0 };
+  Image image = { 0, 0, 0, 0, 0, NULL };
   static const char *format_name[] =
     { "gray", "RGB", "red", "green", "blue" };
 
@@ -1619,6 +2600,161 @@ cleanup:
   return status;
 }
 
+/* --benchmark: histograms with power of two buckets, bucket 0 counts
+   values below 1, bucket n values from 2^(n-1) up to 2^n */
+#define BENCH_BUCKETS	32
+
+static void
+histogram_add (unsigned long *hist, double value)
+{
+  int n = 0;
+
+  while (value >= 1 && n < BENCH_BUCKETS - 1)
+    {
+      value /= 2;
+      n++;
+    }
+  hist[n]++;
+}
+
+static void
+print_histogram (const char *name, const unsigned long *hist)
+{
+  const char *sep = "";
+  int n;
+
+  printf ("  \"%s\": [", name);
+  for (n = 0; n < BENCH_BUCKETS; n++)
+    if (hist[n])
+      {
+	printf ("%s\n    {\"from\": %.0f, \"count\": %lu}", sep,
+		n ? (double) (1UL << (n - 1)) : 0, hist[n]);
+	sep = ",";
+      }
+  printf ("\n  ]");
+}
+
+static void
+print_json_string (const char *str)
+{
+  putchar ('"');
+  for (; *str; str++)
+    {
+      if (*str == '"' || *str == '\\')
+	printf ("\\%c", *str);
+      else if ((unsigned char) *str < 0x20)
+	printf ("\\u%04x", *str);
+      else
+	putchar (*str);
+    }
+  putchar ('"');
+}
+
+/* Scan benchmark times and throw the data away, printing the time taken
+   by each step as JSON on stdout. */
+static SANE_Status
+benchmark_it (const char *devname, double open_time, double setup_time)
+{
+  unsigned long latency[BENCH_BUCKETS], chunk[BENCH_BUCKETS];
+  SANE_Parameters parm;
+  SANE_Status status = SANE_STATUS_GOOD;
+  int scan, len;
+
+  buffer = malloc (buffer_size);
+  if (!buffer)
+    {
+      fprintf (stderr, "%s: can't allocate read buffer\n", prog_name);
+      return SANE_STATUS_NO_MEM;
+    }
+  memset (latency, 0, sizeof (latency));
+  memset (chunk, 0, sizeof (chunk));
+
+  printf ("{\n  \"device\": ");
+  print_json_string (devname);
+  printf (",\n  \"buffer_size\": %lu,\n  \"open_ms\": %.3f,\n"
+	  "  \"setup_ms\": %.3f,\n  \"scans\": [",
+	  (unsigned long) buffer_size, open_time * 1000, setup_time * 1000);
+
+  for (scan = 0; scan < benchmark && status == SANE_STATUS_GOOD; scan++)
+    {
+      double begin = now (), start_time = 0, first = 0, last = 0, t, t2;
+      double bytes = 0, first_len = 0;
+      unsigned long reads = 0;
+      int frames = 0;
+
+      do
+	{
+	  t = now ();
+#ifdef SANE_STATUS_WARMING_UP
+	  do
+	    {
+	      status = sane_start (device);
+	    }
+	  while (status == SANE_STATUS_WARMING_UP);
+#else
+	  status = sane_start (device);
+#endif
+	  start_time += now () - t;
+	  if (status != SANE_STATUS_GOOD)
+	    break;
+	  status = sane_get_parameters (device, &parm);
+	  if (status != SANE_STATUS_GOOD)
+	    break;
+	  frames++;
+
+	  do
+	    {
+	      t = now ();
+	      status = sane_read (device, buffer, buffer_size, &len);
+	      t2 = now ();
+	      if (status != SANE_STATUS_GOOD)
+		break;
+	      reads++;
+	      histogram_add (latency, (t2 - t) * 1000000);
+	      histogram_add (chunk, len);
+	      if (len > 0 && !first)
+		{
+		  first = t2;
+		  first_len = len;
+		}
+	      bytes += len;
+	      last = t2;
+	    }
+	  while (1);
+	  if (status == SANE_STATUS_EOF)
+	    status = SANE_STATUS_GOOD;
+	}
+      while (status == SANE_STATUS_GOOD && !parm.last_frame);
+
+      /* an empty feeder ends the run, as in batch mode */
+      if (status == SANE_STATUS_NO_DOCS && scan > 0)
+	{
+	  status = SANE_STATUS_GOOD;
+	  break;
+	}
+
+      printf ("%s\n    {\"status\": ", scan ? "," : "");
+      print_json_string (sane_strstatus (status));
+      printf (", \"frames\": %d, \"start_ms\": %.3f, "
+	      "\"first_byte_ms\": %.3f,\n     \"total_ms\": %.3f, "
+	      "\"reads\": %lu, \"bytes\": %.0f, \"mb_per_s\": %.3f}",
+	      frames, start_time * 1000, first ? (first - begin) * 1000 : 0,
+	      (now () - begin) * 1000, reads, bytes,
+	      last > first ? (bytes - first_len) / (last - first) / 1e6 : 0);
+    }
+  sane_cancel (device);
+
+  printf ("\n  ],\n");
+  print_histogram ("read_latency_us", latency);
+  printf (",\n");
+  print_histogram ("read_bytes", chunk);
+  printf ("\n}\n");
+  fflush (stdout);
+
+  free (buffer);
+  buffer = NULL;
+  return status;
+}
 
 static int
 get_resolution (void)
@@ -1720,6 +2856,7 @@ main (int argc, char **argv)
   char *full_optstring;
   SANE_Int version_code;
   FILE *ofp = NULL;
+  double open_start, open_time = 0;
 
   atexit (scanimage_exit);
 
@@ -1772,9 +2909,33 @@ main (int argc, char **argv)
           else
 	    buffer_size = (1024 * 1024);
 	  break;
+	case OPTION_ASYNC_WRITE:
+	  if (optarg)
+	    async_buffers = atoi (optarg);
+	  else
+	    async_buffers = 8;
+	  if (async_buffers < 1 || async_buffers > 255)
+	    {
+	      fprintf (stderr, "%s: --async-write takes 1 to 255 buffers\n",
+		       prog_name);
+	      exit (1);
+	    }
+	  break;
 	case 'T':
 	  test = 1;
 	  break;
+	case OPTION_BENCHMARK:
+	  if (optarg)
+	    benchmark = atoi (optarg);
+	  else
+	    benchmark = 5;
+	  if (benchmark < 1)
+	    {
+	      fprintf (stderr, "%s: --benchmark needs at least one scan\n",
+		       prog_name);
+	      exit (1);
+	    }
+	  break;
 	case 'A':
 	  all = 1;
 	  break;
@@ -1787,6 +2948,14 @@ main (int argc, char **argv)
 	case OPTION_BATCH_PROMPT:
 	  batch_prompt = 1;
 	  break;
+	case OPTION_BATCH_QUEUE:
+	  if (optarg)
+	    batch_queue = atoi (optarg);
+	  else
+	    batch_queue = 2;
+	  if (batch_queue < 0)
+	    batch_queue = 0;
+	  break;
 	case OPTION_BATCH_INCREMENT:
 	  batch_increment = atoi (optarg);
 	  break;
@@ -1803,9 +2972,41 @@ main (int argc, char **argv)
 	case OPTION_FORMAT:
 	  if (strcmp (optarg, "tiff") == 0)
 	    output_format = OUTPUT_TIFF;
+	  else if (strcmp (optarg, "png") == 0
+		   || strcmp (optarg, "tiff-deflate") == 0)
+	    {
+#ifdef HAVE_LIBZ
+	      output_format = optarg[0] == 'p' ? OUTPUT_PNG
+		: OUTPUT_TIFF_DEFLATE;
+#else
+	      fprintf (stderr, "%s: built without zlib, no %s output\n",
+		       prog_name, optarg);
+	      exit (1);
+#endif
+	    }
+	  else if (strcmp (optarg, "jpeg") == 0)
+	    {
+#ifdef HAVE_LIBJPEG
+	      output_format = OUTPUT_JPEG;
+	      putenv (compressed_frames_env);
+#else
+	      fprintf (stderr, "%s: built without libjpeg, no jpeg output\n",
+		       prog_name);
+	      exit (1);
+#endif
+	    }
 	  else
 	    output_format = OUTPUT_PNM;
 	  break;
+	case OPTION_COMPRESSION:
+	  compression_level = atoi (optarg);
+	  if (compression_level < 0 || compression_level > 100)
+	    {
+	      fprintf (stderr, "%s: compression level must be 0 to 100\n",
+		       prog_name);
+	      exit (1);
+	    }
+	  break;
 	case OPTION_MD5:
 	  accept_only_md5_auth = 1;
 	  break;
@@ -1940,9 +3141,12 @@ standard output.\n\
 \n\
 Parameters are separated by a blank from single-character options (e.g.\n\
 -d epson) and by a \"=\" from multi-character options (e.g. --device-name=epson).\n\
--d, --device-name=DEVICE   use a given scanner device (e.g. hp:/dev/scanner)\n\
-    --format=pnm|tiff      file format of output file\n\
--i, --icc-profile=PROFILE  include this ICC profile into TIFF file\n", prog_name);
+-d, --device-name=DEVICE   use a given scanner device (e.g. hp:/dev/scanner)\n", prog_name);
+      printf ("\
+    --format=pnm|tiff|png|jpeg|tiff-deflate\n\
+                           file format of output file\n\
+    --compression-level=#  0-9 for png and tiff-deflate, jpeg quality 0-100\n\
+-i, --icc-profile=PROFILE  include this ICC profile into TIFF file\n");
       printf ("\
 -L, --list-devices         show available scanner devices\n\
 -f, --formatted-device-list=FORMAT similar to -L, but the FORMAT of the output\n\
@@ -1960,6 +3164,9 @@ Parameters are separated by a blank from single-character options (e.g.\n\
     --batch-print          print image filenames to stdout\n\
     --batch-prompt         ask for pressing a key before scanning a page\n");
       printf ("\
+    --batch-queue[=#]      scan the next page while up to # pages are still\n\
+                           being written (default 2)\n");
+      printf ("\
     --accept-md5-only      only accept authorization requests using md5\n\
 -p, --progress             print progress messages\n\
 -n, --dont-scan            only set options, don't actually scan\n\
@@ -1969,6 +3176,10 @@ Parameters are separated by a blank from single-character options (e.g.\n\
 -v, --verbose              give even more status messages\n\
 -B, --buffer-size=#        change input buffer size (in kB, default 32)\n");
       printf ("\
+    --benchmark[=#]        scan # times (default 5) without writing the image\n\
+                           and print timings as JSON\n\
+    --async-write[=#]      write output from a separate task through # buffers\n\
+                           of --buffer-size each (default 8)\n\
 -V, --version              print version information\n");
     }
 
@@ -1996,7 +3207,9 @@ Parameters are separated by a blank from single-character options (e.g.\n\
 	}
     }
 
+  open_start = now ();
   status = sane_open (devname, &device);
+  open_time = now () - open_start;
   if (status != SANE_STATUS_GOOD)
     {
       fprintf (stderr, "%s: open of device %s failed: %s\n",
@@ -2223,14 +3436,22 @@ List of available devices:", prog_name);
   signal (SIGINT, sighandler);
   signal (SIGTERM, sighandler);
 
-  if (test == 0)
+  if (benchmark)
+    status = benchmark_it (devname, open_time,
+			   now () - open_start - open_time);
+  else if (test == 0)
     {
       int n = batch_start_at;
 
       if (batch && NULL == format)
 	{
-	  if (output_format == OUTPUT_TIFF)
+	  if (output_format == OUTPUT_TIFF
+	      || output_format == OUTPUT_TIFF_DEFLATE)
 	    format = "out%d.tif";
+	  else if (output_format == OUTPUT_PNG)
+	    format = "out%d.png";
+	  else if (output_format == OUTPUT_JPEG)
+	    format = "out%d.jpg";
 	  else
 	    format = "out%d.pnm";
 	}
@@ -2254,6 +3475,7 @@ List of available devices:", prog_name);
 	{
 	  char path[PATH_MAX];
 	  char part_path[PATH_MAX];
+	  Page *page = NULL;
 	  if (batch)		/* format is NULL unless batch mode */
 	    {
 	      sprintf (path, format, n);	/* love --(C++) */
@@ -2309,8 +3531,23 @@ List of available devices:", prog_name);
 	    }
 
 
+	  if (batch && batch_queue)
+	    {
+	      /* keep the page in memory, the page writer does the rest */
+	      page = calloc (1, sizeof (Page));
+	      if (!page)
+		{
+		  fprintf (stderr, "%s: can't allocate page\n", prog_name);
+		  sane_cancel (device);
+		  status = SANE_STATUS_NO_MEM;
+		  break;
+		}
+	      strcpy (page->path, path);
+	      strcpy (page->part_path, part_path);
+	      page->print = batch_print;
+	    }
 	  /* write to .part file while scanning is in progress */
-	  if (batch)
+	  else if (batch)
 	    {
 	      if (NULL == (ofp = fopen (part_path, "w")))
 		{
@@ -2320,7 +3557,7 @@ List of available devices:", prog_name);
 		}
 	    }
 
-	  status = scan_it (ofp);
+	  status = scan_it (ofp, page);
 	  if (batch)
 	    {
 	      fprintf (stderr, "Scanned page %d.", n);
@@ -2332,7 +3569,12 @@ List of available devices:", prog_name);
 	    case SANE_STATUS_GOOD:
 	    case SANE_STATUS_EOF:
 	      status = SANE_STATUS_GOOD;
-	      if (batch)
+	      if (page)
+		{
+		  status = queue_page (page);
+		  page = NULL;
+		}
+	      else if (batch)
 		{
 		  if (!ofp || 0 != fclose(ofp))
 		    {
@@ -2360,7 +3602,9 @@ List of available devices:", prog_name);
 		}
 	      break;
 	    default:
-	      if (batch)
+	      if (page)
+		free_page (page);
+	      else if (batch)
 		{
 		  if (ofp)
 		    {
@@ -2377,6 +3621,15 @@ List of available devices:", prog_name);
 	      && (batch_count == BATCH_COUNT_UNLIMITED || --batch_count))
 	     && SANE_STATUS_GOOD == status);
 
+      if (batch_queue)
+	{
+	  SANE_Status write_status = page_queue_finish ();
+
+	  if (write_status != SANE_STATUS_GOOD
+	      && (status == SANE_STATUS_GOOD || status == SANE_STATUS_NO_DOCS))
+	    status = write_status;
+	}
+
       if (batch
 	  && SANE_STATUS_NO_DOCS == status
 	  && (batch_count == BATCH_COUNT_UNLIMITED)
@@ -178,7 +178,8 @@ write_ifd (FILE *fptr, IFD *ifd, int motorola)
 
 
 static void
-write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
+write_tiff_bw_header (FILE *fptr, int width, int height, int resolution,
+                      int compression, int compressed_size)
 {IFD *ifd;
     int header_size = 8, ifd_size;
     int strip_offset, data_offset, data_size;
@@ -189,6 +190,8 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
     ifd = create_ifd ();
 
     strip_bytecount = ((width+7)/8) * height;
+    if (compression != TIFF_COMPRESSION_NONE)
+        strip_bytecount = compressed_size;
 
     /* the following values must be known in advance */
     ntags = 12;
@@ -213,8 +216,8 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
                    1, height);
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 1, 1);
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, compression);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 0);
     /* fill order */
@@ -262,7 +265,8 @@ write_tiff_bw_header (FILE *fptr, int width, int height, int resolution)
 
 static void
 write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
-                        int resolution, const char *icc_profile)
+                        int resolution, const char *icc_profile,
+                        int compression, int compressed_size)
 {IFD *ifd;
     int header_size = 8, ifd_size;
     int strip_offset, data_offset, data_size;
@@ -292,6 +296,8 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
     bps = (depth <= 8) ? 1 : 2;  /* Bytes per sample */
     maxsamplevalue = (depth <= 8) ? 255 : 65535;
     strip_bytecount = width * height * bps;
+    if (compression != TIFF_COMPRESSION_NONE)
+        strip_bytecount = compressed_size;
 
     /* the following values must be known in advance */
     ntags = 13;
@@ -322,8 +328,8 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
                    1, height);
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 1, depth);
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, compression);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 1);
     /* strip offset */
@@ -412,7 +418,8 @@ write_tiff_grey_header (FILE *fptr, int width, int height, int depth,
 
 static void
 write_tiff_color_header (FILE *fptr, int width, int height, int depth,
-                         int resolution, const char *icc_profile)
+                         int resolution, const char *icc_profile,
+                         int compression, int compressed_size)
 {IFD *ifd;
     int header_size = 8, ifd_size;
     int strip_offset, data_offset, data_size;
@@ -443,6 +450,8 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
     bps = (depth <= 8) ? 1 : 2;  /* Bytes per sample */
     maxsamplevalue = (depth <= 8) ? 255 : 65535;
     strip_bytecount = width * height * 3 * bps;
+    if (compression != TIFF_COMPRESSION_NONE)
+        strip_bytecount = compressed_size;
 
     /* the following values must be known in advance */
     ntags = 13;
@@ -476,8 +485,8 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
     /* bits per sample */
     add_ifd_entry (ifd, 258, IFDE_TYP_SHORT, 3, data_offset);
     data_offset += 3*2;
-    /* compression (uncompressed) */
-    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, 1);
+    /* compression */
+    add_ifd_entry (ifd, 259, IFDE_TYP_SHORT, 1, compression);
     /* photometric interpretation */
     add_ifd_entry (ifd, 262, IFDE_TYP_SHORT, 1, 2);
     /* strip offset */
@@ -587,6 +596,17 @@ write_tiff_color_header (FILE *fptr, int width, int height, int depth,
 void
 sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
 			 int resolution, const char *icc_profile, FILE *ofp)
+{
+    sanei_write_tiff_header_compressed (format, width, height, depth,
+                                        resolution, icc_profile,
+                                        TIFF_COMPRESSION_NONE, 0, ofp);
+}
+
+void
+sanei_write_tiff_header_compressed (SANE_Frame format, int width, int height,
+                                    int depth, int resolution,
+                                    const char *icc_profile, int compression,
+                                    int compressed_size, FILE *ofp)
 {
 #ifdef __EMX__	/* OS2 - write in binary mode. */
     _fsetmode(ofp, "b");
@@ -597,14 +617,17 @@ sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
     case SANE_FRAME_GREEN:
     case SANE_FRAME_BLUE:
     case SANE_FRAME_RGB:
-        write_tiff_color_header (ofp, width, height, depth, resolution, icc_profile);
+        write_tiff_color_header (ofp, width, height, depth, resolution,
+                                 icc_profile, compression, compressed_size);
         break;
 
     default:
         if (depth == 1)
-            write_tiff_bw_header (ofp, width, height, resolution);
+            write_tiff_bw_header (ofp, width, height, resolution,
+                                  compression, compressed_size);
         else
-            write_tiff_grey_header (ofp, width, height, depth, resolution, icc_profile);
+            write_tiff_grey_header (ofp, width, height, depth, resolution,
+                                    icc_profile, compression, compressed_size);
         break;
     }
 }
@@ -15,6 +15,18 @@
    along with this program; if not, write to the Free Software
    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.  */
 
+#define TIFF_COMPRESSION_NONE     1
+#define TIFF_COMPRESSION_DEFLATE  8
+
 void
 sanei_write_tiff_header (SANE_Frame format, int width, int height, int depth,
                          int resolution, const char *icc_profile, FILE *ofp);
+
+/* For compressed data the strip is compressed_size bytes long.  The
+   header has the same length whatever height and compressed_size are, so
+   it can be written again once they are known. */
+void
+sanei_write_tiff_header_compressed (SANE_Frame format, int width, int height,
+                                    int depth, int resolution,
+                                    const char *icc_profile, int compression,
+                                    int compressed_size, FILE *ofp);
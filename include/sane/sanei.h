@@ -103,6 +103,14 @@
  * Return number of elements of an array.
  *
  */
+/** @def SANEI_COMPRESSED_FRAMES()
+ * Check whether the frontend accepts compressed frames.
+ *
+ * SANE 1.0 frontends only know the frame types of sane.h, so backends
+ * that can send SANE_FRAME_JPEG only offer this when the frontend has
+ * set the environment variable named by SANEI_COMPRESSED_FRAMES_ENV
+ * before opening the device.
+ */
 
 /** @fn extern SANE_Status sanei_check_value (const SANE_Option_Descriptor * opt, void * value);
  * Check the constraints of a SANE option.
@@ -150,6 +158,20 @@
 /** @hideinitializer */
 #define PASTE(x,y)	PASTE1(x,y)
 
+/* frame types for compressed data, from the SANE 1.1 draft; sane.h
+   keeps them disabled until then */
+#ifndef SANE_FRAME_JPEG
+/** complete baseline JPEG file */
+#define SANE_FRAME_JPEG 0x0B
+#endif
+
+/** environment variable a frontend sets to accept compressed frames */
+#define SANEI_COMPRESSED_FRAMES_ENV "SANE_COMPRESSED_FRAMES"
+
+/** @hideinitializer */
+#define SANEI_COMPRESSED_FRAMES() \
+  (getenv (SANEI_COMPRESSED_FRAMES_ENV) != NULL)
+
 extern SANE_Status sanei_check_value (const SANE_Option_Descriptor * opt,
 				      void * value);
 
@@ -0,0 +1,243 @@
+/* sane - Scanner Access Now Easy.
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_buf_pool.h
+ * Recycled buffers passed from a reader thread to sane_read().
+ *
+ * Backends that read from the scanner in a thread of their own hand
+ * the data to sane_read() in fixed size buffers. A buffer pool keeps
+ * these buffers for the whole session instead of allocating and freeing
+ * one for every block, and passes them through a single-producer,
+ * single-consumer queue: the writer (the reader thread) fills a free
+ * buffer and puts it into the pool, the reader (sane_read()) gets it,
+ * uses the data and puts it back.
+ *
+ * The writer never blocks. Buffers the reader has put back are reused;
+ * if there are none, the pool allocates another one and counts this, so
+ * that the number of buffers preallocated can be tuned with
+ * sanei_buf_pool_get_stats(). Neither side takes a lock as long as the
+ * reader finds data waiting.
+ *
+ * Alternatively, a pool can be given a limit with
+ * sanei_buf_pool_set_limit(). Once it has that many buffers, the writer
+ * waits for the reader to put one back, so it never gets further ahead
+ * than the limit allows; sanei_buf_pool_reader_close() ends the wait if
+ * the reader gives up.
+ *
+ * Typical use:
+ * - sanei_buf_pool_new() once, e.g. in sane_open(), and
+ *   sanei_buf_pool_set_limit() if the writer should wait for the reader
+ * - sanei_buf_pool_reset() before starting the thread for each page
+ * - in the thread: sanei_buf_pool_writer_get_buffer() and
+ *   sanei_buf_pool_writer_put_buffer() for each block of data, and
+ *   sanei_buf_pool_writer_close() at the end
+ * - in sane_read(): sanei_buf_pool_reader_get_buffer() and
+ *   sanei_buf_pool_reader_put_buffer()
+ * - sanei_buf_pool_free() in sane_close()
+ *
+ * The pool needs threads sharing memory; it is not available if SANE
+ * is built without pthreads.
+ *
+ * @sa sanei_shm_channel.h for reader tasks that may be processes
+ */
+
+#ifndef sanei_buf_pool_h
+#define sanei_buf_pool_h
+
+#include "../include/sane/sane.h"
+
+/** Buffer pool object */
+typedef struct SANEI_Buf_Pool SANEI_Buf_Pool;
+
+/** Counters for sizing the pool */
+typedef struct
+{
+  SANE_Int buffers;		/**< buffers allocated in total */
+  SANE_Int exhausted;		/**< times the writer found no free buffer */
+  SANE_Int max_queued;		/**< most filled buffers waiting at once */
+  SANE_Int reader_waits;	/**< times the reader had to wait for data */
+  SANE_Int writer_waits;	/**< times the writer had to wait for a free
+				   buffer because of the limit */
+} SANEI_Buf_Pool_Stats;
+
+/** Create a new buffer pool.
+ *
+ * @param buf_size size of each buffer in bytes
+ * @param buf_count number of buffers to allocate at once
+ * @param pool_return the new pool
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if the buffers couldn't be allocated
+ * - SANE_STATUS_INVAL - on invalid parameters
+ * - SANE_STATUS_UNSUPPORTED - if SANE was built without pthreads
+ */
+extern SANE_Status
+sanei_buf_pool_new (SANE_Int buf_size, SANE_Int buf_count,
+		    SANEI_Buf_Pool ** pool_return);
+
+/** Release the pool and all its buffers.
+ *
+ * The writer thread must have finished.
+ *
+ * @param pool the pool
+ */
+extern void sanei_buf_pool_free (SANEI_Buf_Pool * pool);
+
+/** Prepare the pool for the next transfer.
+ *
+ * Drops any data still queued, clears the status set by
+ * sanei_buf_pool_writer_close() or sanei_buf_pool_reader_close() and the
+ * counters, and allocates more buffers if the pool has less than
+ * buf_count. The writer thread must not be running.
+ *
+ * @param pool the pool
+ * @param buf_count number of buffers the pool should have
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if the buffers couldn't be allocated
+ */
+extern SANE_Status
+sanei_buf_pool_reset (SANEI_Buf_Pool * pool, SANE_Int buf_count);
+
+/** Limit the number of buffers.
+ *
+ * Once the pool has max_buffers buffers, the writer waits for the reader
+ * to put one back instead of allocating another. The buffer being filled
+ * and the one the reader holds count as well. The limit is kept across
+ * sanei_buf_pool_reset(), and buffers the pool already has are not
+ * freed. The writer thread must not be running.
+ *
+ * @param pool the pool
+ * @param max_buffers most buffers, 0 for no limit
+ */
+extern void
+sanei_buf_pool_set_limit (SANEI_Buf_Pool * pool, SANE_Int max_buffers);
+
+/** Get a free buffer for writing.
+ *
+ * Returns the same buffer again until it is passed on with
+ * sanei_buf_pool_writer_put_buffer(). Only the writer thread may call
+ * this. If the pool has reached its limit, waits until the reader puts
+ * a buffer back.
+ *
+ * @param pool the pool
+ *
+ * @return the buffer, or NULL if the pool had to grow and there is no
+ * memory left, or if the reader has closed the pool
+ */
+extern SANE_Byte *sanei_buf_pool_writer_get_buffer (SANEI_Buf_Pool * pool);
+
+/** Pass the buffer filled last to the reader.
+ *
+ * @param pool the pool
+ * @param buffer_bytes number of data bytes in the buffer
+ */
+extern void
+sanei_buf_pool_writer_put_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Int buffer_bytes);
+
+/** End the transfer.
+ *
+ * The reader gets the status once it has received all buffers put
+ * before. This may also be called by the frontend thread after the
+ * writer thread has been cancelled, to wake up sane_read().
+ *
+ * @param pool the pool
+ * @param status SANE_STATUS_EOF, or the error that ended the transfer
+ */
+extern void
+sanei_buf_pool_writer_close (SANEI_Buf_Pool * pool, SANE_Status status);
+
+/** Get the next filled buffer.
+ *
+ * Blocks until the writer puts a buffer or closes the pool. Buffers
+ * arrive in the order they were put. Pass the buffer back with
+ * sanei_buf_pool_reader_put_buffer() after using its data.
+ *
+ * @param pool the pool
+ * @param buffer_addr_return the buffer address
+ * @param buffer_bytes_return number of data bytes in the buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - the status passed to sanei_buf_pool_writer_close() - once all
+ *   buffers have been received
+ */
+extern SANE_Status
+sanei_buf_pool_reader_get_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Byte ** buffer_addr_return,
+				  SANE_Int * buffer_bytes_return);
+
+/** Stop reading.
+ *
+ * Wakes up the writer if it waits for a free buffer, and makes
+ * sanei_buf_pool_writer_get_buffer() return NULL until the next
+ * sanei_buf_pool_reset(). Call this before waiting for the writer
+ * thread to finish when cancelling.
+ *
+ * @param pool the pool
+ */
+extern void sanei_buf_pool_reader_close (SANEI_Buf_Pool * pool);
+
+/** Give the buffer from sanei_buf_pool_reader_get_buffer() back.
+ *
+ * The buffer must not be accessed afterwards.
+ *
+ * @param pool the pool
+ */
+extern void sanei_buf_pool_reader_put_buffer (SANEI_Buf_Pool * pool);
+
+/** Get the counters collected since the last reset.
+ *
+ * Call this after the transfer. If exhausted is not zero, the writer
+ * had to allocate buffers while scanning; buffers is the count to
+ * preallocate next time.
+ *
+ * @param pool the pool
+ * @param stats the counters
+ */
+extern void
+sanei_buf_pool_get_stats (SANEI_Buf_Pool * pool,
+			  SANEI_Buf_Pool_Stats * stats);
+
+#endif /* sanei_buf_pool_h */
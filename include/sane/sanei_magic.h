@@ -50,6 +50,9 @@
  * - Blank detection (check if density is over a threshold)
  * - Rotate (detect and correct 90 degree increment rotations)
  *
+ * Edge, skew and blank detection are also available line by line, as
+ * the image arrives, see sanei_magic_stream_new().
+ *
  * Note that these functions are simplistic, and are expected to change.
  * Patches and suggestions are welcome.
  */
@@ -98,6 +101,10 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int dpiX, int dpiY, int * centerX, int * centerY, double * finSlope);
 
 /** Correct the skew of the media inside the image, via simple rotation
+ *
+ * The image is rotated in place; besides a strip of rows, no second copy
+ * of it is allocated. Large images are shared out to a few threads when
+ * SANE is built with pthread support.
  *
  * @param params describes image
  * @param buffer contains image data
@@ -219,4 +226,110 @@ extern SANE_Status
 sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
   int angle);
 
+/** Incremental edge, skew and blank detection */
+typedef struct SANEI_Magic_Stream SANEI_Magic_Stream;
+
+/** Start incremental detection for a new page
+ *
+ * Lines are passed to sanei_magic_stream_write() as they arrive, so
+ * results can be had without holding the whole page. The results are
+ * the same sanei_magic_findEdges(), sanei_magic_findSkew() and
+ * sanei_magic_isBlank2() give for the complete image; some of them are
+ * known before the end of the page.
+ *
+ * @param params describes image; the number of lines may be unknown
+ * @param dpiX horizontal resolution
+ * @param dpiY vertical resolution
+ * @param thresh maximum density of a blank page, as for
+ *     sanei_magic_isBlank2()
+ * @param[out] stream the new stream
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - invalid image parameters
+ */
+extern SANE_Status
+sanei_magic_stream_new (SANE_Parameters * params, int dpiX, int dpiY,
+  double thresh, SANEI_Magic_Stream ** stream);
+
+/** Release a stream
+ *
+ * @param stream the stream
+ */
+extern SANE_Status
+sanei_magic_stream_free (SANEI_Magic_Stream * stream);
+
+/** Pass the next lines of the page to a stream
+ *
+ * @param stream the stream
+ * @param buffer complete lines of image data
+ * @param lines number of lines in buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_NO_MEM - not enough memory
+ * - SANE_STATUS_INVAL - the stream is already finished
+ */
+extern SANE_Status
+sanei_magic_stream_write (SANEI_Magic_Stream * stream, SANE_Byte * buffer,
+  int lines);
+
+/** Tell a stream the page is complete, settling all results
+ *
+ * @param stream the stream
+ */
+extern SANE_Status
+sanei_magic_stream_finish (SANEI_Magic_Stream * stream);
+
+/** Get the top edge of the media
+ *
+ * The top edge is known a few lines after the media starts.
+ *
+ * @param stream the stream
+ * @param[out] top the first line with media
+ *
+ * @return
+ * - SANE_STATUS_GOOD - success
+ * - SANE_STATUS_DEVICE_BUSY - not known yet, pass more lines
+ * - SANE_STATUS_UNSUPPORTED - the page is finished, no edges found
+ */
+extern SANE_Status
+sanei_magic_stream_findTop (SANEI_Magic_Stream * stream, int * top);
+
+/** Get the edges of the media, as sanei_magic_findEdges()
+ *
+ * @return
+ * - SANE_STATUS_DEVICE_BUSY - the page is not finished yet
+ * - otherwise as sanei_magic_findEdges()
+ */
+extern SANE_Status
+sanei_magic_stream_findEdges (SANEI_Magic_Stream * stream,
+  int * top, int * bot, int * left, int * right);
+
+/** Get the skew of the media, as sanei_magic_findSkew()
+ *
+ * @return
+ * - SANE_STATUS_DEVICE_BUSY - the page is not finished yet
+ * - otherwise as sanei_magic_findSkew()
+ */
+extern SANE_Status
+sanei_magic_stream_findSkew (SANEI_Magic_Stream * stream,
+  int * centerX, int * centerY, double * finSlope);
+
+/** Check if the page is blank, as sanei_magic_isBlank2()
+ *
+ * A page is known not to be blank half an inch after the first block
+ * that is too dark; that it is blank is only known at the end.
+ *
+ * @param stream the stream
+ *
+ * @return
+ * - SANE_STATUS_GOOD - page is not blank
+ * - SANE_STATUS_NO_DOCS - page is blank
+ * - SANE_STATUS_DEVICE_BUSY - not known yet, pass more lines
+ */
+extern SANE_Status
+sanei_magic_stream_isBlank2 (SANEI_Magic_Stream * stream);
+
 #endif /* SANEI_MAGIC_H */
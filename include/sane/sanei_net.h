@@ -20,7 +20,16 @@
 #include <sane/sane.h>
 #include <sane/sanei_wire.h>
 
-#define SANEI_NET_PROTOCOL_VERSION	3
+/* Version 4 adds SANE_NET_CONTROL_OPTION_BATCH, version 5 lets the
+   client ask for a compressed data stream in SANE_NET_START.  Client
+   and server agree on the lower of their two versions in
+   SANE_NET_INIT.  */
+#define SANEI_NET_PROTOCOL_VERSION	5
+
+/* Set in the build number of the SANE_NET_INIT version code by clients
+   whose frontend accepts compressed frames (SANE_FRAME_JPEG); servers
+   hide them from all other clients.  Older servers ignore the bit.  */
+#define SANE_NET_INIT_COMPRESSED_FRAMES	0x8000
 
 typedef enum
   {
@@ -41,10 +50,24 @@ typedef enum
     SANE_NET_START,
     SANE_NET_CANCEL,
     SANE_NET_AUTHORIZE,
-    SANE_NET_EXIT
+    SANE_NET_EXIT,
+    SANE_NET_CONTROL_OPTION_BATCH	/* protocol version 4 */
   }
 SANE_Net_Procedure_Number;
 
+/* Compression of the data stream (protocol version 5).  Anything but
+   SANE_NET_COMPRESSION_NONE means that the payload of each data record
+   is the next piece of a single zlib stream, ended by a sync flush so
+   the client can inflate record by record.  The values only differ
+   in the amount of CPU time the server spends on compression.  */
+typedef enum
+  {
+    SANE_NET_COMPRESSION_NONE = 0,
+    SANE_NET_COMPRESSION_FAST,
+    SANE_NET_COMPRESSION_BEST
+  }
+SANE_Net_Compression;
+
 typedef struct
   {
     SANE_Word version_code;
@@ -110,12 +133,37 @@ typedef struct
   }
 SANE_Get_Parameters_Reply;
 
+typedef struct
+  {
+    SANE_Word handle;
+    SANE_Word num_reqs;
+    SANE_Control_Option_Req *req;
+    SANE_Word get_parameters;	/* also run GET_PARAMETERS afterwards? */
+  }
+SANE_Control_Option_Batch_Req;
+
+typedef struct
+  {
+    SANE_Word num_replies;
+    SANE_Control_Option_Reply *reply;
+    SANE_Get_Parameters_Reply params;	/* only valid if requested */
+  }
+SANE_Control_Option_Batch_Reply;
+
+typedef struct
+  {
+    SANE_Word handle;
+    SANE_Word compression;	/* protocol version 5 */
+  }
+SANE_Start_Req;
+
 typedef struct
   {
     SANE_Status status;
     SANE_Word port;
     SANE_Word byte_order;
     SANE_String resource_to_authorize;
+    SANE_Word compression;	/* protocol version 5 */
   }
 SANE_Start_Reply;
 
@@ -138,6 +186,11 @@ extern void sanei_w_control_option_reply (Wire *w,
 					  SANE_Control_Option_Reply *reply);
 extern void sanei_w_get_parameters_reply (Wire *w,
 					  SANE_Get_Parameters_Reply *reply);
+extern void sanei_w_control_option_batch_req (Wire *w,
+					      SANE_Control_Option_Batch_Req *req);
+extern void sanei_w_control_option_batch_reply (Wire *w,
+						SANE_Control_Option_Batch_Reply *reply);
+extern void sanei_w_start_req (Wire *w, SANE_Start_Req *req);
 extern void sanei_w_start_reply (Wire *w, SANE_Start_Reply *reply);
 extern void sanei_w_authorization_req (Wire *w, SANE_Authorization_Req *req);
 
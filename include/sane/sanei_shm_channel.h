@@ -0,0 +1,269 @@
+/* sane - Scanner Access Now Easy.
+
+   Copyright (C) 2002 Sergey Vlasov <vsu@altlinux.ru>
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_shm_channel.h
+ * Shared memory channel between a reader task and sane_read().
+ *
+ * Many backends start a reader task with sanei_thread_begin() and pass
+ * the image data to sane_read() through a pipe, which copies every byte
+ * through the kernel twice. A shared memory channel instead consists
+ * of a fixed number of buffers shared by both tasks. Only the one byte
+ * buffer identifiers go through pipes: the writer (the reader task
+ * talking to the scanner) fills a free buffer and puts it into the
+ * channel, the reader (sane_read()) gets it, uses the data and puts it
+ * back.
+ *
+ * The channel works with processes as well as with threads; pass
+ * sanei_thread_is_forked() to sanei_shm_channel_new(). The pipe
+ * carrying filled buffers can be handed out by sane_get_select_fd().
+ *
+ * Typical use:
+ * - sanei_shm_channel_new() before sanei_thread_begin()
+ * - in the reader task: sanei_shm_channel_writer_init(), then
+ *   sanei_shm_channel_writer_get_buffer() and
+ *   sanei_shm_channel_writer_put_buffer() for each block of data,
+ *   and sanei_shm_channel_writer_close() at the end
+ * - in the frontend task: sanei_shm_channel_reader_init() and
+ *   sanei_shm_channel_reader_start(), then
+ *   sanei_shm_channel_reader_get_buffer() and
+ *   sanei_shm_channel_reader_put_buffer() in sane_read()
+ * - sanei_shm_channel_free() after the reader task has finished
+ *
+ * @sa sanei_thread.h
+ */
+
+#ifndef sanei_shm_channel_h
+#define sanei_shm_channel_h
+
+#include "../include/sane/sane.h"
+
+/** Shared memory channel object */
+typedef struct SANEI_Shm_Channel SANEI_Shm_Channel;
+
+/** Create a new shared memory channel.
+ *
+ * This function must be called before the reader task is started.
+ *
+ * @param buf_size size of each buffer in bytes
+ * @param buf_count number of buffers (up to 255)
+ * @param forked SANE_TRUE if the tasks are processes, SANE_FALSE if they
+ *     are threads of the same process; usually sanei_thread_is_forked()
+ * @param shm_channel_return the new channel
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if the buffers or pipes couldn't be created
+ * - SANE_STATUS_INVAL - on invalid parameters
+ */
+extern SANE_Status
+sanei_shm_channel_new (SANE_Int buf_size, SANE_Int buf_count,
+		       SANE_Bool forked,
+		       SANEI_Shm_Channel ** shm_channel_return);
+
+/** Release the channel and all associated resources.
+ *
+ * Both tasks must be done with the channel; with processes, this is
+ * called in the frontend process after the reader process has exited.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status sanei_shm_channel_free (SANEI_Shm_Channel * shm_channel);
+
+/** Initialize the writing half in the reader task.
+ *
+ * With processes, this closes the file descriptors used only by the
+ * frontend process. With threads, it does nothing.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status
+sanei_shm_channel_writer_init (SANEI_Shm_Channel * shm_channel);
+
+/** Get a free buffer for writing.
+ *
+ * Blocks until the reader puts a buffer back, if none is free. Fill
+ * the buffer and pass it on with sanei_shm_channel_writer_put_buffer().
+ *
+ * @param shm_channel the channel
+ * @param buffer_id_return the buffer identifier
+ * @param buffer_addr_return the buffer address
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_EOF - if the reader has closed its half of the channel
+ * - SANE_STATUS_IO_ERROR - on I/O errors
+ */
+extern SANE_Status
+sanei_shm_channel_writer_get_buffer (SANEI_Shm_Channel * shm_channel,
+				     SANE_Int * buffer_id_return,
+				     SANE_Byte ** buffer_addr_return);
+
+/** Pass a filled buffer to the reader.
+ *
+ * @param shm_channel the channel
+ * @param buffer_id the identifier from
+ *     sanei_shm_channel_writer_get_buffer()
+ * @param buffer_bytes number of data bytes in the buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_IO_ERROR - if the reader has closed its half of the
+ *   channel, or on other I/O errors
+ */
+extern SANE_Status
+sanei_shm_channel_writer_put_buffer (SANEI_Shm_Channel * shm_channel,
+				     SANE_Int buffer_id,
+				     SANE_Int buffer_bytes);
+
+/** Close the writing half of the channel.
+ *
+ * The reader gets SANE_STATUS_EOF once it has received all buffers put
+ * before.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status
+sanei_shm_channel_writer_close (SANEI_Shm_Channel * shm_channel);
+
+/** Initialize the reading half in the frontend task.
+ *
+ * With processes, this closes the file descriptors used only by the
+ * reader process. With threads, it does nothing.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status
+sanei_shm_channel_reader_init (SANEI_Shm_Channel * shm_channel);
+
+/** Set non-blocking or blocking mode for reading.
+ *
+ * In non-blocking mode sanei_shm_channel_reader_get_buffer() returns
+ * at once if no filled buffer is available, as needed for
+ * sane_set_io_mode().
+ *
+ * @param shm_channel the channel
+ * @param non_blocking SANE_TRUE for non-blocking mode
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_IO_ERROR - if the mode couldn't be set
+ */
+extern SANE_Status
+sanei_shm_channel_reader_set_io_mode (SANEI_Shm_Channel * shm_channel,
+				      SANE_Bool non_blocking);
+
+/** Get a file descriptor that becomes readable when data is available.
+ *
+ * When select() or poll() reports it readable,
+ * sanei_shm_channel_reader_get_buffer() returns without blocking. This
+ * is the descriptor to hand out by sane_get_select_fd().
+ *
+ * @param shm_channel the channel
+ * @param fd_return the file descriptor
+ */
+extern SANE_Status
+sanei_shm_channel_reader_get_select_fd (SANEI_Shm_Channel * shm_channel,
+					SANE_Int * fd_return);
+
+/** Start the transfer.
+ *
+ * The writer blocks in sanei_shm_channel_writer_get_buffer() until
+ * this function passes it all buffers.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status
+sanei_shm_channel_reader_start (SANEI_Shm_Channel * shm_channel);
+
+/** Get the next filled buffer.
+ *
+ * Buffers arrive in the order they were put by the writer. Pass the
+ * buffer back with sanei_shm_channel_reader_put_buffer() after using
+ * its data.
+ *
+ * @param shm_channel the channel
+ * @param buffer_id_return the buffer identifier
+ * @param buffer_addr_return the buffer address, or NULL in
+ *     non-blocking mode if no buffer is available yet
+ * @param buffer_bytes_return number of data bytes in the buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_EOF - if the writer has closed its half of the channel
+ * - SANE_STATUS_IO_ERROR - on I/O errors
+ */
+extern SANE_Status
+sanei_shm_channel_reader_get_buffer (SANEI_Shm_Channel * shm_channel,
+				     SANE_Int * buffer_id_return,
+				     SANE_Byte ** buffer_addr_return,
+				     SANE_Int * buffer_bytes_return);
+
+/** Give a buffer back to the writer.
+ *
+ * The buffer must not be accessed afterwards.
+ *
+ * @param shm_channel the channel
+ * @param buffer_id the identifier from
+ *     sanei_shm_channel_reader_get_buffer()
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_IO_ERROR - if the writer has closed its half of the
+ *   channel, or on other I/O errors
+ */
+extern SANE_Status
+sanei_shm_channel_reader_put_buffer (SANEI_Shm_Channel * shm_channel,
+				     SANE_Int buffer_id);
+
+/** Close the reading half of the channel.
+ *
+ * The writer gets SANE_STATUS_EOF from
+ * sanei_shm_channel_writer_get_buffer() once no free buffer is left.
+ * Use this to stop the reader task on cancel.
+ *
+ * @param shm_channel the channel
+ */
+extern SANE_Status
+sanei_shm_channel_reader_close (SANEI_Shm_Channel * shm_channel);
+
+#endif /* sanei_shm_channel_h */
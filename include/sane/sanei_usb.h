@@ -344,6 +344,74 @@ extern SANE_Status sanei_usb_reset (SANE_Int dn);
 extern SANE_Status
 sanei_usb_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size);
 
+/** Check if sanei_usb_read_bulk_async_start() and friends are available.
+ */
+#define HAVE_SANEI_USB_READ_BULK_ASYNC
+
+/** Start streaming bulk reads.
+ *
+ * Keeps up to num_transfers reads of transfer_size bytes each queued on
+ * the bulk-in endpoint, so the bus doesn't idle between two reads. The
+ * data is handed out in order by sanei_usb_read_bulk_async_next(). With
+ * libusb-1.0 the reads are asynchronous transfers; with the other access
+ * methods sanei_usb_read_bulk_async_next() falls back to one synchronous
+ * read of transfer_size bytes per call.
+ *
+ * No more than total bytes are requested from the device. A total of 0
+ * keeps reading until sanei_usb_read_bulk_async_stop() is called, which
+ * only makes sense if the device sends data indefinitely.
+ *
+ * @param dn device number
+ * @param transfer_size bytes per transfer, best a multiple of the
+ *     endpoint's maximum packet size
+ * @param num_transfers number of transfers in flight
+ * @param total number of bytes to read, or 0 for no limit
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_NO_MEM - if the buffers couldn't be allocated
+ * - SANE_STATUS_IO_ERROR - if the transfers couldn't be submitted
+ * - SANE_STATUS_INVAL - on every other error
+ */
+extern SANE_Status
+sanei_usb_read_bulk_async_start (SANE_Int dn, size_t transfer_size,
+				 SANE_Int num_transfers, size_t total);
+
+/** Get the next buffer of a bulk read stream.
+ *
+ * Waits for the oldest transfer to complete. The buffer stays valid
+ * until the next call of sanei_usb_read_bulk_async_next() or
+ * sanei_usb_read_bulk_async_stop(); it is then queued again.
+ *
+ * @param dn device number
+ * @param buffer set to the data read
+ * @param size set to the number of bytes in buffer
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_EOF - if total bytes have been handed out, or the device
+ *     sent a zero length packet
+ * - SANE_STATUS_IO_ERROR - if a transfer failed; stop the stream then
+ * - SANE_STATUS_INVAL - on every other error
+ */
+extern SANE_Status
+sanei_usb_read_bulk_async_next (SANE_Int dn, SANE_Byte ** buffer,
+				size_t * size);
+
+/** Stop a bulk read stream.
+ *
+ * Cancels the transfers still in flight and frees the buffers. Data the
+ * device sent for cancelled transfers is lost. Called by
+ * sanei_usb_close() if needed.
+ *
+ * @param dn device number
+ *
+ * @return
+ * - SANE_STATUS_GOOD - on success
+ * - SANE_STATUS_INVAL - if dn is invalid or no stream was started
+ */
+extern SANE_Status sanei_usb_read_bulk_async_stop (SANE_Int dn);
+
 /** Initiate a bulk transfer write.
  *
  * Write up to size bytes from buffer to the device. After the write size
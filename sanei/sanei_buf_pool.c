@@ -0,0 +1,597 @@
+/* sane - Scanner Access Now Easy.
+
+   This file is part of the SANE package.
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+   MA 02111-1307, USA.
+
+   As a special exception, the authors of SANE give permission for
+   additional uses of the libraries contained in this release of SANE.
+
+   The exception is that, if you link a SANE library with other files
+   to produce an executable, this does not by itself cause the
+   resulting executable to be covered by the GNU General Public
+   License.  Your use of that executable is in no way restricted on
+   account of linking the SANE library code into it.
+
+   This exception does not, however, invalidate any other reasons why
+   the executable file might be covered by the GNU General Public
+   License.
+
+   If you submit changes to SANE to the maintainers to be included in
+   a subsequent release, you agree by submitting the changes that
+   those changes may be distributed with this exception intact.
+
+   If you write modifications of your own for SANE, it is your choice
+   whether to permit this exception to apply to your modifications.
+   If you do not wish that, delete this exception notice.
+*/
+
+/** @file sanei_buf_pool.c
+ * Buffer pool implementation.
+ *
+ * The queue is a singly linked list of buffer nodes. The reader's tail
+ * points to the last node it has received and put back; nodes after it
+ * are filled and waiting. Nodes before it are free, so the writer
+ * recycles them from the front of the list and appends them at the end
+ * again, without the reader ever freeing anything. The only shared
+ * words are the next links, written by the writer, and the tail,
+ * written by the reader; memory barriers order them against the buffer
+ * contents. The reader only sleeps on a condition variable when the
+ * queue is empty. With a limit, the writer sleeps on a second one when
+ * no node is free and the pool may not grow; the reader only wakes it
+ * in that case.
+ *
+ * @sa sanei_buf_pool.h
+ */
+
+#include "../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define BACKEND_NAME sanei_buf_pool	/**< name of this module for debugging */
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_debug.h"
+#include "../include/sane/sanei_buf_pool.h"
+
+#ifdef HAVE_PTHREAD_H
+
+/* __sync_synchronize() is a full memory barrier since gcc 4.1; without
+ * it, locking and unlocking a mutex nobody else waits for is one, as
+ * POSIX requires mutex operations to synchronize memory */
+#if defined(__GNUC__) && \
+  (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1))
+#define BUF_POOL_SYNC
+#define BUF_POOL_BARRIER(pool) __sync_synchronize ()
+#else
+#define BUF_POOL_BARRIER(pool) \
+  (pthread_mutex_lock (&(pool)->fence), pthread_mutex_unlock (&(pool)->fence))
+#endif
+
+/** One buffer, followed by its data */
+struct Buf_Pool_Node
+{
+  struct Buf_Pool_Node *volatile next;	/**< Next node, set by the writer */
+  SANE_Int bytes;			/**< Number of data bytes */
+  SANE_Byte *data;			/**< The buffer */
+};
+
+/** Buffer pool.
+ *
+ */
+struct SANEI_Buf_Pool
+{
+  SANE_Int buf_size;			/**< Size of each buffer */
+
+  /* reader side */
+  struct Buf_Pool_Node *volatile tail;	/**< Last node received */
+  volatile SANE_Int released;		/**< Buffers put back */
+  SANE_Int reader_waits;		/**< Times the reader had to sleep */
+
+  /* writer side */
+  struct Buf_Pool_Node *head;		/**< Last node put */
+  struct Buf_Pool_Node *first;		/**< Oldest node, free if not tail */
+  struct Buf_Pool_Node *tail_copy;	/**< Tail as last seen by writer */
+  struct Buf_Pool_Node *filling;	/**< Node being filled */
+  SANE_Int put;				/**< Buffers put */
+  SANE_Int buffers;			/**< Nodes allocated, one more than
+					     can be filled at once */
+  SANE_Int exhausted;			/**< Times no free node was left */
+  SANE_Int max_queued;			/**< Most nodes waiting at once */
+  SANE_Int limit;			/**< Most buffers, 0 for no limit */
+  SANE_Int writer_waits;		/**< Times the writer had to sleep */
+
+  /* shared */
+  volatile SANE_Status status;		/**< Status at end of transfer */
+  volatile SANE_Bool closed;		/**< Writer is done */
+  volatile SANE_Bool waiting;		/**< Reader sleeps or is about to */
+  volatile SANE_Bool writer_waiting;	/**< Writer sleeps or is about to */
+  volatile SANE_Bool reader_closed;	/**< Reader gave up */
+  pthread_mutex_t mutex;		/**< Protects the sleep */
+  pthread_cond_t cond;			/**< Wakes up the reader */
+  pthread_cond_t writer_cond;		/**< Wakes up the writer */
+#ifndef BUF_POOL_SYNC
+  pthread_mutex_t fence;		/**< Used as memory barrier only */
+#endif
+};
+
+/** Allocate a node with its buffer */
+static struct Buf_Pool_Node *
+buf_pool_alloc_node (SANEI_Buf_Pool * pool)
+{
+  struct Buf_Pool_Node *node;
+
+  node = malloc (sizeof (struct Buf_Pool_Node) + pool->buf_size);
+  if (node == NULL)
+    return NULL;
+  node->next = NULL;
+  node->bytes = 0;
+  node->data = (SANE_Byte *) (node + 1);
+  pool->buffers++;
+  return node;
+}
+
+/** Add free nodes in front of the list until buf_count can be filled;
+ * the node the tail points to is never free */
+static SANE_Status
+buf_pool_grow (SANEI_Buf_Pool * pool, SANE_Int buf_count)
+{
+  struct Buf_Pool_Node *node;
+
+  while (pool->buffers < buf_count + 1)
+    {
+      node = buf_pool_alloc_node (pool);
+      if (node == NULL)
+	{
+	  DBG (3, "sanei_buf_pool: no memory for buffer %d of %d\n",
+	       pool->buffers, buf_count);
+	  return SANE_STATUS_NO_MEM;
+	}
+      node->next = pool->first;
+      pool->first = node;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+/** Wake up the reader if it sleeps */
+static void
+buf_pool_wake (SANEI_Buf_Pool * pool)
+{
+  pthread_mutex_lock (&pool->mutex);
+  pthread_cond_signal (&pool->cond);
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+/** Wake up the writer if it sleeps */
+static void
+buf_pool_wake_writer (SANEI_Buf_Pool * pool)
+{
+  pthread_mutex_lock (&pool->mutex);
+  pthread_cond_signal (&pool->writer_cond);
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+/** Sleep until the reader puts a node back or closes the pool; returns
+ * SANE_FALSE if it closed */
+static SANE_Bool
+buf_pool_writer_wait (SANEI_Buf_Pool * pool)
+{
+  SANE_Bool closed;
+
+  /* the reader checks writer_waiting after moving the tail, we check
+   * the tail after setting writer_waiting, so one of us sees the other */
+  pthread_mutex_lock (&pool->mutex);
+  pool->writer_waiting = SANE_TRUE;
+  BUF_POOL_BARRIER (pool);
+  if (pool->tail == pool->tail_copy && !pool->reader_closed)
+    pool->writer_waits++;
+  while (pool->tail == pool->tail_copy && !pool->reader_closed)
+    pthread_cond_wait (&pool->writer_cond, &pool->mutex);
+  pool->writer_waiting = SANE_FALSE;
+  closed = pool->reader_closed;
+  pthread_mutex_unlock (&pool->mutex);
+
+  BUF_POOL_BARRIER (pool);
+  pool->tail_copy = pool->tail;
+  BUF_POOL_BARRIER (pool);
+  return !closed;
+}
+
+SANE_Status
+sanei_buf_pool_new (SANE_Int buf_size, SANE_Int buf_count,
+		    SANEI_Buf_Pool ** pool_return)
+{
+  SANEI_Buf_Pool *pool;
+  SANE_Status status;
+
+  DBG_INIT ();
+
+  if (buf_size <= 0)
+    {
+      DBG (3, "sanei_buf_pool_new: invalid buf_size=%d\n", buf_size);
+      return SANE_STATUS_INVAL;
+    }
+  if (buf_count < 0)
+    {
+      DBG (3, "sanei_buf_pool_new: invalid buf_count=%d\n", buf_count);
+      return SANE_STATUS_INVAL;
+    }
+  if (pool_return == NULL)
+    {
+      DBG (3, "sanei_buf_pool_new: BUG: pool_return==NULL\n");
+      return SANE_STATUS_INVAL;
+    }
+
+  *pool_return = NULL;
+  pool = calloc (1, sizeof (SANEI_Buf_Pool));
+  if (pool == NULL)
+    {
+      DBG (3, "sanei_buf_pool_new: no memory for SANEI_Buf_Pool\n");
+      return SANE_STATUS_NO_MEM;
+    }
+  pool->buf_size = buf_size;
+  pool->status = SANE_STATUS_GOOD;
+
+  /* the list always holds at least the node the tail points to */
+  pool->first = buf_pool_alloc_node (pool);
+  if (pool->first == NULL)
+    {
+      DBG (3, "sanei_buf_pool_new: no memory for buffers\n");
+      free (pool);
+      return SANE_STATUS_NO_MEM;
+    }
+  pool->tail = pool->head = pool->tail_copy = pool->first;
+
+  pthread_mutex_init (&pool->mutex, NULL);
+  pthread_cond_init (&pool->cond, NULL);
+  pthread_cond_init (&pool->writer_cond, NULL);
+#ifndef BUF_POOL_SYNC
+  pthread_mutex_init (&pool->fence, NULL);
+#endif
+
+  status = buf_pool_grow (pool, buf_count);
+  if (status != SANE_STATUS_GOOD)
+    {
+      sanei_buf_pool_free (pool);
+      return status;
+    }
+
+  *pool_return = pool;
+  return SANE_STATUS_GOOD;
+}
+
+void
+sanei_buf_pool_free (SANEI_Buf_Pool * pool)
+{
+  struct Buf_Pool_Node *node, *next;
+
+  if (pool == NULL)
+    return;
+
+  for (node = pool->first; node; node = next)
+    {
+      next = node->next;
+      free (node);
+    }
+  free (pool->filling);
+
+  pthread_mutex_destroy (&pool->mutex);
+  pthread_cond_destroy (&pool->cond);
+  pthread_cond_destroy (&pool->writer_cond);
+#ifndef BUF_POOL_SYNC
+  pthread_mutex_destroy (&pool->fence);
+#endif
+  free (pool);
+}
+
+SANE_Status
+sanei_buf_pool_reset (SANEI_Buf_Pool * pool, SANE_Int buf_count)
+{
+  /* everything queued counts as received, so all nodes but the last
+   * one put are free */
+  pool->tail = pool->tail_copy = pool->head;
+  pool->released = pool->put = 0;
+  pool->status = SANE_STATUS_GOOD;
+  pool->closed = SANE_FALSE;
+  pool->waiting = SANE_FALSE;
+  pool->writer_waiting = SANE_FALSE;
+  pool->reader_closed = SANE_FALSE;
+  pool->exhausted = 0;
+  pool->max_queued = 0;
+  pool->reader_waits = 0;
+  pool->writer_waits = 0;
+
+  return buf_pool_grow (pool, buf_count);
+}
+
+void
+sanei_buf_pool_set_limit (SANEI_Buf_Pool * pool, SANE_Int max_buffers)
+{
+  pool->limit = max_buffers > 0 ? max_buffers : 0;
+}
+
+SANE_Byte *
+sanei_buf_pool_writer_get_buffer (SANEI_Buf_Pool * pool)
+{
+  struct Buf_Pool_Node *node;
+
+  if (pool->filling)
+    return pool->filling->data;
+
+  if (pool->reader_closed)
+    return NULL;
+
+  if (pool->first == pool->tail_copy)
+    {
+      /* see how far the reader has got since */
+      BUF_POOL_BARRIER (pool);
+      pool->tail_copy = pool->tail;
+      BUF_POOL_BARRIER (pool);
+    }
+
+  /* the node the tail points to is not counted as a buffer */
+  if (pool->first == pool->tail_copy && pool->limit
+      && pool->buffers - 1 >= pool->limit)
+    {
+      if (!buf_pool_writer_wait (pool))
+	return NULL;
+    }
+
+  if (pool->first != pool->tail_copy)
+    {
+      node = pool->first;
+      pool->first = node->next;
+    }
+  else
+    {
+      node = buf_pool_alloc_node (pool);
+      if (node == NULL)
+	{
+	  DBG (3, "sanei_buf_pool_writer_get_buffer: no memory for "
+	       "buffer %d\n", pool->buffers);
+	  return NULL;
+	}
+      pool->exhausted++;
+    }
+
+  pool->filling = node;
+  return node->data;
+}
+
+void
+sanei_buf_pool_writer_put_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Int buffer_bytes)
+{
+  struct Buf_Pool_Node *node = pool->filling;
+  SANE_Int queued;
+
+  if (node == NULL)
+    {
+      DBG (3, "sanei_buf_pool_writer_put_buffer: BUG: no buffer to put\n");
+      return;
+    }
+  pool->filling = NULL;
+  node->bytes = buffer_bytes;
+  node->next = NULL;
+
+  /* the data must be there before the reader can see the node, and
+   * the node before we look whether the reader sleeps */
+  BUF_POOL_BARRIER (pool);
+  pool->head->next = node;
+  pool->head = node;
+  BUF_POOL_BARRIER (pool);
+
+  pool->put++;
+  queued = pool->put - pool->released;
+  if (queued > pool->max_queued)
+    pool->max_queued = queued;
+
+  if (pool->waiting)
+    buf_pool_wake (pool);
+}
+
+void
+sanei_buf_pool_writer_close (SANEI_Buf_Pool * pool, SANE_Status status)
+{
+  pool->status = status;
+  BUF_POOL_BARRIER (pool);
+  pool->closed = SANE_TRUE;
+  BUF_POOL_BARRIER (pool);
+  buf_pool_wake (pool);
+}
+
+SANE_Status
+sanei_buf_pool_reader_get_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Byte ** buffer_addr_return,
+				  SANE_Int * buffer_bytes_return)
+{
+  struct Buf_Pool_Node *node;
+  SANE_Bool closed;
+
+  for (;;)
+    {
+      closed = pool->closed;
+      BUF_POOL_BARRIER (pool);
+      node = pool->tail->next;
+      if (node)
+	{
+	  BUF_POOL_BARRIER (pool);
+	  *buffer_addr_return = node->data;
+	  *buffer_bytes_return = node->bytes;
+	  return SANE_STATUS_GOOD;
+	}
+      if (closed)
+	{
+	  *buffer_addr_return = NULL;
+	  *buffer_bytes_return = 0;
+	  return pool->status;
+	}
+
+      /* the writer checks waiting after linking a node, we check for a
+       * node after setting waiting, so one of us sees the other */
+      pthread_mutex_lock (&pool->mutex);
+      pool->waiting = SANE_TRUE;
+      BUF_POOL_BARRIER (pool);
+      if (pool->tail->next == NULL && !pool->closed)
+	{
+	  pool->reader_waits++;
+	  pthread_cond_wait (&pool->cond, &pool->mutex);
+	}
+      pool->waiting = SANE_FALSE;
+      pthread_mutex_unlock (&pool->mutex);
+    }
+}
+
+void
+sanei_buf_pool_reader_put_buffer (SANEI_Buf_Pool * pool)
+{
+  struct Buf_Pool_Node *node = pool->tail->next;
+
+  if (node == NULL)
+    {
+      DBG (3, "sanei_buf_pool_reader_put_buffer: BUG: no buffer to put\n");
+      return;
+    }
+
+  /* done with the data before the writer may reuse the node */
+  BUF_POOL_BARRIER (pool);
+  pool->tail = node;
+  pool->released++;
+
+  /* and the node there before we look whether the writer sleeps */
+  if (pool->limit)
+    {
+      BUF_POOL_BARRIER (pool);
+      if (pool->writer_waiting)
+	buf_pool_wake_writer (pool);
+    }
+}
+
+void
+sanei_buf_pool_reader_close (SANEI_Buf_Pool * pool)
+{
+  pthread_mutex_lock (&pool->mutex);
+  pool->reader_closed = SANE_TRUE;
+  pthread_cond_signal (&pool->writer_cond);
+  pthread_mutex_unlock (&pool->mutex);
+}
+
+void
+sanei_buf_pool_get_stats (SANEI_Buf_Pool * pool,
+			  SANEI_Buf_Pool_Stats * stats)
+{
+  BUF_POOL_BARRIER (pool);
+  stats->buffers = pool->buffers - 1;
+  stats->exhausted = pool->exhausted;
+  stats->max_queued = pool->max_queued;
+  stats->reader_waits = pool->reader_waits;
+  stats->writer_waits = pool->writer_waits;
+}
+
+#else /* !HAVE_PTHREAD_H */
+
+SANE_Status
+sanei_buf_pool_new (SANE_Int buf_size, SANE_Int buf_count,
+		    SANEI_Buf_Pool ** pool_return)
+{
+  DBG_INIT ();
+  DBG (3, "sanei_buf_pool_new: not supported without pthreads\n");
+  (void) buf_size;
+  (void) buf_count;
+  if (pool_return)
+    *pool_return = NULL;
+  return SANE_STATUS_UNSUPPORTED;
+}
+
+void
+sanei_buf_pool_free (SANEI_Buf_Pool * pool)
+{
+  (void) pool;
+}
+
+SANE_Status
+sanei_buf_pool_reset (SANEI_Buf_Pool * pool, SANE_Int buf_count)
+{
+  (void) pool;
+  (void) buf_count;
+  return SANE_STATUS_UNSUPPORTED;
+}
+
+void
+sanei_buf_pool_set_limit (SANEI_Buf_Pool * pool, SANE_Int max_buffers)
+{
+  (void) pool;
+  (void) max_buffers;
+}
+
+SANE_Byte *
+sanei_buf_pool_writer_get_buffer (SANEI_Buf_Pool * pool)
+{
+  (void) pool;
+  return NULL;
+}
+
+void
+sanei_buf_pool_writer_put_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Int buffer_bytes)
+{
+  (void) pool;
+  (void) buffer_bytes;
+}
+
+void
+sanei_buf_pool_writer_close (SANEI_Buf_Pool * pool, SANE_Status status)
+{
+  (void) pool;
+  (void) status;
+}
+
+SANE_Status
+sanei_buf_pool_reader_get_buffer (SANEI_Buf_Pool * pool,
+				  SANE_Byte ** buffer_addr_return,
+				  SANE_Int * buffer_bytes_return)
+{
+  (void) pool;
+  *buffer_addr_return = NULL;
+  *buffer_bytes_return = 0;
+  return SANE_STATUS_UNSUPPORTED;
+}
+
+void
+sanei_buf_pool_reader_close (SANEI_Buf_Pool * pool)
+{
+  (void) pool;
+}
+
+void
+sanei_buf_pool_reader_put_buffer (SANEI_Buf_Pool * pool)
+{
+  (void) pool;
+}
+
+void
+sanei_buf_pool_get_stats (SANEI_Buf_Pool * pool,
+			  SANEI_Buf_Pool_Stats * stats)
+{
+  (void) pool;
+  memset (stats, 0, sizeof (SANEI_Buf_Pool_Stats));
+}
+
+#endif /* HAVE_PTHREAD_H */
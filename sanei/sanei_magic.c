@@ -50,12 +50,73 @@
 #include <errno.h>
 #include <math.h>
 
+#ifdef USE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
 #define BACKEND_NAME sanei_magic      /* name of this module for debugging */
 
 #include "../include/sane/sane.h"
 #include "../include/sane/sanei_debug.h"
 #include "../include/sane/sanei_magic.h"
 
+/* sanei_magic_rotate() works on bands of output rows, in tiles of
+ * columns; within a tile, coordinates step in 16.16 fixed point */
+#define ROT_BAND_LINES 32
+#define ROT_TILE_PIXELS 64
+#define ROT_SHIFT 16
+#define ROT_ONE (1 << ROT_SHIFT)
+
+/* keeps fixed point values within a tile positive, see rotateTiles() */
+#define ROT_BIAS 128
+
+/* images smaller than this many pixels are not worth extra threads */
+#define ROT_POOL_PIXELS (1024*1024)
+#define ROT_POOL_MAX 4
+
+struct rotateJob
+{
+  int pwidth;
+  int height;
+  int bwidth;
+  int depth;          /* bytes per pixel, 0 for lineart */
+  int centerX;
+  int centerY;
+  double slopeSin;
+  double slopeCos;
+  int stepX;          /* fixed point change per output column */
+  int stepY;
+  int bg_color;
+  int tiles;
+
+  /* source rows, either in the image or saved in the ring */
+  SANE_Byte ** rows;
+
+  /* the band of output rows being built */
+  SANE_Byte * band;
+  int first;
+  int lines;
+
+#ifdef USE_PTHREAD
+  /* helper threads, each building its share of the tiles of a band */
+  pthread_t threads[ROT_POOL_MAX];
+  pthread_mutex_t lock;
+  pthread_cond_t go;
+  pthread_cond_t done;
+  int started;
+  int generation;
+  int pending;
+  int quit;
+  int nextTile;
+  int chunk;
+#endif
+  int workers;        /* including the calling thread */
+};
+
 /* prototypes for utility functions defined at bottom of file */
 int * sanei_magic_getTransY (
   SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top);
@@ -69,6 +130,41 @@ static SANE_Status getTopEdge (int width, int height, int resolution,
 static SANE_Status getLeftEdge (int width, int height, int * top, int * bot,
  double slope, int * finXInter, int * finYInter);
 
+static SANE_Status getEdges (int width, int height, int * topBuf,
+  int * botBuf, int * leftBuf, int * rightBuf, int * top, int * bot,
+  int * left, int * right);
+
+static SANE_Status getSkew (int pwidth, int height, int dpiY, int * topBuf,
+  int * botBuf, int * centerX, int * centerY, double * finSlope);
+
+static int getTransRow (SANE_Parameters * params, SANE_Byte * line,
+  int left);
+
+static void filterTrans (int * buff, int first, int last, int dpi,
+  int empty);
+
+static void streamColumns (SANEI_Magic_Stream * s, SANE_Byte * line, int r);
+
+static void streamBlocks (SANEI_Magic_Stream * s, SANE_Byte * line, int r);
+
+static void runMin (const int * v, int n, int w, int * out, int * fwd,
+  int * bwd);
+
+static SANE_Status despeckColor (SANE_Parameters * params,
+  SANE_Byte * buffer, int diam, int spp);
+
+static SANE_Status despeckBinary (SANE_Parameters * params,
+  SANE_Byte * buffer, int diam);
+
+static void rotateTiles (struct rotateJob * job, int firstTile,
+  int lastTile);
+
+static void rotateStartPool (struct rotateJob * job);
+
+static void rotateRunBand (struct rotateJob * job);
+
+static void rotateStopPool (struct rotateJob * job);
+
 static SANE_Status getLine (int height, int width, int * buff,
   int slopes, double minSlope, double maxSlope,
   int offsets, int minOffset, int maxOffset,
@@ -88,178 +184,18 @@ sanei_magic_despeck (SANE_Parameters * params, SANE_Byte * buffer,
 
   SANE_Status ret = SANE_STATUS_GOOD;
 
-  int pw = params->pixels_per_line;
-  int bw = params->bytes_per_line;
-  int h  = params->lines;
-  int bt = bw*h;
-
-  int i,j,k,l,n;
-
   DBG (10, "sanei_magic_despeck: start\n");
 
   if(params->format == SANE_FRAME_RGB){
-
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
-
-        int thresh = 255*3;
-        int outer[] = {0,0,0};
-        int hits = 0;
-
-        /* loop over rows and columns in window */
-        /* find darkest pixel */
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            int tmp = 0;
-
-            for(n=0; n<3; n++){
-              tmp += buffer[i + j*3 + k*bw + l*3 + n];
-            }
-
-            if(tmp < thresh)
-              thresh = tmp;
-          }
-        }
-
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255*3 + 255*3)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
-
-            int tmp[3];
-  
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            for(n=0; n<3; n++){
-              tmp[n] = buffer[i + j*3 + k*bw + l*3 + n];
-              outer[n] += tmp[n];
-            }
-            if(tmp[0]+tmp[1]+tmp[2] < thresh){
-              hits++;
-              break;
-            }
-          }
-        }
-
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
-
-          /* per channel replacement color */
-          for(n=0; n<3; n++){
-            outer[n] /= (4*diam + 4);
-          }
-
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              for(n=0; n<3; n++){
-                buffer[i + j*3 + k*bw + l*3 + n] = outer[n];
-              }
-            }
-          }
-        }
-      }
-    }
+    ret = despeckColor (params, buffer, diam, 3);
   }
 
   else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
-
-        int thresh = 255;
-        int outer = 0;
-        int hits = 0;
-
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            if(buffer[i + j + k*bw + l] < thresh)
-              thresh = buffer[i + j + k*bw + l];
-          }
-        }
-
-        /* convert darkest pixel into a brighter threshold */
-        thresh = (thresh + 255 + 255)/3;
-  
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
-
-            int tmp = 0;
-
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            tmp = buffer[i + j + k*bw + l];
-
-            if(tmp < thresh){
-              hits++;
-              break;
-            }
-
-            outer += tmp;
-          }
-        }
-
-        /*no hits, overwrite with avg surrounding color*/
-        if(!hits){
-          /* replacement color */
-          outer /= (4*diam + 4);
-
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + j + k*bw + l] = outer;
-            }
-          }
-        }
-      }
-    }
+    ret = despeckColor (params, buffer, diam, 1);
   }
 
   else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
-    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
-      for(j=1; j<pw-1-diam; j++){
-        
-        int curr = 0;
-        int hits = 0;
-
-        for(k=0; k<diam; k++){
-          for(l=0; l<diam; l++){
-            curr += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
-          }
-        }
-
-        if(!curr)
-          continue;
-
-        /*loop over rows and columns around window */
-        for(k=-1; k<diam+1; k++){
-          for(l=-1; l<diam+1; l++){
-
-            /* dont count pixels in the window */
-            if(k != -1 && k != diam && l != -1 && l != diam)
-              continue;
-  
-            hits += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
-
-            if(hits)
-              break;
-          }
-        }
-
-        /*no hits, overwrite with white*/
-        if(!hits){
-          for(k=0; k<diam; k++){
-            for(l=0; l<diam; l++){
-              buffer[i + k*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
-            }
-          }
-        }
-      }
-    }
+    ret = despeckBinary (params, buffer, diam);
   }
 
   else{
@@ -285,11 +221,6 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
   int * topBuf = NULL, * botBuf = NULL;
   int * leftBuf = NULL, * rightBuf = NULL;
 
-  int topCount = 0, botCount = 0;
-  int leftCount = 0, rightCount = 0;
-
-  int i;
-
   DBG (10, "sanei_magic_findEdges: start\n");
 
   /* get buffers to find sides and bottom */
@@ -321,102 +252,8 @@ sanei_magic_findEdges(SANE_Parameters * params, SANE_Byte * buffer,
     goto cleanup;
   }
 
-  /* loop thru left and right lists, look for top and bottom extremes */
-  *top = height;
-  for(i=0; i<height; i++){
-    if(rightBuf[i] > leftBuf[i]){
-      if(*top > i){
-        *top = i;
-      }
-
-      topCount++;
-      if(topCount > 3){
-        break;
-      }
-    }
-    else{
-      topCount = 0;
-      *top = height;
-    }
-  }
-
-  *bot = -1;
-  for(i=height-1; i>=0; i--){
-    if(rightBuf[i] > leftBuf[i]){
-      if(*bot < i){
-        *bot = i;
-      }
-
-      botCount++;
-      if(botCount > 3){
-        break;
-      }
-    }
-    else{
-      botCount = 0;
-      *bot = -1;
-    }
-  }
-
-  /* could not find top/bot edges */
-  if(*top > *bot){
-    DBG (5, "sanei_magic_findEdges: bad t/b edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
-  }
-
-  /* loop thru top and bottom lists, look for l and r extremes
-   * NOTE: We dont look above the top or below the bottom found previously.
-   * This prevents issues with adf scanners that pad the image after the
-   * paper runs out (usually with white) */
-  DBG (5, "sanei_magic_findEdges: bb0:%d tb0:%d b:%d t:%d\n",
-    botBuf[0], topBuf[0], *bot, *top);
-
-  *left = width;
-  for(i=0; i<width; i++){
-    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
-      if(*left > i){
-        *left = i;
-      }
-
-      leftCount++;
-      if(leftCount > 3){
-        break;
-      }
-    }
-    else{
-      leftCount = 0;
-      *left = width;
-    }
-  }
-
-  *right = -1;
-  for(i=width-1; i>=0; i--){
-    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
-      if(*right < i){
-        *right = i;
-      }
-
-      rightCount++;
-      if(rightCount > 3){
-        break;
-      }
-    }
-    else{
-      rightCount = 0;
-      *right = -1;
-    }
-  }
-
-  /* could not find left/right edges */
-  if(*left > *right){
-    DBG (5, "sanei_magic_findEdges: bad l/r edges\n");
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
-  }
-
-  DBG (15, "sanei_magic_findEdges: t:%d b:%d l:%d r:%d\n",
-    *top,*bot,*left,*right);
+  ret = getEdges (width, height, topBuf, botBuf, leftBuf, rightBuf,
+    top, bot, left, right);
 
   cleanup:
   if(topBuf)
@@ -510,21 +347,6 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
   int pwidth = params->pixels_per_line;
   int height = params->lines;
 
-  double TSlope = 0;
-  int TXInter = 0;
-  int TYInter = 0;
-  double TSlopeHalf = 0;
-  int TOffsetHalf = 0;
-
-  double LSlope = 0;
-  int LXInter = 0;
-  int LYInter = 0;
-  double LSlopeHalf = 0;
-  int LOffsetHalf = 0;
-
-  int rotateX = 0;
-  int rotateY = 0;
-
   int * topBuf = NULL, * botBuf = NULL;
 
   DBG (10, "sanei_magic_findSkew: start\n");
@@ -546,48 +368,8 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
     goto cleanup;
   }
 
-  /* find best top line */
-  ret = getTopEdge (pwidth, height, dpiY, topBuf,
-    &TSlope, &TXInter, &TYInter);
-  if(ret){
-    DBG(5,"sanei_magic_findSkew: gTE error: %d",ret);
-    goto cleanup;
-  }
-  DBG(15,"top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
-
-  /* slope is too shallow, don't want to divide by 0 */
-  if(fabs(TSlope) < 0.0001){
-    DBG(15,"sanei_magic_findSkew: slope too shallow: %0.08f\n",TSlope);
-    ret = SANE_STATUS_UNSUPPORTED;
-    goto cleanup;
-  }
-
-  /* find best left line, perpendicular to top line */
-  LSlope = (double)-1/TSlope;
-  ret = getLeftEdge (pwidth, height, topBuf, botBuf, LSlope,
-    &LXInter, &LYInter);
-  if(ret){
-    DBG(5,"sanei_magic_findSkew: gLE error: %d",ret);
-    goto cleanup;
-  }
-  DBG(15,"sanei_magic_findSkew: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
-
-  /* find point about which to rotate */
-  TSlopeHalf = tan(atan(TSlope)/2);
-  TOffsetHalf = LYInter;
-  DBG(15,"sanei_magic_findSkew: top half: %04.04f %d\n",TSlopeHalf,TOffsetHalf);
-
-  LSlopeHalf = tan((atan(LSlope) + ((LSlope < 0)?-M_PI_2:M_PI_2))/2);
-  LOffsetHalf = - LSlopeHalf * TXInter;
-  DBG(15,"sanei_magic_findSkew: left half: %04.04f %d\n",LSlopeHalf,LOffsetHalf);
-
-  rotateX = (LOffsetHalf-TOffsetHalf) / (TSlopeHalf-LSlopeHalf);
-  rotateY = TSlopeHalf * rotateX + TOffsetHalf;
-  DBG(15,"sanei_magic_findSkew: rotate: %d %d\n",rotateX,rotateY);
-
-  *centerX = rotateX;
-  *centerY = rotateY;
-  *finSlope = TSlope;
+  ret = getSkew (pwidth, height, dpiY, topBuf, botBuf,
+    centerX, centerY, finSlope);
 
   cleanup:
   if(topBuf)
@@ -601,8 +383,14 @@ sanei_magic_findSkew(SANE_Parameters * params, SANE_Byte * buffer,
 
 /* function to do a simple rotation by a given slope, around
  * a given point. The point can be outside of image to get
- * proper edge alignment. Unused areas filled with bg color
- * FIXME: Do in-place rotation to save memory */
+ * proper edge alignment. Unused areas filled with bg color.
+ *
+ * The output is built a band of ROT_BAND_LINES rows at a time, each
+ * band in tiles of ROT_TILE_PIXELS columns. Source coordinates are
+ * computed exactly at the start of each tile row and stepped in fixed
+ * point across it. Once a band is done, the original rows it replaces
+ * are saved in a ring of the rows later bands can still reach, so the
+ * extra memory is a strip of the image instead of a full copy. */
 SANE_Status
 sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
   int centerX, int centerY, double slope, int bg_color)
@@ -617,100 +405,111 @@ sanei_magic_rotate (SANE_Parameters * params, SANE_Byte * buffer,
   int pwidth = params->pixels_per_line;
   int bwidth = params->bytes_per_line;
   int height = params->lines;
-  int depth = 1;
 
-  unsigned char * outbuf;
-  int i, j, k;
+  struct rotateJob job;
+  SANE_Byte * ring = NULL;
+  int reach, ringLines, bandLines;
+  int i, k;
 
   DBG(10,"sanei_magic_rotate: start: %d %d\n",centerX,centerY);
 
-  outbuf = malloc(bwidth*height);
-  if(!outbuf){
-    DBG(15,"sanei_magic_rotate: no outbuf\n");
-    ret = SANE_STATUS_NO_MEM;
+  memset(&job,0,sizeof(job));
+
+  if(params->format == SANE_FRAME_RGB){
+    job.depth = 3;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
+    job.depth = 1;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    job.depth = 0;
+    if(bg_color)
+      bg_color = 0xff;
+  }
+  else{
+    DBG (5, "sanei_magic_rotate: unsupported format/depth\n");
+    ret = SANE_STATUS_INVAL;
     goto cleanup;
   }
 
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  if(pwidth < 1 || height < 1)
+    goto cleanup;
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
-
-    memset(outbuf,bg_color,bwidth*height);
-
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
-    
-        for (k=0; k<depth; k++) {
-          outbuf[i*bwidth+j*depth+k]
-            = buffer[sourceY*bwidth+sourceX*depth+k];
-        }
-      }
-    }
+  /* output row i reads source rows at most reach rows away from it */
+  {
+    double dy = abs(centerY) > abs(centerY-height+1)
+      ? abs(centerY) : abs(centerY-height+1);
+    double dx = abs(centerX) > abs(centerX-pwidth+1)
+      ? abs(centerX) : abs(centerX-pwidth+1);
+    double r = dy * (1 - slopeCos) + dx * fabs(slopeSin) + 2;
+
+    reach = (r < height) ? (int)r : height;
+  }
+
+  bandLines = ROT_BAND_LINES < height ? ROT_BAND_LINES : height;
+  ringLines = reach;
+
+  DBG(15,"sanei_magic_rotate: reach %d, ring %d lines\n",reach,ringLines);
+
+  job.pwidth = pwidth;
+  job.height = height;
+  job.bwidth = bwidth;
+  job.centerX = centerX;
+  job.centerY = centerY;
+  job.slopeSin = slopeSin;
+  job.slopeCos = slopeCos;
+  job.stepX = -(int)floor(slopeCos * ROT_ONE + 0.5);
+  job.stepY = -(int)floor(slopeSin * ROT_ONE + 0.5);
+  job.bg_color = bg_color;
+  job.tiles = (pwidth + ROT_TILE_PIXELS - 1) / ROT_TILE_PIXELS;
+
+  job.rows = malloc(height * sizeof(SANE_Byte *));
+  job.band = malloc(bandLines * bwidth);
+  ring = malloc(ringLines * bwidth);
+  if(!job.rows || !job.band || !ring){
+    DBG(15,"sanei_magic_rotate: no buffers\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
   }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  /* rows not yet replaced are read from the image itself */
+  for(i=0; i<height; i++)
+    job.rows[i] = buffer + i*bwidth;
 
-    if(bg_color)
-      bg_color = 0xff;
+  rotateStartPool(&job);
 
-    memset(outbuf,bg_color,bwidth*height);
+  for(i=0; i<height; i+=bandLines){
 
-    for (i=0; i<height; i++) {
-      int shiftY = centerY - i;
-    
-      for (j=0; j<pwidth; j++) {
-        int shiftX = centerX - j;
-        int sourceX, sourceY;
-    
-        sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
-        if (sourceX < 0 || sourceX >= pwidth)
-          continue;
-    
-        sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
-        if (sourceY < 0 || sourceY >= height)
-          continue;
+    job.first = i;
+    job.lines = (height - i < bandLines) ? height - i : bandLines;
 
-        /* wipe out old bit */
-        outbuf[i*bwidth + j/8] &= ~(1 << (7-(j%8)));
+    memset(job.band,bg_color,job.lines*bwidth);
+    rotateRunBand(&job);
 
-        /* fill in new bit */
-        outbuf[i*bwidth + j/8] |= 
-          ((buffer[sourceY*bwidth + sourceX/8]
-          >> (7-(sourceX%8))) & 1) << (7-(j%8));
-      }
+    /* keep the original rows, then replace them */
+    for(k=i; k<i+job.lines; k++){
+      SANE_Byte * save = ring + (k % ringLines)*bwidth;
+
+      memcpy(save, buffer + k*bwidth, bwidth);
+      job.rows[k] = save;
+      memcpy(buffer + k*bwidth, job.band + (k-i)*bwidth, bwidth);
     }
   }
-  else{
-    DBG (5, "sanei_magic_rotate: unsupported format/depth\n");
-    ret = SANE_STATUS_INVAL;
-    goto cleanup;
-  }
 
-  memcpy(buffer,outbuf,bwidth*height);
+  rotateStopPool(&job);
 
   cleanup:
 
-  if(outbuf)
-    free(outbuf);
+  if(job.rows)
+    free(job.rows);
+  if(job.band)
+    free(job.band);
+  if(ring)
+    free(ring);
 
   DBG(10,"sanei_magic_rotate: finish\n");
 
-  return 0;
+  return ret;
 }
 
 SANE_Status
@@ -1260,682 +1059,1874 @@ sanei_magic_turn(SANE_Parameters * params, SANE_Byte * buffer,
   return ret;
 }
 
-/* Utility functions, not used outside this file */
+/* Incremental versions of sanei_magic_findEdges(), sanei_magic_findSkew()
+ * and sanei_magic_isBlank2(), for backends that would rather not hold
+ * the whole page before they can tell the frontend anything about it.
+ *
+ * Each line is reduced as it arrives: per row, the transitions from the
+ * left and right; per column, sliding window sums over a small ring of
+ * rows, for the transitions from the top and bottom; per half inch
+ * block, the density. The windows, thresholds and neighbor filters are
+ * the same as in sanei_magic_getTransX() and sanei_magic_getTransY(),
+ * so the final results match the whole page functions exactly. */
+
+/* window length, as used by sanei_magic_getTransY() */
+#define STREAM_WIN 9
+#define STREAM_RING (STREAM_WIN*2+1)
+
+struct SANEI_Magic_Stream
+{
+  SANE_Parameters params;
+  int dpiX;
+  int dpiY;
+  int spp;             /* samples per pixel, 0 for lineart */
+  int lines;           /* lines received so far */
+  int finished;
+
+  /* per column: first transition from the top, or -1, and the last
+   * transition from the bottom found so far, or -1 */
+  int * topBuf;
+  int * botBuf;
+
+  /* per column: gray/color window sums from the top and bottom, or for
+   * lineart the last line each bit value was seen */
+  int * nearT;
+  int * farT;
+  int * nearB;
+  int * farB;
+
+  /* per column sample sums of the last STREAM_RING lines; for lineart
+   * the bits of the first and last line */
+  int * ring;
+
+  /* per line: transitions from the left and right */
+  int * leftBuf;
+  int * rightBuf;
+  int alloc;
+  int filtered;        /* lines already through filterTrans() */
+
+  /* top edge, as sanei_magic_findEdges() looks for it */
+  int topScan;
+  int topCount;
+  int top;
+  int topFound;
+
+  /* half inch blocks of sanei_magic_isBlank2() */
+  double thresh;
+  int xquarter;
+  int yquarter;
+  int xhalf;
+  int yhalf;
+  int xblocks;
+  double * blockSums;
+  int darkBand;        /* first row of blocks with a dark one, or -1 */
+
+  /* results, once finished */
+  SANE_Status edgesRet;
+  int edges[4];
+  SANE_Status skewRet;
+  int centerX;
+  int centerY;
+  double slope;
+};
 
-/* Repeatedly call getLine to find the best range of slope and offset.
- * Shift the ranges thru 4 different positions to avoid splitting data
- * across multiple bins (false positive). Home-in on the most likely upper
- * line of the paper inside the image. Return the 'best' edge. */
-static SANE_Status
-getTopEdge(int width, int height, int resolution,
-  int * buff, double * finSlope, int * finXInter, int * finYInter)
+SANE_Status
+sanei_magic_stream_new (SANE_Parameters * params, int dpiX, int dpiY,
+  double thresh, SANEI_Magic_Stream ** stream)
 {
-  SANE_Status ret = SANE_STATUS_GOOD;
+  SANEI_Magic_Stream * s;
+  int width = params->pixels_per_line;
+  int i;
 
-  int slopes = 31;
-  int offsets = 31;
-  double maxSlope = 1;
-  double minSlope = -1;
-  int maxOffset = resolution;
-  int minOffset = -resolution;
+  DBG (10, "sanei_magic_stream_new: start\n");
 
-  double topSlope = 0;
-  int topOffset = 0;
-  int topDensity = 0;
-  
-  int i,j;
-  int pass = 0;
+  *stream = NULL;
 
-  DBG(10,"getTopEdge: start\n");
+  if(width < 1){
+    DBG (5, "sanei_magic_stream_new: bad width\n");
+    return SANE_STATUS_INVAL;
+  }
 
-  while(pass++ < 7){
-    double sStep = (maxSlope-minSlope)/slopes;
-    int oStep = (maxOffset-minOffset)/offsets;
+  s = calloc(1,sizeof(SANEI_Magic_Stream));
+  if(!s){
+    DBG (5, "sanei_magic_stream_new: no stream\n");
+    return SANE_STATUS_NO_MEM;
+  }
 
-    double slope = 0;
-    int offset = 0;
-    int density = 0;
-    int go = 0;
+  s->params = *params;
+  s->dpiX = dpiX;
+  s->dpiY = dpiY;
 
-    topSlope = 0;
-    topOffset = 0;
-    topDensity = 0;
+  if(params->format == SANE_FRAME_RGB && params->depth == 8){
+    s->spp = 3;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
+    s->spp = 1;
+  }
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    s->spp = 0;
+  }
+  else{
+    DBG (5, "sanei_magic_stream_new: unsupported format/depth\n");
+    free(s);
+    return SANE_STATUS_INVAL;
+  }
 
-    /* find lines 4 times with slightly moved params,
-     * to bypass binning errors, highest density wins */
-    for(i=0;i<2;i++){
-      double sStep2 = sStep*i/2;
-      for(j=0;j<2;j++){
-        int oStep2 = oStep*j/2;
-        ret = getLine(height,width,buff,slopes,minSlope+sStep2,maxSlope+sStep2,offsets,minOffset+oStep2,maxOffset+oStep2,&slope,&offset,&density);
-        if(ret){
-          DBG(5,"getTopEdge: getLine error %d\n",ret);
-          return ret;
-        }
-        DBG(15,"getTopEdge: %d %d %+0.4f %d %d\n",i,j,slope,offset,density);
+  /* same block layout as sanei_magic_isBlank2() */
+  s->thresh = thresh/100;
+  s->xquarter = dpiX/4/8*8;
+  s->yquarter = dpiY/4/8*8;
+  s->xhalf = s->xquarter*2;
+  s->yhalf = s->yquarter*2;
+  if(s->xhalf > 0)
+    s->xblocks = (width-s->xhalf)/s->xhalf;
+  if(s->xblocks < 0)
+    s->xblocks = 0;
+  s->darkBand = -1;
+
+  s->alloc = params->lines > 0 ? params->lines : 1024;
+  s->top = -1;
+
+  s->topBuf = malloc(width * sizeof(int));
+  s->botBuf = malloc(width * sizeof(int));
+  s->nearT = calloc(width * 4, sizeof(int));
+  s->ring = calloc(width * STREAM_RING, sizeof(int));
+  s->leftBuf = malloc(s->alloc * sizeof(int));
+  s->rightBuf = malloc(s->alloc * sizeof(int));
+  s->blockSums = calloc(s->xblocks + 1, sizeof(double));
+
+  if(!s->topBuf || !s->botBuf || !s->nearT || !s->ring
+    || !s->leftBuf || !s->rightBuf || !s->blockSums
+  ){
+    DBG (5, "sanei_magic_stream_new: no buffers\n");
+    sanei_magic_stream_free(s);
+    return SANE_STATUS_NO_MEM;
+  }
 
-        if(density > topDensity){
-          topSlope = slope;
-          topOffset = offset;
-          topDensity = density;
-        }
-      }
+  s->farT = s->nearT + width;
+  s->nearB = s->nearT + width*2;
+  s->farB = s->nearT + width*3;
+
+  for(i=0; i<width; i++){
+    s->topBuf[i] = -1;
+    s->botBuf[i] = -1;
+    if(!s->spp){
+      s->nearB[i] = -1;
+      s->farB[i] = -1;
     }
+  }
 
-    DBG(15,"getTopEdge: ok %+0.4f %d %d\n",topSlope,topOffset,topDensity);
+  *stream = s;
 
-    /* did not find anything promising on first pass,
-     * give up instead of fixating on some small, pointless feature */
-    if(pass == 1 && topDensity < width/5){
-      DBG(5,"getTopEdge: density too small %d %d\n",topDensity,width);
-      topOffset = 0;
-      topSlope = 0;
-      break;
-    }
+  DBG (10, "sanei_magic_stream_new: finish\n");
+  return SANE_STATUS_GOOD;
+}
 
-    /* if slope can zoom in some more, do so. */
-    if(sStep >= 0.0001){
-      minSlope = topSlope - sStep;
-      maxSlope = topSlope + sStep;
-      go = 1;
-    }
+SANE_Status
+sanei_magic_stream_free (SANEI_Magic_Stream * stream)
+{
+  if(!stream)
+    return SANE_STATUS_INVAL;
 
-    /* if offset can zoom in some more, do so. */
-    if(oStep){
-      minOffset = topOffset - oStep;
-      maxOffset = topOffset + oStep;
-      go = 1;
-    }
+  if(stream->topBuf)
+    free(stream->topBuf);
+  if(stream->botBuf)
+    free(stream->botBuf);
+  if(stream->nearT)
+    free(stream->nearT);
+  if(stream->ring)
+    free(stream->ring);
+  if(stream->leftBuf)
+    free(stream->leftBuf);
+  if(stream->rightBuf)
+    free(stream->rightBuf);
+  if(stream->blockSums)
+    free(stream->blockSums);
+  free(stream);
+
+  return SANE_STATUS_GOOD;
+}
 
-    /* cannot zoom in more, bail out */
-    if(!go){
-      break;
-    }
+SANE_Status
+sanei_magic_stream_write (SANEI_Magic_Stream * stream, SANE_Byte * buffer,
+  int lines)
+{
+  SANEI_Magic_Stream * s = stream;
+  int n;
 
-    DBG(15,"getTopEdge: zoom: %+0.4f %+0.4f %d %d\n",
-      minSlope,maxSlope,minOffset,maxOffset);
+  if(s->finished){
+    DBG (5, "sanei_magic_stream_write: already finished\n");
+    return SANE_STATUS_INVAL;
   }
 
-  /* topOffset is in the center of the image,
-   * convert to x and y intercept */
-  if(topSlope != 0){
-    *finYInter = topOffset - topSlope * width/2;
-    *finXInter = *finYInter / -topSlope;
-    *finSlope = topSlope;
-  }
-  else{
-    *finYInter = 0;
-    *finXInter = 0;
-    *finSlope = 0;
-  }
+  for(n=0; n<lines; n++){
 
-  DBG(10,"getTopEdge: finish\n");
+    SANE_Byte * line = buffer + n*s->params.bytes_per_line;
+    int r = s->lines;
 
-  return 0;
+    /* transitions from the left and right */
+    if(r == s->alloc){
+      int * left = realloc(s->leftBuf, s->alloc * 2 * sizeof(int));
+      int * right;
+
+      if(left)
+        s->leftBuf = left;
+      right = realloc(s->rightBuf, s->alloc * 2 * sizeof(int));
+      if(right)
+        s->rightBuf = right;
+      if(!left || !right){
+        DBG (5, "sanei_magic_stream_write: no buffers\n");
+        return SANE_STATUS_NO_MEM;
+      }
+      s->alloc *= 2;
+    }
+
+    s->leftBuf[r] = getTransRow(&s->params, line, 1);
+    s->rightBuf[r] = getTransRow(&s->params, line, 0);
+
+    streamColumns(s, line, r);
+    streamBlocks(s, line, r);
+
+    s->lines++;
+
+    /* a line is filtered once the 7 after it are known */
+    for(; s->filtered + 7 < s->lines; s->filtered++){
+      filterTrans(s->leftBuf, s->filtered, s->filtered+1, s->dpiX,
+        s->params.pixels_per_line);
+      filterTrans(s->rightBuf, s->filtered, s->filtered+1, s->dpiX, -1);
+    }
+
+    /* the first run of 4 lines with media in them is the top edge */
+    for(; !s->topFound && s->topScan < s->filtered; s->topScan++){
+      int i = s->topScan;
+
+      if(s->rightBuf[i] > s->leftBuf[i]){
+        if(s->top < 0)
+          s->top = i;
+        s->topCount++;
+        if(s->topCount > 3){
+          s->topFound = 1;
+          DBG (15, "sanei_magic_stream_write: top %d\n", s->top);
+        }
+      }
+      else{
+        s->topCount = 0;
+        s->top = -1;
+      }
+    }
+  }
+
+  return SANE_STATUS_GOOD;
 }
 
-/* Loop thru a transition array, and use a simplified Hough transform
- * to divide likely edges into a 2-d array of bins. Then weight each
- * bin based on its angle and offset. Return the 'best' bin. */
-static SANE_Status
-getLine (int height, int width, int * buff,
-  int slopes, double minSlope, double maxSlope,
-  int offsets, int minOffset, int maxOffset,
-  double * finSlope, int * finOffset, int * finDensity)
+SANE_Status
+sanei_magic_stream_finish (SANEI_Magic_Stream * stream)
 {
-  SANE_Status ret = 0;
+  SANEI_Magic_Stream * s = stream;
+  int width = s->params.pixels_per_line;
+  int height = s->lines;
+  int i;
 
-  int ** lines = NULL;
-  int i, j;
-  int rise, run;
-  double slope;
-  int offset;
-  int sIndex, oIndex;
-  int hWidth = width/2;
+  DBG (10, "sanei_magic_stream_finish: start %d\n", height);
 
-  double * slopeCenter = NULL;
-  int * slopeScale = NULL;
-  double * offsetCenter = NULL;
-  int * offsetScale = NULL;
+  if(s->finished)
+    return SANE_STATUS_GOOD;
 
-  int maxDensity = 1;
-  double absMaxSlope = fabs(maxSlope);
-  double absMinSlope = fabs(minSlope);
-  int absMaxOffset = abs(maxOffset);
-  int absMinOffset = abs(minOffset);
+  s->finished = 1;
+  s->params.lines = height;
 
-  DBG(10,"getLine: start %+0.4f %+0.4f %d %d\n",
-    minSlope,maxSlope,minOffset,maxOffset);
+  if(s->spp){
 
-  /*silence compiler*/
-  height = height;
+    /* the last transitions from the bottom have windows reaching past
+     * the last line, which count as more copies of it */
+    int first = height - STREAM_WIN*2 + 1;
 
-  if(absMaxSlope < absMinSlope)
-    absMaxSlope = absMinSlope;
+    if(first < 0)
+      first = 0;
 
-  if(absMaxOffset < absMinOffset)
-    absMaxOffset = absMinOffset;
+    for(i=0; i<width; i++){
+      int j;
 
-  /* build an array of pretty-print values for slope */
-  slopeCenter = calloc(slopes,sizeof(double));
-  if(!slopeCenter){
-    DBG(5,"getLine: cant load slopeCenter\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
-  }
+      for(j=height-2; j>=first; j--){
+        int near = 0, far = 0, t;
 
-  /* build an array of scaling factors for slope */
-  slopeScale = calloc(slopes,sizeof(int));
-  if(!slopeScale){
-    DBG(5,"getLine: cant load slopeScale\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
-  }
+        for(t=0; t<STREAM_WIN*2; t++){
+          int y = (j+t < height) ? j+t : height-1;
+          int v = s->ring[(y % STREAM_RING)*width + i];
 
-  for(j=0;j<slopes;j++){
+          if(t < STREAM_WIN)
+            near += v;
+          else
+            far += v;
+        }
 
-    /* find central value of this 'bucket' */
-    slopeCenter[j] = (
-      (double)j*(maxSlope-minSlope)/slopes+minSlope 
-      + (double)(j+1)*(maxSlope-minSlope)/slopes+minSlope
-    )/2;
+        if(abs(near - far) > 50*STREAM_WIN*s->spp - near*40/255){
+          s->botBuf[i] = j;
+          break;
+        }
+      }
+    }
+  }
+  else if(height > 0){
 
-    /* scale value from the requested range into an inverted 100-1 range
-     * input close to 0 makes output close to 100 */
-    slopeScale[j] = 101 - fabs(slopeCenter[j])*100/absMaxSlope;
+    /* last change from the color of the last line */
+    for(i=0; i<width; i++){
+      s->botBuf[i] = s->ring[width+i] ? s->farB[i] : s->nearB[i];
+    }
   }
 
-  /* build an array of pretty-print values for offset */
-  offsetCenter = calloc(offsets,sizeof(double));
-  if(!offsetCenter){
-    DBG(5,"getLine: cant load offsetCenter\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  for(i=0; i<width; i++){
+    if(s->topBuf[i] < 0)
+      s->topBuf[i] = height;
   }
 
-  /* build an array of scaling factors for offset */
-  offsetScale = calloc(offsets,sizeof(int));
-  if(!offsetScale){
-    DBG(5,"getLine: cant load offsetScale\n");
-    ret = SANE_STATUS_NO_MEM;
+  filterTrans(s->topBuf, 0, width-7, s->dpiY, height);
+  filterTrans(s->botBuf, 0, width-7, s->dpiY, -1);
+
+  s->edgesRet = getEdges (width, height, s->topBuf, s->botBuf,
+    s->leftBuf, s->rightBuf,
+    &s->edges[0], &s->edges[1], &s->edges[2], &s->edges[3]);
+
+  s->skewRet = getSkew (width, height, s->dpiY, s->topBuf, s->botBuf,
+    &s->centerX, &s->centerY, &s->slope);
+
+  DBG (10, "sanei_magic_stream_finish: finish\n");
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_magic_stream_findTop (SANEI_Magic_Stream * stream, int * top)
+{
+  if(stream->topFound){
+    *top = stream->top;
+    return SANE_STATUS_GOOD;
+  }
+
+  if(stream->finished){
+    *top = stream->edges[0];
+    return stream->edgesRet;
+  }
+
+  return SANE_STATUS_DEVICE_BUSY;
+}
+
+SANE_Status
+sanei_magic_stream_findEdges (SANEI_Magic_Stream * stream,
+  int * top, int * bot, int * left, int * right)
+{
+  if(!stream->finished)
+    return SANE_STATUS_DEVICE_BUSY;
+
+  *top = stream->edges[0];
+  *bot = stream->edges[1];
+  *left = stream->edges[2];
+  *right = stream->edges[3];
+
+  return stream->edgesRet;
+}
+
+SANE_Status
+sanei_magic_stream_findSkew (SANEI_Magic_Stream * stream,
+  int * centerX, int * centerY, double * finSlope)
+{
+  if(!stream->finished)
+    return SANE_STATUS_DEVICE_BUSY;
+
+  *centerX = stream->centerX;
+  *centerY = stream->centerY;
+  *finSlope = stream->slope;
+
+  return stream->skewRet;
+}
+
+SANE_Status
+sanei_magic_stream_isBlank2 (SANEI_Magic_Stream * stream)
+{
+  /* a row of blocks only counts if another half inch follows it */
+  if(stream->darkBand >= 0
+    && stream->lines >= (stream->darkBand+2) * stream->yhalf
+  ){
+    return SANE_STATUS_GOOD;
+  }
+
+  if(stream->finished)
+    return SANE_STATUS_NO_DOCS;
+
+  return SANE_STATUS_DEVICE_BUSY;
+}
+
+/* Utility functions, not used outside this file */
+
+/* Pick the edges of the media from the transitions found from each side
+ * by sanei_magic_getTransX() and sanei_magic_getTransY() */
+static SANE_Status
+getEdges (int width, int height, int * topBuf, int * botBuf,
+  int * leftBuf, int * rightBuf, int * top, int * bot, int * left,
+  int * right)
+{
+  int topCount = 0, botCount = 0;
+  int leftCount = 0, rightCount = 0;
+
+  int i;
+
+  /* loop thru left and right lists, look for top and bottom extremes */
+  *top = height;
+  for(i=0; i<height; i++){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*top > i){
+        *top = i;
+      }
+
+      topCount++;
+      if(topCount > 3){
+        break;
+      }
+    }
+    else{
+      topCount = 0;
+      *top = height;
+    }
+  }
+
+  *bot = -1;
+  for(i=height-1; i>=0; i--){
+    if(rightBuf[i] > leftBuf[i]){
+      if(*bot < i){
+        *bot = i;
+      }
+
+      botCount++;
+      if(botCount > 3){
+        break;
+      }
+    }
+    else{
+      botCount = 0;
+      *bot = -1;
+    }
+  }
+
+  /* could not find top/bot edges */
+  if(*top > *bot){
+    DBG (5, "getEdges: bad t/b edges\n");
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  /* loop thru top and bottom lists, look for l and r extremes
+   * NOTE: We dont look above the top or below the bottom found previously.
+   * This prevents issues with adf scanners that pad the image after the
+   * paper runs out (usually with white) */
+  DBG (5, "getEdges: bb0:%d tb0:%d b:%d t:%d\n",
+    botBuf[0], topBuf[0], *bot, *top);
+
+  *left = width;
+  for(i=0; i<width; i++){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*left > i){
+        *left = i;
+      }
+
+      leftCount++;
+      if(leftCount > 3){
+        break;
+      }
+    }
+    else{
+      leftCount = 0;
+      *left = width;
+    }
+  }
+
+  *right = -1;
+  for(i=width-1; i>=0; i--){
+    if(botBuf[i] > topBuf[i] && (botBuf[i]-10 < *bot || topBuf[i]+10 > *top)){
+      if(*right < i){
+        *right = i;
+      }
+
+      rightCount++;
+      if(rightCount > 3){
+        break;
+      }
+    }
+    else{
+      rightCount = 0;
+      *right = -1;
+    }
+  }
+
+  /* could not find left/right edges */
+  if(*left > *right){
+    DBG (5, "getEdges: bad l/r edges\n");
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  DBG (15, "getEdges: t:%d b:%d l:%d r:%d\n",
+    *top,*bot,*left,*right);
+
+  return SANE_STATUS_GOOD;
+}
+
+/* Find the angle of the media and the point to rotate it about from the
+ * transitions found from the top and bottom by sanei_magic_getTransY() */
+static SANE_Status
+getSkew (int pwidth, int height, int dpiY, int * topBuf, int * botBuf,
+  int * centerX, int * centerY, double * finSlope)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  double TSlope = 0;
+  int TXInter = 0;
+  int TYInter = 0;
+  double TSlopeHalf = 0;
+  int TOffsetHalf = 0;
+
+  double LSlope = 0;
+  int LXInter = 0;
+  int LYInter = 0;
+  double LSlopeHalf = 0;
+  int LOffsetHalf = 0;
+
+  int rotateX = 0;
+  int rotateY = 0;
+
+  /* find best top line */
+  ret = getTopEdge (pwidth, height, dpiY, topBuf,
+    &TSlope, &TXInter, &TYInter);
+  if(ret){
+    DBG(5,"getSkew: gTE error: %d",ret);
+    return ret;
+  }
+  DBG(15,"top: %04.04f %d %d\n",TSlope,TXInter,TYInter);
+
+  /* slope is too shallow, don't want to divide by 0 */
+  if(fabs(TSlope) < 0.0001){
+    DBG(15,"getSkew: slope too shallow: %0.08f\n",TSlope);
+    return SANE_STATUS_UNSUPPORTED;
+  }
+
+  /* find best left line, perpendicular to top line */
+  LSlope = (double)-1/TSlope;
+  ret = getLeftEdge (pwidth, height, topBuf, botBuf, LSlope,
+    &LXInter, &LYInter);
+  if(ret){
+    DBG(5,"getSkew: gLE error: %d",ret);
+    return ret;
+  }
+  DBG(15,"getSkew: left: %04.04f %d %d\n",LSlope,LXInter,LYInter);
+
+  /* find point about which to rotate */
+  TSlopeHalf = tan(atan(TSlope)/2);
+  TOffsetHalf = LYInter;
+  DBG(15,"getSkew: top half: %04.04f %d\n",TSlopeHalf,TOffsetHalf);
+
+  LSlopeHalf = tan((atan(LSlope) + ((LSlope < 0)?-M_PI_2:M_PI_2))/2);
+  LOffsetHalf = - LSlopeHalf * TXInter;
+  DBG(15,"getSkew: left half: %04.04f %d\n",LSlopeHalf,LOffsetHalf);
+
+  rotateX = (LOffsetHalf-TOffsetHalf) / (TSlopeHalf-LSlopeHalf);
+  rotateY = TSlopeHalf * rotateX + TOffsetHalf;
+  DBG(15,"getSkew: rotate: %d %d\n",rotateX,rotateY);
+
+  *centerX = rotateX;
+  *centerY = rotateY;
+  *finSlope = TSlope;
+
+  return ret;
+}
+
+/* Repeatedly call getLine to find the best range of slope and offset.
+ * Shift the ranges thru 4 different positions to avoid splitting data
+ * across multiple bins (false positive). Home-in on the most likely upper
+ * line of the paper inside the image. Return the 'best' edge. */
+static SANE_Status
+getTopEdge(int width, int height, int resolution,
+  int * buff, double * finSlope, int * finXInter, int * finYInter)
+{
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int slopes = 31;
+  int offsets = 31;
+  double maxSlope = 1;
+  double minSlope = -1;
+  int maxOffset = resolution;
+  int minOffset = -resolution;
+
+  double topSlope = 0;
+  int topOffset = 0;
+  int topDensity = 0;
+  
+  int i,j;
+  int pass = 0;
+
+  DBG(10,"getTopEdge: start\n");
+
+  while(pass++ < 7){
+    double sStep = (maxSlope-minSlope)/slopes;
+    int oStep = (maxOffset-minOffset)/offsets;
+
+    double slope = 0;
+    int offset = 0;
+    int density = 0;
+    int go = 0;
+
+    topSlope = 0;
+    topOffset = 0;
+    topDensity = 0;
+
+    /* find lines 4 times with slightly moved params,
+     * to bypass binning errors, highest density wins */
+    for(i=0;i<2;i++){
+      double sStep2 = sStep*i/2;
+      for(j=0;j<2;j++){
+        int oStep2 = oStep*j/2;
+        ret = getLine(height,width,buff,slopes,minSlope+sStep2,maxSlope+sStep2,offsets,minOffset+oStep2,maxOffset+oStep2,&slope,&offset,&density);
+        if(ret){
+          DBG(5,"getTopEdge: getLine error %d\n",ret);
+          return ret;
+        }
+        DBG(15,"getTopEdge: %d %d %+0.4f %d %d\n",i,j,slope,offset,density);
+
+        if(density > topDensity){
+          topSlope = slope;
+          topOffset = offset;
+          topDensity = density;
+        }
+      }
+    }
+
+    DBG(15,"getTopEdge: ok %+0.4f %d %d\n",topSlope,topOffset,topDensity);
+
+    /* did not find anything promising on first pass,
+     * give up instead of fixating on some small, pointless feature */
+    if(pass == 1 && topDensity < width/5){
+      DBG(5,"getTopEdge: density too small %d %d\n",topDensity,width);
+      topOffset = 0;
+      topSlope = 0;
+      break;
+    }
+
+    /* if slope can zoom in some more, do so. */
+    if(sStep >= 0.0001){
+      minSlope = topSlope - sStep;
+      maxSlope = topSlope + sStep;
+      go = 1;
+    }
+
+    /* if offset can zoom in some more, do so. */
+    if(oStep){
+      minOffset = topOffset - oStep;
+      maxOffset = topOffset + oStep;
+      go = 1;
+    }
+
+    /* cannot zoom in more, bail out */
+    if(!go){
+      break;
+    }
+
+    DBG(15,"getTopEdge: zoom: %+0.4f %+0.4f %d %d\n",
+      minSlope,maxSlope,minOffset,maxOffset);
+  }
+
+  /* topOffset is in the center of the image,
+   * convert to x and y intercept */
+  if(topSlope != 0){
+    *finYInter = topOffset - topSlope * width/2;
+    *finXInter = *finYInter / -topSlope;
+    *finSlope = topSlope;
+  }
+  else{
+    *finYInter = 0;
+    *finXInter = 0;
+    *finSlope = 0;
+  }
+
+  DBG(10,"getTopEdge: finish\n");
+
+  return 0;
+}
+
+/* Loop thru a transition array, and use a simplified Hough transform
+ * to divide likely edges into a 2-d array of bins. Then weight each
+ * bin based on its angle and offset. Return the 'best' bin. */
+static SANE_Status
+getLine (int height, int width, int * buff,
+  int slopes, double minSlope, double maxSlope,
+  int offsets, int minOffset, int maxOffset,
+  double * finSlope, int * finOffset, int * finDensity)
+{
+  SANE_Status ret = 0;
+
+  int ** lines = NULL;
+  int i, j;
+  int rise, run;
+  double slope;
+  int offset;
+  int sIndex, oIndex;
+  int hWidth = width/2;
+
+  double * slopeCenter = NULL;
+  int * slopeScale = NULL;
+  double * offsetCenter = NULL;
+  int * offsetScale = NULL;
+
+  int maxDensity = 1;
+  double absMaxSlope = fabs(maxSlope);
+  double absMinSlope = fabs(minSlope);
+  int absMaxOffset = abs(maxOffset);
+  int absMinOffset = abs(minOffset);
+
+  DBG(10,"getLine: start %+0.4f %+0.4f %d %d\n",
+    minSlope,maxSlope,minOffset,maxOffset);
+
+  /*silence compiler*/
+  height = height;
+
+  if(absMaxSlope < absMinSlope)
+    absMaxSlope = absMinSlope;
+
+  if(absMaxOffset < absMinOffset)
+    absMaxOffset = absMinOffset;
+
+  /* build an array of pretty-print values for slope */
+  slopeCenter = calloc(slopes,sizeof(double));
+  if(!slopeCenter){
+    DBG(5,"getLine: cant load slopeCenter\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  /* build an array of scaling factors for slope */
+  slopeScale = calloc(slopes,sizeof(int));
+  if(!slopeScale){
+    DBG(5,"getLine: cant load slopeScale\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  for(j=0;j<slopes;j++){
+
+    /* find central value of this 'bucket' */
+    slopeCenter[j] = (
+      (double)j*(maxSlope-minSlope)/slopes+minSlope 
+      + (double)(j+1)*(maxSlope-minSlope)/slopes+minSlope
+    )/2;
+
+    /* scale value from the requested range into an inverted 100-1 range
+     * input close to 0 makes output close to 100 */
+    slopeScale[j] = 101 - fabs(slopeCenter[j])*100/absMaxSlope;
+  }
+
+  /* build an array of pretty-print values for offset */
+  offsetCenter = calloc(offsets,sizeof(double));
+  if(!offsetCenter){
+    DBG(5,"getLine: cant load offsetCenter\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  /* build an array of scaling factors for offset */
+  offsetScale = calloc(offsets,sizeof(int));
+  if(!offsetScale){
+    DBG(5,"getLine: cant load offsetScale\n");
+    ret = SANE_STATUS_NO_MEM;
+    goto cleanup;
+  }
+
+  for(j=0;j<offsets;j++){
+
+    /* find central value of this 'bucket'*/
+    offsetCenter[j] = (
+      (double)j/offsets*(maxOffset-minOffset)+minOffset
+      + (double)(j+1)/offsets*(maxOffset-minOffset)+minOffset
+    )/2;
+
+    /* scale value from the requested range into an inverted 100-1 range
+     * input close to 0 makes output close to 100 */
+    offsetScale[j] = 101 - fabs(offsetCenter[j])*100/absMaxOffset;
+  }
+
+  /* build 2-d array of 'density', divided into slope and offset ranges */
+  lines = calloc(slopes, sizeof(int *));
+  if(!lines){
+    DBG(5,"getLine: cant load lines\n");
+    ret = SANE_STATUS_NO_MEM;
     goto cleanup;
   }
 
-  for(j=0;j<offsets;j++){
+  for(i=0;i<slopes;i++){
+    if(!(lines[i] = calloc(offsets, sizeof(int)))){
+      DBG(5,"getLine: cant load lines %d\n",i);
+      ret = SANE_STATUS_NO_MEM;
+      goto cleanup;
+    }
+  }
+
+  for(i=0;i<width;i++){
+    for(j=i+1;j<width && j<i+width/3;j++){
+
+      /*FIXME: check for invalid (min/max) values?*/
+      rise = buff[j] - buff[i];
+      run = j-i;
+
+      slope = (double)rise/run;
+      if(slope >= maxSlope || slope < minSlope)
+        continue;
+
+      /* offset in center of width, not y intercept! */
+      offset = slope * hWidth + buff[i] - slope * i;
+      if(offset >= maxOffset || offset < minOffset)
+        continue;
+
+      sIndex = (slope - minSlope) * slopes/(maxSlope-minSlope);
+      if(sIndex >= slopes)
+        continue;
+
+      oIndex = (offset - minOffset) * offsets/(maxOffset-minOffset);
+      if(oIndex >= offsets)
+        continue;
+
+      lines[sIndex][oIndex]++;
+    }
+  }
+
+  /* go thru array, and find most dense line (highest number) */
+  for(i=0;i<slopes;i++){
+    for(j=0;j<offsets;j++){
+      if(lines[i][j] > maxDensity)
+        maxDensity = lines[i][j];
+    }
+  }
+  
+  DBG(15,"getLine: maxDensity %d\n",maxDensity);
+
+  *finSlope = 0;
+  *finOffset = 0;
+  *finDensity = 0;
+
+  /* go thru array, and scale densities to % of maximum, plus adjust for
+   * prefered (smaller absolute value) slope and offset */
+  for(i=0;i<slopes;i++){
+    for(j=0;j<offsets;j++){
+      lines[i][j] = (float)lines[i][j] / maxDensity * slopeScale[i] * offsetScale[j];
+      if(lines[i][j] > *finDensity){
+        *finDensity = lines[i][j];
+        *finSlope = slopeCenter[i];
+        *finOffset = offsetCenter[j];
+      }
+    }
+  }
+  
+  if(0){
+    fprintf(stderr,"offsetCenter:       ");
+    for(j=0;j<offsets;j++){
+      fprintf(stderr," %+04.0f",offsetCenter[j]);
+    }
+    fprintf(stderr,"\n");
+  
+    fprintf(stderr,"offsetScale:        ");
+    for(j=0;j<offsets;j++){
+      fprintf(stderr," %04d",offsetScale[j]);
+    }
+    fprintf(stderr,"\n");
+  
+    for(i=0;i<slopes;i++){
+      fprintf(stderr,"slope: %02d %+02.2f %03d:",i,slopeCenter[i],slopeScale[i]);
+      for(j=0;j<offsets;j++){
+        fprintf(stderr,"% 5d",lines[i][j]);
+      }
+      fprintf(stderr,"\n");
+    }
+  }
+
+  /* dont forget to cleanup */
+  cleanup:
+  for(i=0;i<slopes;i++){
+    if(lines[i])
+      free(lines[i]);
+  }
+  if(lines)
+    free(lines);
+  if(slopeCenter)
+    free(slopeCenter);
+  if(slopeScale)
+    free(slopeScale);
+  if(offsetCenter)
+    free(offsetCenter);
+  if(offsetScale)
+    free(offsetScale);
+
+  DBG(10,"getLine: finish\n");
+
+  return ret;
+}
+
+/* find the left side of paper by moving a line 
+ * perpendicular to top slope across the image
+ * the 'left-most' point on the paper is the
+ * one with the smallest X intercept
+ * return x and y intercepts */
+static SANE_Status 
+getLeftEdge (int width, int height, int * top, int * bot,
+ double slope, int * finXInter, int * finYInter)
+{
+
+  int i;
+  int topXInter, topYInter;
+  int botXInter, botYInter;
+  int leftCount;
+
+  DBG(10,"getEdgeSlope: start\n");
+
+  topXInter = width;
+  topYInter = 0;
+  leftCount = 0;
+
+  for(i=0;i<width;i++){
+    
+    if(top[i] < height){
+      int tyi = top[i] - (slope * i);
+      int txi = tyi/-slope;
+
+      if(topXInter > txi){
+        topXInter = txi;
+        topYInter = tyi;
+      }
+
+      leftCount++;
+      if(leftCount > 5){
+        break;
+      }
+    }
+    else{
+      topXInter = width;
+      topYInter = 0;
+      leftCount = 0;
+    }
+  }
+
+  botXInter = width;
+  botYInter = 0;
+  leftCount = 0;
+
+  for(i=0;i<width;i++){
+    
+    if(bot[i] > -1){
+
+      int byi = bot[i] - (slope * i);
+      int bxi = byi/-slope;
+
+      if(botXInter > bxi){
+        botXInter = bxi;
+        botYInter = byi;
+      }
+
+      leftCount++;
+      if(leftCount > 5){
+        break;
+      }
+    }
+    else{
+      botXInter = width;
+      botYInter = 0;
+      leftCount = 0;
+    }
+  }
+
+  if(botXInter < topXInter){
+    *finXInter = botXInter;
+    *finYInter = botYInter;
+  }
+  else{
+    *finXInter = topXInter;
+    *finYInter = topYInter;
+  }
+
+  DBG(10,"getEdgeSlope: finish\n");
+
+  return 0;
+}
+
+/* Loop thru the image and look for first color change in each column.
+ * Return a malloc'd array. Caller is responsible for freeing. */
+int * 
+sanei_magic_getTransY (
+  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top)
+{
+  int * buff;
+
+  int i, j, k;
+  int winLen = 9;
+
+  int width = params->pixels_per_line;
+  int height = params->lines;
+  int depth = 1;
+
+  /* defaults for bottom-up */
+  int firstLine = height-1;
+  int lastLine = -1;
+  int direction = -1;
+
+  DBG (10, "sanei_magic_getTransY: start\n");
+
+  /* override for top-down */
+  if(top){
+    firstLine = 0;
+    lastLine = height;
+    direction = 1;
+  }
+
+  /* build output and preload with impossible value */
+  buff = calloc(width,sizeof(int));
+  if(!buff){
+    DBG (5, "sanei_magic_getTransY: no buff\n");
+    return NULL;
+  }
+  for(i=0; i<width; i++)
+    buff[i] = lastLine;
+
+  /* load the buff array with y value for first color change from edge
+   * gray/color uses a different algo from binary/halftone */
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    if(params->format == SANE_FRAME_RGB)
+      depth = 3;
+
+    /* loop over all columns, find first transition */
+    for(i=0; i<width; i++){
+
+      int near = 0;
+      int far = 0;
+
+      /* load the near and far windows with repeated copy of first pixel */
+      for(k=0; k<depth; k++){
+        near += buffer[(firstLine*width+i) * depth + k];
+      }
+      near *= winLen;
+      far = near;
+  
+      /* move windows, check delta */
+      for(j=firstLine+direction; j!=lastLine; j+=direction){
+  
+        int farLine = j-winLen*2*direction;
+        int nearLine = j-winLen*direction;
+
+        if(farLine < 0 || farLine >= height){
+          farLine = firstLine;
+        }
+        if(nearLine < 0 || nearLine >= height){
+          nearLine = firstLine;
+        }
+
+        for(k=0; k<depth; k++){
+          far -= buffer[(farLine*width+i)*depth+k];
+          far += buffer[(nearLine*width+i)*depth+k];
+
+          near -= buffer[(nearLine*width+i)*depth+k];
+          near += buffer[(j*width+i)*depth+k];
+        }
+
+        /* significant transition */
+        if(abs(near - far) > 50*winLen*depth - near*40/255){
+          buff[i] = j;
+          break;
+        }
+      }
+    }
+  }
+
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+
+    int near = 0;
+
+    for(i=0; i<width; i++){
+  
+      /* load the near window with first pixel */
+      near = buffer[(firstLine*width+i)/8] >> (7-(i%8)) & 1;
+  
+      /* move */
+      for(j=firstLine+direction; j!=lastLine; j+=direction){
+        if((buffer[(j*width+i)/8] >> (7-(i%8)) & 1) != near){
+          buff[i] = j;
+          break;
+        }
+      }
+    }
+  }
+
+  /* some other format? */
+  else{
+    DBG (5, "sanei_magic_getTransY: unsupported format/depth\n");
+    free(buff);
+    return NULL;
+  }
+
+  /* ignore transitions with few neighbors within .5 inch */
+  filterTrans(buff, 0, width-7, dpi, lastLine);
+
+  DBG (10, "sanei_magic_getTransY: finish\n");
 
-    /* find central value of this 'bucket'*/
-    offsetCenter[j] = (
-      (double)j/offsets*(maxOffset-minOffset)+minOffset
-      + (double)(j+1)/offsets*(maxOffset-minOffset)+minOffset
-    )/2;
+  return buff;
+}
 
-    /* scale value from the requested range into an inverted 100-1 range
-     * input close to 0 makes output close to 100 */
-    offsetScale[j] = 101 - fabs(offsetCenter[j])*100/absMaxOffset;
+/* Loop thru the image height and look for first color change in each row.
+ * Return a malloc'd array. Caller is responsible for freeing. */
+int * 
+sanei_magic_getTransX (
+  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left)
+{
+  int * buff;
+
+  int i;
+
+  int bwidth = params->bytes_per_line;
+  int width = params->pixels_per_line;
+  int height = params->lines;
+
+  DBG (10, "sanei_magic_getTransX: start\n");
+
+  if(!(params->format == SANE_FRAME_RGB
+    || (params->format == SANE_FRAME_GRAY && params->depth == 8)
+    || (params->format == SANE_FRAME_GRAY && params->depth == 1))
+  ){
+    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
+    return NULL;
   }
 
-  /* build 2-d array of 'density', divided into slope and offset ranges */
-  lines = calloc(slopes, sizeof(int *));
-  if(!lines){
-    DBG(5,"getLine: cant load lines\n");
-    ret = SANE_STATUS_NO_MEM;
-    goto cleanup;
+  /* build output */
+  buff = calloc(height,sizeof(int));
+  if(!buff){
+    DBG (5, "sanei_magic_getTransX: no buff\n");
+    return NULL;
   }
 
-  for(i=0;i<slopes;i++){
-    if(!(lines[i] = calloc(offsets, sizeof(int)))){
-      DBG(5,"getLine: cant load lines %d\n",i);
-      ret = SANE_STATUS_NO_MEM;
-      goto cleanup;
-    }
+  /* load the buff array with x value for first color change from edge */
+  for(i=0; i<height; i++){
+    buff[i] = getTransRow(params, buffer + i*bwidth, left);
   }
 
-  for(i=0;i<width;i++){
-    for(j=i+1;j<width && j<i+width/3;j++){
+  /* ignore transitions with few neighbors within .5 inch */
+  filterTrans(buff, 0, height-7, dpi, left ? width : -1);
 
-      /*FIXME: check for invalid (min/max) values?*/
-      rise = buff[j] - buff[i];
-      run = j-i;
+  DBG (10, "sanei_magic_getTransX: finish\n");
 
-      slope = (double)rise/run;
-      if(slope >= maxSlope || slope < minSlope)
-        continue;
+  return buff;
+}
 
-      /* offset in center of width, not y intercept! */
-      offset = slope * hWidth + buff[i] - slope * i;
-      if(offset >= maxOffset || offset < minOffset)
-        continue;
+/* Look for the first color change in one row, from the left or right.
+ * gray/color uses a different algo from binary/halftone. Return the x
+ * value, or one past the far end if there is none. */
+static int
+getTransRow (SANE_Parameters * params, SANE_Byte * line, int left)
+{
+  int j, k;
+  int winLen = 9;
 
-      sIndex = (slope - minSlope) * slopes/(maxSlope-minSlope);
-      if(sIndex >= slopes)
-        continue;
+  int width = params->pixels_per_line;
+  int depth = 1;
 
-      oIndex = (offset - minOffset) * offsets/(maxOffset-minOffset);
-      if(oIndex >= offsets)
-        continue;
+  /* defaults for right-first */
+  int firstCol = width-1;
+  int lastCol = -1;
+  int direction = -1;
 
-      lines[sIndex][oIndex]++;
-    }
+  /* override for left-first*/
+  if(left){
+    firstCol = 0;
+    lastCol = width;
+    direction = 1;
   }
 
-  /* go thru array, and find most dense line (highest number) */
-  for(i=0;i<slopes;i++){
-    for(j=0;j<offsets;j++){
-      if(lines[i][j] > maxDensity)
-        maxDensity = lines[i][j];
+  if(params->format == SANE_FRAME_RGB || 
+    (params->format == SANE_FRAME_GRAY && params->depth == 8)
+  ){
+
+    int near = 0;
+    int far = 0;
+
+    if(params->format == SANE_FRAME_RGB)
+      depth = 3;
+
+    /* load the near and far windows with repeated copy of first pixel */
+    for(k=0; k<depth; k++){
+      near += line[k];
     }
-  }
-  
-  DBG(15,"getLine: maxDensity %d\n",maxDensity);
+    near *= winLen;
+    far = near;
 
-  *finSlope = 0;
-  *finOffset = 0;
-  *finDensity = 0;
+    /* move windows, check delta */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
 
-  /* go thru array, and scale densities to % of maximum, plus adjust for
-   * prefered (smaller absolute value) slope and offset */
-  for(i=0;i<slopes;i++){
-    for(j=0;j<offsets;j++){
-      lines[i][j] = (float)lines[i][j] / maxDensity * slopeScale[i] * offsetScale[j];
-      if(lines[i][j] > *finDensity){
-        *finDensity = lines[i][j];
-        *finSlope = slopeCenter[i];
-        *finOffset = offsetCenter[j];
+      int farCol = j-winLen*2*direction;
+      int nearCol = j-winLen*direction;
+
+      if(farCol < 0 || farCol >= width){
+        farCol = firstCol;
+      }
+      if(nearCol < 0 || nearCol >= width){
+        nearCol = firstCol;
+      }
+
+      for(k=0; k<depth; k++){
+        far -= line[farCol*depth + k];
+        far += line[nearCol*depth + k];
+
+        near -= line[nearCol*depth + k];
+        near += line[j*depth + k];
+      }
+
+      if(abs(near - far) > 50*winLen*depth - near*40/255){
+        return j;
       }
     }
   }
-  
-  if(0){
-    fprintf(stderr,"offsetCenter:       ");
-    for(j=0;j<offsets;j++){
-      fprintf(stderr," %+04.0f",offsetCenter[j]);
-    }
-    fprintf(stderr,"\n");
-  
-    fprintf(stderr,"offsetScale:        ");
-    for(j=0;j<offsets;j++){
-      fprintf(stderr," %04d",offsetScale[j]);
-    }
-    fprintf(stderr,"\n");
-  
-    for(i=0;i<slopes;i++){
-      fprintf(stderr,"slope: %02d %+02.2f %03d:",i,slopeCenter[i],slopeScale[i]);
-      for(j=0;j<offsets;j++){
-        fprintf(stderr,"% 5d",lines[i][j]);
+
+  else{
+
+    /* load the near window with first pixel */
+    int near = line[firstCol/8] >> (7-(firstCol%8)) & 1;
+
+    /* move */
+    for(j=firstCol+direction; j!=lastCol; j+=direction){
+      if((line[j/8] >> (7-(j%8)) & 1) != near){
+        return j;
       }
-      fprintf(stderr,"\n");
     }
   }
 
-  /* dont forget to cleanup */
-  cleanup:
-  for(i=0;i<slopes;i++){
-    if(lines[i])
-      free(lines[i]);
-  }
-  if(lines)
-    free(lines);
-  if(slopeCenter)
-    free(slopeCenter);
-  if(slopeScale)
-    free(slopeScale);
-  if(offsetCenter)
-    free(offsetCenter);
-  if(offsetScale)
-    free(offsetScale);
+  return lastCol;
+}
 
-  DBG(10,"getLine: finish\n");
+/* Replace transitions from first up to last with the empty value, if
+ * fewer than two of the next 7 are within .5 inch */
+static void
+filterTrans (int * buff, int first, int last, int dpi, int empty)
+{
+  int i, j;
 
-  return ret;
+  for(i=first;i<last;i++){
+    int sum = 0;
+    for(j=1;j<=7;j++){
+      if(abs(buff[i+j] - buff[i]) < dpi/2)
+        sum++;
+    }
+    if(sum < 2)
+      buff[i] = empty;
+  }
 }
 
-/* find the left side of paper by moving a line 
- * perpendicular to top slope across the image
- * the 'left-most' point on the paper is the
- * one with the smallest X intercept
- * return x and y intercepts */
-static SANE_Status 
-getLeftEdge (int width, int height, int * top, int * bot,
- double slope, int * finXInter, int * finYInter)
+/* Minimum of every run of w values in v, out[x] = min(v[x..x+w-1]) for
+ * x = 0..n-w, in constant time per value (van Herk/Gil-Werman): within
+ * blocks of w values, keep running minima from the left in fwd and
+ * from the right in bwd; every run spans at most two blocks. */
+static void
+runMin (const int * v, int n, int w, int * out, int * fwd, int * bwd)
 {
+  int x, end;
 
-  int i;
-  int topXInter, topYInter;
-  int botXInter, botYInter;
-  int leftCount;
+  for(x=0; x<n; x+=w){
+    int y;
+    end = x+w < n ? x+w : n;
+    fwd[x] = v[x];
+    for(y=x+1; y<end; y++)
+      fwd[y] = v[y] < fwd[y-1] ? v[y] : fwd[y-1];
+    bwd[end-1] = v[end-1];
+    for(y=end-2; y>=x; y--)
+      bwd[y] = v[y] < bwd[y+1] ? v[y] : bwd[y+1];
+  }
 
-  DBG(10,"getEdgeSlope: start\n");
+  for(x=0; x+w<=n; x++)
+    out[x] = bwd[x] < fwd[x+w-1] ? bwd[x] : fwd[x+w-1];
+}
 
-  topXInter = width;
-  topYInter = 0;
-  leftCount = 0;
+/* Despeckle 8 bit gray (spp 1) or RGB (spp 3) data.
+ *
+ * Every diam x diam window whose ring of 4*diam+4 surrounding pixels has
+ * no pixel darker than a threshold derived from the window's darkest
+ * pixel is replaced with the ring's average color. A pixel's value is
+ * the sum of its samples.
+ *
+ * Windows are visited in the same order, and replaced in place, as the
+ * original brute force scan did, so the output is identical. Instead of
+ * rescanning every window and ring, this keeps the pixel values of the
+ * diam+2 rows a band of windows touches, per column minimum and maximum
+ * over the band, and the minimum of the row segments just above and
+ * below each window. Those two rows are never written while the band is
+ * scanned; the rest is updated when a window is replaced. */
+static SANE_Status
+despeckColor (SANE_Parameters * params, SANE_Byte * buffer, int diam,
+  int spp)
+{
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h  = params->lines;
+  int white = 255*spp;
+  int ring = 4*diam + 4;
+  int rows = diam + 2;
 
-  for(i=0;i<width;i++){
-    
-    if(top[i] < height){
-      int tyi = top[i] - (slope * i);
-      int txi = tyi/-slope;
+  int *mem;
+  int *vals, *colMin, *colMax, *topMin, *botMin, *fwd, *bwd;
 
-      if(topXInter > txi){
-        topXInter = txi;
-        topYInter = tyi;
-      }
+  int i,j,k,l,n;
 
-      leftCount++;
-      if(leftCount > 5){
-        break;
+  if(diam < 1 || h-1-diam <= 1 || pw-1-diam <= 1)
+    return SANE_STATUS_GOOD;
+
+  mem = malloc(sizeof(int) * pw * (rows + 6));
+  if(!mem){
+    DBG (5, "despeckColor: no buffer\n");
+    return SANE_STATUS_NO_MEM;
+  }
+  vals = mem;
+  colMin = vals + pw*rows;
+  colMax = colMin + pw;
+  topMin = colMax + pw;
+  botMin = topMin + pw;
+  fwd = botMin + pw;
+  bwd = fwd + pw;
+
+  /* i is the first row of the band of windows */
+  for(i=1; i<h-1-diam; i++){
+
+    int * top = vals + ((i-1)%rows)*pw;
+    int * bot = vals + ((i+diam)%rows)*pw;
+
+    /* pixel values of the rows not seen yet */
+    for(k = (i==1 ? 0 : i+diam); k<=i+diam; k++){
+      SANE_Byte * row = buffer + k*bw;
+      int * val = vals + (k%rows)*pw;
+      for(j=0; j<pw; j++){
+        int tmp = 0;
+        for(n=0; n<spp; n++)
+          tmp += row[j*spp + n];
+        val[j] = tmp;
       }
     }
-    else{
-      topXInter = width;
-      topYInter = 0;
-      leftCount = 0;
+
+    /* per column darkest and brightest pixel in the band */
+    for(j=0; j<pw; j++){
+      colMin[j] = white;
+      colMax[j] = 0;
+    }
+    for(k=i; k<i+diam; k++){
+      int * val = vals + (k%rows)*pw;
+      for(j=0; j<pw; j++){
+        if(val[j] < colMin[j])
+          colMin[j] = val[j];
+        if(val[j] > colMax[j])
+          colMax[j] = val[j];
+      }
     }
-  }
 
-  botXInter = width;
-  botYInter = 0;
-  leftCount = 0;
+    /* darkest pixel of row segments above and below each window, corners
+     * included. the window at j starts at segment j-1 */
+    runMin (top, pw, diam+2, topMin, fwd, bwd);
+    runMin (bot, pw, diam+2, botMin, fwd, bwd);
 
-  for(i=0;i<width;i++){
-    
-    if(bot[i] > -1){
+    for(j=1; j<pw-1-diam; j++){
 
-      int byi = bot[i] - (slope * i);
-      int bxi = byi/-slope;
+      int darkest = white;
+      int thresh;
+      int outer[3] = {0,0,0};
+      int sum = 0;
 
-      if(botXInter > bxi){
-        botXInter = bxi;
-        botYInter = byi;
+      /* find darkest pixel in window */
+      for(l=0; l<diam; l++){
+        if(colMin[j+l] < darkest)
+          darkest = colMin[j+l];
       }
 
-      leftCount++;
-      if(leftCount > 5){
-        break;
+      /* a white window stays white either way */
+      if(darkest == white)
+        continue;
+
+      /* convert darkest pixel into a brighter threshold */
+      thresh = (darkest + white + white)/3;
+
+      /* any hits around window? */
+      if(topMin[j-1] < thresh || botMin[j-1] < thresh
+        || colMin[j-1] < thresh || colMin[j+diam] < thresh)
+        continue;
+
+      /* no hits, overwrite with avg surrounding color */
+      for(k=-1; k<diam+1; k++){
+        SANE_Byte * row = buffer + (i+k)*bw + j*spp;
+        for(l=-1; l<diam+1; l++){
+
+          /* dont count pixels in the window */
+          if(k != -1 && k != diam && l != -1 && l != diam)
+            continue;
+
+          for(n=0; n<spp; n++)
+            outer[n] += row[l*spp + n];
+        }
+      }
+      for(n=0; n<spp; n++){
+        outer[n] /= ring;
+        sum += outer[n];
+      }
+
+      /* nothing to change if the window has that color already. pixel
+       * values only tell for gray, or with all samples at one end */
+      if(darkest == sum && (spp == 1 || sum == 0)){
+        int brightest = 0;
+        for(l=0; l<diam; l++){
+          if(colMax[j+l] > brightest)
+            brightest = colMax[j+l];
+        }
+        if(brightest == sum)
+          continue;
+      }
+
+      for(k=0; k<diam; k++){
+        SANE_Byte * row = buffer + (i+k)*bw + j*spp;
+        int * val = vals + ((i+k)%rows)*pw + j;
+        for(l=0; l<diam; l++){
+          for(n=0; n<spp; n++){
+            row[l*spp + n] = outer[n];
+          }
+          val[l] = sum;
+        }
       }
-    }
-    else{
-      botXInter = width;
-      botYInter = 0;
-      leftCount = 0;
-    }
-  }
 
-  if(botXInter < topXInter){
-    *finXInter = botXInter;
-    *finYInter = botYInter;
-  }
-  else{
-    *finXInter = topXInter;
-    *finYInter = topYInter;
+      for(l=0; l<diam; l++){
+        colMin[j+l] = sum;
+        colMax[j+l] = sum;
+      }
+    }
   }
 
-  DBG(10,"getEdgeSlope: finish\n");
-
-  return 0;
+  free(mem);
+  return SANE_STATUS_GOOD;
 }
 
-/* Loop thru the image and look for first color change in each column.
- * Return a malloc'd array. Caller is responsible for freeing. */
-int * 
-sanei_magic_getTransY (
-  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int top)
+/* Despeckle 1 bit gray data: clear every diam x diam window with black
+ * pixels in it but none in the surrounding ring. Same approach as
+ * despeckColor, counting black pixels. */
+static SANE_Status
+despeckBinary (SANE_Parameters * params, SANE_Byte * buffer, int diam)
 {
-  int * buff;
-
-  int i, j, k;
-  int winLen = 9;
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h  = params->lines;
 
-  int width = params->pixels_per_line;
-  int height = params->lines;
-  int depth = 1;
+  int *mem;
+  int *colCnt, *topCnt, *botCnt;
 
-  /* defaults for bottom-up */
-  int firstLine = height-1;
-  int lastLine = -1;
-  int direction = -1;
+  int i,j,k,l;
 
-  DBG (10, "sanei_magic_getTransY: start\n");
+  if(diam < 1 || pw < 1)
+    return SANE_STATUS_GOOD;
 
-  /* override for top-down */
-  if(top){
-    firstLine = 0;
-    lastLine = height;
-    direction = 1;
+  mem = malloc(sizeof(int) * pw * 3);
+  if(!mem){
+    DBG (5, "despeckBinary: no buffer\n");
+    return SANE_STATUS_NO_MEM;
   }
+  colCnt = mem;
+  topCnt = colCnt + pw;
+  botCnt = topCnt + pw;
 
-  /* build output and preload with impossible value */
-  buff = calloc(width,sizeof(int));
-  if(!buff){
-    DBG (5, "sanei_magic_getTransY: no buff\n");
-    return NULL;
-  }
-  for(i=0; i<width; i++)
-    buff[i] = lastLine;
+  for(i=1; i<h-1-diam; i++){
 
-  /* load the buff array with y value for first color change from edge
-   * gray/color uses a different algo from binary/halftone */
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+    SANE_Byte * top = buffer + (i-1)*bw;
+    SANE_Byte * bot = buffer + (i+diam)*bw;
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
+    for(j=0; j<pw; j++)
+      colCnt[j] = 0;
+    for(k=0; k<diam; k++){
+      SANE_Byte * row = buffer + (i+k)*bw;
+      for(j=0; j<pw; j++)
+        colCnt[j] += row[j/8] >> (7-j%8) & 1;
+    }
 
-    /* loop over all columns, find first transition */
-    for(i=0; i<width; i++){
+    for(j=1; j<pw-1-diam; j++){
+      topCnt[j] = 0;
+      botCnt[j] = 0;
+      for(l=-1; l<diam+1; l++){
+        topCnt[j] += top[(j+l)/8] >> (7-(j+l)%8) & 1;
+        botCnt[j] += bot[(j+l)/8] >> (7-(j+l)%8) & 1;
+      }
+    }
 
-      int near = 0;
-      int far = 0;
+    for(j=1; j<pw-1-diam; j++){
 
-      /* load the near and far windows with repeated copy of first pixel */
-      for(k=0; k<depth; k++){
-        near += buffer[(firstLine*width+i) * depth + k];
-      }
-      near *= winLen;
-      far = near;
-  
-      /* move windows, check delta */
-      for(j=firstLine+direction; j!=lastLine; j+=direction){
-  
-        int farLine = j-winLen*2*direction;
-        int nearLine = j-winLen*direction;
+      int curr = 0;
 
-        if(farLine < 0 || farLine >= height){
-          farLine = firstLine;
-        }
-        if(nearLine < 0 || nearLine >= height){
-          nearLine = firstLine;
-        }
+      for(l=0; l<diam; l++)
+        curr += colCnt[j+l];
 
-        for(k=0; k<depth; k++){
-          far -= buffer[(farLine*width+i)*depth+k];
-          far += buffer[(nearLine*width+i)*depth+k];
+      if(!curr)
+        continue;
 
-          near -= buffer[(nearLine*width+i)*depth+k];
-          near += buffer[(j*width+i)*depth+k];
-        }
+      /* any hits around window? */
+      if(topCnt[j] || botCnt[j] || colCnt[j-1] || colCnt[j+diam])
+        continue;
 
-        /* significant transition */
-        if(abs(near - far) > 50*winLen*depth - near*40/255){
-          buff[i] = j;
-          break;
+      /* no hits, overwrite with white */
+      for(k=0; k<diam; k++){
+        SANE_Byte * row = buffer + (i+k)*bw;
+        for(l=0; l<diam; l++){
+          row[(j+l)/8] &= ~(1 << (7-(j+l)%8));
         }
       }
+
+      for(l=0; l<diam; l++)
+        colCnt[j+l] = 0;
     }
   }
 
-  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+  free(mem);
+  return SANE_STATUS_GOOD;
+}
 
-    int near = 0;
+/* Build the given tiles of the current band of sanei_magic_rotate().
+ * At the start of each tile row, the source position is split into an
+ * integer and a 16.16 fixed point part, the latter offset by ROT_BIAS
+ * so it stays positive across the tile and shifts give the floor. */
+static void
+rotateTiles (struct rotateJob * job, int firstTile, int lastTile)
+{
+  int pwidth = job->pwidth;
+  int height = job->height;
+  int bwidth = job->bwidth;
+  int depth = job->depth;
+  int centerX = job->centerX;
+  int centerY = job->centerY;
+  int r, t;
+
+  for(r=0; r<job->lines; r++){
+    int shiftY = centerY - job->first - r;
+    SANE_Byte * out = job->band + r*bwidth;
+
+    for(t=firstTile; t<lastTile; t++){
+      int j = t*ROT_TILE_PIXELS;
+      int end = j+ROT_TILE_PIXELS < pwidth ? j+ROT_TILE_PIXELS : pwidth;
+      int shiftX = centerX - j;
+
+      double vx = shiftX * job->slopeCos + shiftY * job->slopeSin;
+      double vy = -shiftY * job->slopeCos + shiftX * job->slopeSin;
+      double fx = floor(vx);
+      double fy = floor(vy);
+
+      int baseX = (int)fx - ROT_BIAS;
+      int baseY = (int)fy - ROT_BIAS;
+      int accX = (int)((vx - fx) * ROT_ONE + 0.5) + ROT_BIAS * ROT_ONE;
+      int accY = (int)((vy - fy) * ROT_ONE + 0.5) + ROT_BIAS * ROT_ONE;
+
+      for(; j<end; j++, accX += job->stepX, accY += job->stepY){
+        int tx = baseX + (accX >> ROT_SHIFT);
+        int ty = baseY + (accY >> ROT_SHIFT);
+        int sourceX, sourceY;
+        SANE_Byte * src;
 
-    for(i=0; i<width; i++){
-  
-      /* load the near window with first pixel */
-      near = buffer[(firstLine*width+i)/8] >> (7-(i%8)) & 1;
-  
-      /* move */
-      for(j=firstLine+direction; j!=lastLine; j+=direction){
-        if((buffer[(j*width+i)/8] >> (7-(i%8)) & 1) != near){
-          buff[i] = j;
-          break;
+        /* round toward zero, like the cast to int it replaces */
+        if(tx < 0 && (accX & (ROT_ONE-1)))
+          tx++;
+        if(ty < 0 && (accY & (ROT_ONE-1)))
+          ty++;
+
+        sourceX = centerX - tx;
+        if (sourceX < 0 || sourceX >= pwidth)
+          continue;
+
+        sourceY = centerY + ty;
+        if (sourceY < 0 || sourceY >= height)
+          continue;
+
+        src = job->rows[sourceY];
+
+        if(depth == 3){
+          out[j*3] = src[sourceX*3];
+          out[j*3+1] = src[sourceX*3+1];
+          out[j*3+2] = src[sourceX*3+2];
+        }
+        else if(depth == 1){
+          out[j] = src[sourceX];
+        }
+        else{
+          /* wipe out old bit */
+          out[j/8] &= ~(1 << (7-(j%8)));
+
+          /* fill in new bit */
+          out[j/8] |= ((src[sourceX/8] >> (7-(sourceX%8))) & 1) << (7-(j%8));
         }
       }
     }
   }
+}
 
-  /* some other format? */
-  else{
-    DBG (5, "sanei_magic_getTransY: unsupported format/depth\n");
-    free(buff);
-    return NULL;
-  }
+#ifdef USE_PTHREAD
+/* Hand out tiles of the current band until none are left. Called, and
+ * returns, with the lock held. */
+static void
+rotateShare (struct rotateJob * job)
+{
+  while(job->nextTile < job->tiles){
+    int first = job->nextTile;
+    int last = first + job->chunk;
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<width-7;i++){
-    int sum = 0;
-    for(j=1;j<=7;j++){
-      if(abs(buff[i+j] - buff[i]) < dpi/2)
-        sum++;
-    }
-    if(sum < 2)
-      buff[i] = lastLine;
+    if(last > job->tiles)
+      last = job->tiles;
+    job->nextTile = last;
+
+    pthread_mutex_unlock(&job->lock);
+    rotateTiles(job, first, last);
+    pthread_mutex_lock(&job->lock);
   }
+}
 
-  DBG (10, "sanei_magic_getTransY: finish\n");
+static void *
+rotateWorker (void * arg)
+{
+  struct rotateJob * job = arg;
+  int seen = 0;
+
+  pthread_mutex_lock(&job->lock);
+  for(;;){
+    while(!job->quit && job->generation == seen)
+      pthread_cond_wait(&job->go, &job->lock);
+    if(job->quit)
+      break;
+    seen = job->generation;
 
-  return buff;
+    rotateShare(job);
+
+    if(--job->pending == 0)
+      pthread_cond_signal(&job->done);
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  return NULL;
 }
+#endif
 
-/* Loop thru the image height and look for first color change in each row.
- * Return a malloc'd array. Caller is responsible for freeing. */
-int * 
-sanei_magic_getTransX (
-  SANE_Parameters * params, int dpi, SANE_Byte * buffer, int left)
+/* Start helper threads for large images, if there are several CPUs.
+ * Without them, or if none can be started, the calling thread builds
+ * every band itself. */
+static void
+rotateStartPool (struct rotateJob * job)
 {
-  int * buff;
+  job->workers = 1;
 
-  int i, j, k;
-  int winLen = 9;
+#ifdef USE_PTHREAD
+  {
+    long cpus = 1;
+    int k;
 
-  int bwidth = params->bytes_per_line;
-  int width = params->pixels_per_line;
-  int height = params->lines;
-  int depth = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if(cpus > ROT_POOL_MAX + 1)
+      cpus = ROT_POOL_MAX + 1;
 
-  /* defaults for right-first */
-  int firstCol = width-1;
-  int lastCol = -1;
-  int direction = -1;
+    if(cpus < 2 || (double)job->pwidth * job->height < ROT_POOL_PIXELS)
+      return;
 
-  DBG (10, "sanei_magic_getTransX: start\n");
+    if(pthread_mutex_init(&job->lock, NULL))
+      return;
+    pthread_cond_init(&job->go, NULL);
+    pthread_cond_init(&job->done, NULL);
 
-  /* override for left-first*/
-  if(left){
-    firstCol = 0;
-    lastCol = width;
-    direction = 1;
+    for(k=0; k<cpus-1; k++){
+      if(pthread_create(&job->threads[k], NULL, rotateWorker, job))
+        break;
+    }
+    job->started = k;
+    job->workers = k + 1;
+
+    if(!k){
+      pthread_cond_destroy(&job->go);
+      pthread_cond_destroy(&job->done);
+      pthread_mutex_destroy(&job->lock);
+      return;
+    }
+
+    /* a few chunks per thread, to even out uneven tiles */
+    job->chunk = job->tiles / (job->workers * 4);
+    if(job->chunk < 1)
+      job->chunk = 1;
+
+    DBG(15,"rotateStartPool: %d threads\n",job->workers);
   }
+#endif
+}
 
-  /* build output and preload with impossible value */
-  buff = calloc(height,sizeof(int));
-  if(!buff){
-    DBG (5, "sanei_magic_getTransX: no buff\n");
-    return NULL;
+/* Build the current band, sharing the tiles with the helper threads */
+static void
+rotateRunBand (struct rotateJob * job)
+{
+#ifdef USE_PTHREAD
+  if(job->started){
+    pthread_mutex_lock(&job->lock);
+    job->nextTile = 0;
+    job->pending = job->started;
+    job->generation++;
+    pthread_cond_broadcast(&job->go);
+
+    rotateShare(job);
+
+    while(job->pending)
+      pthread_cond_wait(&job->done, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    return;
   }
-  for(i=0; i<height; i++)
-    buff[i] = lastCol;
+#endif
 
-  /* load the buff array with x value for first color change from edge
-   * gray/color uses a different algo from binary/halftone */
-  if(params->format == SANE_FRAME_RGB || 
-    (params->format == SANE_FRAME_GRAY && params->depth == 8)
-  ){
+  rotateTiles(job, 0, job->tiles);
+}
 
-    if(params->format == SANE_FRAME_RGB)
-      depth = 3;
+static void
+rotateStopPool (struct rotateJob * job)
+{
+#ifdef USE_PTHREAD
+  int k;
+
+  if(!job->started)
+    return;
+
+  pthread_mutex_lock(&job->lock);
+  job->quit = 1;
+  pthread_cond_broadcast(&job->go);
+  pthread_mutex_unlock(&job->lock);
+
+  for(k=0; k<job->started; k++)
+    pthread_join(job->threads[k], NULL);
+
+  pthread_cond_destroy(&job->go);
+  pthread_cond_destroy(&job->done);
+  pthread_mutex_destroy(&job->lock);
+  job->workers = 1;
+  job->started = 0;
+#else
+  (void) job;
+#endif
+}
 
-    /* loop over all columns, find first transition */
-    for(i=0; i<height; i++){
+/* Update the transitions from the top and bottom of every column with
+ * line r of a stream. Windows reaching above the first line count it
+ * repeatedly, as in sanei_magic_getTransY(); windows from the bottom
+ * are only checked here once they lie entirely inside the page, the
+ * rest is left to sanei_magic_stream_finish(). */
+static void
+streamColumns (SANEI_Magic_Stream * s, SANE_Byte * line, int r)
+{
+  int width = s->params.pixels_per_line;
+  int spp = s->spp;
+  int i, k;
 
-      int near = 0;
-      int far = 0;
+  if(spp){
 
-      /* load the near and far windows with repeated copy of first pixel */
-      for(k=0; k<depth; k++){
-        near += buffer[i*bwidth + k];
-      }
-      near *= winLen;
-      far = near;
-  
-      /* move windows, check delta */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-  
-        int farCol = j-winLen*2*direction;
-        int nearCol = j-winLen*direction;
+    int * vals = s->ring + (r % STREAM_RING)*width;
+    int * nearVals = s->ring + ((r >= STREAM_WIN ? r-STREAM_WIN : 0)
+      % STREAM_RING)*width;
+    int * farVals = s->ring + ((r >= STREAM_WIN*2 ? r-STREAM_WIN*2 : 0)
+      % STREAM_RING)*width;
+    int thresh = 50*STREAM_WIN*spp;
 
-        if(farCol < 0 || farCol >= width){
-          farCol = firstCol;
-        }
-        if(nearCol < 0 || nearCol >= width){
-          nearCol = firstCol;
-        }
+    for(i=0; i<width; i++){
+      int v = 0;
+      int nearV, farV;
 
-        for(k=0; k<depth; k++){
-          far -= buffer[i*bwidth + farCol*depth + k];
-          far += buffer[i*bwidth + nearCol*depth + k];
+      for(k=0; k<spp; k++){
+        v += line[i*spp+k];
+      }
+      vals[i] = v;
 
-          near -= buffer[i*bwidth + nearCol*depth + k];
-          near += buffer[i*bwidth + j*depth + k];
-        }
-  
-        if(abs(near - far) > 50*winLen*depth - near*40/255){
-          buff[i] = j;
-          break;
-        }
+      if(!r){
+        s->nearT[i] = v*STREAM_WIN;
+        s->farT[i] = s->nearT[i];
+        s->farB[i] = v;
+        continue;
       }
+
+      /* from the top, until found */
+      if(s->topBuf[i] < 0){
+        s->farT[i] += nearVals[i] - farVals[i];
+        s->nearT[i] += v - nearVals[i];
+        if(abs(s->nearT[i] - s->farT[i]) > thresh - s->nearT[i]*40/255)
+          s->topBuf[i] = r;
+      }
+
+      /* from the bottom, the window ending at this line */
+      nearV = r >= STREAM_WIN ? nearVals[i] : 0;
+      farV = r >= STREAM_WIN*2 ? farVals[i] : 0;
+      s->farB[i] += v - nearV;
+      s->nearB[i] += nearV - farV;
+      if(r >= STREAM_WIN*2-1
+        && abs(s->nearB[i] - s->farB[i]) > thresh - s->nearB[i]*40/255)
+        s->botBuf[i] = r - STREAM_WIN*2 + 1;
     }
   }
 
-  else if (params->format == SANE_FRAME_GRAY && params->depth == 1){
+  else{
 
-    int near = 0;
+    for(i=0; i<width; i++){
+      int px = line[i/8] >> (7-(i%8)) & 1;
 
-    for(i=0; i<height; i++){
-  
-      /* load the near window with first pixel */
-      near = buffer[i*bwidth + firstCol/8] >> (7-(firstCol%8)) & 1;
-  
-      /* move */
-      for(j=firstCol+direction; j!=lastCol; j+=direction){
-        if((buffer[i*bwidth + j/8] >> (7-(j%8)) & 1) != near){
-          buff[i] = j;
-          break;
-        }
-      }
+      if(!r)
+        s->ring[i] = px;
+      else if(s->topBuf[i] < 0 && px != s->ring[i])
+        s->topBuf[i] = r;
+
+      /* last line with each value */
+      if(px)
+        s->nearB[i] = r;
+      else
+        s->farB[i] = r;
+
+      s->ring[width+i] = px;
     }
   }
+}
 
-  /* some other format? */
-  else{
-    DBG (5, "sanei_magic_getTransX: unsupported format/depth\n");
-    free(buff);
-    return NULL;
-  }
+/* Add line r of a stream to the half inch blocks of
+ * sanei_magic_isBlank2(), and check a row of blocks once complete */
+static void
+streamBlocks (SANEI_Magic_Stream * s, SANE_Byte * line, int r)
+{
+  int xb, x, y;
 
-  /* ignore transitions with few neighbors within .5 inch */
-  for(i=0;i<height-7;i++){
-    int sum = 0;
-    for(j=1;j<=7;j++){
-      if(abs(buff[i+j] - buff[i]) < dpi/2)
-        sum++;
+  /* an earlier row of blocks is already too dark */
+  if(s->darkBand >= 0 || !s->yhalf || !s->xblocks || r < s->yquarter)
+    return;
+
+  y = r - s->yquarter;
+
+  for(xb=0; xb<s->xblocks; xb++){
+    int rowsum = 0;
+
+    if(s->spp){
+      int bytes = s->xhalf*s->spp;
+      SANE_Byte * ptr = line + (s->xquarter + xb*s->xhalf) * s->spp;
+
+      for(x=0; x<bytes; x++){
+        rowsum += 255 - ptr[x];
+      }
+      s->blockSums[xb] += (double)rowsum/bytes/255;
+    }
+    else{
+      SANE_Byte * ptr = line + (s->xquarter + xb*s->xhalf) / 8;
+
+      for(x=0; x<s->xhalf; x++){
+        rowsum += ptr[x/8] >> (7-(x%8)) & 1;
+      }
+      s->blockSums[xb] += (double)rowsum/s->xhalf;
     }
-    if(sum < 2)
-      buff[i] = lastCol;
   }
 
-  DBG (10, "sanei_magic_getTransX: finish\n");
+  if(y % s->yhalf != s->yhalf-1)
+    return;
 
-  return buff;
+  for(xb=0; xb<s->xblocks; xb++){
+    if(s->darkBand < 0 && s->blockSums[xb]/s->yhalf > s->thresh){
+      DBG (15, "streamBlocks: not blank %f %d %d\n",
+        s->blockSums[xb]/s->yhalf, y / s->yhalf, xb);
+      s->darkBand = y / s->yhalf;
+    }
+    s->blockSums[xb] = 0;
+  }
 }
-
@@ -168,6 +168,36 @@ sanei_w_get_parameters_reply (Wire *w, SANE_Get_Parameters_Reply *reply)
   sanei_w_parameters (w, &reply->params);
 }
 
+void
+sanei_w_control_option_batch_req (Wire *w, SANE_Control_Option_Batch_Req *req)
+{
+  sanei_w_word (w, &req->handle);
+  sanei_w_array (w, &req->num_reqs, (void **) &req->req,
+		 (WireCodecFunc) sanei_w_control_option_req,
+		 sizeof (req->req[0]));
+  sanei_w_word (w, &req->get_parameters);
+}
+
+void
+sanei_w_control_option_batch_reply (Wire *w,
+				    SANE_Control_Option_Batch_Reply *reply)
+{
+  sanei_w_array (w, &reply->num_replies, (void **) &reply->reply,
+		 (WireCodecFunc) sanei_w_control_option_reply,
+		 sizeof (reply->reply[0]));
+  sanei_w_get_parameters_reply (w, &reply->params);
+}
+
+void
+sanei_w_start_req (Wire *w, SANE_Start_Req *req)
+{
+  sanei_w_word (w, &req->handle);
+  if (w->version >= 5)
+    sanei_w_word (w, &req->compression);
+  else
+    req->compression = SANE_NET_COMPRESSION_NONE;
+}
+
 void
 sanei_w_start_reply (Wire *w, SANE_Start_Reply *reply)
 {
@@ -175,6 +205,10 @@ sanei_w_start_reply (Wire *w, SANE_Start_Reply *reply)
   sanei_w_word (w, &reply->port);
   sanei_w_word (w, &reply->byte_order);
   sanei_w_string (w, &reply->resource_to_authorize);
+  if (w->version >= 5)
+    sanei_w_word (w, &reply->compression);
+  else
+    reply->compression = SANE_NET_COMPRESSION_NONE;
 }
 
 void
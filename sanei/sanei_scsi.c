@@ -341,6 +341,18 @@ int sanei_scsi_max_request_size = MAX_DATA;
 #ifndef SG_NEXT_CMD_LEN
 #define SG_NEXT_CMD_LEN 0x2283
 #endif
+#ifndef SG_SET_FORCE_PACK_ID
+#define SG_SET_FORCE_PACK_ID 0x227b
+#endif
+#ifndef BLKSECTGET
+#define BLKSECTGET 0x1267
+#endif
+
+/* number of commands kept queued per file descriptor with the SG v3
+   interface; the SG driver itself accepts up to 16 */
+#ifndef SG_V3_QUEUE_MAX
+#define SG_V3_QUEUE_MAX 8
+#endif
 
 #ifndef SCSIBUFFERSIZE
 #define SCSIBUFFERSIZE (128 * 1024)
@@ -800,11 +812,29 @@ static int num_alloced = 0;
 
 static int sg_version = 0;
 
+#ifdef SG_IO
+/* With the SG v3 interface, a command that doesn't fit into the
+   reserved buffer gets a scatter-gather buffer of its own, so the
+   transfer size is limited only by the host adapter's maximum request
+   size.  Returns the larger of that and the reserved buffer size. */
+static int
+sg3_max_transfer_size (int fd, int reserved)
+{
+  int version = 0, max_bytes = 0;
+
+  if (ioctl (fd, SG_GET_VERSION_NUM, &version) != 0 || version < 30000)
+    return reserved;
+  if (ioctl (fd, BLKSECTGET, &max_bytes) != 0 || max_bytes < reserved)
+    return reserved;
+  return max_bytes;
+}
+#endif
+
 static SANE_Status
 get_max_buffer_size (const char *file)
 {
   int fd = -1;
-  int buffersize = SCSIBUFFERSIZE, i;
+  int buffersize = SCSIBUFFERSIZE, wanted, i;
   size_t len;
   char *cc, *cc1, buf[32];
 
@@ -825,9 +855,18 @@ get_max_buffer_size (const char *file)
 	    buffersize = i;
 	}
 
+      wanted = buffersize;
       ioctl (fd, SG_SET_RESERVED_SIZE, &buffersize);
       if (0 == ioctl (fd, SG_GET_RESERVED_SIZE, &buffersize))
 	{
+#ifdef SG_IO
+	  if (buffersize < wanted)
+	    {
+	      buffersize = sg3_max_transfer_size (fd, buffersize);
+	      if (buffersize > wanted)
+		buffersize = wanted;
+	    }
+#endif
 	  if (buffersize < sanei_scsi_max_request_size)
 	    sanei_scsi_max_request_size = buffersize;
 	  close (fd);
@@ -1380,6 +1419,11 @@ sanei_scsi_open (const char *dev, int *fdp,
 	 */
 	if (0 == ioctl (fd, SG_GET_RESERVED_SIZE, &real_buffersize))
 	  {
+#ifdef SG_IO
+	    /* larger commands can go through the SG v3 interface */
+	    if (real_buffersize < *buffersize)
+	      real_buffersize = sg3_max_transfer_size (fd, real_buffersize);
+#endif
 	    /* if we got more memory than requested, we stick with
 	       with the requested value, in order to allow
 	       sanei_scsi_open to check the buffer size exactly.
@@ -1416,6 +1460,26 @@ sanei_scsi_open (const char *dev, int *fdp,
 		  }
 	      }
 	  }
+#ifdef SG_IO
+	if (sg_version >= 30000)
+	  {
+	    /* SG v3 commands are submitted with write() and their
+	       results read back in order by pack_id. They don't share
+	       the reserved buffer, and the SCSI midlayer passes them on
+	       one by one if the device can't queue, so several of them
+	       keep the device busy.
+	     */
+	    ioctl_val = 1;
+	    if (0 == ioctl (fd, SG_SET_COMMAND_Q, &ioctl_val)
+		&& 0 == ioctl (fd, SG_SET_FORCE_PACK_ID, &ioctl_val))
+	      {
+		if (fdpa->sg_queue_max < SG_V3_QUEUE_MAX)
+		  fdpa->sg_queue_max = SG_V3_QUEUE_MAX;
+	      }
+	    else
+	      fdpa->sg_queue_max = 1;
+	  }
+#endif
       }
     else
       {
@@ -1918,8 +1982,9 @@ issue (struct req *req)
 	  else
 	    {
 	      ATOMIC (rp->running = 1;
-		      ret = ioctl(rp->fd, SG_IO, &rp->sgdata.sg3.hdr);
-		      nwritten = 0;
+		      nwritten = write (rp->fd, &rp->sgdata.sg3.hdr,
+					sizeof (Sg_io_hdr));
+		      ret = (nwritten == sizeof (Sg_io_hdr)) ? 0 : -1;
 		      if (ret < 0)
 		      {
 		      /* ENOMEM can easily happen, if both command queuein
@@ -1972,9 +2037,9 @@ issue (struct req *req)
 		    DBG (1, "sanei_scsi.issue: bad write (errno=%i) %s %li\n",
 			 errno, strerror (errno), (long)nwritten);
 #ifdef SG_IO
-		  else if (sg_version > 30000)
-		    DBG (1, "sanei_scsi.issue: SG_IO ioctl error (errno=%i, ret=%d) %s\n",
-			 errno, ret, strerror (errno));
+		  else
+		    DBG (1, "sanei_scsi.issue: bad SG v3 write (errno=%i) %s %li\n",
+			 errno, strerror (errno), (long)nwritten);
 #endif
 		  rp->done = 1;
 		  if (errno == ENOMEM)
@@ -2004,7 +2069,7 @@ issue (struct req *req)
 #endif
 		req->status = SANE_STATUS_IO_ERROR;
 #ifdef SG_IO
-	      else if (sg_version > 30000) /* SG_IO is synchronous, we're all set */
+	      else /* queued; sanei_scsi_req_wait() reads the result */
 		req->status = SANE_STATUS_GOOD;
 #endif
 	    }
@@ -2258,12 +2323,67 @@ issue (struct req *req)
 	  }
 	else
 	  {
+	    fd_set readable;
+	    struct timeval deadline, now, tv;
+	    int err, ready;
+
 	    IF_DBG (if (DBG_LEVEL >= 255)
 		    system ("cat /proc/scsi/sg/debug 1>&2");)
 
-	      /* set DONE: */
-	      nread = 0; /* unused in this code path */
-	      req->done = 1;
+	    /* the kernel aborts the command after hdr.timeout and hands
+	       back an error result, so this is only a safety net */
+	    gettimeofday (&deadline, 0);
+	    deadline.tv_sec += sane_scsicmd_timeout + 10;
+
+	    /* wait for command completion. With SG_SET_FORCE_PACK_ID,
+	       read() only returns the result of this command, but the fd
+	       is readable as soon as any command completed; only if a
+	       later one completed first, back off briefly before waiting
+	       again.
+	     */
+	    for (;;)
+	      {
+		gettimeofday (&now, 0);
+		tv.tv_sec = deadline.tv_sec - now.tv_sec;
+		tv.tv_usec = deadline.tv_usec - now.tv_usec;
+		if (tv.tv_usec < 0)
+		  {
+		    tv.tv_sec--;
+		    tv.tv_usec += 1000000;
+		  }
+		if (tv.tv_sec < 0)
+		  {
+		    DBG (1, "sanei_scsi_req_wait: timed out\n");
+		    nread = -1;
+		    errno = ETIMEDOUT;
+		    break;
+		  }
+
+		FD_ZERO (&readable);
+		FD_SET (req->fd, &readable);
+		ready = select (req->fd + 1, &readable, 0, 0, &tv);
+		if (ready < 0 && errno != EINTR)
+		  {
+		    nread = -1;
+		    break;
+		  }
+		if (ready <= 0)
+		  continue;
+
+		ATOMIC (nread = read (req->fd, &req->sgdata.sg3.hdr,
+				      sizeof (Sg_io_hdr));
+			err = errno;
+			if (nread >= 0)
+			req->done = 1);
+		if (nread >= 0 || (err != EAGAIN && err != EINTR))
+		  break;
+		if (err == EAGAIN)
+		  {
+		    tv.tv_sec = 0;
+		    tv.tv_usec = 1000;
+		    select (0, 0, 0, 0, &tv);
+		  }
+	      }
 	  }
 #endif
 
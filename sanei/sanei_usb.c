@@ -61,6 +61,9 @@
 #include <stdio.h>
 #include <dirent.h>
 #include <time.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 
 /* for debug messages */
 #if __STDC_VERSION__ < 199901L
@@ -137,6 +140,28 @@ typedef enum
 }
 sanei_usb_access_method_type;
 
+/**
+ * state of a sanei_usb_read_bulk_async_*() stream: a ring of num
+ * buffers, of which in_flight starting at head are queued */
+typedef struct
+{
+  SANE_Byte *mem;		/* num buffers of size bytes each */
+  size_t size;
+  int num;
+  int head;			/* oldest queued buffer */
+  int in_flight;
+  SANE_Bool lent;		/* the buffer before head is with the caller */
+  SANE_Bool unlimited;		/* read until stopped */
+  size_t remaining;		/* bytes not yet requested */
+  size_t last_len;		/* length of the last queued read */
+#ifdef HAVE_LIBUSB_1_0
+  SANE_Bool async;		/* libusb-1.0 transfers, else plain reads */
+  struct libusb_transfer **xfer;
+  int *done;			/* set by the completion callback */
+#endif /* HAVE_LIBUSB_1_0 */
+}
+async_read_type;
+
 typedef struct
 {
   SANE_Bool open;
@@ -163,6 +188,7 @@ typedef struct
   libusb_device *lu_device;
   libusb_device_handle *lu_handle;
 #endif /* HAVE_LIBUSB_1_0 */
+  async_read_type *async_read;
 }
 device_list_type;
 
@@ -2111,6 +2137,8 @@ sanei_usb_close (SANE_Int dn)
 	   dn);
       return;
     }
+  if (devices[dn].async_read)
+    sanei_usb_read_bulk_async_stop (dn);
   if (devices[dn].method == sanei_usb_method_scanner_driver)
     close (devices[dn].fd);
   else if (devices[dn].method == sanei_usb_method_usbcalls)
@@ -2394,6 +2422,360 @@ sanei_usb_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size)
   return SANE_STATUS_GOOD;
 }
 
+#ifdef HAVE_LIBUSB_1_0
+static void LIBUSB_CALL
+async_read_callback (struct libusb_transfer *transfer)
+{
+  *(int *) transfer->user_data = 1;
+}
+#endif /* HAVE_LIBUSB_1_0 */
+
+/* Queue the next read of stream A into the free buffer after the ones
+   in flight. */
+static SANE_Status
+async_read_submit (SANE_Int dn, async_read_type * a)
+{
+  size_t len = a->size;
+
+  if (!a->unlimited)
+    {
+      if (len > a->remaining)
+	len = a->remaining;
+      a->remaining -= len;
+    }
+
+#ifdef HAVE_LIBUSB_1_0
+  if (a->async)
+    {
+      int slot = (a->head + a->in_flight) % a->num;
+      int ret;
+
+      /* no timeout here: a transfer far back in the queue may wait
+	 long before its turn comes; sanei_usb_read_bulk_async_next()
+	 times the one it waits for */
+      libusb_fill_bulk_transfer (a->xfer[slot], devices[dn].lu_handle,
+				 devices[dn].bulk_in_ep,
+				 a->mem + slot * a->size, (int) len,
+				 async_read_callback, &a->done[slot], 0);
+      a->done[slot] = 0;
+      ret = libusb_submit_transfer (a->xfer[slot]);
+      if (ret < 0)
+	{
+	  DBG (1, "async_read_submit: can't submit transfer: %s\n",
+	       sanei_libusb_strerror (ret));
+	  return SANE_STATUS_IO_ERROR;
+	}
+    }
+#else
+  (void) dn;
+#endif /* HAVE_LIBUSB_1_0 */
+
+  a->last_len = len;
+  a->in_flight++;
+  return SANE_STATUS_GOOD;
+}
+
+/* Keep as many reads queued as there are free buffers. */
+static SANE_Status
+async_read_fill (SANE_Int dn, async_read_type * a)
+{
+  SANE_Status status;
+
+  while (a->in_flight < a->num - (a->lent ? 1 : 0)
+	 && (a->unlimited || a->remaining > 0))
+    {
+      status = async_read_submit (dn, a);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_usb_read_bulk_async_start (SANE_Int dn, size_t transfer_size,
+				 SANE_Int num_transfers, size_t total)
+{
+  async_read_type *a;
+
+  if (dn >= device_number || dn < 0)
+    {
+      DBG (1, "sanei_usb_read_bulk_async_start: dn >= device number || "
+	   "dn < 0\n");
+      return SANE_STATUS_INVAL;
+    }
+  if (!devices[dn].open || devices[dn].async_read
+      || transfer_size == 0 || num_transfers < 1)
+    {
+      DBG (1, "sanei_usb_read_bulk_async_start: device %d not open, already "
+	   "streaming or bad parameters\n", dn);
+      return SANE_STATUS_INVAL;
+    }
+
+  a = calloc (1, sizeof (*a));
+  if (!a)
+    return SANE_STATUS_NO_MEM;
+  a->size = transfer_size;
+  a->num = num_transfers;
+  a->unlimited = (total == 0);
+  a->remaining = total;
+
+#ifdef HAVE_LIBUSB_1_0
+  if (devices[dn].method == sanei_usb_method_libusb)
+    {
+      int i = 0;
+
+      if (!devices[dn].bulk_in_ep)
+	{
+	  DBG (1, "sanei_usb_read_bulk_async_start: can't read without a "
+	       "bulk-in endpoint\n");
+	  free (a);
+	  return SANE_STATUS_INVAL;
+	}
+      a->async = SANE_TRUE;
+      a->xfer = calloc (a->num, sizeof (a->xfer[0]));
+      a->done = calloc (a->num, sizeof (a->done[0]));
+      if (a->xfer && a->done)
+	for (i = 0; i < a->num; i++)
+	  if ((a->xfer[i] = libusb_alloc_transfer (0)) == NULL)
+	    break;
+      if (!a->xfer || !a->done || i < a->num)
+	{
+	  devices[dn].async_read = a;
+	  sanei_usb_read_bulk_async_stop (dn);
+	  return SANE_STATUS_NO_MEM;
+	}
+    }
+  else
+#endif /* HAVE_LIBUSB_1_0 */
+    /* plain reads go one at a time into a single buffer */
+    a->num = 1;
+
+  a->mem = malloc (a->num * a->size);
+  devices[dn].async_read = a;
+  if (!a->mem)
+    {
+      sanei_usb_read_bulk_async_stop (dn);
+      return SANE_STATUS_NO_MEM;
+    }
+
+  DBG (5, "sanei_usb_read_bulk_async_start: %d x %lu bytes, total %lu\n",
+       a->num, (unsigned long) a->size, (unsigned long) total);
+
+#ifdef HAVE_LIBUSB_1_0
+  if (a->async)
+    {
+      SANE_Status status = async_read_fill (dn, a);
+
+      if (status != SANE_STATUS_GOOD)
+	{
+	  sanei_usb_read_bulk_async_stop (dn);
+	  return status;
+	}
+    }
+#endif /* HAVE_LIBUSB_1_0 */
+
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_usb_read_bulk_async_next (SANE_Int dn, SANE_Byte ** buffer,
+				size_t * size)
+{
+  async_read_type *a;
+  SANE_Status status;
+
+  if (dn >= device_number || dn < 0 || !buffer || !size)
+    {
+      DBG (1, "sanei_usb_read_bulk_async_next: invalid arguments\n");
+      return SANE_STATUS_INVAL;
+    }
+  a = devices[dn].async_read;
+  if (!a)
+    {
+      DBG (1, "sanei_usb_read_bulk_async_next: no stream started\n");
+      return SANE_STATUS_INVAL;
+    }
+
+  /* the caller is done with the last buffer */
+  a->lent = SANE_FALSE;
+
+#ifdef HAVE_LIBUSB_1_0
+  if (a->async)
+    {
+      struct libusb_transfer *xfer;
+      struct timeval deadline, now, tv;
+      SANE_Bool timed_out = SANE_FALSE;
+      int slot, ret;
+
+      status = async_read_fill (dn, a);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+      if (a->in_flight == 0)
+	return SANE_STATUS_EOF;
+
+      slot = a->head;
+      xfer = a->xfer[slot];
+
+      /* the timeout counts from now, not from the submission */
+      gettimeofday (&deadline, NULL);
+      deadline.tv_sec += libusb_timeout / 1000;
+      deadline.tv_usec += (libusb_timeout % 1000) * 1000;
+      if (deadline.tv_usec >= 1000000)
+	{
+	  deadline.tv_sec++;
+	  deadline.tv_usec -= 1000000;
+	}
+
+      while (!a->done[slot])
+	{
+	  if (libusb_timeout > 0 && !timed_out)
+	    {
+	      gettimeofday (&now, NULL);
+	      tv.tv_sec = deadline.tv_sec - now.tv_sec;
+	      tv.tv_usec = deadline.tv_usec - now.tv_usec;
+	      if (tv.tv_usec < 0)
+		{
+		  tv.tv_sec--;
+		  tv.tv_usec += 1000000;
+		}
+	      if (tv.tv_sec < 0)
+		{
+		  /* the callback still has to run before the slot is
+		     free again */
+		  DBG (1, "sanei_usb_read_bulk_async_next: timed out\n");
+		  libusb_cancel_transfer (xfer);
+		  timed_out = SANE_TRUE;
+		  continue;
+		}
+	      ret = libusb_handle_events_timeout_completed (sanei_usb_ctx, &tv,
+							    &a->done[slot]);
+	    }
+	  else
+	    ret = libusb_handle_events_completed (sanei_usb_ctx,
+						  &a->done[slot]);
+	  if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+	    {
+	      DBG (1, "sanei_usb_read_bulk_async_next: handling events "
+		   "failed: %s\n", sanei_libusb_strerror (ret));
+	      return SANE_STATUS_IO_ERROR;
+	    }
+	}
+
+      a->head = (slot + 1) % a->num;
+      a->in_flight--;
+      a->lent = SANE_TRUE;
+
+      if (xfer->status != LIBUSB_TRANSFER_COMPLETED)
+	{
+	  DBG (1, "sanei_usb_read_bulk_async_next: transfer failed "
+	       "(status %d)\n", xfer->status);
+	  if (xfer->status == LIBUSB_TRANSFER_STALL)
+	    libusb_clear_halt (devices[dn].lu_handle, devices[dn].bulk_in_ep);
+	  *size = 0;
+	  return SANE_STATUS_IO_ERROR;
+	}
+      *buffer = xfer->buffer;
+      *size = xfer->actual_length;
+    }
+  else
+#endif /* HAVE_LIBUSB_1_0 */
+    {
+      status = async_read_fill (dn, a);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+      if (a->in_flight == 0)
+	return SANE_STATUS_EOF;
+
+      a->in_flight--;
+      a->lent = SANE_TRUE;
+
+      /* with a single buffer, the read queued last is this one */
+      *size = a->last_len;
+      *buffer = a->mem;
+      status = sanei_usb_read_bulk (dn, a->mem, size);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+    }
+
+  if (*size == 0)
+    return SANE_STATUS_EOF;
+
+  if (debug_level > 10)
+    print_buffer (*buffer, *size);
+  DBG (5, "sanei_usb_read_bulk_async_next: got %lu bytes\n",
+       (unsigned long) *size);
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+sanei_usb_read_bulk_async_stop (SANE_Int dn)
+{
+  async_read_type *a;
+
+  if (dn >= device_number || dn < 0 || !devices[dn].async_read)
+    {
+      DBG (1, "sanei_usb_read_bulk_async_stop: invalid device or no "
+	   "stream started\n");
+      return SANE_STATUS_INVAL;
+    }
+  a = devices[dn].async_read;
+
+  DBG (5, "sanei_usb_read_bulk_async_stop: cancelling %d transfers\n",
+       a->in_flight);
+
+#ifdef HAVE_LIBUSB_1_0
+  if (a->async)
+    {
+      int i, slot, ret, errors = 0;
+
+      /* cancel what's still queued, then wait until every callback
+	 has run; libusb owns a transfer and its buffer until then */
+      for (i = 0; i < a->in_flight; i++)
+	{
+	  slot = (a->head + i) % a->num;
+	  if (!a->done[slot])
+	    libusb_cancel_transfer (a->xfer[slot]);
+	}
+      for (i = 0; i < a->in_flight; i++)
+	{
+	  slot = (a->head + i) % a->num;
+	  while (!a->done[slot])
+	    {
+	      ret = libusb_handle_events_completed (sanei_usb_ctx,
+						    &a->done[slot]);
+	      if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED
+		  && ++errors > 100)
+		{
+		  /* freeing them now would let libusb write to freed
+		     memory later, so leave them be */
+		  DBG (1, "sanei_usb_read_bulk_async_stop: handling events "
+		       "failed: %s, leaking the transfers\n",
+		       sanei_libusb_strerror (ret));
+		  free (a);
+		  devices[dn].async_read = NULL;
+		  return SANE_STATUS_IO_ERROR;
+		}
+	    }
+	}
+    }
+  if (a->xfer)
+    {
+      int i;
+
+      for (i = 0; i < a->num; i++)
+	if (a->xfer[i])
+	  libusb_free_transfer (a->xfer[i]);
+      free (a->xfer);
+    }
+  free (a->done);
+#endif /* HAVE_LIBUSB_1_0 */
+
+  free (a->mem);
+  free (a);
+  devices[dn].async_read = NULL;
+  return SANE_STATUS_GOOD;
+}
+
 SANE_Status
 sanei_usb_write_bulk (SANE_Int dn, const SANE_Byte * buffer, size_t * size)
 {
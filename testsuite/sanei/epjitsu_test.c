@@ -0,0 +1,966 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* the image routines of the epjitsu backend are static, take them from
+ * the backend source the way the backend is built; its usb reads and
+ * writes go to the fake scanner below */
+#define BACKEND_NAME epjitsu
+#define sanei_usb_write_bulk fake_usb_write_bulk
+#define sanei_usb_read_bulk fake_usb_read_bulk
+#define sanei_usb_read_bulk_async_start fake_usb_read_bulk_async_start
+#define sanei_usb_read_bulk_async_next fake_usb_read_bulk_async_next
+#define sanei_usb_read_bulk_async_stop fake_usb_read_bulk_async_stop
+#include "../../backend/epjitsu.c"
+#include "../../backend/sane_strstatus.c"
+
+/* the former byte at a time descramble_raw(), copy_block_to_page() and
+ * binarize_line(), to check that the faster ones give the same results */
+
+static SANE_Status reference_binarize_line (struct scanner *s,
+					    unsigned char *lineOut, int width);
+
+/* de-scrambles the raw data from the scanner into the image buffer */
+/* the output image might be lower dpi than input image, so we scale horizontally */
+static SANE_Status
+reference_descramble_raw(struct scanner *s, struct transfer * tp)
+{
+    SANE_Status ret = SANE_STATUS_GOOD;
+    unsigned char *p_out = tp->image->buffer;
+    int height = tp->total_bytes / tp->line_stride;
+    int i, j, k;
+
+    if (s->model == MODEL_S300 || s->model == MODEL_S1300i) {
+      for (i = 0; i < 2; i++){                   /* page, front/back */
+        for (j = 0; j < height; j++){             /* row (y)*/
+          int curr_col = 0;
+          int r=0, g=0, b=0, ppc=0;
+      
+          for (k = 0; k <= tp->plane_width; k++){  /* column (x) */
+            int this_col = k*tp->image->x_res/tp->x_res;
+      
+            /* going to change output pixel, dump rgb and reset */
+            if(ppc && curr_col != this_col){
+              *p_out = r/ppc;
+              p_out++;
+      
+              *p_out = g/ppc;
+              p_out++;
+      
+              *p_out = b/ppc;
+              p_out++;
+      
+              r = g = b = ppc = 0;
+      
+              curr_col = this_col;
+            }
+      
+            if(k == tp->plane_width || this_col >= tp->image->width_pix){
+              break;
+            }
+  
+            /*red is first*/
+            r += tp->raw_data[j*tp->line_stride + k*3 + i];
+      
+            /*green is second*/
+            g += tp->raw_data[j*tp->line_stride + tp->plane_stride + k*3 + i];
+      
+            /*blue is third*/
+            b += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k*3 + i];
+      
+            ppc++;
+          }
+        }
+      }
+    }
+    else if (s->model == MODEL_S1100){
+      for (j = 0; j < height; j++){             /* row (y)*/
+        int curr_col = 0;
+        int r=0, g=0, b=0, ppc=0;
+    
+        for (k = 0; k <= tp->plane_width; k++){  /* column (x) */
+          int this_col = k*tp->image->x_res/tp->x_res;
+    
+          /* going to change output pixel, dump rgb and reset */
+          if(ppc && curr_col != this_col){
+            *p_out = r/ppc;
+            p_out++;
+    
+            *p_out = g/ppc;
+            p_out++;
+    
+            *p_out = b/ppc;
+            p_out++;
+    
+            r = g = b = ppc = 0;
+    
+            curr_col = this_col;
+          }
+    
+          if(k == tp->plane_width || this_col >= tp->image->width_pix){
+            break;
+          }
+
+          /*red is second*/
+          r += tp->raw_data[j*tp->line_stride + tp->plane_stride + k];
+    
+          /*green is third*/
+          g += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k];
+    
+          /*blue is first*/
+          b += tp->raw_data[j*tp->line_stride + k];
+    
+          ppc++;
+        }
+      }
+    }
+    else { /* MODEL_FI60F or MODEL_FI65F */
+
+      for (j = 0; j < height; j++){             /* row (y)*/
+        int curr_col = 0;
+
+        for (i = 0; i < 3; i++){                /* read head */
+          int r=0, g=0, b=0, ppc=0;
+      
+          for (k = 0; k <= tp->plane_width; k++){  /* column (x) within the read head */
+            int this_col = (k+i*tp->plane_width)*tp->image->x_res/tp->x_res;
+      
+            /* going to change output pixel, dump rgb and reset */
+            if(ppc && curr_col != this_col){
+              *p_out = r/ppc;
+              p_out++;
+      
+              *p_out = g/ppc;
+              p_out++;
+      
+              *p_out = b/ppc;
+              p_out++;
+      
+              r = g = b = ppc = 0;
+      
+              curr_col = this_col;
+            }
+      
+            if(k == tp->plane_width || this_col >= tp->image->width_pix){
+              break;
+            }
+  
+            /*red is first*/
+            r += tp->raw_data[j*tp->line_stride + k*3 + i];
+      
+            /*green is second*/
+            g += tp->raw_data[j*tp->line_stride + tp->plane_stride + k*3 + i];
+      
+            /*blue is third*/
+            b += tp->raw_data[j*tp->line_stride + 2*tp->plane_stride + k*3 + i];
+      
+            ppc++;
+          }
+        }
+      }
+    }
+
+    return ret;
+}
+
+/* copies block buffer into front or back image buffer */
+/* converts pixel data from RGB Color to the output format */
+/* the output image might be lower dpi than input image, so we scale vertically */
+static SANE_Status
+reference_copy_block_to_page(struct scanner *s,int side)
+{
+    SANE_Status ret = SANE_STATUS_GOOD;
+    struct transfer * block = &s->block_xfr;
+    struct page * page = &s->pages[side];
+    int image_height = block->total_bytes / block->line_stride;
+    int page_height = SCANNER_UNIT_TO_PIX(s->page_height, s->resolution);
+    int page_width = page->image->width_pix;
+    int block_page_stride = block->image->width_bytes * block->image->height;
+    int line_reverse = (side == SIDE_BACK) || (s->model == MODEL_FI60F) || (s->model == MODEL_FI65F);
+    int i,j,k=0,l=0;
+
+    int curr_in_row = s->fullscan.rx_bytes/s->fullscan.width_bytes;
+    int last_out_row = (page->bytes_scanned / page->image->width_bytes) - 1;
+
+    DBG (10, "reference_copy_block_to_page: start\n");
+
+    /* skip padding and tl_y */
+    if (s->fullscan.rx_bytes + s->block_xfr.rx_bytes < block->line_stride * page->image->y_skip_offset)
+    {
+        DBG (10, "reference_copy_block_to_page: before the start? %d\n", side);
+        return ret;
+    }
+    else if (s->fullscan.rx_bytes < block->line_stride * page->image->y_skip_offset)
+    {
+        k = page->image->y_skip_offset - s->fullscan.rx_bytes / block->line_stride;
+        DBG (10, "reference_copy_block_to_page: k start? %d\n", k);
+    }
+
+    /* skip trailer */
+    if (s->page_height)
+    {
+        DBG (10, "reference_copy_block_to_page: ph %d\n", s->page_height);
+        if (s->fullscan.rx_bytes > block->line_stride * page->image->y_skip_offset + page_height * block->line_stride)
+        {
+            DBG (10, "reference_copy_block_to_page: off the end? %d\n", side);
+            return ret;
+        }
+        else if (s->fullscan.rx_bytes + s->block_xfr.rx_bytes
+                 > block->line_stride * page->image->y_skip_offset + page_height * block->line_stride)
+        {
+             l = (s->fullscan.rx_bytes + s->block_xfr.rx_bytes) / block->line_stride
+                 - page_height - page->image->y_skip_offset;
+        }
+    }
+
+    /* loop over all the lines in the block */
+    for (i = k; i < image_height-l; i++)
+    {
+      /* determine source and dest rows (dpi scaling) */
+      int this_in_row = curr_in_row + i;
+      int this_out_row = (this_in_row - page->image->y_skip_offset) * page->image->y_res / s->fullscan.y_res;
+      DBG (15, "reference_copy_block_to_page: in %d out %d lastout %d\n", this_in_row, this_out_row, last_out_row);
+      DBG (15, "reference_copy_block_to_page: bs %d wb %d\n", page->bytes_scanned, page->image->width_bytes);
+    
+      /* don't walk off the end of the output buffer */
+      if(this_out_row >= page->image->height || this_out_row < 0){
+          DBG (10, "reference_copy_block_to_page: out of space? %d\n", side);
+          DBG (10, "reference_copy_block_to_page: rx:%d tx:%d tot:%d line:%d\n",
+            page->bytes_scanned, page->bytes_read, page->bytes_total,page->image->width_bytes);
+          return ret;
+      }
+    
+      /* ok, different output row, so we do the math */
+      if(this_out_row > last_out_row){
+
+        unsigned char * p_in = block->image->buffer + (side * block_page_stride)
+            + (i * block->image->width_bytes) + page->image->x_start_offset * 3;
+        unsigned char * p_out = page->image->buffer + this_out_row * page->image->width_bytes;
+        unsigned char * lineStart = p_out;
+
+        last_out_row = this_out_row;
+
+        /* reverse order for back side or FI-60F scanner */
+        if (line_reverse)
+            p_in += (page_width - 1) * 3;
+
+        /* convert all of the pixels in this row */
+        for (j = 0; j < page_width; j++)
+        {
+            unsigned char r, g, b;
+            if (s->model == MODEL_S300 || s->model == MODEL_S1300i)
+                { r = p_in[1]; g = p_in[2]; b = p_in[0]; }
+            else /* MODEL_FI60F or MODEL_FI65F or MODEL_S1100 */
+                { r = p_in[0]; g = p_in[1]; b = p_in[2]; }
+            if (s->mode == MODE_COLOR)
+            {
+                *p_out++ = r;
+                *p_out++ = g;
+                *p_out++ = b;
+            }
+            else if (s->mode == MODE_GRAYSCALE)
+            {
+                *p_out++ = (r + g + b) / 3;
+            }
+            else if (s->mode == MODE_LINEART)
+            {
+                s->dt.buffer[j] = (r + g + b) / 3; /* stores dt temp image buffer and binarize afterword */
+            }
+            if (line_reverse)
+                p_in -= 3;
+            else
+                p_in += 3;
+        }
+
+	/* skip non-transfer pixels in block image buffer */
+        if (line_reverse)
+            p_in -= page->image->x_offset_bytes;
+        else
+            p_in += page->image->x_offset_bytes;
+
+        /* for MODE_LINEART, binarize the gray line stored in the temp image buffer(dt) */
+        /* bacause dt.width = page_width, we pass page_width */
+        if (s->mode == MODE_LINEART)
+            reference_binarize_line(s, lineStart, page_width);
+
+        page->bytes_scanned += page->image->width_bytes;
+      }
+    }
+
+    DBG (10, "reference_copy_block_to_page: finish\n");
+
+    return ret;
+}
+
+/*uses the threshold/threshold_curve to control binarization*/
+static SANE_Status
+reference_binarize_line(struct scanner *s, unsigned char *lineOut, int width)
+{
+    SANE_Status ret = SANE_STATUS_GOOD;
+    int j, windowX, sum = 0;
+
+    /* ~1mm works best, but the window needs to have odd # of pixels */
+    windowX = 6 * s->resolution / 150;
+    if (!(windowX % 2)) windowX++;
+
+    /*second, prefill the sliding sum*/
+    for (j = 0; j < windowX; j++)
+        sum += s->dt.buffer[j];
+
+    /* third, walk the dt buffer, update the sliding sum, */
+    /* determine threshold, output bits */
+    for (j = 0; j < width; j++)
+    {
+        /*output image location*/
+        int offset = j % 8;
+        unsigned char mask = 0x80 >> offset;
+        int thresh = s->threshold;
+
+        /* move sum/update threshold only if there is a curve*/
+        if (s->threshold_curve)
+        {
+            int addCol  = j + windowX/2;
+            int dropCol = addCol - windowX;
+  
+            if (dropCol >= 0 && addCol < width)
+            {
+                sum -= s->dt.buffer[dropCol];
+                sum += s->dt.buffer[addCol];
+            }
+            thresh = s->dt_lut[sum/windowX];
+        }
+
+        /*use average to lookup threshold*/
+        if (s->dt.buffer[j] > thresh)
+          *lineOut &= ~mask;     /* white */
+        else
+          *lineOut |= mask;      /* black */
+                  
+        if (offset == 7)
+            lineOut++;
+      }
+
+    return ret;
+}
+
+static unsigned int seed = 1;
+
+/* fill with noise, ranging over the whole byte */
+static void
+fill_random (unsigned char *buffer, int len)
+{
+  int i;
+
+  for (i = 0; i < len; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      buffer[i] = seed >> 16;
+    }
+}
+
+/* fill with gray levels near the threshold curve, so the dynamic
+ * threshold decides about the bits */
+static void
+fill_smooth (unsigned char *buffer, int len)
+{
+  int i, level = 128;
+
+  for (i = 0; i < len; i++)
+    {
+      seed = seed * 1103515245 + 12345;
+      level += (int) ((seed >> 16) % 21) - 10;
+      if (level < 60)
+	level = 60;
+      if (level > 200)
+	level = 200;
+      buffer[i] = level;
+    }
+}
+
+/* set up a scanner the way sane_start() does, without the hardware */
+static int
+setup_scanner (struct scanner *s, int model, int usb_power, int resolution,
+	       int mode, int source, int page_height, int curve)
+{
+  int i;
+
+  memset (s, 0, sizeof (*s));
+  s->model = model;
+  s->usb_power = usb_power;
+  s->resolution = resolution;
+  s->mode = mode;
+  s->source = source;
+  s->page_height = page_height;
+  s->tl_y = 120;
+  s->adf_height_padding = 120;
+  s->threshold = 120;
+  s->threshold_curve = curve;
+
+  if (change_params (s) != SANE_STATUS_GOOD)
+    return 0;
+  assert (setup_buffers (s) == SANE_STATUS_GOOD);
+  assert (load_lut (s->dt_lut, 8, 8, 50, 205, s->threshold_curve,
+		    s->threshold - 127) == SANE_STATUS_GOOD);
+
+  s->fullscan.total_bytes = s->fullscan.width_bytes * s->fullscan.height;
+  update_transfer_totals (&s->block_xfr);
+  for (i = 0; i < 2; i++)
+    {
+      struct image *page_img = s->pages[i].image;
+      s->pages[i].bytes_total = page_img->width_bytes * page_img->height;
+    }
+  return 1;
+}
+
+static void
+compare_images (struct image *a, struct image *b)
+{
+  assert (a->buffer != NULL && b->buffer != NULL);
+  assert (memcmp (a->buffer, b->buffer,
+		  a->width_bytes * a->height * a->pages) == 0);
+}
+
+/**
+ * the calibration lines go through descramble_raw() at the scan
+ * resolution
+ */
+static void
+check_calibration (struct scanner *s, struct scanner *ref)
+{
+  s->cal_image.image = &s->darkcal;
+  ref->cal_image.image = &ref->darkcal;
+  s->cal_image.total_bytes = s->cal_image.line_stride * 16;
+  ref->cal_image.total_bytes = ref->cal_image.line_stride * 16;
+
+  fill_random (s->cal_image.raw_data, s->cal_image.total_bytes);
+  memcpy (ref->cal_image.raw_data, s->cal_image.raw_data,
+	  s->cal_image.total_bytes);
+
+  assert (descramble_raw (s, &s->cal_image) == SANE_STATUS_GOOD);
+  reference_descramble_raw (ref, &ref->cal_image);
+  compare_images (&s->darkcal, &ref->darkcal);
+}
+
+/**
+ * scan some blocks, the way sane_read() gets them, past the top padding
+ * and, with a page height, beyond the bottom of the page
+ */
+static void
+check_scan (struct scanner *s, struct scanner *ref)
+{
+  int lines, side;
+
+  /* the paper runs out a few blocks after the top padding and the page */
+  lines = s->front.y_skip_offset + 3 * s->block_img.height
+    + SCANNER_UNIT_TO_PIX (s->page_height, s->fullscan.y_res);
+  lines -= lines % s->block_img.height;
+  if (lines < s->fullscan.height)
+    {
+      s->fullscan.total_bytes = s->fullscan.width_bytes * lines;
+      ref->fullscan.total_bytes = ref->fullscan.width_bytes * lines;
+    }
+
+  while (s->fullscan.rx_bytes < s->fullscan.total_bytes)
+    {
+      int remain = s->fullscan.total_bytes - s->fullscan.rx_bytes;
+
+      if (remain < s->block_xfr.total_bytes)
+	{
+	  s->block_xfr.total_bytes = remain;
+	  ref->block_xfr.total_bytes = remain;
+	}
+      s->block_xfr.rx_bytes = s->block_xfr.total_bytes;
+      ref->block_xfr.rx_bytes = ref->block_xfr.total_bytes;
+
+      if (s->mode == MODE_LINEART && s->threshold_curve)
+	fill_smooth (s->block_xfr.raw_data, s->block_xfr.total_bytes);
+      else
+	fill_random (s->block_xfr.raw_data, s->block_xfr.total_bytes);
+      memcpy (ref->block_xfr.raw_data, s->block_xfr.raw_data,
+	      s->block_xfr.total_bytes);
+
+      assert (descramble_raw (s, &s->block_xfr) == SANE_STATUS_GOOD);
+      reference_descramble_raw (ref, &ref->block_xfr);
+      compare_images (&s->block_img, &ref->block_img);
+
+      for (side = 0; side < 2; side++)
+	{
+	  if (!s->pages[side].image->buffer)
+	    continue;
+	  assert (copy_block_to_page (s, side) == SANE_STATUS_GOOD);
+	  reference_copy_block_to_page (ref, side);
+	  assert (s->pages[side].bytes_scanned
+		  == ref->pages[side].bytes_scanned);
+	}
+
+      s->fullscan.rx_bytes += s->block_xfr.rx_bytes;
+      ref->fullscan.rx_bytes += ref->block_xfr.rx_bytes;
+      update_transfer_totals (&s->block_xfr);
+      update_transfer_totals (&ref->block_xfr);
+    }
+
+  /* the pages are as long as the scanner allows, only the part that was
+   * scanned is of interest */
+  for (side = 0; side < 2; side++)
+    if (s->pages[side].image->buffer)
+      assert (memcmp (s->pages[side].image->buffer,
+		      ref->pages[side].image->buffer,
+		      s->pages[side].bytes_scanned) == 0);
+}
+
+/**
+ * every model of the settings table at each kind of scaling it does, in
+ * color, gray and lineart, with a page height and with paper length
+ * detection
+ */
+static void
+descramble_and_copy (void)
+{
+  /* 100 and 200 dpi are scaled down from 150 and 225 dpi */
+  static const int resolutions[] = { 100, 200, 300, 600 };
+  static const struct
+  {
+    int mode;
+    int page_height;
+    int curve;
+  } scans[] =
+  {
+    { MODE_COLOR, 0, 0 },
+    { MODE_GRAYSCALE, 1200 / 2, 0 },
+    { MODE_LINEART, 0, 0 },
+    { MODE_LINEART, 1200 / 2, 55 }
+  };
+  struct scanner *s, *ref;
+  int i, r, m;
+
+  s = malloc (sizeof (*s));
+  ref = malloc (sizeof (*ref));
+  assert (s != NULL && ref != NULL);
+
+  for (i = 0; settings[i].model; i++)
+    {
+      int model = settings[i].model;
+      int source = SOURCE_ADF_FRONT;
+
+      /* each usb power setting once */
+      if (i > 0 && settings[i - 1].model == model
+	  && settings[i - 1].usb_power == settings[i].usb_power)
+	continue;
+      if (model == MODEL_S300 || model == MODEL_S1300i)
+	source = SOURCE_ADF_DUPLEX;
+
+      for (r = 0; r < (int) (sizeof (resolutions) / sizeof (int)); r++)
+	for (m = 0; m < (int) (sizeof (scans) / sizeof (scans[0])); m++)
+	  {
+	    if (!setup_scanner (s, model, settings[i].usb_power,
+				resolutions[r], scans[m].mode, source,
+				scans[m].page_height, scans[m].curve))
+	      continue;
+	    assert (setup_scanner (ref, model, settings[i].usb_power,
+				   resolutions[r], scans[m].mode, source,
+				   scans[m].page_height, scans[m].curve));
+
+	    check_calibration (s, ref);
+	    check_scan (s, ref);
+
+	    teardown_buffers (s);
+	    teardown_buffers (ref);
+	  }
+    }
+
+  free (s);
+  free (ref);
+}
+
+/**
+ * lines that do not end on a byte keep the bits after them
+ */
+static void
+binarize_short (void)
+{
+  struct scanner *s;
+  unsigned char out[4], expected[4];
+  int width, curve;
+
+  s = calloc (1, sizeof (*s));
+  assert (s != NULL);
+  s->dt.buffer = malloc (32);
+  assert (s->dt.buffer != NULL);
+  s->resolution = 150;
+  s->threshold = 120;
+
+  for (curve = 0; curve < 2; curve++)
+    {
+      s->threshold_curve = curve * 55;
+      load_lut (s->dt_lut, 8, 8, 50, 205, s->threshold_curve,
+		s->threshold - 127);
+      for (width = 7; width <= 32; width++)
+	{
+	  fill_smooth (s->dt.buffer, 32);
+	  fill_random (out, sizeof (out));
+	  memcpy (expected, out, sizeof (out));
+	  binarize_line (s, out, width);
+	  reference_binarize_line (s, expected, width);
+	  assert (memcmp (out, expected, sizeof (out)) == 0);
+	}
+    }
+
+  free (s->dt.buffer);
+  free (s);
+}
+
+/* a scanner sending the raw scan in blocks, each followed by a trailer,
+ * and answering the commands around them */
+static struct
+{
+  unsigned char *data;		/* the raw scan */
+  int len;			/* bytes in the raw scan */
+  int block;			/* bytes in a full block */
+  int pos;			/* bytes sent */
+  int trailer;			/* trailer bytes still to send */
+  int paper_lines;		/* end of the paper, told by the 0x43 cmd */
+  int fail_at;			/* reads fail from here on, 0 for never */
+  unsigned char reply[10];	/* answer to the last command */
+  size_t reply_len;
+  int stream;			/* reads queued by async_start */
+  int streams;			/* async_start calls so far */
+  size_t stream_size;		/* bytes in one queued read */
+  size_t stream_left;		/* bytes not yet handed out */
+  unsigned char *stream_buf;
+} fake;
+
+SANE_Status
+fake_usb_write_bulk (SANE_Int dn, const SANE_Byte * buffer, size_t * size)
+{
+  (void) dn;
+
+  /* the scanner would answer with the queued reads */
+  assert (!fake.stream);
+
+  memset (fake.reply, 0, sizeof (fake.reply));
+  fake.reply[0] = 6;
+  fake.reply_len = 1;
+  if (*size == 2 && buffer[0] == 0x1b && buffer[1] == 0x43)
+    {
+      fake.reply[6] = fake.paper_lines >> 8;
+      fake.reply[7] = fake.paper_lines & 0xff;
+      fake.reply_len = 10;
+    }
+  return SANE_STATUS_GOOD;
+}
+
+static SANE_Status
+fake_read (SANE_Byte * buffer, size_t * size)
+{
+  size_t n = 0, t;
+  int end;
+
+  if (fake.reply_len)
+    {
+      n = fake.reply_len < *size ? fake.reply_len : *size;
+      memcpy (buffer, fake.reply, n);
+      fake.reply_len = 0;
+      *size = n;
+      return SANE_STATUS_GOOD;
+    }
+  if (fake.fail_at && fake.pos >= fake.fail_at)
+    {
+      *size = 0;
+      return SANE_STATUS_IO_ERROR;
+    }
+
+  /* the rest of the current block, then its trailer */
+  if (!fake.trailer)
+    {
+      end = fake.pos + fake.block - fake.pos % fake.block;
+      if (end > fake.len)
+	end = fake.len;
+      n = end - fake.pos;
+      if (n > *size)
+	n = *size;
+      memcpy (buffer, fake.data + fake.pos, n);
+      fake.pos += n;
+      if (fake.pos == end)
+	fake.trailer = 8;
+    }
+  t = *size - n;
+  if (t > (size_t) fake.trailer)
+    t = fake.trailer;
+  memset (buffer + n, 0, t);
+  fake.trailer -= t;
+  n += t;
+
+  *size = n;
+  return n ? SANE_STATUS_GOOD : SANE_STATUS_EOF;
+}
+
+SANE_Status
+fake_usb_read_bulk (SANE_Int dn, SANE_Byte * buffer, size_t * size)
+{
+  (void) dn;
+
+  assert (!fake.stream);
+  return fake_read (buffer, size);
+}
+
+/* the queued reads are answered one after the other, as they are
+ * handed out */
+SANE_Status
+fake_usb_read_bulk_async_start (SANE_Int dn, size_t transfer_size,
+				SANE_Int num_transfers, size_t total)
+{
+  (void) dn;
+
+  assert (!fake.stream);
+  assert (num_transfers > 0 && transfer_size > 0 && total > 0);
+  fake.stream_buf = realloc (fake.stream_buf, transfer_size);
+  assert (fake.stream_buf != NULL);
+  fake.stream_size = transfer_size;
+  fake.stream_left = total;
+  fake.stream = 1;
+  fake.streams++;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+fake_usb_read_bulk_async_next (SANE_Int dn, SANE_Byte ** buffer,
+			       size_t * size)
+{
+  SANE_Status status;
+
+  (void) dn;
+
+  assert (fake.stream);
+  if (!fake.stream_left)
+    return SANE_STATUS_EOF;
+  *size = fake.stream_size;
+  if (*size > fake.stream_left)
+    *size = fake.stream_left;
+  status = fake_read (fake.stream_buf, size);
+  if (status != SANE_STATUS_GOOD)
+    return status;
+  fake.stream_left -= *size;
+  *buffer = fake.stream_buf;
+  return SANE_STATUS_GOOD;
+}
+
+SANE_Status
+fake_usb_read_bulk_async_stop (SANE_Int dn)
+{
+  (void) dn;
+
+  assert (fake.stream);
+  fake.stream = 0;
+  return SANE_STATUS_GOOD;
+}
+
+/* sets up the scanner and the fake for a new page of random data, the
+ * scan shortened to 12 blocks; with paper_out, the scanner tells that
+ * the paper ended half way */
+static void
+setup_fake (struct scanner *s, int model, int source, int page_height,
+	    int paper_out)
+{
+  assert (setup_scanner (s, model, 0, 300, MODE_COLOR, source,
+			 page_height, 0));
+  s->fullscan.height = 12 * s->block_img.height;
+  s->fullscan.total_bytes = s->fullscan.width_bytes * s->fullscan.height;
+
+  free (fake.data);
+  fake.len = s->fullscan.total_bytes;
+  fake.data = malloc (fake.len);
+  assert (fake.data != NULL);
+  seed = 1;
+  fill_random (fake.data, fake.len);
+  fake.block = s->block_xfr.total_bytes;
+  fake.pos = 0;
+  fake.trailer = 0;
+  fake.reply_len = 0;
+  fake.stream = 0;
+  fake.streams = 0;
+  fake.paper_lines = s->fullscan.height;
+  if (paper_out)
+    fake.paper_lines = s->fullscan.height / 2 + 5;
+  fake.fail_at = 0;
+}
+
+/* reads the sides of a page through sane_read() the way a frontend
+ * does, returns the last status */
+static SANE_Status
+read_page (struct scanner *s, unsigned char *out[2], int out_len[2])
+{
+  SANE_Status status = SANE_STATUS_GOOD;
+  SANE_Int len;
+  int side;
+
+  s->started = 1;
+  assert (start_reader (s) == SANE_STATUS_GOOD);
+  assert (s->reader_running == (global_readahead > 0));
+
+  for (side = 0; side < (s->source == SOURCE_ADF_DUPLEX ? 2 : 1); side++)
+    {
+      s->side = side;
+      out_len[side] = 0;
+      do
+	{
+	  status = sane_read (s, out[side] + out_len[side], 4000, &len);
+	  out_len[side] += len;
+	}
+      while (status == SANE_STATUS_GOOD);
+      if (status != SANE_STATUS_EOF)
+	return status;
+    }
+  return status;
+}
+
+/**
+ * the reader thread and the queued usb reads give the same pages as
+ * reading in sane_read(), with and without paper length detection, and
+ * stop on errors and cancel
+ */
+static void
+reader_thread (void)
+{
+  static const struct
+  {
+    int model;
+    int source;
+    int page_height;
+    int paper_out;		/* paper ends half way down */
+  } scans[] =
+  {
+    { MODEL_S300, SOURCE_ADF_DUPLEX, 0, 1 },
+    { MODEL_S300, SOURCE_ADF_DUPLEX, 1200 * 3, 0 },
+    { MODEL_S1300i, SOURCE_ADF_FRONT, 0, 1 },
+    { MODEL_FI60F, SOURCE_FLATBED, 0, 0 }
+  };
+  /* in sane_read, with the thread, with queued reads, with both */
+  static const struct
+  {
+    int readahead;
+    int usbqueue;
+  } ways[] =
+  {
+    { 0, 0 },
+    { 2, 0 },
+    { 0, 3 },
+    { 2, 3 }
+  };
+#define NUM_WAYS (int) (sizeof (ways) / sizeof (ways[0]))
+  struct scanner *s;
+  unsigned char *out[NUM_WAYS][2];
+  int out_len[NUM_WAYS][2];
+  SANE_Int len;
+  int i, r, side;
+
+  s = malloc (sizeof (*s));
+  assert (s != NULL);
+  memset (out, 0, sizeof (out));
+
+  for (i = 0; i < (int) (sizeof (scans) / sizeof (scans[0])); i++)
+    {
+      for (r = 0; r < NUM_WAYS; r++)
+	{
+	  global_readahead = ways[r].readahead;
+	  global_usbqueue = ways[r].usbqueue;
+	  setup_fake (s, scans[i].model, scans[i].source,
+		      scans[i].page_height, scans[i].paper_out);
+
+	  /* no side gets more than the raw scan */
+	  for (side = 0; side < 2; side++)
+	    {
+	      out[r][side] = realloc (out[r][side], fake.len);
+	      assert (out[r][side] != NULL);
+	    }
+
+	  assert (read_page (s, out[r], out_len[r]) == SANE_STATUS_EOF);
+	  assert (!s->reader_running);
+	  assert (!fake.stream && !s->usb_stream);
+	  assert ((fake.streams > 0)
+		  == (ways[r].usbqueue > 0 && scans[i].model != MODEL_S1300i));
+	  if (scans[i].paper_out)
+	    assert (fake.pos < fake.len);
+	  else
+	    assert (fake.pos == fake.len);
+	  if (ways[r].readahead)
+	    {
+	      SANEI_Buf_Pool_Stats stats;
+	      sanei_buf_pool_get_stats (s->pool, &stats);
+	      assert (stats.buffers <= global_readahead + 1);
+	    }
+	  teardown_buffers (s);
+	}
+
+      for (side = 0; side < (scans[i].source == SOURCE_ADF_DUPLEX ? 2 : 1);
+	   side++)
+	{
+	  assert (out_len[0][side] > 0);
+	  for (r = 1; r < NUM_WAYS; r++)
+	    {
+	      assert (out_len[0][side] == out_len[r][side]);
+	      assert (memcmp (out[0][side], out[r][side],
+			      out_len[0][side]) == 0);
+	    }
+	}
+    }
+
+  /* a failing read ends the page in every way */
+  for (r = 0; r < NUM_WAYS; r++)
+    {
+      global_readahead = ways[r].readahead;
+      global_usbqueue = ways[r].usbqueue;
+      setup_fake (s, MODEL_S300, SOURCE_ADF_DUPLEX, 0, 0);
+      fake.fail_at = fake.block * 2 + 100;
+      assert (read_page (s, out[r], out_len[r]) == SANE_STATUS_IO_ERROR);
+      sane_cancel (s);
+      assert (!s->reader_running);
+      assert (!fake.stream && !s->usb_stream);
+      teardown_buffers (s);
+    }
+  global_usbqueue = 0;
+
+  /* cancel while the thread waits for sane_read */
+  global_readahead = 1;
+  setup_fake (s, MODEL_S300, SOURCE_ADF_DUPLEX, 0, 0);
+  s->started = 1;
+  assert (start_reader (s) == SANE_STATUS_GOOD);
+  assert (sane_read (s, out[0][0], 4000, &len) == SANE_STATUS_GOOD);
+  sane_cancel (s);
+  assert (!s->reader_running);
+  assert (fake.pos < fake.len);
+  teardown_buffers (s);
+  global_readahead = 0;
+
+  /* cancel half way through a block of queued reads */
+  global_usbqueue = 3;
+  setup_fake (s, MODEL_S300, SOURCE_ADF_DUPLEX, 0, 0);
+  assert (read_from_scanner (s, &s->block_xfr) == SANE_STATUS_GOOD);
+  assert (!s->block_xfr.done);
+  assert (fake.stream && s->usb_stream);
+  sane_cancel (s);
+  assert (!fake.stream && !s->usb_stream);
+  teardown_buffers (s);
+  global_usbqueue = 0;
+
+  for (r = 0; r < NUM_WAYS; r++)
+    for (side = 0; side < 2; side++)
+      free (out[r][side]);
+  free (fake.stream_buf);
+  free (fake.data);
+  free (s);
+}
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  descramble_and_copy ();
+  binarize_short ();
+  reader_thread ();
+
+  return 0;
+}
@@ -0,0 +1,451 @@
+#include "../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+
+#include "sanei_bench.h"
+
+/* synthetic pages are US letter sized */
+#define PAGE_WIDTH_TENTHS 85
+#define PAGE_HEIGHT_TENTHS 110
+
+static double min_time = 0.5;
+static char **patterns;
+static int pattern_count;
+
+static unsigned long random_state = 1;
+
+static unsigned int
+next_random (void)
+{
+  random_state = random_state * 1103515245 + 12345;
+  return (unsigned int) (random_state / 65536) % 32768;
+}
+
+static double
+now (void)
+{
+  struct timeval tv;
+
+  gettimeofday (&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static int
+selected (const char *name)
+{
+  int i;
+
+  if (!pattern_count)
+    return 1;
+  for (i = 0; i < pattern_count; i++)
+    if (strstr (name, patterns[i]))
+      return 1;
+  return 0;
+}
+
+/* one line per routine: name, mode, dpi, MPixel per run, seconds per run
+ * and MPixel/s, separated by blanks so that scripts can split them */
+void
+bench_run (const char *name, const bench_page * page, double pixels,
+	   void (*setup) (void *), void (*run) (void *), void *arg)
+{
+  double start, total = 0;
+  int runs = 0;
+
+  if (!selected (name))
+    return;
+
+  do
+    {
+      if (setup)
+	setup (arg);
+      start = now ();
+      run (arg);
+      total += now () - start;
+      runs++;
+    }
+  while (total < min_time);
+
+  printf ("%-28s %-7s %4d %8.3f %10.6f %10.2f\n", name, page->mode,
+	  page->dpi, pixels / 1000000, total / runs,
+	  pixels / 1000000 / (total / runs));
+  fflush (stdout);
+}
+
+/*
+ * a light sheet, skewed by 1/100 and with a quarter inch of dark
+ * background around it, carrying lines of text and a few specks
+ */
+void
+bench_make_page (bench_page * page, SANE_Frame format, int depth, int dpi)
+{
+  SANE_Parameters *params = &page->params;
+  int spp = format == SANE_FRAME_RGB ? 3 : 1;
+  int margin = dpi / 4, pitch = dpi / 6, glyph = dpi / 20;
+  double c = cos (atan (0.01)), s = sin (atan (0.01));
+  int sheet_w, sheet_h;
+  int x, y, n;
+
+  params->format = format;
+  params->last_frame = SANE_TRUE;
+  params->depth = depth;
+  params->pixels_per_line = dpi * PAGE_WIDTH_TENTHS / 10;
+  params->lines = dpi * PAGE_HEIGHT_TENTHS / 10;
+  if (depth == 1)
+    params->bytes_per_line = (params->pixels_per_line + 7) / 8;
+  else
+    params->bytes_per_line = params->pixels_per_line * spp;
+  page->dpi = dpi;
+  page->mode = depth == 1 ? "lineart" : spp == 3 ? "color" : "gray";
+
+  page->data = calloc (params->bytes_per_line, params->lines);
+  if (!page->data)
+    return;
+
+  sheet_w = params->pixels_per_line - 2 * margin;
+  sheet_h = params->lines - 2 * margin;
+  for (y = 0; y < params->lines; y++)
+    for (x = 0; x < params->pixels_per_line; x++)
+      {
+	double u = (x - margin) * c + (y - margin) * s;
+	double v = -(x - margin) * s + (y - margin) * c;
+	int value = 30 + next_random () % 10;
+
+	if (u >= 0 && u < sheet_w && v >= 0 && v < sheet_h)
+	  {
+	    int col = (int) u / glyph, row = (int) v / pitch;
+	    int in_line = (int) v % pitch < pitch / 2;
+	    int in_text = u >= dpi && u < sheet_w - dpi
+	      && v >= dpi && v < sheet_h - dpi;
+
+	    value = 235 - next_random () % 10;
+	    /* roughly two glyphs in three are ink, words split by spaces */
+	    if (in_text && in_line
+		&& ((col * 7919 + row * 104729) % 13) % 3 && col % 7)
+	      value = 40;
+	    else if (!(next_random () % 5000))
+	      value = 20;
+	  }
+
+	if (depth == 1)
+	  {
+	    if (value < 128)
+	      page->data[y * params->bytes_per_line + x / 8] |= 0x80 >> (x % 8);
+	    continue;
+	  }
+	for (n = 0; n < spp; n++)
+	  page->data[y * params->bytes_per_line + x * spp + n] = value;
+      }
+}
+
+/* an empty sheet, cropped and white calibrated, with specks only; blank
+ * detection has to look at all of it */
+static void
+make_blank (const SANE_Parameters * params, SANE_Byte * buffer)
+{
+  int size = params->bytes_per_line * params->lines;
+  int i;
+
+  memset (buffer, params->depth == 1 ? 0 : 253, size);
+  for (i = 0; i < size; i++)
+    if (!(next_random () % 5000))
+      buffer[i] = params->depth == 1 ? 0x10 : 20;
+}
+
+void
+bench_free_page (bench_page * page)
+{
+  free (page->data);
+  page->data = NULL;
+}
+
+struct magic_arg
+{
+  const bench_page *page;
+  SANE_Parameters params;
+  SANE_Byte *work;
+  SANE_Byte *blank;
+  int top, bot, left, right;
+  int center_x, center_y;
+  double slope;
+  int angle;
+};
+
+/* the routines working in place get a fresh copy of the page each run,
+ * the others a copy of its parameters */
+static void
+setup_copy (void *arg)
+{
+  struct magic_arg *a = arg;
+
+  a->params = a->page->params;
+  memcpy (a->work, a->page->data,
+	  a->params.bytes_per_line * a->params.lines);
+}
+
+static void
+run_despeck (void *arg)
+{
+  struct magic_arg *a = arg;
+
+  sanei_magic_despeck (&a->params, a->work, 2);
+}
+
+static void
+run_findEdges (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANE_Parameters params = a->page->params;
+  int top, bot, left, right;
+
+  sanei_magic_findEdges (&params, a->page->data, a->page->dpi,
+			 a->page->dpi, &top, &bot, &left, &right);
+}
+
+static void
+run_crop (void *arg)
+{
+  struct magic_arg *a = arg;
+
+  sanei_magic_crop (&a->params, a->work, a->top, a->bot, a->left,
+		    a->right);
+}
+
+static void
+run_findSkew (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANE_Parameters params = a->page->params;
+  int center_x, center_y;
+  double slope;
+
+  sanei_magic_findSkew (&params, a->page->data, a->page->dpi,
+			a->page->dpi, &center_x, &center_y, &slope);
+}
+
+static void
+run_rotate (void *arg)
+{
+  struct magic_arg *a = arg;
+
+  sanei_magic_rotate (&a->params, a->work, a->center_x, a->center_y,
+		      a->slope, a->params.depth == 1 ? 0 : 0xff);
+}
+
+static void
+run_isBlank (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANE_Parameters params = a->page->params;
+
+  sanei_magic_isBlank (&params, a->blank, 1.0);
+}
+
+static void
+run_isBlank2 (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANE_Parameters params = a->page->params;
+
+  sanei_magic_isBlank2 (&params, a->blank, a->page->dpi,
+			a->page->dpi, 1.0);
+}
+
+static void
+run_findTurn (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANE_Parameters params = a->page->params;
+  int angle;
+
+  sanei_magic_findTurn (&params, a->page->data, a->page->dpi,
+			a->page->dpi, &angle);
+}
+
+static void
+run_turn (void *arg)
+{
+  struct magic_arg *a = arg;
+
+  sanei_magic_turn (&a->params, a->work, a->angle);
+}
+
+/* feed the page in blocks of a tenth of an inch, as they come off USB */
+static void
+run_stream (void *arg)
+{
+  struct magic_arg *a = arg;
+  SANEI_Magic_Stream *stream;
+  SANE_Parameters params = a->page->params;
+  int chunk = a->page->dpi / 10;
+  int line, top, bot, left, right, center_x, center_y;
+  double slope;
+
+  params.lines = -1;
+  if (sanei_magic_stream_new (&params, a->page->dpi, a->page->dpi, 1.0,
+			      &stream) != SANE_STATUS_GOOD)
+    return;
+  for (line = 0; line < a->page->params.lines; line += chunk)
+    {
+      int lines = a->page->params.lines - line;
+
+      if (lines > chunk)
+	lines = chunk;
+      sanei_magic_stream_write (stream,
+				a->page->data +
+				line * params.bytes_per_line, lines);
+    }
+  sanei_magic_stream_finish (stream);
+  sanei_magic_stream_findEdges (stream, &top, &bot, &left, &right);
+  sanei_magic_stream_findSkew (stream, &center_x, &center_y, &slope);
+  sanei_magic_stream_isBlank2 (stream);
+  sanei_magic_stream_free (stream);
+}
+
+static void
+bench_magic (const bench_page * page)
+{
+  struct magic_arg a;
+  const SANE_Parameters *params = &page->params;
+  double pixels = (double) params->pixels_per_line * params->lines;
+  int size = params->bytes_per_line * params->lines;
+
+  /* turning lineart by 90 degrees pads the other dimension */
+  if (params->depth == 1
+      && (params->lines + 7) / 8 * params->pixels_per_line > size)
+    size = (params->lines + 7) / 8 * params->pixels_per_line;
+
+  memset (&a, 0, sizeof (a));
+  a.page = page;
+  a.params = *params;
+  a.work = malloc (size);
+  a.blank = malloc (size);
+  if (!a.work || !a.blank)
+    {
+      free (a.work);
+      free (a.blank);
+      return;
+    }
+  make_blank (params, a.blank);
+
+  if (sanei_magic_findEdges (&a.params, page->data, page->dpi, page->dpi,
+			     &a.top, &a.bot, &a.left, &a.right)
+      != SANE_STATUS_GOOD)
+    {
+      a.top = a.left = 0;
+      a.bot = params->lines;
+      a.right = params->pixels_per_line;
+    }
+  if (sanei_magic_findSkew (&a.params, page->data, page->dpi, page->dpi,
+			    &a.center_x, &a.center_y, &a.slope)
+      != SANE_STATUS_GOOD)
+    {
+      a.center_x = params->pixels_per_line / 2;
+      a.center_y = params->lines / 2;
+      a.slope = 0.01;
+    }
+  a.angle = 90;
+
+  bench_run ("magic_despeck", page, pixels, setup_copy, run_despeck, &a);
+  bench_run ("magic_findEdges", page, pixels, NULL, run_findEdges, &a);
+  bench_run ("magic_crop", page, pixels, setup_copy, run_crop, &a);
+  bench_run ("magic_findSkew", page, pixels, NULL, run_findSkew, &a);
+  bench_run ("magic_rotate", page, pixels, setup_copy, run_rotate, &a);
+  bench_run ("magic_isBlank", page, pixels, NULL, run_isBlank, &a);
+  bench_run ("magic_isBlank2", page, pixels, NULL, run_isBlank2, &a);
+  bench_run ("magic_findTurn", page, pixels, NULL, run_findTurn, &a);
+  bench_run ("magic_turn", page, pixels, setup_copy, run_turn, &a);
+  bench_run ("magic_stream", page, pixels, NULL, run_stream, &a);
+
+  free (a.work);
+  free (a.blank);
+}
+
+static void
+bench_resolution (int dpi)
+{
+  bench_page lineart, gray, color;
+
+  bench_make_page (&lineart, SANE_FRAME_GRAY, 1, dpi);
+  bench_make_page (&gray, SANE_FRAME_GRAY, 8, dpi);
+  bench_make_page (&color, SANE_FRAME_RGB, 8, dpi);
+
+  if (lineart.data && gray.data && color.data)
+    {
+      bench_magic (&lineart);
+      bench_magic (&gray);
+      bench_magic (&color);
+
+      bench_genesys (&gray, &color);
+      bench_pixma (&gray, &color);
+      bench_plustek (&lineart, &gray, &color);
+    }
+  else
+    fprintf (stderr, "not enough memory for the %d dpi pages\n", dpi);
+
+  bench_free_page (&lineart);
+  bench_free_page (&gray);
+  bench_free_page (&color);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr, "usage: %s [-t seconds] [-d dpi] [routine...]\n"
+	   "  -t seconds  time to spend on each routine, default 0.5\n"
+	   "  -d dpi      page resolution, default 150, 300 and 600\n"
+	   "  routine     only run routines whose names contain this\n",
+	   name);
+}
+
+/**
+ * time the image processing routines shared by backends on synthetic
+ * pages and print the throughput of each
+ */
+int
+main (int argc, char **argv)
+{
+  int dpi = 0;
+  int i;
+
+  for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+      if (!strcmp (argv[i], "-t") && i + 1 < argc)
+	min_time = atof (argv[++i]);
+      else if (!strcmp (argv[i], "-d") && i + 1 < argc)
+	dpi = atoi (argv[++i]);
+      else
+	{
+	  usage (argv[0]);
+	  return 1;
+	}
+    }
+  patterns = argv + i;
+  pattern_count = argc - i;
+
+  sanei_magic_init ();
+
+  printf ("# routine mode dpi mpixel seconds mpixel/s\n");
+  if (dpi > 0)
+    bench_resolution (dpi);
+  else
+    {
+      bench_resolution (150);
+      bench_resolution (300);
+      bench_resolution (600);
+    }
+
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -0,0 +1,39 @@
+#ifndef SANEI_BENCH_H
+#define SANEI_BENCH_H
+
+/* shared by the sanei_bench driver and the backend kernel wrappers */
+
+#include "../include/sane/sane.h"
+
+/** one synthetic page, as a frontend would get it from sane_read() */
+typedef struct
+{
+  SANE_Parameters params;
+  int dpi;
+  const char *mode;		/* "lineart", "gray", "color", "gray16"... */
+  SANE_Byte *data;
+} bench_page;
+
+/**
+ * time run (arg) until the minimum time has passed and print one result
+ * line; setup (arg), if not NULL, is called before every run and is not
+ * timed
+ */
+extern void bench_run (const char *name, const bench_page * page,
+		       double pixels, void (*setup) (void *),
+		       void (*run) (void *), void *arg);
+
+/** draw a slightly skewed text page on a dark background */
+extern void bench_make_page (bench_page * page, SANE_Frame format,
+			     int depth, int dpi);
+
+extern void bench_free_page (bench_page * page);
+
+/* backend kernels, one file per backend since each includes the
+ * backend's own sources */
+extern void bench_genesys (const bench_page * gray, const bench_page * color);
+extern void bench_pixma (const bench_page * gray, const bench_page * color);
+extern void bench_plustek (const bench_page * lineart,
+			   const bench_page * gray, const bench_page * color);
+
+#endif /* SANEI_BENCH_H */
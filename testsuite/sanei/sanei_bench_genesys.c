@@ -0,0 +1,218 @@
+#include "../../include/sane/config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/sane/sane.h"
+#include "../include/_stdint.h"
+
+#include "sanei_bench.h"
+
+/* the conversion filters, compiled exactly as genesys_conv.c does */
+
+#define SINGLE_BYTE
+#define BYTES_PER_COMPONENT 1
+#define COMPONENT_TYPE uint8_t
+
+#define FUNC_NAME(f) f ## _8
+
+#include "../../backend/genesys_conv_hlp.c"
+
+#undef FUNC_NAME
+
+#undef COMPONENT_TYPE
+#undef BYTES_PER_COMPONENT
+#undef SINGLE_BYTE
+
+#define DOUBLE_BYTE
+#define BYTES_PER_COMPONENT 2
+#define COMPONENT_TYPE uint16_t
+
+#define FUNC_NAME(f) f ## _16
+
+#include "../../backend/genesys_conv_hlp.c"
+
+#undef FUNC_NAME
+
+#undef COMPONENT_TYPE
+#undef BYTES_PER_COMPONENT
+#undef DOUBLE_BYTE
+
+struct conv_arg
+{
+  uint8_t *src;
+  uint8_t *dst;
+  unsigned int lines;
+  unsigned int src_pixels;
+  unsigned int dst_pixels;
+  unsigned int channels;
+  unsigned int ccd_shift[6];
+  unsigned int shift_count;
+  int wide;
+};
+
+static void
+run_reorder_cis (void *arg)
+{
+  struct conv_arg *a = arg;
+
+  if (a->wide)
+    genesys_reorder_components_cis_16 (a->src, a->dst, a->lines,
+				       a->src_pixels);
+  else
+    genesys_reorder_components_cis_8 (a->src, a->dst, a->lines,
+				      a->src_pixels);
+}
+
+static void
+run_reorder_cis_bgr (void *arg)
+{
+  struct conv_arg *a = arg;
+
+  if (a->wide)
+    genesys_reorder_components_cis_bgr_16 (a->src, a->dst, a->lines,
+					   a->src_pixels);
+  else
+    genesys_reorder_components_cis_bgr_8 (a->src, a->dst, a->lines,
+					  a->src_pixels);
+}
+
+static void
+run_reorder_bgr (void *arg)
+{
+  struct conv_arg *a = arg;
+
+  if (a->wide)
+    genesys_reorder_components_bgr_16 (a->src, a->dst, a->lines,
+				       a->src_pixels);
+  else
+    genesys_reorder_components_bgr_8 (a->src, a->dst, a->lines,
+				      a->src_pixels);
+}
+
+static void
+run_reverse_ccd (void *arg)
+{
+  struct conv_arg *a = arg;
+
+  if (a->wide)
+    genesys_reverse_ccd_16 (a->src, a->dst, a->lines,
+			    a->src_pixels * a->channels, a->ccd_shift,
+			    a->shift_count);
+  else
+    genesys_reverse_ccd_8 (a->src, a->dst, a->lines,
+			   a->src_pixels * a->channels, a->ccd_shift,
+			   a->shift_count);
+}
+
+static void
+run_shrink_lines (void *arg)
+{
+  struct conv_arg *a = arg;
+
+  if (a->wide)
+    genesys_shrink_lines_16 (a->src, a->dst, a->lines, a->src_pixels,
+			     a->dst_pixels, a->channels);
+  else
+    genesys_shrink_lines_8 (a->src, a->dst, a->lines, a->src_pixels,
+			    a->dst_pixels, a->channels);
+}
+
+/* widen 8 bit samples to native 16 bit ones */
+static uint8_t *
+widen (const bench_page * page)
+{
+  int bytes = page->params.bytes_per_line * page->params.lines;
+  uint16_t *wide = malloc (bytes * 2);
+  int i;
+
+  if (!wide)
+    return NULL;
+  for (i = 0; i < bytes; i++)
+    wide[i] = page->data[i] * 257;
+  return (uint8_t *) wide;
+}
+
+static void
+bench_width (const bench_page * page, unsigned int channels, uint8_t * src,
+	     uint8_t * dst, int wide)
+{
+  struct conv_arg a;
+  double pixels = (double) page->params.pixels_per_line * page->params.lines;
+  char name[64];
+  unsigned int i;
+
+  a.src = src;
+  a.dst = dst;
+  a.lines = page->params.lines;
+  a.src_pixels = page->params.pixels_per_line;
+  a.dst_pixels = a.src_pixels;
+  a.channels = channels;
+  a.wide = wide;
+
+  if (channels == 3)
+    {
+      sprintf (name, "genesys_reorder_cis_%d", wide ? 16 : 8);
+      bench_run (name, page, pixels, NULL, run_reorder_cis, &a);
+      sprintf (name, "genesys_reorder_cis_bgr_%d", wide ? 16 : 8);
+      bench_run (name, page, pixels, NULL, run_reorder_cis_bgr, &a);
+      sprintf (name, "genesys_reorder_bgr_%d", wide ? 16 : 8);
+      bench_run (name, page, pixels, NULL, run_reorder_bgr, &a);
+    }
+
+  /* staggered sensor, with line distance between the colors the way
+   * genesys_read_ordered_data sets it up; the last lines are left out
+   * since they need source lines beyond the page */
+  a.shift_count = 2 * channels;
+  for (i = 0; i < channels; i++)
+    {
+      a.ccd_shift[i] = i * 4;
+      a.ccd_shift[i + channels] = i * 4 + 2;
+    }
+  a.lines = page->params.lines - a.ccd_shift[a.shift_count - 1];
+  sprintf (name, "genesys_reverse_ccd_%d", wide ? 16 : 8);
+  bench_run (name, page, (double) a.src_pixels * a.lines, NULL,
+	     run_reverse_ccd, &a);
+  a.lines = page->params.lines;
+
+  /* down to half the width, as after scanning at twice the resolution */
+  a.dst_pixels = a.src_pixels / 2;
+  sprintf (name, "genesys_shrink_lines_%d", wide ? 16 : 8);
+  bench_run (name, page, pixels, NULL, run_shrink_lines, &a);
+
+  /* and up from half the width, pixels are counted on the wide side */
+  a.src_pixels = a.dst_pixels;
+  a.dst_pixels = page->params.pixels_per_line;
+  sprintf (name, "genesys_expand_lines_%d", wide ? 16 : 8);
+  bench_run (name, page, pixels, NULL, run_shrink_lines, &a);
+}
+
+void
+bench_genesys (const bench_page * gray, const bench_page * color)
+{
+  int bytes = color->params.bytes_per_line * color->params.lines;
+  uint8_t *dst, *wide;
+
+  dst = malloc (bytes * 2);
+  if (!dst)
+    return;
+
+  bench_width (gray, 1, gray->data, dst, 0);
+  bench_width (color, 3, color->data, dst, 0);
+
+  wide = widen (gray);
+  if (wide)
+    {
+      bench_width (gray, 1, wide, dst, 1);
+      free (wide);
+    }
+  wide = widen (color);
+  if (wide)
+    {
+      bench_width (color, 3, wide, dst, 1);
+      free (wide);
+    }
+
+  free (dst);
+}
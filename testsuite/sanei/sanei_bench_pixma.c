@@ -0,0 +1,213 @@
+#include "../../include/sane/config.h"
+
+#include <stdarg.h>
+
+/* the image helpers live in pixma_common.c next to everything else the
+ * subdrivers share, so take the whole file */
+#include "../../backend/pixma_common.c"
+
+#include "sanei_bench.h"
+
+/* stand-ins for pixma.c, pixma_io_sanei.c and the subdrivers, which
+ * pixma_common.c refers to but the image helpers never reach */
+
+const pixma_config_t pixma_mp150_devices[] = { {0} };
+const pixma_config_t pixma_mp750_devices[] = { {0} };
+const pixma_config_t pixma_mp730_devices[] = { {0} };
+const pixma_config_t pixma_mp810_devices[] = { {0} };
+const pixma_config_t pixma_iclass_devices[] = { {0} };
+
+#ifndef NDEBUG
+void
+sanei_debug_pixma_call (int level, const char *msg, ...)
+{
+  (void) level;
+  (void) msg;
+}
+#endif
+
+int
+pixma_io_init (void)
+{
+  return 0;
+}
+
+void
+pixma_io_cleanup (void)
+{
+}
+
+unsigned
+pixma_collect_devices (const char **conf_devices,
+		       const struct pixma_config_t *const pixma_devices[])
+{
+  (void) conf_devices;
+  (void) pixma_devices;
+  return 0;
+}
+
+const struct pixma_config_t *
+pixma_get_device_config (unsigned devnr)
+{
+  (void) devnr;
+  return NULL;
+}
+
+const char *
+pixma_get_device_id (unsigned devnr)
+{
+  (void) devnr;
+  return NULL;
+}
+
+int
+pixma_connect (unsigned devnr, pixma_io_t ** handle)
+{
+  (void) devnr;
+  (void) handle;
+  return PIXMA_ENODEV;
+}
+
+void
+pixma_disconnect (pixma_io_t * io)
+{
+  (void) io;
+}
+
+int
+pixma_activate (pixma_io_t * io)
+{
+  (void) io;
+  return PIXMA_ENODEV;
+}
+
+int
+pixma_deactivate (pixma_io_t * io)
+{
+  (void) io;
+  return PIXMA_ENODEV;
+}
+
+int
+pixma_write (pixma_io_t * io, const void *cmd, unsigned len)
+{
+  (void) io;
+  (void) cmd;
+  (void) len;
+  return PIXMA_ENODEV;
+}
+
+int
+pixma_read (pixma_io_t * io, void *buf, unsigned size)
+{
+  (void) io;
+  (void) buf;
+  (void) size;
+  return PIXMA_ENODEV;
+}
+
+int
+pixma_set_interrupt_mode (pixma_io_t * io, int background)
+{
+  (void) io;
+  (void) background;
+  return PIXMA_ENODEV;
+}
+
+struct line_arg
+{
+  const bench_page *page;
+  pixma_scan_param_t sp;
+  uint8_t *src;
+  uint8_t *dst;
+  unsigned int c;
+};
+
+/* line by line, as the subdrivers call them from fill_buffer */
+static void
+run_rgb_to_gray (void *arg)
+{
+  struct line_arg *a = arg;
+  unsigned int w = a->page->params.pixels_per_line;
+  unsigned int bpl = w * a->c;
+  int y;
+
+  for (y = 0; y < a->page->params.lines; y++)
+    pixma_rgb_to_gray (a->dst, a->src + y * bpl, w, a->c);
+}
+
+static void
+run_binarize_line (void *arg)
+{
+  struct line_arg *a = arg;
+  unsigned int w = a->page->params.pixels_per_line;
+  int y;
+
+  for (y = 0; y < a->page->params.lines; y++)
+    pixma_binarize_line (&a->sp, a->dst, a->src + y * w, w, a->c);
+}
+
+void
+bench_pixma (const bench_page * gray, const bench_page * color)
+{
+  struct line_arg a;
+  int bytes = color->params.bytes_per_line * color->params.lines;
+  uint8_t *wide;
+  int i;
+
+  memset (&a, 0, sizeof (a));
+  a.dst = malloc (color->params.bytes_per_line * 2);
+  if (!a.dst)
+    return;
+
+  a.page = color;
+  a.src = color->data;
+  a.c = 3;
+  bench_run ("pixma_rgb_to_gray_8", color, (double) color->params.
+	     pixels_per_line * color->params.lines, NULL, run_rgb_to_gray,
+	     &a);
+
+  wide = malloc (bytes * 2);
+  if (wide)
+    {
+      /* 48 bit RGB comes little endian from the scanner */
+      for (i = 0; i < bytes; i++)
+	{
+	  wide[2 * i] = color->data[i];
+	  wide[2 * i + 1] = color->data[i];
+	}
+      a.src = wide;
+      a.c = 6;
+      bench_run ("pixma_rgb_to_gray_16", color, (double) color->params.
+		 pixels_per_line * color->params.lines, NULL,
+		 run_rgb_to_gray, &a);
+      free (wide);
+    }
+
+  /* binarize normalizes the source line in place; a copy of the page
+   * keeps the generated one intact for the other routines */
+  a.page = gray;
+  a.c = 1;
+  a.sp.xdpi = gray->dpi;
+  a.sp.threshold = 127;
+  a.src = malloc (gray->params.bytes_per_line * gray->params.lines);
+  if (a.src)
+    {
+      memcpy (a.src, gray->data,
+	      gray->params.bytes_per_line * gray->params.lines);
+      bench_run ("pixma_binarize_line", gray, (double) gray->params.
+		 pixels_per_line * gray->params.lines, NULL,
+		 run_binarize_line, &a);
+
+      /* with the dynamic threshold curve, as set up by pixma_scan */
+      a.sp.threshold_curve = 64;
+      load_lut (a.sp.lineart_lut, 8, 8, 50, 205, a.sp.threshold_curve,
+		a.sp.threshold - 127);
+      bench_run ("pixma_binarize_line_curve", gray, (double) gray->params.
+		 pixels_per_line * gray->params.lines, NULL,
+		 run_binarize_line, &a);
+      free (a.src);
+    }
+
+  free (a.dst);
+}
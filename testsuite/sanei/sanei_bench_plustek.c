@@ -0,0 +1,206 @@
+#include "../../include/sane/config.h"
+#include "../../include/lalloca.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei.h"
+#include "../include/sane/saneopts.h"
+
+/* the USB part of the plustek backend is one translation unit made of
+ * included files; take it the way plustek.c does */
+
+#define BACKEND_NAME    plustek
+#include "../include/sane/sanei_access.h"
+#include "../include/sane/sanei_backend.h"
+#include "../include/sane/sanei_config.h"
+#include "../include/sane/sanei_thread.h"
+
+#define USE_IPC
+
+#include "../../backend/plustek-usb.h"
+#include "../../backend/plustek.h"
+
+#define _DBG_FATAL      0
+#define _DBG_ERROR      1
+#define _DBG_WARNING    3
+#define _DBG_INFO       5
+#define _DBG_PROC       7
+#define _DBG_SANE_INIT 10
+#define _DBG_INFO2     15
+#define _DBG_DREGS     20
+#define _DBG_DCALDATA  22
+#define _DBG_DPIC      25
+#define _DBG_READ      30
+
+static SANE_Bool  cancelRead;
+static DevList   *usbDevs;
+
+/* only the image routines are benched, and the warnings the backend
+ * sources give are for the backend build to report, not this one */
+#ifdef __GNUC__
+#pragma GCC diagnostic ignored "-Wpragmas"
+#pragma GCC diagnostic ignored "-Wunknown-warning-option"
+#pragma GCC diagnostic ignored "-Wunused-function"
+#pragma GCC diagnostic ignored "-Wabsolute-value"
+#pragma GCC diagnostic ignored "-Wmemset-elt-size"
+#endif
+
+#include "../../backend/plustek-usbio.c"
+#include "../../backend/plustek-usbdevs.c"
+#include "../../backend/plustek-usbhw.c"
+#include "../../backend/plustek-usbmap.c"
+#include "../../backend/plustek-usbscan.c"
+#include "../../backend/plustek-usbimg.c"
+#include "../../backend/plustek-usbcalfile.c"
+#include "../../backend/plustek-usbshading.c"
+#include "../../backend/plustek-usbcal.c"
+#include "../../backend/plustek-usb.c"
+
+#include "sanei_bench.h"
+
+struct scale_arg
+{
+  const bench_page *page;
+  Plustek_Device dev;
+  u_char *src;
+  int src_bpl;		/* bytes per line of the source */
+  int step;		/* bytes between the color planes of one pixel */
+  void (*process) (Plustek_Device *);
+};
+
+/* run the processing routine once per line, the way usb_ReadData does */
+static void
+run_process (void *arg)
+{
+  struct scale_arg *a = arg;
+  ScanDef *scan = &a->dev.scanning;
+  int y;
+
+  for (y = 0; y < a->page->params.lines; y++)
+    {
+      u_char *line = a->src + y * a->src_bpl;
+
+      scan->Red.pb = line;
+      scan->Green.pb = line + a->step;
+      scan->Blue.pb = line + 2 * a->step;
+      a->process (&a->dev);
+    }
+}
+
+/* phy_dpi is the resolution of the source, the page is scaled to the
+ * page resolution */
+static void
+bench_process (const char *name, struct scale_arg *a, int phy_dpi,
+	       void (*process) (Plustek_Device *))
+{
+  ScanDef *scan = &a->dev.scanning;
+  u_long pixels = a->page->params.pixels_per_line;
+
+  scan->sParam.PhyDpi.x = phy_dpi;
+  scan->sParam.UserDpi.x = a->page->dpi;
+  scan->sParam.Size.dwPhyPixels = pixels;
+  scan->sParam.Size.dwPixels = pixels * a->page->dpi / phy_dpi;
+  scan->sParam.Size.dwValidPixels = pixels;
+  scan->dwBytesLine = a->page->params.bytes_per_line;
+  a->process = process;
+
+  bench_run (name, a->page,
+	     (double) a->page->params.pixels_per_line *
+	     a->page->params.lines, NULL, run_process, a);
+}
+
+/* 16 bit samples come big endian from the LM983x */
+static u_char *
+widen (const bench_page * page)
+{
+  int bytes = page->params.bytes_per_line * page->params.lines;
+  u_char *wide = malloc (bytes * 2);
+  int i;
+
+  if (!wide)
+    return NULL;
+  for (i = 0; i < bytes; i++)
+    {
+      wide[2 * i] = page->data[i];
+      wide[2 * i + 1] = 0;
+    }
+  return wide;
+}
+
+void
+bench_plustek (const bench_page * lineart, const bench_page * gray,
+	       const bench_page * color)
+{
+  struct scale_arg a;
+  ScanDef *scan = &a.dev.scanning;
+  int dpi = color->dpi;
+  int scaled = color->dpi * 3 / 2;
+
+  memset (&a, 0, sizeof (a));
+  scan->sParam.bSource = SOURCE_Reflection;
+  scan->fGrayFromColor = 2;
+  scan->UserBuf.pb = malloc (color->params.bytes_per_line * 2);
+  if (!scan->UserBuf.pb)
+    return;
+
+  /* CCD color, pixel interleaved */
+  a.page = color;
+  a.src = color->data;
+  a.src_bpl = color->params.bytes_per_line;
+  a.step = 1;
+  bench_process ("plustek_color_duplicate8", &a, dpi, usb_ColorDuplicate8);
+  bench_process ("plustek_color_scale8", &a, scaled, usb_ColorScale8);
+  bench_process ("plustek_color_scale_gray", &a, scaled,
+		 usb_ColorScaleGray);
+
+  a.src = widen (color);
+  if (a.src)
+    {
+      a.src_bpl *= 2;
+      a.step = 2;
+      bench_process ("plustek_color_duplicate16", &a, dpi,
+		     usb_ColorDuplicate16);
+      bench_process ("plustek_color_scale16", &a, scaled, usb_ColorScale16);
+      free (a.src);
+    }
+
+  a.page = gray;
+  a.src = gray->data;
+  a.src_bpl = gray->params.bytes_per_line;
+  a.step = 0;
+  bench_process ("plustek_gray_scale8", &a, scaled, usb_GrayScale8);
+
+  a.src = widen (gray);
+  if (a.src)
+    {
+      a.src_bpl *= 2;
+      bench_process ("plustek_gray_duplicate16", &a, dpi,
+		     usb_GrayDuplicate16);
+      bench_process ("plustek_gray_scale16", &a, scaled, usb_GrayScale16);
+      free (a.src);
+    }
+
+  a.page = lineart;
+  a.src = lineart->data;
+  a.src_bpl = lineart->params.bytes_per_line;
+  bench_process ("plustek_bw_scale", &a, scaled, usb_BWScale);
+
+  free (scan->UserBuf.pb);
+}
@@ -0,0 +1,319 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_buf_pool.h"
+
+#define BUF_SIZE 4096
+#define BUF_COUNT 4
+#define BLOCKS 2000
+
+#ifdef HAVE_PTHREAD_H
+
+/* fill one block with a pattern depending on its number */
+static void
+fill_block (SANE_Byte * addr, int block, int bytes)
+{
+  int i;
+
+  for (i = 0; i < bytes; i++)
+    addr[i] = (SANE_Byte) (block * 7 + i);
+}
+
+static int
+check_block (SANE_Byte * addr, int block, int bytes)
+{
+  int i;
+
+  for (i = 0; i < bytes; i++)
+    if (addr[i] != (SANE_Byte) (block * 7 + i))
+      return 0;
+  return 1;
+}
+
+/* blocks get different lengths, some of them empty */
+static int
+block_bytes (int block)
+{
+  return (block * 611) % (BUF_SIZE + 1);
+}
+
+static void
+put_block (SANEI_Buf_Pool * pool, int block)
+{
+  SANE_Byte *addr;
+
+  addr = sanei_buf_pool_writer_get_buffer (pool);
+  assert (addr != NULL);
+  fill_block (addr, block, block_bytes (block));
+  sanei_buf_pool_writer_put_buffer (pool, block_bytes (block));
+}
+
+static void
+get_block (SANEI_Buf_Pool * pool, int block)
+{
+  SANE_Status status;
+  SANE_Byte *addr;
+  SANE_Int bytes;
+
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_GOOD);
+  assert (bytes == block_bytes (block));
+  assert (check_block (addr, block, bytes));
+  sanei_buf_pool_reader_put_buffer (pool);
+}
+
+/* the writer thread: put BLOCKS blocks, then close with the status */
+static void *
+writer (void *arg)
+{
+  SANEI_Buf_Pool *pool = arg;
+  int block;
+
+  for (block = 0; block < BLOCKS; block++)
+    put_block (pool, block);
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_IO_ERROR);
+  return NULL;
+}
+
+/**
+ * buffers put back are reused, and the writer takes new ones when
+ * none are free
+ */
+static void
+single_thread (void)
+{
+  SANEI_Buf_Pool *pool;
+  SANEI_Buf_Pool_Stats stats;
+  SANE_Status status;
+  SANE_Byte *addr, *again;
+  SANE_Int bytes;
+  int block;
+
+  status = sanei_buf_pool_new (BUF_SIZE, BUF_COUNT, &pool);
+  assert (status == SANE_STATUS_GOOD);
+
+  /* the same buffer until it is put */
+  addr = sanei_buf_pool_writer_get_buffer (pool);
+  again = sanei_buf_pool_writer_get_buffer (pool);
+  assert (addr != NULL && addr == again);
+
+  /* one buffer at a time never needs more than one */
+  for (block = 0; block < 3 * BUF_COUNT; block++)
+    {
+      put_block (pool, block);
+      get_block (pool, block);
+    }
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_EOF);
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_EOF);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.buffers == BUF_COUNT);
+  assert (stats.exhausted == 0);
+  assert (stats.max_queued == 1);
+
+  /* twice as many blocks as buffers before reading any */
+  status = sanei_buf_pool_reset (pool, BUF_COUNT);
+  assert (status == SANE_STATUS_GOOD);
+  for (block = 0; block < 2 * BUF_COUNT; block++)
+    put_block (pool, block);
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_EOF);
+  for (block = 0; block < 2 * BUF_COUNT; block++)
+    get_block (pool, block);
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_EOF);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.buffers == 2 * BUF_COUNT);
+  assert (stats.exhausted == BUF_COUNT);
+  assert (stats.max_queued == 2 * BUF_COUNT);
+
+  /* the pool keeps its buffers, a reset drops what is still queued */
+  status = sanei_buf_pool_reset (pool, BUF_COUNT);
+  assert (status == SANE_STATUS_GOOD);
+  for (block = 0; block < 2 * BUF_COUNT; block++)
+    put_block (pool, block);
+  status = sanei_buf_pool_reset (pool, 0);
+  assert (status == SANE_STATUS_GOOD);
+  for (block = 0; block < 2 * BUF_COUNT; block++)
+    put_block (pool, block);
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_NO_DOCS);
+  for (block = 0; block < 2 * BUF_COUNT; block++)
+    get_block (pool, block);
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_NO_DOCS);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.buffers == 2 * BUF_COUNT);
+  assert (stats.exhausted == 0);
+
+  sanei_buf_pool_free (pool);
+}
+
+/**
+ * a writer thread and this thread as the reader
+ */
+static void
+two_threads (void)
+{
+  SANEI_Buf_Pool *pool;
+  SANEI_Buf_Pool_Stats stats;
+  SANE_Status status;
+  SANE_Byte *addr;
+  SANE_Int bytes;
+  pthread_t thread;
+  int pass, block;
+
+  status = sanei_buf_pool_new (BUF_SIZE, BUF_COUNT, &pool);
+  assert (status == SANE_STATUS_GOOD);
+
+  for (pass = 0; pass < 4; pass++)
+    {
+      status = sanei_buf_pool_reset (pool, BUF_COUNT);
+      assert (status == SANE_STATUS_GOOD);
+      assert (pthread_create (&thread, NULL, writer, pool) == 0);
+
+      for (block = 0; block < BLOCKS; block++)
+	get_block (pool, block);
+      status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+      assert (status == SANE_STATUS_IO_ERROR);
+      assert (addr == NULL && bytes == 0);
+
+      assert (pthread_join (thread, NULL) == 0);
+      sanei_buf_pool_get_stats (pool, &stats);
+      assert (stats.buffers >= BUF_COUNT);
+      assert (stats.buffers == BUF_COUNT + stats.exhausted
+	      || pass > 0);
+      assert (stats.max_queued <= stats.buffers);
+    }
+
+  sanei_buf_pool_free (pool);
+}
+
+/* the writer thread for a limited pool: put blocks until the reader
+ * closes the pool, and return how many */
+static void *
+limited_writer (void *arg)
+{
+  SANEI_Buf_Pool *pool = arg;
+  SANE_Byte *addr;
+  static int block;
+
+  for (block = 0; block < BLOCKS; block++)
+    {
+      addr = sanei_buf_pool_writer_get_buffer (pool);
+      if (addr == NULL)
+	break;
+      fill_block (addr, block, block_bytes (block));
+      sanei_buf_pool_writer_put_buffer (pool, block_bytes (block));
+    }
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_CANCELLED);
+  return &block;
+}
+
+/**
+ * with a limit, the writer waits for the reader instead of allocating
+ * more buffers, and the reader can stop it while it waits
+ */
+static void
+limited_pool (void)
+{
+  SANEI_Buf_Pool *pool;
+  SANEI_Buf_Pool_Stats stats;
+  SANE_Status status;
+  SANE_Byte *addr;
+  SANE_Int bytes;
+  pthread_t thread;
+  void *result;
+  int block;
+
+  status = sanei_buf_pool_new (BUF_SIZE, 1, &pool);
+  assert (status == SANE_STATUS_GOOD);
+  sanei_buf_pool_set_limit (pool, BUF_COUNT);
+
+  /* all blocks through BUF_COUNT buffers, the pool grows up to there */
+  assert (pthread_create (&thread, NULL, writer, pool) == 0);
+  for (block = 0; block < BLOCKS; block++)
+    get_block (pool, block);
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_IO_ERROR);
+  assert (pthread_join (thread, NULL) == 0);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.buffers <= BUF_COUNT);
+  assert (stats.max_queued <= BUF_COUNT);
+
+  /* the writer fills all buffers and waits, until the reader closes */
+  status = sanei_buf_pool_reset (pool, BUF_COUNT);
+  assert (status == SANE_STATUS_GOOD);
+  assert (pthread_create (&thread, NULL, limited_writer, pool) == 0);
+  get_block (pool, 0);
+  get_block (pool, 1);
+  sanei_buf_pool_reader_close (pool);
+  assert (pthread_join (thread, &result) == 0);
+  assert (*(int *) result >= 2 && *(int *) result <= BUF_COUNT + 2);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.buffers == BUF_COUNT);
+  assert (stats.exhausted == 0);
+
+  /* a reset opens the pool again */
+  status = sanei_buf_pool_reset (pool, BUF_COUNT);
+  assert (status == SANE_STATUS_GOOD);
+  for (block = 0; block < BUF_COUNT; block++)
+    put_block (pool, block);
+  sanei_buf_pool_writer_close (pool, SANE_STATUS_EOF);
+  for (block = 0; block < BUF_COUNT; block++)
+    get_block (pool, block);
+  status = sanei_buf_pool_reader_get_buffer (pool, &addr, &bytes);
+  assert (status == SANE_STATUS_EOF);
+  sanei_buf_pool_get_stats (pool, &stats);
+  assert (stats.writer_waits == 0);
+
+  sanei_buf_pool_free (pool);
+}
+
+/**
+ * invalid parameters are refused
+ */
+static void
+invalid_pool (void)
+{
+  SANEI_Buf_Pool *pool;
+
+  assert (sanei_buf_pool_new (0, BUF_COUNT, &pool) == SANE_STATUS_INVAL);
+  assert (sanei_buf_pool_new (BUF_SIZE, -1, &pool) == SANE_STATUS_INVAL);
+  assert (sanei_buf_pool_new (BUF_SIZE, BUF_COUNT, NULL)
+	  == SANE_STATUS_INVAL);
+  sanei_buf_pool_free (NULL);
+}
+
+static void
+sanei_buf_pool_suite (void)
+{
+  invalid_pool ();
+  single_thread ();
+  two_threads ();
+  limited_pool ();
+}
+
+#endif /* HAVE_PTHREAD_H */
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  /* run suites */
+#ifdef HAVE_PTHREAD_H
+  sanei_buf_pool_suite ();
+#endif
+
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
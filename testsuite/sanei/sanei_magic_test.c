@@ -0,0 +1,776 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_magic.h"
+
+#define WIDTH 103
+#define HEIGHT 67
+
+/* the brute force despeckle sanei_magic_despeck() used to be, to check
+ * that the faster one gives the same results */
+static SANE_Status
+reference_despeck (SANE_Parameters * params, SANE_Byte * buffer,
+  SANE_Int diam)
+{
+
+  SANE_Status ret = SANE_STATUS_GOOD;
+
+  int pw = params->pixels_per_line;
+  int bw = params->bytes_per_line;
+  int h  = params->lines;
+  int bt = bw*h;
+
+  int i,j,k,l,n;
+
+
+  if(params->format == SANE_FRAME_RGB){
+
+    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
+      for(j=1; j<pw-1-diam; j++){
+
+        int thresh = 255*3;
+        int outer[] = {0,0,0};
+        int hits = 0;
+
+        /* loop over rows and columns in window */
+        /* find darkest pixel */
+        for(k=0; k<diam; k++){
+          for(l=0; l<diam; l++){
+            int tmp = 0;
+
+            for(n=0; n<3; n++){
+              tmp += buffer[i + j*3 + k*bw + l*3 + n];
+            }
+
+            if(tmp < thresh)
+              thresh = tmp;
+          }
+        }
+
+        /* convert darkest pixel into a brighter threshold */
+        thresh = (thresh + 255*3 + 255*3)/3;
+  
+        /*loop over rows and columns around window */
+        for(k=-1; k<diam+1; k++){
+          for(l=-1; l<diam+1; l++){
+
+            int tmp[3];
+  
+            /* dont count pixels in the window */
+            if(k != -1 && k != diam && l != -1 && l != diam)
+              continue;
+  
+            for(n=0; n<3; n++){
+              tmp[n] = buffer[i + j*3 + k*bw + l*3 + n];
+              outer[n] += tmp[n];
+            }
+            if(tmp[0]+tmp[1]+tmp[2] < thresh){
+              hits++;
+              break;
+            }
+          }
+        }
+
+        /*no hits, overwrite with avg surrounding color*/
+        if(!hits){
+
+          /* per channel replacement color */
+          for(n=0; n<3; n++){
+            outer[n] /= (4*diam + 4);
+          }
+
+          for(k=0; k<diam; k++){
+            for(l=0; l<diam; l++){
+              for(n=0; n<3; n++){
+                buffer[i + j*3 + k*bw + l*3 + n] = outer[n];
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 8){
+    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
+      for(j=1; j<pw-1-diam; j++){
+
+        int thresh = 255;
+        int outer = 0;
+        int hits = 0;
+
+        for(k=0; k<diam; k++){
+          for(l=0; l<diam; l++){
+            if(buffer[i + j + k*bw + l] < thresh)
+              thresh = buffer[i + j + k*bw + l];
+          }
+        }
+
+        /* convert darkest pixel into a brighter threshold */
+        thresh = (thresh + 255 + 255)/3;
+  
+        /*loop over rows and columns around window */
+        for(k=-1; k<diam+1; k++){
+          for(l=-1; l<diam+1; l++){
+
+            int tmp = 0;
+
+            /* dont count pixels in the window */
+            if(k != -1 && k != diam && l != -1 && l != diam)
+              continue;
+  
+            tmp = buffer[i + j + k*bw + l];
+
+            if(tmp < thresh){
+              hits++;
+              break;
+            }
+
+            outer += tmp;
+          }
+        }
+
+        /*no hits, overwrite with avg surrounding color*/
+        if(!hits){
+          /* replacement color */
+          outer /= (4*diam + 4);
+
+          for(k=0; k<diam; k++){
+            for(l=0; l<diam; l++){
+              buffer[i + j + k*bw + l] = outer;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  else if(params->format == SANE_FRAME_GRAY && params->depth == 1){
+    for(i=bw; i<bt-bw-(bw*diam); i+=bw){
+      for(j=1; j<pw-1-diam; j++){
+        
+        int curr = 0;
+        int hits = 0;
+
+        for(k=0; k<diam; k++){
+          for(l=0; l<diam; l++){
+            curr += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+          }
+        }
+
+        if(!curr)
+          continue;
+
+        /*loop over rows and columns around window */
+        for(k=-1; k<diam+1; k++){
+          for(l=-1; l<diam+1; l++){
+
+            /* dont count pixels in the window */
+            if(k != -1 && k != diam && l != -1 && l != diam)
+              continue;
+  
+            hits += buffer[i + k*bw + (j+l)/8] >> (7-(j+l)%8) & 1;
+
+            if(hits)
+              break;
+          }
+        }
+
+        /*no hits, overwrite with white*/
+        if(!hits){
+          for(k=0; k<diam; k++){
+            for(l=0; l<diam; l++){
+              buffer[i + k*bw + (j+l)/8] &= ~(1 << (7-(j+l)%8));
+            }
+          }
+        }
+      }
+    }
+  }
+
+  else{
+    ret = SANE_STATUS_INVAL;
+  }
+
+  return ret;
+}
+
+/* the rotation sanei_magic_rotate() used to be, computing every source
+ * position in floating point and building the result in a full copy */
+static SANE_Status
+reference_rotate (SANE_Parameters * params, SANE_Byte * buffer,
+  int centerX, int centerY, double slope, int bg_color)
+{
+  double slopeRad = -atan(slope);
+  double slopeSin = sin(slopeRad);
+  double slopeCos = cos(slopeRad);
+
+  int pwidth = params->pixels_per_line;
+  int bwidth = params->bytes_per_line;
+  int height = params->lines;
+  int depth = params->format == SANE_FRAME_RGB ? 3 : 1;
+
+  unsigned char * outbuf;
+  int i, j, k;
+
+  outbuf = malloc(bwidth*height);
+  if(!outbuf)
+    return SANE_STATUS_NO_MEM;
+
+  if(params->depth == 1 && bg_color)
+    bg_color = 0xff;
+  memset(outbuf,bg_color,bwidth*height);
+
+  for (i=0; i<height; i++) {
+    int shiftY = centerY - i;
+
+    for (j=0; j<pwidth; j++) {
+      int shiftX = centerX - j;
+      int sourceX, sourceY;
+
+      sourceX = centerX - (int)(shiftX * slopeCos + shiftY * slopeSin);
+      if (sourceX < 0 || sourceX >= pwidth)
+        continue;
+
+      sourceY = centerY + (int)(-shiftY * slopeCos + shiftX * slopeSin);
+      if (sourceY < 0 || sourceY >= height)
+        continue;
+
+      if(params->depth == 1){
+        outbuf[i*bwidth + j/8] &= ~(1 << (7-(j%8)));
+        outbuf[i*bwidth + j/8] |=
+          ((buffer[sourceY*bwidth + sourceX/8]
+          >> (7-(sourceX%8))) & 1) << (7-(j%8));
+        continue;
+      }
+
+      for (k=0; k<depth; k++) {
+        outbuf[i*bwidth+j*depth+k]
+          = buffer[sourceY*bwidth+sourceX*depth+k];
+      }
+    }
+  }
+
+  memcpy(buffer,outbuf,bwidth*height);
+  free(outbuf);
+
+  return SANE_STATUS_GOOD;
+}
+
+static unsigned long seed = 1;
+
+static int
+next_random (void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+/* a page with specks of random size and darkness on a white or light
+ * gray background, and a noisy area */
+static void
+make_page (SANE_Byte * buffer, SANE_Parameters * params, int background)
+{
+  int spp = params->format == SANE_FRAME_RGB ? 3 : 1;
+  int x, y, n, i;
+
+  for (y = 0; y < params->lines; y++)
+    for (x = 0; x < params->pixels_per_line; x++)
+      for (n = 0; n < spp; n++)
+	{
+	  int v = background;
+	  if (x > params->pixels_per_line / 2 && y > params->lines / 2)
+	    v -= next_random () % 40;
+	  buffer[y * params->bytes_per_line + x * spp + n] = v;
+	}
+
+  for (i = 0; i < 60; i++)
+    {
+      int size = 1 + next_random () % 6;
+      int px = next_random () % params->pixels_per_line;
+      int py = next_random () % params->lines;
+      int dark = next_random () % 256;
+
+      for (y = py; y < py + size && y < params->lines; y++)
+	for (x = px; x < px + size && x < params->pixels_per_line; x++)
+	  for (n = 0; n < spp; n++)
+	    buffer[y * params->bytes_per_line + x * spp + n] =
+	      (dark + n * 50) % 256;
+    }
+}
+
+static void
+make_binary_page (SANE_Byte * buffer, SANE_Parameters * params)
+{
+  int x, y, i;
+
+  memset (buffer, 0, params->bytes_per_line * params->lines);
+  for (i = 0; i < 80; i++)
+    {
+      int size = 1 + next_random () % 6;
+      int px = next_random () % params->pixels_per_line;
+      int py = next_random () % params->lines;
+
+      for (y = py; y < py + size && y < params->lines; y++)
+	for (x = px; x < px + size && x < params->pixels_per_line; x++)
+	  buffer[y * params->bytes_per_line + x / 8] |= 0x80 >> (x % 8);
+    }
+}
+
+/**
+ * despeckle the same page with both implementations and compare
+ */
+static void
+compare_despeck (SANE_Frame format, int depth, int background)
+{
+  SANE_Parameters params;
+  SANE_Byte *expected, *result;
+  size_t size;
+  int diam;
+
+  params.format = format;
+  params.last_frame = SANE_TRUE;
+  params.depth = depth;
+  params.pixels_per_line = WIDTH;
+  params.lines = HEIGHT;
+  if (depth == 1)
+    params.bytes_per_line = (WIDTH + 7) / 8;
+  else
+    params.bytes_per_line = WIDTH * (format == SANE_FRAME_RGB ? 3 : 1);
+  size = params.bytes_per_line * params.lines;
+
+  expected = malloc (size);
+  result = malloc (size);
+  assert (expected != NULL && result != NULL);
+
+  for (diam = 1; diam <= 9; diam++)
+    {
+      if (depth == 1)
+	make_binary_page (expected, &params);
+      else
+	make_page (expected, &params, background);
+      memcpy (result, expected, size);
+
+      assert (reference_despeck (&params, expected, diam)
+	      == SANE_STATUS_GOOD);
+      assert (sanei_magic_despeck (&params, result, diam)
+	      == SANE_STATUS_GOOD);
+      assert (memcmp (expected, result, size) == 0);
+    }
+
+  free (expected);
+  free (result);
+}
+
+static void
+despeck_gray (void)
+{
+  compare_despeck (SANE_FRAME_GRAY, 8, 255);
+  compare_despeck (SANE_FRAME_GRAY, 8, 230);
+}
+
+static void
+despeck_color (void)
+{
+  compare_despeck (SANE_FRAME_RGB, 8, 255);
+  compare_despeck (SANE_FRAME_RGB, 8, 230);
+}
+
+static void
+despeck_binary (void)
+{
+  compare_despeck (SANE_FRAME_GRAY, 1, 0);
+}
+
+static void
+despeck_unsupported (void)
+{
+  SANE_Parameters params;
+  SANE_Byte buffer[16];
+
+  params.format = SANE_FRAME_GRAY;
+  params.depth = 16;
+  params.pixels_per_line = 4;
+  params.bytes_per_line = 8;
+  params.lines = 2;
+  assert (sanei_magic_despeck (&params, buffer, 1) == SANE_STATUS_INVAL);
+}
+
+/**
+ * rotate the same page with both implementations and compare; the
+ * fixed point stepping may round a source position the other way when
+ * it is within a tiny fraction of a pixel of an integer, so allow a
+ * few differing pixels, except for the exact slope 0
+ */
+static void
+compare_rotate (SANE_Frame format, int depth, int width, int height,
+		int centerX, int centerY, double slope)
+{
+  SANE_Parameters params;
+  SANE_Byte *expected, *result;
+  size_t size;
+  int spp = format == SANE_FRAME_RGB ? 3 : 1;
+  int x, y, n, differ = 0;
+
+  params.format = format;
+  params.last_frame = SANE_TRUE;
+  params.depth = depth;
+  params.pixels_per_line = width;
+  params.lines = height;
+  if (depth == 1)
+    params.bytes_per_line = (width + 7) / 8;
+  else
+    params.bytes_per_line = width * spp;
+  size = params.bytes_per_line * params.lines;
+
+  expected = malloc (size);
+  result = malloc (size);
+  assert (expected != NULL && result != NULL);
+
+  if (depth == 1)
+    make_binary_page (expected, &params);
+  else
+    make_page (expected, &params, 230);
+  memcpy (result, expected, size);
+
+  assert (reference_rotate (&params, expected, centerX, centerY, slope, 1)
+	  == SANE_STATUS_GOOD);
+  assert (sanei_magic_rotate (&params, result, centerX, centerY, slope, 1)
+	  == SANE_STATUS_GOOD);
+
+  for (y = 0; y < height; y++)
+    for (x = 0; x < width; x++)
+      {
+	if (depth == 1)
+	  {
+	    SANE_Byte *e = expected + y * params.bytes_per_line + x / 8;
+	    SANE_Byte *r = result + y * params.bytes_per_line + x / 8;
+	    if ((*e ^ *r) & (0x80 >> (x % 8)))
+	      differ++;
+	    continue;
+	  }
+	for (n = 0; n < spp; n++)
+	  if (expected[y * params.bytes_per_line + x * spp + n]
+	      != result[y * params.bytes_per_line + x * spp + n])
+	    {
+	      differ++;
+	      break;
+	    }
+      }
+
+  if (slope == 0)
+    assert (differ == 0);
+  else
+    assert (differ <= width * height / 1000);
+
+  free (expected);
+  free (result);
+}
+
+static void
+rotate_gray (void)
+{
+  compare_rotate (SANE_FRAME_GRAY, 8, WIDTH, HEIGHT, 0, 0, 0);
+  compare_rotate (SANE_FRAME_GRAY, 8, WIDTH, HEIGHT, 20, 10, 0.05);
+  compare_rotate (SANE_FRAME_GRAY, 8, WIDTH, HEIGHT, 50, 30, -0.12);
+  /* center outside of the image */
+  compare_rotate (SANE_FRAME_GRAY, 8, WIDTH, HEIGHT, -40, -25, 0.2);
+  /* steep enough that every row can reach every other */
+  compare_rotate (SANE_FRAME_GRAY, 8, WIDTH, HEIGHT, 50, 30, 3.0);
+}
+
+static void
+rotate_color (void)
+{
+  compare_rotate (SANE_FRAME_RGB, 8, WIDTH, HEIGHT, 10, 60, -0.07);
+  compare_rotate (SANE_FRAME_RGB, 8, WIDTH, HEIGHT, WIDTH, HEIGHT, 0.3);
+}
+
+static void
+rotate_binary (void)
+{
+  compare_rotate (SANE_FRAME_GRAY, 1, WIDTH, HEIGHT, 0, 0, 0);
+  compare_rotate (SANE_FRAME_GRAY, 1, WIDTH, HEIGHT, 30, 5, 0.09);
+  compare_rotate (SANE_FRAME_GRAY, 1, WIDTH, HEIGHT, 70, 40, -0.5);
+}
+
+/**
+ * a page large enough for several bands, and for helper threads
+ */
+static void
+rotate_large (void)
+{
+  compare_rotate (SANE_FRAME_GRAY, 8, 1300, 900, 40, 20, 0.03);
+  compare_rotate (SANE_FRAME_GRAY, 1, 1304, 900, 650, 450, -0.06);
+}
+
+static void
+rotate_unsupported (void)
+{
+  SANE_Parameters params;
+  SANE_Byte buffer[16];
+
+  params.format = SANE_FRAME_GRAY;
+  params.depth = 16;
+  params.pixels_per_line = 4;
+  params.bytes_per_line = 8;
+  params.lines = 2;
+  assert (sanei_magic_rotate (&params, buffer, 0, 0, 0.1, 0)
+	  == SANE_STATUS_INVAL);
+}
+
+/* dark background with a light sheet, rotated by slope, on it; as the
+ * background of most sheet fed scanners is */
+static void
+make_sheet (SANE_Byte * buffer, SANE_Parameters * params, double slope,
+	    int left, int top)
+{
+  int spp = params->format == SANE_FRAME_RGB ? 3 : 1;
+  double c = cos (atan (slope)), s = sin (atan (slope));
+  int x, y, n;
+
+  memset (buffer, 0, params->bytes_per_line * params->lines);
+  for (y = 0; y < params->lines; y++)
+    for (x = 0; x < params->pixels_per_line; x++)
+      {
+	double u = (x - left) * c + (y - top) * s;
+	double v = -(x - left) * s + (y - top) * c;
+	int v1 = 30 + next_random () % 10;
+
+	if (u >= 0 && u < params->pixels_per_line - 2 * left
+	    && v >= 0 && v < params->lines - 2 * top)
+	  v1 = next_random () % 500 ? 235 - next_random () % 10 : 20;
+
+	if (params->depth == 1)
+	  {
+	    if (v1 < 128)
+	      buffer[y * params->bytes_per_line + x / 8] |= 0x80 >> (x % 8);
+	    continue;
+	  }
+	for (n = 0; n < spp; n++)
+	  buffer[y * params->bytes_per_line + x * spp + n] = v1;
+      }
+}
+
+static void
+init_params (SANE_Parameters * params, SANE_Frame format, int depth,
+	     int width, int height)
+{
+  params->format = format;
+  params->last_frame = SANE_TRUE;
+  params->depth = depth;
+  params->pixels_per_line = width;
+  params->lines = height;
+  if (depth == 1)
+    params->bytes_per_line = (width + 7) / 8;
+  else
+    params->bytes_per_line = width * (format == SANE_FRAME_RGB ? 3 : 1);
+}
+
+/**
+ * feed a page to a stream in chunks of the given number of lines and
+ * check it settles on what the whole page functions find
+ */
+static void
+compare_stream (SANE_Frame format, int depth, double slope, int chunk)
+{
+  SANE_Parameters params;
+  SANEI_Magic_Stream *stream;
+  SANE_Byte *buffer;
+  SANE_Status edges_status, skew_status;
+  int edges[4], got[4];
+  int center_x, center_y, got_x, got_y;
+  double found_slope, got_slope;
+  int line, top = -1, top_line = -1;
+
+  init_params (&params, format, depth, 640, 760);
+  buffer = malloc (params.bytes_per_line * params.lines);
+  assert (buffer != NULL);
+  make_sheet (buffer, &params, slope, 60, 50);
+
+  edges_status = sanei_magic_findEdges (&params, buffer, 150, 150,
+					edges, edges + 1, edges + 2,
+					edges + 3);
+  skew_status = sanei_magic_findSkew (&params, buffer, 150, 150,
+				      &center_x, &center_y, &found_slope);
+  assert (edges_status == SANE_STATUS_GOOD);
+
+  params.lines = -1;
+  assert (sanei_magic_stream_new (&params, 150, 150, 1.0, &stream)
+	  == SANE_STATUS_GOOD);
+
+  for (line = 0; line < 760; line += chunk)
+    {
+      int lines = 760 - line < chunk ? 760 - line : chunk;
+
+      assert (sanei_magic_stream_write (stream,
+					buffer + line * params.bytes_per_line,
+					lines) == SANE_STATUS_GOOD);
+      if (top_line < 0
+	  && sanei_magic_stream_findTop (stream, &top) == SANE_STATUS_GOOD)
+	top_line = line + lines;
+      assert (sanei_magic_stream_findEdges (stream, got, got + 1, got + 2,
+					    got + 3)
+	      == SANE_STATUS_DEVICE_BUSY);
+    }
+
+  /* the top edge was known long before the end */
+  assert (top == edges[0]);
+  assert (top_line > 0 && top_line < edges[0] + 20 + chunk);
+
+  assert (sanei_magic_stream_finish (stream) == SANE_STATUS_GOOD);
+  assert (sanei_magic_stream_findEdges (stream, got, got + 1, got + 2,
+					got + 3) == edges_status);
+  assert (memcmp (edges, got, sizeof (edges)) == 0);
+  assert (sanei_magic_stream_findSkew (stream, &got_x, &got_y, &got_slope)
+	  == skew_status);
+  if (skew_status == SANE_STATUS_GOOD)
+    {
+      assert (got_x == center_x && got_y == center_y);
+      assert (got_slope == found_slope);
+    }
+  assert (sanei_magic_stream_write (stream, buffer, 1)
+	  == SANE_STATUS_INVAL);
+
+  sanei_magic_stream_free (stream);
+  free (buffer);
+}
+
+static void
+stream_edges (void)
+{
+  compare_stream (SANE_FRAME_GRAY, 8, 0.05, 1);
+  compare_stream (SANE_FRAME_GRAY, 8, -0.03, 37);
+  compare_stream (SANE_FRAME_RGB, 8, 0.02, 16);
+  compare_stream (SANE_FRAME_RGB, 8, -0.07, 5);
+  compare_stream (SANE_FRAME_GRAY, 1, 0.04, 8);
+  compare_stream (SANE_FRAME_GRAY, 1, -0.05, 100);
+}
+
+/**
+ * blank detection settles on what sanei_magic_isBlank2() says, and
+ * decides a page with something on it early
+ */
+static void
+compare_stream_blank (SANE_Frame format, int depth, int dark_line)
+{
+  SANE_Parameters params;
+  SANEI_Magic_Stream *stream;
+  SANE_Byte *buffer;
+  SANE_Status expected, status = SANE_STATUS_DEVICE_BUSY;
+  int line, x, decided = -1;
+
+  init_params (&params, format, depth, 800, 1000);
+  buffer = malloc (params.bytes_per_line * params.lines);
+  assert (buffer != NULL);
+  memset (buffer, depth == 1 ? 0 : 255,
+	  params.bytes_per_line * params.lines);
+
+  /* a dark bar of 100x30 pixels */
+  if (dark_line >= 0)
+    for (line = dark_line; line < dark_line + 30; line++)
+      for (x = 200; x < 300; x++)
+	{
+	  if (depth == 1)
+	    buffer[line * params.bytes_per_line + x / 8] |= 0x80 >> (x % 8);
+	  else if (format == SANE_FRAME_RGB)
+	    memset (buffer + line * params.bytes_per_line + x * 3, 0, 3);
+	  else
+	    buffer[line * params.bytes_per_line + x] = 0;
+	}
+
+  expected = sanei_magic_isBlank2 (&params, buffer, 200, 200, 2.0);
+
+  assert (sanei_magic_stream_new (&params, 200, 200, 2.0, &stream)
+	  == SANE_STATUS_GOOD);
+  for (line = 0; line < 1000; line++)
+    {
+      assert (sanei_magic_stream_write (stream,
+					buffer + line * params.bytes_per_line,
+					1) == SANE_STATUS_GOOD);
+      status = sanei_magic_stream_isBlank2 (stream);
+      if (status != SANE_STATUS_DEVICE_BUSY)
+	{
+	  decided = line;
+	  break;
+	}
+    }
+  if (status == SANE_STATUS_DEVICE_BUSY)
+    {
+      sanei_magic_stream_finish (stream);
+      status = sanei_magic_stream_isBlank2 (stream);
+    }
+  assert (status == expected);
+
+  /* a page with a dark block is known not to be blank within an inch */
+  if (expected == SANE_STATUS_GOOD)
+    assert (decided >= 0 && decided < dark_line + 30 + 200);
+
+  sanei_magic_stream_free (stream);
+  free (buffer);
+}
+
+static void
+stream_blank (void)
+{
+  compare_stream_blank (SANE_FRAME_GRAY, 8, -1);
+  compare_stream_blank (SANE_FRAME_GRAY, 8, 300);
+  compare_stream_blank (SANE_FRAME_RGB, 8, 120);
+  compare_stream_blank (SANE_FRAME_GRAY, 1, 500);
+  compare_stream_blank (SANE_FRAME_GRAY, 1, -1);
+  /* in the bottom margin, not counted */
+  compare_stream_blank (SANE_FRAME_GRAY, 8, 960);
+}
+
+static void
+stream_unsupported (void)
+{
+  SANE_Parameters params;
+  SANEI_Magic_Stream *stream;
+
+  init_params (&params, SANE_FRAME_GRAY, 16, 100, 100);
+  assert (sanei_magic_stream_new (&params, 150, 150, 1.0, &stream)
+	  == SANE_STATUS_INVAL);
+  assert (sanei_magic_stream_free (NULL) == SANE_STATUS_INVAL);
+}
+
+static void
+sanei_magic_suite (void)
+{
+  sanei_magic_init ();
+
+  despeck_gray ();
+  despeck_color ();
+  despeck_binary ();
+  despeck_unsupported ();
+
+  rotate_gray ();
+  rotate_color ();
+  rotate_binary ();
+  rotate_large ();
+  rotate_unsupported ();
+
+  stream_edges ();
+  stream_blank ();
+  stream_unsupported ();
+}
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  /* run suites */
+  sanei_magic_suite ();
+
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -0,0 +1,205 @@
+#include "../../include/sane/config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* sane includes for the sanei functions called */
+#include "../include/sane/sane.h"
+#include "../include/sane/sanei_shm_channel.h"
+
+#define BUF_SIZE 4096
+#define BUF_COUNT 4
+#define BLOCKS 32
+
+/* fill one block with a pattern depending on its number */
+static void
+fill_block (SANE_Byte * addr, int block)
+{
+  int i;
+
+  for (i = 0; i < BUF_SIZE; i++)
+    addr[i] = (SANE_Byte) (block * 7 + i);
+}
+
+static int
+check_block (SANE_Byte * addr, int block)
+{
+  int i;
+
+  for (i = 0; i < BUF_SIZE; i++)
+    if (addr[i] != (SANE_Byte) (block * 7 + i))
+      return 0;
+  return 1;
+}
+
+/* put BLOCKS blocks into the channel, then close it */
+static SANE_Status
+writer (SANEI_Shm_Channel * ch)
+{
+  SANE_Status status;
+  SANE_Int id;
+  SANE_Byte *addr;
+  int block;
+
+  sanei_shm_channel_writer_init (ch);
+  for (block = 0; block < BLOCKS; block++)
+    {
+      status = sanei_shm_channel_writer_get_buffer (ch, &id, &addr);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+      fill_block (addr, block);
+      status = sanei_shm_channel_writer_put_buffer (ch, id, BUF_SIZE);
+      if (status != SANE_STATUS_GOOD)
+	return status;
+    }
+  return sanei_shm_channel_writer_close (ch);
+}
+
+/* read all blocks back, in order, until end of file */
+static void
+reader (SANEI_Shm_Channel * ch)
+{
+  SANE_Status status;
+  SANE_Int id, bytes;
+  SANE_Byte *addr;
+  int block = 0;
+
+  for (;;)
+    {
+      status = sanei_shm_channel_reader_get_buffer (ch, &id, &addr, &bytes);
+      if (status == SANE_STATUS_EOF)
+	break;
+      assert (status == SANE_STATUS_GOOD);
+      assert (addr != NULL);
+      assert (bytes == BUF_SIZE);
+      assert (check_block (addr, block));
+      block++;
+      status = sanei_shm_channel_reader_put_buffer (ch, id);
+      assert (status == SANE_STATUS_GOOD);
+    }
+  assert (block == BLOCKS);
+}
+
+/**
+ * writer and reader in two processes
+ */
+static void
+forked_channel (void)
+{
+  SANEI_Shm_Channel *ch;
+  SANE_Status status;
+  int pid, pid_status;
+
+  status = sanei_shm_channel_new (BUF_SIZE, BUF_COUNT, SANE_TRUE, &ch);
+  assert (status == SANE_STATUS_GOOD);
+
+  pid = fork ();
+  assert (pid != -1);
+  if (pid == 0)
+    _exit (writer (ch));
+
+  sanei_shm_channel_reader_init (ch);
+  status = sanei_shm_channel_reader_start (ch);
+  assert (status == SANE_STATUS_GOOD);
+  reader (ch);
+
+  assert (waitpid (pid, &pid_status, 0) == pid);
+  assert (WIFEXITED (pid_status));
+  assert (WEXITSTATUS (pid_status) == SANE_STATUS_GOOD);
+  sanei_shm_channel_free (ch);
+}
+
+/**
+ * writer and reader in the same process, as with threads; the writer
+ * only puts as many blocks as there are buffers so nothing blocks
+ */
+static void
+threaded_channel (void)
+{
+  SANEI_Shm_Channel *ch;
+  SANE_Status status;
+  SANE_Int id, bytes;
+  SANE_Byte *addr;
+  int block;
+
+  status = sanei_shm_channel_new (BUF_SIZE, BUF_COUNT, SANE_FALSE, &ch);
+  assert (status == SANE_STATUS_GOOD);
+  sanei_shm_channel_writer_init (ch);
+  sanei_shm_channel_reader_init (ch);
+  status = sanei_shm_channel_reader_start (ch);
+  assert (status == SANE_STATUS_GOOD);
+
+  /* nothing there yet in non-blocking mode */
+  status = sanei_shm_channel_reader_set_io_mode (ch, SANE_TRUE);
+  assert (status == SANE_STATUS_GOOD);
+  status = sanei_shm_channel_reader_get_buffer (ch, &id, &addr, &bytes);
+  assert (status == SANE_STATUS_GOOD);
+  assert (addr == NULL);
+  status = sanei_shm_channel_reader_set_io_mode (ch, SANE_FALSE);
+  assert (status == SANE_STATUS_GOOD);
+
+  for (block = 0; block < BUF_COUNT; block++)
+    {
+      status = sanei_shm_channel_writer_get_buffer (ch, &id, &addr);
+      assert (status == SANE_STATUS_GOOD);
+      fill_block (addr, block);
+      status = sanei_shm_channel_writer_put_buffer (ch, id, BUF_SIZE);
+      assert (status == SANE_STATUS_GOOD);
+    }
+  sanei_shm_channel_writer_close (ch);
+
+  for (block = 0; block < BUF_COUNT; block++)
+    {
+      status = sanei_shm_channel_reader_get_buffer (ch, &id, &addr, &bytes);
+      assert (status == SANE_STATUS_GOOD);
+      assert (check_block (addr, block));
+      sanei_shm_channel_reader_put_buffer (ch, id);
+    }
+  status = sanei_shm_channel_reader_get_buffer (ch, &id, &addr, &bytes);
+  assert (status == SANE_STATUS_EOF);
+
+  sanei_shm_channel_free (ch);
+}
+
+/**
+ * invalid parameters are refused
+ */
+static void
+invalid_channel (void)
+{
+  SANEI_Shm_Channel *ch;
+
+  assert (sanei_shm_channel_new (0, BUF_COUNT, SANE_TRUE, &ch)
+	  == SANE_STATUS_INVAL);
+  assert (sanei_shm_channel_new (BUF_SIZE, 256, SANE_TRUE, &ch)
+	  == SANE_STATUS_INVAL);
+  assert (sanei_shm_channel_free (NULL) == SANE_STATUS_INVAL);
+}
+
+static void
+sanei_shm_channel_suite (void)
+{
+  invalid_channel ();
+  threaded_channel ();
+  forked_channel ();
+}
+
+/**
+ * main function to run the test suites
+ */
+int
+main (void)
+{
+  /* run suites */
+  sanei_shm_channel_suite ();
+
+  return 0;
+}
+
+/* vim: set sw=2 cino=>2se-1sn-1s{s^-1st0(0u0 smarttab expandtab: */
@@ -86,7 +86,8 @@ typedef enum output_mode
   output_mode_hwdb,
   output_mode_plist,
   output_mode_hal,
-  output_mode_halnew
+  output_mode_halnew,
+  output_mode_dllindex
 }
 output_mode;
 
@@ -320,7 +321,8 @@ print_usage (char *program_name)
 	  "(multiple directories can be concatenated by \":\")\n");
   printf ("  -m|--mode mode         "
 	  "Output mode (ascii, html-backends-split, html-mfgs,\n"
-	  "                         xml, statistics, usermap, db, udev, udev+acl, udev+hwdb, hwdb, plist, hal, hal-new)\n");
+	  "                         xml, statistics, usermap, db, udev, udev+acl, udev+hwdb, hwdb, plist, hal, hal-new,\n"
+	  "                         dll-index)\n");
   printf ("  -t|--title \"title\"     The title used for HTML pages\n");
   printf ("  -i|--intro \"intro\"     A short description of the "
 	  "contents of the page\n");
@@ -447,6 +449,11 @@ get_options (int argc, char **argv)
 	      DBG_INFO ("Output mode: %s\n", optarg);
 	      mode = output_mode_halnew;
 	    }
+	  else if (strcmp (optarg, "dll-index") == 0)
+	    {
+	      DBG_INFO ("Output mode: %s\n", optarg);
+	      mode = output_mode_dllindex;
+	    }
 	  else
 	    {
 	      DBG_ERR ("Unknown output mode: %s\n", optarg);
@@ -3995,6 +4002,124 @@ print_hal (int new)
   printf ("</deviceinfo>\n");
 }
 
+/* Is every device of this backend a USB device with known ids? */
+static SANE_Bool
+is_usb_only_backend (backend_entry * be)
+{
+  type_entry *type;
+  SANE_Bool have_id = SANE_FALSE;
+
+  for (type = be->type; type; type = type->next)
+    {
+      mfg_entry *mfg;
+
+      if (type->type == type_meta || type->type == type_api)
+	return SANE_FALSE;
+
+      for (mfg = type->mfg; mfg; mfg = mfg->next)
+	{
+	  model_entry *model;
+
+	  for (model = mfg->model; model; model = model->next)
+	    {
+	      if (model->status == status_unsupported)
+		continue;
+
+	      if (!model->interface
+		  || strcasecmp (model->interface, "USB") != 0
+		  || model->ignore_usb_id
+		  || !model->usb_vendor_id || !model->usb_product_id)
+		{
+		  DBG_DBG ("is_usb_only_backend: `%s' also drives `%s %s'\n",
+			   be->name, mfg->name, model->name);
+		  return SANE_FALSE;
+		}
+	      have_id = SANE_TRUE;
+	    }
+	}
+    }
+  return have_id;
+}
+
+/* Has the id of MODEL already been printed for an earlier model? */
+static SANE_Bool
+dll_index_has_id (backend_entry * be, model_entry * last)
+{
+  type_entry *type;
+
+  for (type = be->type; type; type = type->next)
+    {
+      mfg_entry *mfg;
+
+      for (mfg = type->mfg; mfg; mfg = mfg->next)
+	{
+	  model_entry *model;
+
+	  for (model = mfg->model; model; model = model->next)
+	    {
+	      if (model == last)
+		return SANE_FALSE;
+	      if (model->status != status_unsupported
+		  && strcasecmp (model->usb_vendor_id,
+				 last->usb_vendor_id) == 0
+		  && strcasecmp (model->usb_product_id,
+				 last->usb_product_id) == 0)
+		return SANE_TRUE;
+	    }
+	}
+    }
+  return SANE_FALSE;
+}
+
+/* print the USB id index used by the dll backend to load only those
+   backends that can drive one of the attached devices */
+static void
+print_dll_index (void)
+{
+  backend_entry *be;
+  time_t current_time = time (0);
+
+  printf ("# This file was automatically created based on description files (*.desc)\n"
+	  "# by sane-desc %s from %s on %s",
+	  SANE_DESC_VERSION, PACKAGE_STRING, asctime (localtime (&current_time)));
+  printf
+    ("#\n"
+     "# USB vendor and product ids of the backends that support nothing but\n"
+     "# USB devices with known ids.  With \"usb_match = yes\" in dll.conf, the\n"
+     "# dll backend loads these backends only if one of their devices is\n"
+     "# attached.  Backends not listed here are always loaded.\n"
+     "#\n"
+     "# Fields: backend, vendor id, product id\n"
+     "#\n");
+
+  for (be = first_backend; be; be = be->next)
+    {
+      type_entry *type;
+
+      if (!is_usb_only_backend (be))
+	continue;
+
+      for (type = be->type; type; type = type->next)
+	{
+	  mfg_entry *mfg;
+
+	  for (mfg = type->mfg; mfg; mfg = mfg->next)
+	    {
+	      model_entry *model;
+
+	      for (model = mfg->model; model; model = model->next)
+		{
+		  if (model->status == status_unsupported
+		      || dll_index_has_id (be, model))
+		    continue;
+		  printf ("%s %s %s\n", be->name, model->usb_vendor_id,
+			  model->usb_product_id);
+		}
+	    }
+	}
+    }
+}
+
 int
 main (int argc, char **argv)
 {
@@ -4050,6 +4175,9 @@ main (int argc, char **argv)
     case output_mode_halnew:
       print_hal (1);
       break;
+    case output_mode_dllindex:
+      print_dll_index ();
+      break;
     default:
       DBG_ERR ("Unknown output mode\n");
       return 1;